@@ -107,9 +107,13 @@ static void recv_loop(int fd, int notify)
     {
         iguanaPacket response;
         lirc_t prevCode = -1;
+        uint32_t gap = 0;
+        bool frames;
 
-        /* turn on the receiver */
-        if (! daemonTransaction(conn, IG_DEV_RECVON, NULL, 0))
+        /* ask for whole frames ending in the daemon's default gap, and
+         * fall back to every packet on older daemons */
+        frames = daemonTransaction(conn, IG_DEV_RECVFRAMES, &gap, sizeof(gap));
+        if (! frames && ! daemonTransaction(conn, IG_DEV_RECVON, NULL, 0))
         {
             log_error("error when turning receiver on: %s\n", strerror(errno));
         }
@@ -131,18 +135,29 @@ static void recv_loop(int fd, int notify)
                     }
                     break;
                 }
+                else if (iguanaCode(response) == IG_DEV_RECVGAP)
+                {
+                    /* receive data was lost, do not join pulses across it */
+                    log_warn("igdaemon dropped receive data\n");
+                    prevCode = -1;
+                }
                 else
                 {
                     uint32_t* code;
                     unsigned int length, x, y = 0;
-                    lirc_t buffer[8];       /* we read 8 bytes max at a time
-                                             * from the device, i.e. packet
-                                             * can only contain 8
-                                             * signals. */
+                    lirc_t *buffer;
 
                     /* pull the data off the packet */
                     code = (uint32_t*)iguanaRemoveData(response, &length);
                     length /= sizeof(uint32_t);
+                    buffer = (lirc_t*)malloc(sizeof(lirc_t) * (length + 1));
+                    if (buffer == NULL)
+                    {
+                        log_error("out of memory for received signals\n");
+                        free(code);
+                        iguanaFreePacket(response);
+                        break;
+                    }
 
                     /* translate the code into lirc_t pulses (and make
                      * sure they don't split across iguana packets. */
@@ -179,11 +194,21 @@ static void recv_loop(int fd, int notify)
                         }
                     }
 
+                    /* a frame ends in its trailing space, so nothing
+                     * follows to join with */
+                    if (frames && prevCode != -1)
+                    {
+                        buffer[y] = prevCode;
+                        y++;
+                        prevCode = -1;
+                    }
+
                     /* write the data and free it */
                     if (y > 0)
                         chk_write(fd,
                                   buffer,
                                   sizeof(lirc_t) * y);
+                    free(buffer);
                     free(code);
                 }
 
@@ -23,6 +23,7 @@
 
 #ifndef WIN32
     #include <arpa/inet.h>
+    #include <sys/socket.h>
 #endif
 
 #include "pipes.h"
@@ -32,15 +33,592 @@
 #include "client-interface.h"
 #include "protocol-versions.h"
 #include "server.h"
+#include "receiveRing.h"
+#include "pulseFd.h"
+#include "frameAssembly.h"
+#include "irDecode.h"
+#include "codeStore.h"
+#include "encodeCache.h"
+#ifndef WIN32
+    #include "deviceGroup.h"
+#endif
+
+enum
+{
+    /* socket reads taken for one client before returning to the poller */
+    BATCH_READS = 16,
+    /* microseconds ahead of a scheduled send's start at which polling
+       stops and the clock is waited on instead */
+    SCHEDULE_SPIN = 2000
+};
+
+/* an event thread serves other devices while a scheduled send waits,
+   so it only wakes at the start, as close as the poller's millisecond
+   timeout allows, and the device may have the code up to that late */
+static uint64_t scheduleSpin()
+{
+    if (srvSettings.eventThreads > 0)
+        return 0;
+    return SCHEDULE_SPIN;
+}
 
 /* small structure passed through a void* for tellReceivers. */
 typedef struct receiveInfo
 {
     struct dataPacket *packet;
     bool translated;
+    /* when the packet was dispatched, for assembling frames */
+    uint64_t now;
 } receiveInfo;
 
-static bool handleClientRequest(dataPacket *request, client *target)
+/* output a client's socket could not take right away */
+typedef struct outPacket
+{
+    itemHeader header;
+
+    /* receive data may be dropped, replies and gap markers may not */
+    bool droppable;
+    /* for gap markers the count of dropped packets, otherwise 0 */
+    uint32_t gap;
+
+    /* a descriptor to pass with the first byte, -1 if none */
+    int passFd;
+
+    /* the encoded packet and how much of it has been written */
+    int length, sent;
+    unsigned char bytes[1];
+} outPacket;
+
+/* a request waiting its turn on the device's transmit queue */
+typedef struct deferredRequest
+{
+    itemHeader header;
+
+    dataPacket request;
+    /* a descriptor that arrived with the request, -1 if none */
+    int passedFd;
+    /* microsSinceX() by which a transmit must start, 0 for never */
+    uint64_t deadline;
+} deferredRequest;
+
+/* an IG_DEV_SENDAT waiting on the time it is to fire */
+typedef struct scheduledSend
+{
+    itemHeader header;
+
+    client *owner;
+    /* microsSinceX() by which the device should hold the whole code */
+    uint64_t when;
+    /* the encoded IG_DEV_SEND */
+    dataPacket request;
+} scheduledSend;
+
+static void freeOutput(client *target, outPacket *out)
+{
+#ifndef WIN32
+    if (out->passFd != -1)
+        close(out->passFd);
+#endif
+    if (out->droppable)
+        target->queuedRecvs--;
+    free(removeItem((itemHeader*)out));
+}
+
+/* queue an encoded packet before pos (NULL appends) */
+static outPacket* queueOutput(client *target, itemHeader *pos,
+                              const void *head, int headSize,
+                              const void *body, int bodySize,
+                              int sent, bool droppable)
+{
+    outPacket *out;
+
+    out = (outPacket*)malloc(offsetof(outPacket, bytes) + headSize + bodySize);
+    if (out == NULL)
+    {
+        message(LOG_ERROR, "Out of memory queuing output for a client.\n");
+        errno = ENOMEM;
+    }
+    else
+    {
+        memcpy(out->bytes, head, headSize);
+        if (bodySize > 0)
+            memcpy(out->bytes + headSize, body, bodySize);
+        out->length = headSize + bodySize;
+        out->sent = sent;
+        out->droppable = droppable;
+        out->gap = 0;
+        out->passFd = -1;
+        insertItem(&target->outQueue, pos, (itemHeader*)out);
+        if (droppable)
+            target->queuedRecvs++;
+    }
+    return out;
+}
+
+/* note dropped receive data with a gap marker in its place, where pos
+   is the dropped packet still in the queue or NULL if it never was */
+static void markGap(client *target, outPacket *pos)
+{
+    outPacket *gap = NULL;
+
+    if (target->dropped++ == 0)
+        message(LOG_WARN,
+                "A client is not reading its receive data, dropping packets.\n");
+
+    /* only clients of the framed protocol know the marker, older ones
+       just lose the data */
+    if (target->buffer != NULL)
+    {
+        /* grow an unwritten marker next to the hole when there is one */
+        outPacket *before, *after;
+
+        before = (outPacket*)(pos == NULL ? target->outQueue.tail : pos->header.prev);
+        after = (outPacket*)(pos == NULL ? NULL : pos->header.next);
+        if (before != NULL && before->gap > 0 && before->sent == 0)
+            gap = before;
+        else if (after != NULL && after->gap > 0 && after->sent == 0)
+            gap = after;
+
+        if (gap != NULL)
+            gap->gap++;
+        else
+        {
+            dataPacket marker = DATA_PACKET_INIT;
+            unsigned char head[sizeof(dataPacket)];
+            uint32_t count = 1;
+
+            marker.code = IG_DEV_RECVGAP;
+            marker.dataLen = sizeof(uint32_t);
+            gap = queueOutput(target, (itemHeader*)pos, head,
+                              encodePacketHeader(&marker, true, head),
+                              &count, sizeof(uint32_t), 0, false);
+            if (gap != NULL)
+                gap->gap = 1;
+        }
+
+        /* the count is the payload, which ends the encoded packet */
+        if (gap != NULL)
+            memcpy(gap->bytes + gap->length - sizeof(uint32_t),
+                   &gap->gap, sizeof(uint32_t));
+    }
+
+    if (pos != NULL)
+        freeOutput(target, pos);
+}
+
+/* apply the overflow policy before queuing receive data, returns
+   false if the new packet should not be queued */
+static bool makeRoom(client *target)
+{
+    if (target->overflowed)
+        return false;
+    if (target->queuedRecvs < (unsigned int)srvSettings.clientQueue)
+        return true;
+
+    switch(srvSettings.clientOverflow)
+    {
+    case OVERFLOW_DISCONNECT:
+        message(LOG_WARN,
+                "Disconnecting a client that is not reading its receive data.\n");
+        target->overflowed = true;
+#ifndef WIN32
+        /* the next read sees the end of input and releases the client */
+        shutdown(target->fd, SHUT_RD);
+#endif
+        return false;
+
+    case OVERFLOW_DROP_OLDEST:
+    {
+        outPacket *oldest;
+
+        /* partially written packets have to be finished */
+        for(oldest = (outPacket*)target->outQueue.head;
+            oldest != NULL;
+            oldest = (outPacket*)oldest->header.next)
+            if (oldest->droppable && oldest->sent == 0)
+            {
+                markGap(target, oldest);
+                return true;
+            }
+        break;
+    }
+    }
+
+    markGap(target, NULL);
+    return false;
+}
+
+/* write what the socket takes now, passing fd along if it is not -1 */
+static int writeSome(client *target, const void *head, int headSize,
+                     const void *body, int bodySize, int fd)
+{
+#ifdef WIN32
+    (void)fd;
+    return writePipePairSome(target->fd, head, headSize, body, bodySize);
+#else
+    return writePipePairSomeFd(target->fd, head, headSize,
+                               body, bodySize, fd);
+#endif
+}
+
+/* send a packet in whichever framing the client negotiated, without
+   waiting on the socket, and queue whatever it does not take.  passFd
+   (-1 for none) goes along with the packet and stays the caller's. */
+static bool sendToClient(client *target, const dataPacket *packet,
+                         bool droppable, int passFd)
+{
+    outPacket *out;
+    unsigned char head[sizeof(dataPacket)];
+    int headSize, bodySize = 0, sent = 0;
+
+    headSize = encodePacketHeader(packet, target->buffer != NULL, head);
+    if (packet->dataLen > 0)
+        bodySize = packet->dataLen;
+
+#ifdef WIN32
+    /* there is no writable notification, so catch up on each send */
+    flushClient(target);
+#endif
+
+    if (target->outQueue.count == 0)
+    {
+        sent = writeSome(target, head, headSize,
+                         packet->data, bodySize, passFd);
+        if (sent == -1)
+            return false;
+        if (sent == headSize + bodySize)
+            return true;
+    }
+    else if (droppable && ! makeRoom(target))
+        return true;
+
+    out = queueOutput(target, NULL, head, headSize,
+                      packet->data, bodySize, sent, droppable);
+    if (out == NULL)
+        return false;
+#ifndef WIN32
+    /* anything written already carried the descriptor */
+    if (passFd != -1 && sent == 0)
+    {
+        out->passFd = dup(passFd);
+        if (out->passFd == -1)
+        {
+            freeOutput(target, out);
+            return false;
+        }
+    }
+#endif
+    if (target->outQueue.count == 1)
+        watchClientWrites(target, true);
+    return true;
+}
+
+static void discardOutput(client *target)
+{
+    while(target->outQueue.count > 0)
+        freeOutput(target, (outPacket*)target->outQueue.head);
+}
+
+void flushClient(client *me)
+{
+    outPacket *out;
+
+    while((out = (outPacket*)me->outQueue.head) != NULL)
+    {
+        int result;
+
+        result = writeSome(me, out->bytes + out->sent,
+                           out->length - out->sent, NULL, 0,
+                           out->sent == 0 ? out->passFd : -1);
+        if (result == -1)
+        {
+            /* reading from the client will turn up the failure */
+            message(LOG_INFO, "FAILED to write queued output to client: %s\n",
+                    translateError(errno));
+            discardOutput(me);
+            break;
+        }
+
+        out->sent += result;
+        if (out->sent < out->length)
+            break;
+        freeOutput(me, out);
+    }
+
+    if (me->outQueue.count == 0)
+        watchClientWrites(me, false);
+}
+
+/* write the result of a pipelined request back to its client */
+static void replyToClient(dataPacket *request, dataPacket *response,
+                          void *userData)
+{
+    client *target = (client*)userData;
+    int error = errno;
+
+    if (response != NULL)
+    {
+        /* pack data for the client */
+        free(request->data);
+        request->data = response->data;
+        request->dataLen = response->dataLen;
+        free(response);
+    }
+    else
+        message(LOG_ERROR,
+                "Device transaction (0x%2.2x) failed\n", request->code);
+
+    if (response == NULL ||
+        ! translateProtocol(&request->code, target->version, true))
+    {
+        message(LOG_ERROR,
+                "handleClientRequest(0x%2.2x) failed with: %d (%s)\n",
+                request->code, error, translateError(error));
+        request->code = IG_DEV_ERROR;
+        request->dataLen = -error;
+    }
+
+    /* a failed client is released when its socket is next checked */
+    if (! sendToClient(target, request, false, -1))
+        message(LOG_INFO, "FAILED to write packet back to client: 0x%x\n",
+                request->code);
+
+    free(request->data);
+    free(request);
+}
+
+/* hand the client the receive ring in place of receive packets */
+static bool mapRing(client *target, int *passFd)
+{
+    iguanaDev *idev = target->idev;
+
+    /* the descriptor can only be picked up by the framed reader */
+    if (target->buffer == NULL)
+        errno = EPROTO;
+    else if (target->receiving != 0)
+        errno = EBUSY;
+    else if (idev->settings->ringEntries == 0)
+        errno = ENOSYS;
+    else if (idev->ring == NULL &&
+             (idev->ring = createReceiveRing(idev->settings->ringEntries)) == NULL)
+        message(LOG_ERROR, "Failed to create a receive ring: %s\n",
+                translateError(errno));
+    else
+    {
+        if (idev->receiverCount == 0)
+        {
+            dataPacket request = DATA_PACKET_INIT;
+
+            request.code = IG_DEV_RECVON;
+            if (! deviceTransaction(idev, &request, NULL))
+                return false;
+        }
+
+        /* counted as a receiver, but tellReceivers passes it by */
+        idev->receiverCount++;
+        target->receiving = IG_DEV_MAPRING;
+        *passFd = receiveRingFd(idev->ring);
+        return true;
+    }
+
+    return false;
+}
+
+/* switch a receiving client over to whole frames ending in a space of
+   at least gap microseconds, 0 meaning the daemon's default */
+static bool startFrames(client *target, uint32_t gap)
+{
+    if (target->receiving == IG_DEV_MAPRING)
+    {
+        errno = EBUSY;
+        return false;
+    }
+
+    if (gap == 0)
+        gap = target->idev->settings->frameGap;
+    freeAssembler(target->frames);
+    target->frames = createAssembler(gap);
+    return target->frames != NULL;
+}
+
+/* change the protocols a client is sent key presses for, keeping
+   count of the clients that want any */
+static bool setDecoding(client *target, uint32_t mask)
+{
+    iguanaDev *idev = target->idev;
+
+    if (mask != 0)
+    {
+        if (target->receiving == IG_DEV_MAPRING)
+        {
+            errno = EBUSY;
+            return false;
+        }
+
+        if (idev->decoder == NULL &&
+            (idev->decoder = createDecoder(idev->settings->frameGap)) == NULL)
+            return false;
+    }
+
+    if (target->decodeMask == 0 && mask != 0)
+        idev->decodeClients++;
+    else if (target->decodeMask != 0 && mask == 0 &&
+             --idev->decodeClients == 0)
+    {
+        /* a half decoded frame is stale by the next subscriber */
+        freeDecoder(idev->decoder);
+        idev->decoder = NULL;
+    }
+    target->decodeMask = mask;
+    return true;
+}
+
+/* the other receive modes turn the receiver on like IG_DEV_RECVON,
+   which a client that is already receiving does not need */
+static bool receiveInstead(client *target, dataPacket *request)
+{
+    free(request->data);
+    request->data = NULL;
+    request->dataLen = 0;
+
+    /* a client already receiving is already counted */
+    if (target->receiving == IG_DEV_RECVON)
+        return true;
+
+    request->code = IG_DEV_RECVON;
+    return target->idev->receiverCount > 0;
+}
+
+/* encode the pulses a client passed in a memfd without copying them,
+   request->data holds their offset and count within it */
+static bool encodeFromFd(client *target, dataPacket *request,
+                         int compressVersion)
+{
+    bool retval = false;
+    uint32_t *where = (uint32_t*)request->data;
+
+    /* the descriptor arrived along with the request */
+    if (target->buffer == NULL || target->buffer->passedFd == -1)
+        errno = EBADF;
+    else
+    {
+        if (request->dataLen < (int)(2 * sizeof(uint32_t)))
+            errno = EINVAL;
+        else if (target->sendMap == NULL &&
+                 (target->sendMap = (pulseMap*)calloc(1, sizeof(pulseMap))) == NULL)
+            errno = ENOMEM;
+        else
+        {
+            const uint32_t *pulses;
+
+            pulses = mapPulseFd(target->buffer->passedFd, where[0], where[1],
+                                target->sendMap);
+            if (pulses != NULL)
+            {
+                unsigned char *codes;
+
+                request->dataLen = encodeCached(target->idev->carrier,
+                                                pulses, where[1], &codes,
+                                                compressVersion);
+                free(request->data);
+                request->data = codes;
+                request->code = IG_DEV_SEND;
+                retval = request->dataLen != -1;
+            }
+        }
+        /* the descriptor is closed whether or not it was used */
+        releasePacketBuffer(target->buffer);
+    }
+
+    return retval;
+}
+
+/* encode a code from the store, request->data holds its name */
+static bool encodeNamed(client *target, dataPacket *request,
+                        int compressVersion)
+{
+    unsigned char *codes;
+    char *name;
+    int length;
+
+    name = (char*)malloc(request->dataLen + 1);
+    if (name == NULL)
+        return false;
+    memcpy(name, request->data, request->dataLen);
+    name[request->dataLen] = '\0';
+
+    length = encodeNamedCode(name, target->idev->carrier,
+                             compressVersion, &codes);
+    if (length == -1)
+    {
+        int error = errno;
+
+        message(LOG_ERROR, "Cannot send stored code %s: %s\n",
+                name, translateError(error));
+        free(name);
+        errno = error;
+        return false;
+    }
+    free(name);
+
+    free(request->data);
+    request->data = codes;
+    request->dataLen = length;
+    request->code = IG_DEV_SEND;
+    return true;
+}
+
+/* encode an IG_DEV_SENDAT now and hold it until it is due to fire,
+   in order of when on the device's scheduled list */
+static bool scheduleSend(client *target, dataPacket *request,
+                         int compressVersion)
+{
+    scheduledSend *entry, *pos;
+    unsigned char *codes;
+    int count;
+
+    errno = EINVAL;
+    if (target->idev == NULL || request->dataLen < (int)sizeof(uint64_t) ||
+        (request->dataLen - sizeof(uint64_t)) % sizeof(uint32_t) != 0)
+        return false;
+
+    entry = (scheduledSend*)malloc(sizeof(scheduledSend));
+    if (entry == NULL)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+    entry->owner = target;
+    memcpy(&entry->when, request->data, sizeof(uint64_t));
+    entry->request = *request;
+    entry->request.code = IG_DEV_SEND;
+    count = (request->dataLen - sizeof(uint64_t)) / sizeof(uint32_t);
+    entry->request.dataLen = encodeCached(target->idev->carrier,
+                                          (uint32_t*)(request->data +
+                                                      sizeof(uint64_t)),
+                                          count, &codes, compressVersion);
+    entry->request.data = codes;
+    free(request->data);
+    request->data = NULL;
+    if (entry->request.dataLen == -1)
+    {
+        free(entry);
+        return false;
+    }
+
+    for(pos = (scheduledSend*)target->idev->scheduled.head;
+        pos != NULL && pos->when <= entry->when;
+        pos = (scheduledSend*)pos->header.next)
+        ;
+    insertItem(&target->idev->scheduled, (itemHeader*)pos,
+               (itemHeader*)entry);
+    return true;
+}
+
+/* sets pending when the reply will be written once the ack arrives,
+   and passFd to a descriptor to send along with the reply */
+static bool handleClientRequest(dataPacket *request, client *target,
+                                bool *pending, int *passFd)
 {
     bool retval = false;
     dataPacket *response = NULL;
@@ -54,10 +632,26 @@ static bool handleClientRequest(dataPacket *request, client *target)
     if (checkIncomingProtocol(target->idev, request, false) == NULL)
         return false;
 
+    /* replies must go out in the order requests came in */
+    if (target->idev != NULL && ! pipelinedRequest(target->idev, request))
+        finishTransactions(target->idev);
+
     /* figure out what version of the compression we support */
     compressVersion = COMPRESS_VER0;
-    if (target->idev != NULL && (target->idev->version & 0xFF) >= 0x08)
-        compressVersion = COMPRESS_VER1;
+    if (target->idev != NULL)
+        compressVersion = sendCompression(target->idev);
+
+#ifndef WIN32
+    /* group and pool sockets pass sends on to their member devices */
+    if (target->idev == NULL &&
+        (request->code == IG_DEV_SEND || request->code == IG_DEV_SENDNAMED))
+    {
+        if (! sendToGroup(target, request, pending))
+            return false;
+        return *pending ||
+               translateProtocol(&request->code, target->version, true);
+    }
+#endif
 
     switch(request->code)
     {
@@ -67,8 +661,17 @@ static bool handleClientRequest(dataPacket *request, client *target)
         uint16_t *version = ((uint16_t*)(request->data));
         message(LOG_INFO,
                 "Found client using protocol version %d\n", *version);
+        /* older clients get the reply they always have, those asking
+           for framing get the newest protocol we speak, and the
+           framing switches once this reply is written */
         target->version = *version;
-        *version = IG_PROTOCOL_VERSION;
+        if (target->version < IG_FRAMED_PROTOCOL)
+            *version = IG_PROTOCOL_VERSION;
+        else
+        {
+            target->version = IG_FRAMED_PROTOCOL;
+            *version = target->version;
+        }
         retval = true;
         break;
     }
@@ -99,6 +702,48 @@ static bool handleClientRequest(dataPacket *request, client *target)
         break;
     }
 
+    case IG_CTL_LATENCY:
+    {
+        /* an optional device name limits the report to that device */
+        char *name = NULL;
+        if (request->dataLen > 0)
+        {
+            name = (char*)malloc(request->dataLen + 1);
+            memcpy(name, request->data, request->dataLen);
+            name[request->dataLen] = '\0';
+        }
+        free(request->data);
+        request->data = (unsigned char*)deviceLatencies(name);
+        if (request->data == NULL)
+            request->dataLen = 0;
+        else
+            request->dataLen = strlen((char*)request->data) + 1;
+        retval = true;
+        free(name);
+        break;
+    }
+
+    case IG_CTL_LOADCODES:
+    {
+        int count = loadCodes(srvSettings.codeDir);
+
+        if (count == -1)
+            return false;
+        request->data = (unsigned char*)malloc(sizeof(uint32_t));
+        *(uint32_t*)request->data = count;
+        request->dataLen = sizeof(uint32_t);
+        retval = true;
+        break;
+    }
+
+    case IG_CTL_ENCODESTATS:
+        request->data = (unsigned char*)encodeCacheSummary();
+        if (request->data == NULL)
+            return false;
+        request->dataLen = strlen((char*)request->data) + 1;
+        retval = true;
+        break;
+
     case IG_DEV_GETFEATURES:
         /* shortcut the request if possible */
         if (checkFeatures(target->idev, UNKNOWN_FEATURES))
@@ -115,12 +760,55 @@ static bool handleClientRequest(dataPacket *request, client *target)
     case IG_DEV_RECVON:
     case IG_DEV_RAWRECVON:
         request->code = IG_DEV_RECVON;
+        freeAssembler(target->frames);
+        target->frames = NULL;
+        setDecoding(target, 0);
         if (target->idev->receiverCount > 0)
             retval = true;
         break;
 
+    case IG_DEV_RECVFRAMES:
+        if (request->dataLen != (int)sizeof(uint32_t))
+        {
+            errno = EINVAL;
+            return false;
+        }
+        if (! startFrames(target, *(uint32_t*)request->data))
+            return false;
+        setDecoding(target, 0);
+        retval = receiveInstead(target, request);
+        break;
+
+    case IG_DEV_RECVDECODED:
+    {
+        uint32_t mask;
+
+        if (request->dataLen != (int)sizeof(uint32_t))
+        {
+            errno = EINVAL;
+            return false;
+        }
+        mask = *(uint32_t*)request->data;
+        if (! setDecoding(target, mask == 0 ? 0xFFFFFFFF : mask))
+            return false;
+        freeAssembler(target->frames);
+        target->frames = NULL;
+        retval = receiveInstead(target, request);
+        break;
+    }
+
+    case IG_DEV_MAPRING:
+        /* nothing for the device to do past turning receive on */
+        if (! mapRing(target, passFd))
+            return false;
+        retval = true;
+        break;
+
     case IG_DEV_RECVOFF:
         target->receiving = 0;
+        freeAssembler(target->frames);
+        target->frames = NULL;
+        setDecoding(target, 0);
         if (target->idev->receiverCount > 0)
         {
             target->idev->receiverCount--;
@@ -202,13 +890,50 @@ static bool handleClientRequest(dataPacket *request, client *target)
     {
         unsigned char *codes;
         request->dataLen /= sizeof(uint32_t);
-        request->dataLen = pulsesToIguanaSend(target->idev->carrier,
-                                              (uint32_t*)request->data,
-                                              request->dataLen,
-                                              &codes,
-                                              compressVersion);
+        request->dataLen = encodeCached(target->idev->carrier,
+                                        (uint32_t*)request->data,
+                                        request->dataLen,
+                                        &codes,
+                                        compressVersion);
         free(request->data);
         request->data = codes;
+        if (request->dataLen == -1)
+            return false;
+        break;
+    }
+
+    case IG_DEV_SENDFD:
+        /* from here on it is an ordinary send */
+        if (! encodeFromFd(target, request, compressVersion))
+            return false;
+        break;
+
+    case IG_DEV_SENDNAMED:
+        /* from here on it is an ordinary send */
+        if (! encodeNamed(target, request, compressVersion))
+            return false;
+        break;
+
+    case IG_DEV_SENDAT:
+        /* answered by fireScheduled once the send goes out */
+        if (! scheduleSend(target, request, compressVersion))
+            return false;
+        *pending = true;
+        return true;
+
+    case IG_DEV_SENDCLASS:
+    {
+        uint32_t *settings = (uint32_t*)request->data;
+
+        if (request->dataLen != (int)(2 * sizeof(uint32_t)) ||
+            settings[0] > IG_SEND_BULK)
+        {
+            errno = EINVAL;
+            return false;
+        }
+        target->sendClass = settings[0];
+        target->sendDeadline = settings[1];
+        retval = true;
         break;
     }
 
@@ -218,11 +943,11 @@ static bool handleClientRequest(dataPacket *request, client *target)
            will understand, but just compute the length of the encoded
            signal */
         request->dataLen /= sizeof(uint32_t);
-        request->dataLen = pulsesToIguanaSend(target->idev->carrier,
-                                              (uint32_t*)request->data,
-                                              request->dataLen,
-                                              NULL,
-                                              compressVersion);
+        request->dataLen = encodeCached(target->idev->carrier,
+                                        (uint32_t*)request->data,
+                                        request->dataLen,
+                                        NULL,
+                                        compressVersion);
 
         /* return the computed size */
         request->data = (unsigned char*)realloc(request->data,
@@ -257,6 +982,17 @@ static bool handleClientRequest(dataPacket *request, client *target)
                 "Request handled within daemon: 0x%x\n", request->code);
     else if (target->idev == NULL)
         message(LOG_ERROR, "Unknown request from ctl interface.\n");
+    else if (pipelinedRequest(target->idev, request))
+    {
+        /* replyToClient answers once the ack arrives */
+        if (startTransaction(target->idev, request, replyToClient, target))
+        {
+            *pending = true;
+            return true;
+        }
+        message(LOG_ERROR,
+                "Device transaction (0x%2.2x) failed\n", request->code);
+    }
     else if (! deviceTransaction(target->idev, request, &response))
     {
         if (request->code == IG_DEV_RESET)
@@ -302,9 +1038,96 @@ static bool handleClientRequest(dataPacket *request, client *target)
     return retval;
 }
 
+/* does the client have a send waiting on the time it is to fire? */
+static bool sendScheduled(const client *me)
+{
+    scheduledSend *entry;
+
+    for(entry = (scheduledSend*)me->idev->scheduled.head; entry != NULL;
+        entry = (scheduledSend*)entry->header.next)
+        if (entry->owner == me)
+            return true;
+    return false;
+}
+
+/* drop the client's scheduled sends, there is no one to answer */
+static void discardScheduled(client *target)
+{
+    scheduledSend *entry, *next;
+
+    for(entry = (scheduledSend*)target->idev->scheduled.head; entry != NULL;
+        entry = next)
+    {
+        next = (scheduledSend*)entry->header.next;
+        if (entry->owner == target)
+        {
+            removeItem((itemHeader*)entry);
+            free(entry->request.data);
+            free(entry);
+        }
+    }
+}
+
+/* drop the requests still waiting their turn, along with their fds */
+static void discardDeferred(client *target)
+{
+    deferredRequest *entry;
+
+    while((entry = (deferredRequest*)removeFirstItem(&target->deferred)) != NULL)
+    {
+#ifndef WIN32
+        if (entry->passedFd != -1)
+            close(entry->passedFd);
+#endif
+        free(entry->request.data);
+        free(entry);
+        if (target->idev != NULL)
+            target->idev->queuedRequests--;
+    }
+}
+
+/* a client a reply could not be written to gets nothing more, so
+   drop what it has waiting or scheduled and have the next read
+   release it */
+static void dropClient(client *target)
+{
+    target->overflowed = true;
+#ifndef WIN32
+    shutdown(target->fd, SHUT_RD);
+#endif
+    discardDeferred(target);
+    if (target->idev != NULL)
+        discardScheduled(target);
+}
+
 void releaseClient(client *target)
 {
+    discardDeferred(target);
+
+    /* requests still in flight no longer have anyone to answer */
+    if (target->idev != NULL)
+    {
+        abandonTransactions(target->idev, target);
+        discardScheduled(target);
+        setDecoding(target, 0);
+    }
+#ifndef WIN32
+    else
+        abandonGroupSends(target);
+#endif
+
     closePipe(target->fd);
+    if (target->sendMap != NULL)
+        unmapPulseFd(target->sendMap);
+    free(target->sendMap);
+    freeAssembler(target->frames);
+    if (target->buffer != NULL)
+        releasePacketBuffer(target->buffer);
+    free(target->buffer);
+    discardOutput(target);
+    if (target->dropped > 0)
+        message(LOG_INFO, "Client dropped %u receive packets.\n",
+                target->dropped);
 #if DEBUG
 message(LOG_WARN, "CLOSE %d %s(%d)\n", target->fd, __FILE__, __LINE__);
 #endif
@@ -327,54 +1150,178 @@ message(LOG_WARN, "CLOSE %d %s(%d)\n", target->fd, __FILE__, __LINE__);
     free(removeItem((itemHeader*)target));
 }
 
-bool handleClient(client *me)
+/* start or stop buffering reads to match the exchanged version */
+static bool setFraming(client *me)
 {
-    bool retval = true;
-    dataPacket request;
+    if (me->version >= IG_FRAMED_PROTOCOL && me->buffer == NULL)
+    {
+        me->buffer = (packetBuffer*)malloc(sizeof(packetBuffer));
+        if (me->buffer == NULL)
+            return false;
+        initPacketBuffer(me->buffer);
+    }
+    else if (me->version < IG_FRAMED_PROTOCOL && me->buffer != NULL)
+    {
+        releasePacketBuffer(me->buffer);
+        free(me->buffer);
+        me->buffer = NULL;
+    }
+    return true;
+}
+
+/* answer a request that has been read, false if the client failed */
+static bool answerRequest(client *me, dataPacket *request)
+{
+    bool retval = true, pending = false;
+    int passFd = -1;
 
-    if (! readDataPacket(&request, me->fd, srvSettings.devSettings.recvTimeout))
+    if (! handleClientRequest(request, me, &pending, &passFd))
     {
-        releaseClient(me);
+        message(LOG_ERROR,
+                "handleClientRequest(0x%2.2x) failed with: %d (%s)\n",
+                request->code, errno, translateError(errno));
+        request->code = IG_DEV_ERROR;
+        request->dataLen = -errno;
+    }
+    /* replyToClient now owns the request */
+    else if (pending)
+        return retval;
+
+    if (! sendToClient(me, request, false, passFd))
+    {
+        message(LOG_INFO, "FAILED to write packet back to client: 0x%x\n",
+                request->code);
         retval = false;
     }
     else
     {
-        if (! handleClientRequest(&request, me))
-        {
-            message(LOG_ERROR,
-                    "handleClientRequest(0x%2.2x) failed with: %d (%s)\n",
-                    request.code, errno, translateError(errno));
-            request.code = IG_DEV_ERROR;
-            request.dataLen = -errno;
-        }
+        dataPacket *packet = request;
+        message(LOG_DEBUG3, "Successfully wrote packet: ");
+        appendHex(LOG_DEBUG3, (char*)packet + offsetof(dataPacket, code),
+                  offsetof(dataPacket, data) - offsetof(dataPacket, code));
+        if (packet->dataLen > 0)
+            appendHex(LOG_DEBUG3, packet->data, packet->dataLen);
+    }
 
-        if (! writeDataPacket(&request, me->fd, WAIT_FOREVER))
-        {
-            message(LOG_INFO, "FAILED to write packet back to client: 0x%x\n",
-                    request.code);
-            releaseClient(me);
-            retval = false;
-        }
-        else
-        {
-            dataPacket *packet = &request;
-            message(LOG_DEBUG3, "Successfully wrote packet: ");
-            appendHex(LOG_DEBUG3, (char*)packet + offsetof(dataPacket, code),
-                      offsetof(dataPacket, data) - offsetof(dataPacket, code));
-            if (packet->dataLen > 0)
-                appendHex(LOG_DEBUG3, packet->data, packet->dataLen);
-        }
+    /* for SETID calls we need to do a GETID to then update the
+       aliases correctly */
+    if (request->code == IG_DEV_SETID)
+        getID(me->idev);
+    /* later packets use the framing agreed on in the exchange */
+    else if (retval && request->code == IG_EXCH_VERSIONS &&
+             ! setFraming(me))
+    {
+        message(LOG_ERROR, "Out of memory for a client read buffer.\n");
+        retval = false;
+    }
+    free(request->data);
+
+    return retval;
+}
 
-        /* for SETID calls we need to do a GETID to then update the
-           aliases correctly */
-        if (request.code == IG_DEV_SETID)
-            getID(me->idev);
-        free(request.data);
+/* does the request (in the client's protocol) transmit a code? */
+static bool isTransmit(const client *me, uint8_t code)
+{
+    if (! translateProtocol(&code, me->version, false))
+        return false;
+
+    switch(code)
+    {
+    case IG_DEV_SEND:
+    case IG_DEV_SENDFD:
+    case IG_DEV_SENDNAMED:
+    case IG_DEV_RESEND:
+    case IG_DEV_SENDAT:
+        return true;
+    }
+    return false;
+}
+
+/* queue transmits to take their turn at the device, along with
+   anything the client asks for behind them so it is answered in
+   order.  Returns false when the request should be answered now. */
+static bool deferRequest(client *me, dataPacket *request)
+{
+    deferredRequest *entry;
+    bool transmit = false;
+
+    if (me->idev == NULL)
+    {
+#ifndef WIN32
+        /* pool sockets hold a client's requests while its send is out */
+        if (! groupSending(me))
+#endif
+            return false;
+    }
+    else
+    {
+        /* what follows a scheduled send waits until it has fired */
+        transmit = isTransmit(me, request->code);
+        if (! transmit && me->deferred.count == 0 && ! sendScheduled(me))
+            return false;
+    }
+
+    entry = (deferredRequest*)malloc(sizeof(deferredRequest));
+    if (entry == NULL)
+        return false;
+    entry->request = *request;
+    entry->passedFd = -1;
+    if (me->buffer != NULL)
+    {
+        entry->passedFd = me->buffer->passedFd;
+        me->buffer->passedFd = -1;
+    }
+    entry->deadline = 0;
+    if (transmit && me->sendDeadline != 0)
+        entry->deadline = microsSinceX() + (uint64_t)me->sendDeadline * 1000;
+
+    insertItem(&me->deferred, NULL, (itemHeader*)entry);
+    if (me->idev != NULL)
+        me->idev->queuedRequests++;
+    return true;
+}
+
+static bool handleOneRequest(client *me)
+{
+    bool retval = true, success;
+    dataPacket request;
+
+    if (me->overflowed)
+        success = false;
+    else if (me->buffer != NULL)
+        success = readFramedPacket(&request, me->fd, me->buffer,
+                                   srvSettings.devSettings.recvTimeout);
+    else
+        success = readDataPacket(&request, me->fd,
+                                 srvSettings.devSettings.recvTimeout);
+    if (! success || (! deferRequest(me, &request) &&
+                      ! answerRequest(me, &request)))
+    {
+        releaseClient(me);
+        retval = false;
     }
 
     return retval;
 }
 
+bool handleClient(client *me)
+{
+    bool retval;
+    int reads = 0;
+
+    /* the poller cannot see requests that are already buffered, and
+       batched requests waiting in the socket are taken in the same
+       pass up to a limit that keeps other clients from waiting */
+    do
+        retval = handleOneRequest(me);
+    while(retval && me->buffer != NULL &&
+          (framedPacketBuffered(me->buffer) ||
+           (++reads < BATCH_READS && ! me->overflowed &&
+            refillPacketBuffer(me->buffer, me->fd))));
+
+    return retval;
+}
+
 void getID(iguanaDev *idev)
 {
     char buf[13] = {0}, idxStr[4];
@@ -421,12 +1368,18 @@ void getID(iguanaDev *idev)
     }
 }
 
+void stopReader(iguanaDev *idev)
+{
+    idev->quitRequested = true;
+    cancelRecv(idev->usbDev);
+}
+
 static void joinWithReader(iguanaDev *idev)
 {
     void *exitVal;
 
     /* signal then join with the reader */
-    idev->quitRequested = true;
+    stopReader(idev);
     joinThread(idev->reader, &exitVal);
 }
 
@@ -457,11 +1410,255 @@ message(LOG_WARN, "OPEN %d %s(%d)\n", clientFd, __FILE__, __LINE__);
     }
 }
 
+/* when the transfer of a scheduled send must start for the device to
+   hold the whole code at its time */
+static uint64_t scheduledStart(iguanaDev *idev, scheduledSend *entry)
+{
+    uint64_t transfer = transferMicros(idev, &entry->request);
+
+    if (transfer >= entry->when)
+        return 0;
+    return entry->when - transfer;
+}
+
+/* does a client have a queued request that is free to take its turn? */
+static bool queuedReady(iguanaDev *idev)
+{
+    client *me;
+
+    if (idev->queuedRequests > 0)
+        for(me = (client*)idev->clientList.head; me != NULL;
+            me = (client*)me->header.next)
+            if (me->deferred.count > 0 && ! sendScheduled(me))
+                return true;
+    return false;
+}
+
+/* queued transmits are held once one would still be going when the
+   next scheduled send has to start */
+static bool scheduleHolds(iguanaDev *idev, uint64_t now)
+{
+    scheduledSend *next = (scheduledSend*)idev->scheduled.head;
+
+    return next != NULL &&
+           now + recentLatency(idev, IG_DEV_SEND) + SCHEDULE_SPIN >
+           scheduledStart(idev, next);
+}
+
+int transmitTimeout(iguanaDev *idev, int timeout)
+{
+    scheduledSend *next = (scheduledSend*)idev->scheduled.head;
+    uint64_t now = microsSinceX();
+
+    if (next != NULL)
+    {
+        uint64_t start = scheduledStart(idev, next);
+        int wait = 0;
+
+        /* wake in time to wait out the rest on the clock */
+        if (start > now + scheduleSpin())
+            wait = (int)((start - now - scheduleSpin() + 999) / 1000);
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+
+    if (queuedReady(idev) && ! scheduleHolds(idev, now))
+        return 0;
+    return timeout;
+}
+
+/* send the scheduled sends that are about to start, each at the
+   moment its transfer has to begin, and tell their clients how far
+   from their time the device had the codes */
+static void fireScheduled(iguanaDev *idev)
+{
+    scheduledSend *entry;
+
+    while((entry = (scheduledSend*)idev->scheduled.head) != NULL &&
+          scheduledStart(idev, entry) <= microsSinceX() + scheduleSpin())
+    {
+        dataPacket reply = DATA_PACKET_INIT;
+        int64_t skew;
+
+        removeFirstItem(&idev->scheduled);
+        finishTransactions(idev);
+        sleepUntilMicros(scheduledStart(idev, entry));
+        if (! deviceTransaction(idev, &entry->request, NULL))
+        {
+            message(LOG_ERROR, "Scheduled send failed: %s\n",
+                    translateError(errno));
+            reply.code = IG_DEV_ERROR;
+            reply.dataLen = -errno;
+        }
+        else
+        {
+            skew = (int64_t)(idev->transferred - entry->when);
+            reply.code = IG_DEV_SENDAT;
+            reply.dataLen = sizeof(int64_t);
+            reply.data = (unsigned char*)&skew;
+            translateProtocol(&reply.code, entry->owner->version, true);
+        }
+
+        if (! sendToClient(entry->owner, &reply, false, -1))
+            dropClient(entry->owner);
+        free(entry->request.data);
+        free(entry);
+    }
+}
+
+/* answer a client's oldest request that ran out of time to start */
+static bool expireDeferred(client *me, uint64_t now)
+{
+    deferredRequest *entry = (deferredRequest*)me->deferred.head;
+
+    if (entry == NULL || entry->deadline == 0 || entry->deadline > now)
+        return false;
+
+    removeFirstItem(&me->deferred);
+    me->idev->queuedRequests--;
+    message(LOG_INFO, "Transmit missed its deadline by %d ms.\n",
+            (int)((now - entry->deadline) / 1000));
+#ifndef WIN32
+    if (entry->passedFd != -1)
+        close(entry->passedFd);
+#endif
+    free(entry->request.data);
+    entry->request.data = NULL;
+    entry->request.code = IG_DEV_ERROR;
+    entry->request.dataLen = -ETIME;
+    if (! sendToClient(me, &entry->request, false, -1))
+        dropClient(me);
+    free(entry);
+    return true;
+}
+
+/* answer a request taken off the client's deferred list */
+static void answerDeferred(client *me, deferredRequest *entry)
+{
+    if (me->overflowed)
+        free(entry->request.data);
+    else
+    {
+        int passedFd = -1;
+
+        /* answer with the descriptor the request arrived with */
+        if (me->buffer != NULL)
+        {
+            passedFd = me->buffer->passedFd;
+            me->buffer->passedFd = entry->passedFd;
+            entry->passedFd = -1;
+        }
+
+        if (! answerRequest(me, &entry->request))
+            dropClient(me);
+
+        if (me->buffer != NULL)
+        {
+            releasePacketBuffer(me->buffer);
+            me->buffer->passedFd = passedFd;
+        }
+    }
+#ifndef WIN32
+    if (entry->passedFd != -1)
+        close(entry->passedFd);
+#endif
+    free(entry);
+}
+
+void transmitQueued(iguanaDev *idev)
+{
+    client *me, *chosen = NULL;
+    deferredRequest *entry;
+    uint64_t now;
+
+    fireScheduled(idev);
+    if (idev->queuedRequests == 0)
+        return;
+
+    /* fail what can no longer start in time, then take the first
+       client in the most urgent class that is waiting, passing over
+       those whose scheduled sends have yet to fire */
+    now = microsSinceX();
+    for(me = (client*)idev->clientList.head; me != NULL;
+        me = (client*)me->header.next)
+    {
+        while(expireDeferred(me, now))
+            ;
+        if (me->deferred.count > 0 && ! sendScheduled(me) &&
+            (chosen == NULL || me->sendClass < chosen->sendClass))
+            chosen = me;
+    }
+    if (chosen == NULL || scheduleHolds(idev, now))
+        return;
+
+    /* the client goes to the back of the line for its next turn */
+    removeItem((itemHeader*)chosen);
+    insertItem(&idev->clientList, NULL, (itemHeader*)chosen);
+
+    entry = (deferredRequest*)removeFirstItem(&chosen->deferred);
+    idev->queuedRequests--;
+    answerDeferred(chosen, entry);
+}
+
+#ifndef WIN32
+void replyForwarded(client *target, dataPacket *request, dataPacket *response)
+{
+    deferredRequest *entry;
+
+    replyToClient(request, response, target);
+
+    /* then what the client asked for while it waited, up to its next
+       forwarded send */
+    while(! groupSending(target) &&
+          (entry = (deferredRequest*)removeFirstItem(&target->deferred)) != NULL)
+        answerDeferred(target, entry);
+}
+#endif
+
+/* note when an open frame will need finishing */
+static void frameDue(iguanaDev *idev, uint64_t due)
+{
+    if (due != 0 && (idev->framesDue == 0 || due < idev->framesDue))
+        idev->framesDue = due;
+}
+
+/* hand a whole frame to the client passed as userData */
+static void sendFrame(const uint32_t *pulses, int count, void *userData)
+{
+    client *me = (client*)userData;
+    dataPacket frame = DATA_PACKET_INIT;
+
+    frame.code = IG_DEV_RECV;
+    frame.dataLen = count * sizeof(uint32_t);
+    frame.data = (unsigned char*)pulses;
+    if (translateProtocol(&frame.code, me->version, true) &&
+        ! sendToClient(me, &frame, true, -1))
+        message(LOG_ERROR, "Failed to send a frame to receiver: %d: %s\n",
+                errno, translateError(errno));
+}
+
 static bool tellReceivers(itemHeader *item, void *userData)
 {
     client *me = (client*)item;
     receiveInfo *info = (receiveInfo*)userData;
 
+    /* frames are built up here and sent once they are whole */
+    if (me->frames != NULL)
+    {
+        if (me->receiving == IG_DEV_RECVON && info->translated)
+        {
+            assemblePulses(me->frames, (uint32_t*)info->packet->data,
+                           info->packet->dataLen / sizeof(uint32_t),
+                           info->now, sendFrame, me);
+            frameDue(me->idev, frameDeadline(me->frames));
+        }
+        return true;
+    }
+
+    /* clients taking key presses get those from tellDecoded */
+    if (me->decodeMask != 0)
+        return true;
+
     if ((me->receiving == IG_DEV_RECVON    &&   info->translated) ||
         (me->receiving == IG_DEV_RAWRECVON && ! info->translated))
     {
@@ -470,14 +1667,11 @@ static bool tellReceivers(itemHeader *item, void *userData)
         if (! translateProtocol(&info->packet->code, me->version, true))
             return false;
 
-        /* try to write the received data but do not block waiting on it */
-        if (! writeDataPacket(info->packet, me->fd, 100))
-        {
+        /* slow receivers get the data queued, or dropped, rather than
+           holding up everyone else */
+        if (! sendToClient(me, info->packet, true, -1))
             message(LOG_ERROR, "Failed to send packet to receiver: %d: %s\n",
                     errno, translateError(errno));
-            if (errno == 11)
-                message(LOG_WARN, "A client application may not be closing connections to the daemon.\n");
-        }
         else
         {
             message(LOG_DEBUG3, "Sent receivers: ");
@@ -496,6 +1690,82 @@ static bool tellReceivers(itemHeader *item, void *userData)
     return true;
 }
 
+/* hand a key press to the clients that want its protocol */
+static void tellDecoded(const uint32_t *event, void *userData)
+{
+    iguanaDev *idev = (iguanaDev*)userData;
+    dataPacket packet = DATA_PACKET_INIT;
+    client *me;
+
+    message(LOG_DEBUG, "Decoded protocol %u address 0x%x command 0x%x%s\n",
+            event[IG_DECODED_PROTOCOL], event[IG_DECODED_ADDRESS],
+            event[IG_DECODED_COMMAND],
+            event[IG_DECODED_FLAGS] & IG_DECODED_REPEAT ? " (repeat)" : "");
+
+    packet.code = IG_DEV_DECODED;
+    packet.dataLen = IG_DECODED_WORDS * sizeof(uint32_t);
+    packet.data = (unsigned char*)event;
+    for(me = (client*)idev->clientList.head; me != NULL;
+        me = (client*)me->header.next)
+        if (me->receiving == IG_DEV_RECVON &&
+            (me->decodeMask & (1 << event[IG_DECODED_PROTOCOL])) != 0 &&
+            ! sendToClient(me, &packet, true, -1))
+            message(LOG_ERROR, "Failed to send a key press to receiver: %d: %s\n",
+                    errno, translateError(errno));
+}
+
+static void dispatchPacket(iguanaDev *idev, dataPacket *packet)
+{
+    receiveInfo info;
+
+    switch(packet->code)
+    {
+    case IG_DEV_RECV:
+    {
+        /* inform any users that want raw receive data */
+        info.packet = packet;
+        info.translated = false;
+        info.now = microsSinceX();
+        forEach(&idev->clientList, tellReceivers, &info);
+
+        /* translate, then tell interested users about the data */
+        receivedToPulses(idev, packet);
+        if (idev->ring != NULL)
+            publishPulses(idev->ring, (uint32_t*)packet->data,
+                          packet->dataLen / sizeof(uint32_t));
+
+        info.translated = true;
+        forEach(&idev->clientList, tellReceivers, &info);
+
+        /* decoded once for every client that wants key presses */
+        if (idev->decodeClients > 0)
+        {
+            irDecodePulses(idev->decoder, (uint32_t*)packet->data,
+                           packet->dataLen / sizeof(uint32_t), info.now,
+                           tellDecoded, idev);
+            frameDue(idev, decoderDeadline(idev->decoder));
+        }
+        break;
+    }
+
+    case IG_DEV_OVERRECV:
+        message(LOG_ERROR, "Receive too large from USB device.\n");
+        info.packet = packet;
+        info.translated = false;
+        forEach(&idev->clientList, tellReceivers, &info);
+        break;
+
+    default:
+        message(LOG_ERROR,
+                "Unexpected code (0x%x) with %d data bytes from usb\n",
+                packet->code, packet->dataLen);
+        if (packet->dataLen != 0)
+            appendHex(LOG_ERROR, packet->data, packet->dataLen);
+    }
+
+    releasePacket(idev, packet);
+}
+
 bool handleReader(iguanaDev *idev)
 {
     bool retval = false;
@@ -511,54 +1781,131 @@ bool handleReader(iguanaDev *idev)
     case 0:
         break;
 
+    /* one wakeup covers everything queued since the last one */
     case 1:
     {
         dataPacket *packet;
-        receiveInfo info;
 
-        packet = removeNextPacket(idev);
-        switch(packet->code)
-        {
-        case IG_DEV_RECV:
-        {
-            uint32_t *pulses;
+        acknowledgeWakeup(idev);
+        while((packet = removeNextPacket(idev)) != NULL)
+            dispatchPacket(idev, packet);
+        if (idev->ring != NULL)
+            wakeReceivers(idev->ring);
+        retval = true;
+        break;
+    }
+    }
+    return retval;
+}
 
-            /* inform any users that want raw receive data */
-            info.packet = packet;
-            info.translated = false;
-            forEach(&idev->clientList, tellReceivers, &info);
+int framesTimeout(iguanaDev *idev, int timeout)
+{
+    uint64_t now;
+    int wait = 0;
+
+    if (idev->framesDue == 0)
+        return timeout;
+
+    now = microsSinceX();
+    if (idev->framesDue > now)
+        wait = (idev->framesDue - now + 999) / 1000;
+    if (timeout < 0 || wait < timeout)
+        return wait;
+    return timeout;
+}
 
-            /* translate, then tell interested users about the data */
-            pulses = iguanaDevToPulses(packet->data, &packet->dataLen);
-            free(packet->data);
-            packet->data = (unsigned char*)pulses;
+void finishFrames(iguanaDev *idev)
+{
+    uint64_t now;
+    client *me;
 
-            info.translated = true;
-            forEach(&idev->clientList, tellReceivers, &info);
-            break;
-        }
+    if (idev->framesDue == 0 || idev->framesDue > (now = microsSinceX()))
+        return;
 
-        case IG_DEV_OVERRECV:
-            message(LOG_ERROR, "Receive too large from USB device.\n");
-            info.packet = packet;
-            info.translated = false;
-            forEach(&idev->clientList, tellReceivers, &info);
-            break;
+    idev->framesDue = 0;
+    for(me = (client*)idev->clientList.head; me != NULL;
+        me = (client*)me->header.next)
+        if (me->frames != NULL)
+        {
+            uint64_t due = frameDeadline(me->frames);
 
-        default:
-            message(LOG_ERROR,
-                    "Unexpected code (0x%x) with %d data bytes from usb\n",
-                    packet->code, packet->dataLen);
-            if (packet->dataLen != 0)
-                appendHex(LOG_ERROR, packet->data, packet->dataLen);
+            if (due != 0 && due <= now)
+                finishFrame(me->frames, sendFrame, me);
+            else
+                frameDue(idev, due);
         }
 
-        freeDataPacket(packet);
-        retval = true;
-        break;
+    if (idev->decodeClients > 0)
+    {
+        uint64_t due = decoderDeadline(idev->decoder);
+
+        if (due != 0 && due <= now)
+            finishDecoding(idev->decoder, tellDecoded, idev);
+        else
+            frameDue(idev, due);
     }
+}
+
+bool activateDevice(iguanaDev *idev)
+{
+    if (! checkVersion(idev))
+        return false;
+
+    /* add this device to the list of devices */
+    EnterCriticalSection(&srvSettings.devsLock);
+    insertItem(&srvSettings.devs, NULL, (itemHeader*)idev);
+    LeaveCriticalSection(&srvSettings.devsLock);
+    return true;
+}
+
+void deactivateDevice(iguanaDev *idev)
+{
+    /* nothing more will be read from the responsePipe */
+    abandonTransactions(idev, NULL);
+
+    /* Close some of the pipes but leave one to mark when the
+       device reader exits. */
+    closePipe(idev->readerPipe[READ]);
+    closePipe(idev->responsePipe[READ]);
+    closePipe(idev->responsePipe[WRITE]);
+#if DEBUG
+message(LOG_WARN, "CLOSE %d %s(%d)\n", idev->readerPipe[READ], __FILE__, __LINE__);
+message(LOG_WARN, "CLOSE %d %s(%d)\n", idev->responsePipe[READ], __FILE__, __LINE__);
+message(LOG_WARN, "CLOSE %d %s(%d)\n", idev->responsePipe[WRITE], __FILE__, __LINE__);
+#endif
+
+    /* remove this from the active device list */
+    EnterCriticalSection(&srvSettings.devsLock);
+    removeItem((itemHeader*)idev);
+    LeaveCriticalSection(&srvSettings.devsLock);
+}
+
+void destroyDevice(iguanaDev *idev)
+{
+    /* release resources for reader and usb device, shared receive
+       engines have already finished when this is called */
+    if (idev->reader != INVALID_THREAD_PTR)
+        joinWithReader(idev);
+    freePacketRing(idev);
+    while(idev->responses.count > 0)
+        freeDataPacket((dataPacket*)removeFirstItem(&idev->responses));
+    freePacketPool(idev);
+    freeLatencies(idev);
+    while(idev->scheduled.count > 0)
+    {
+        scheduledSend *entry;
+        entry = (scheduledSend*)removeFirstItem(&idev->scheduled);
+        free(entry->request.data);
+        free(entry);
     }
-    return retval;
+    closeReceiveRing(idev->ring);
+    freeDecoder(idev->decoder);
+    free(idev->lastSend);
+    releaseDevice(idev->usbDev);
+    freeDevice(idev->usbDev);
+    free(idev->locAlias);
+    free(idev->userAlias);
+    free(idev);
 }
 
 static void* workLoop(void *instance)
@@ -572,47 +1919,21 @@ static void* workLoop(void *instance)
 #endif
 
     message(LOG_INFO, "Worker %d starting\n", idev->usbDev->id);
-    if (checkVersion(idev))
+    if (activateDevice(idev))
     {
         char name[4];
 
-        /* add this device to the list of devices */
-        EnterCriticalSection(&srvSettings.devsLock);
-        insertItem(&srvSettings.devs, NULL, (itemHeader*)idev);
-        LeaveCriticalSection(&srvSettings.devsLock);
-
         /* start the listener */
         sprintf(name, "%d", idev->usbDev->id);
         listenToClients(name, &idev->clientList, idev);
 
-        /* Close some of the pipes but leave one to mark when the
-           device reader exits. */
-        closePipe(idev->readerPipe[READ]);
-        closePipe(idev->responsePipe[READ]);
-        closePipe(idev->responsePipe[WRITE]);
-#if DEBUG
-message(LOG_WARN, "CLOSE %d %s(%d)\n", idev->readerPipe[READ], __FILE__, __LINE__);
-message(LOG_WARN, "CLOSE %d %s(%d)\n", idev->responsePipe[READ], __FILE__, __LINE__);
-message(LOG_WARN, "CLOSE %d %s(%d)\n", idev->responsePipe[WRITE], __FILE__, __LINE__);
-#endif
-
-        /* remove this from the active device list */
-        EnterCriticalSection(&srvSettings.devsLock);
-        removeItem((itemHeader*)idev);
-        LeaveCriticalSection(&srvSettings.devsLock);
+        deactivateDevice(idev);
     }
 
     /* log the shutdown and grab a copy of the thread id for later */
     message(LOG_INFO, "Worker %d exiting\n", idev->usbDev->id);
     thread = idev->worker;
-
-    /* release resources for reader and usb device */
-    joinWithReader(idev);
-    releaseDevice(idev->usbDev);
-    freeDevice(idev->usbDev);
-    free(idev->locAlias);
-    free(idev->userAlias);
-    free(idev);
+    destroyDevice(idev);
 
     /* tell the parent thread to go ahead and reclaim our resources */
     makeParentJoin(thread);
@@ -664,6 +1985,33 @@ message(LOG_WARN, "OPEN %d %s(%d)\n", idev->responsePipe[WRITE], __FILE__, __LIN
             if (! findDeviceEndpoints(idev->usbDev, &idev->maxPacketSize))
                 message(LOG_ERROR,
                         "Failed find device endpoints for %d\n", info->id);
+            else if (! initPacketPool(idev) || ! initPacketRing(idev))
+                message(LOG_ERROR,
+                        "Out of memory for the receive buffers of %d\n", info->id);
+#ifndef WIN32
+            /* the shared event threads serve this device, usually
+               without a reader thread of its own */
+            else if (srvSettings.eventThreads > 0)
+            {
+                if (startIncomingPackets(idev) ||
+                    startThread(&idev->reader,
+                                (void *(*)(void*))handleIncomingPackets,
+                                idev))
+                {
+                    if (reactorAddDevice(idev))
+                        return;
+
+                    /* wait for the reader to close its pipe */
+                    stopReader(idev);
+                    while(handleReader(idev))
+                        ;
+                    destroyDevice(idev);
+                    return;
+                }
+                message(LOG_ERROR,
+                        "Failed to start reading from %d\n", info->id);
+            }
+#endif
             else if (! startThread(&idev->reader,
                                    (void *(*)(void*))handleIncomingPackets,
                                    idev))
@@ -680,6 +2028,8 @@ message(LOG_WARN, "OPEN %d %s(%d)\n", idev->responsePipe[WRITE], __FILE__, __LIN
 
                 joinWithReader(idev);
             }
+            freePacketRing(idev);
+            freePacketPool(idev);
         }
         free(idev);
     }
@@ -692,6 +2042,14 @@ bool reapAllChildren(deviceList *list)
 
     /* stop all the readers and thereby the workers */
     x = stopDevices(list);
+#ifndef WIN32
+    /* the event threads tear down their own devices */
+    if (srvSettings.eventThreads > 0)
+    {
+        stopReactors();
+        x = 0;
+    }
+#endif
     while(x > 0)
     {
         void *exitVal;
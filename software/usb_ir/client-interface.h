@@ -29,6 +29,44 @@ typedef struct client
     /* protocol version that should be used with this client */
     uint16_t version;
 
+    /* buffers reads once the client exchanges IG_FRAMED_PROTOCOL, and
+       is NULL while packets go back and forth as whole dataPackets */
+    struct packetBuffer *buffer;
+
+    /* output the socket has not taken yet, oldest first, and how many
+       of those queued packets are receive data */
+    listHeader outQueue;
+    unsigned int queuedRecvs;
+
+    /* receive packets dropped since the client could not keep up */
+    unsigned int dropped;
+    /* set once the overflow policy has decided to disconnect */
+    bool overflowed;
+
+    /* the memfd the client last sent pulses from, kept mapped for its
+       next send, or NULL before the first */
+    struct pulseMap *sendMap;
+
+    /* builds whole frames for a client that asked for them, or NULL
+       while receive data goes out packet by packet */
+    struct frameAssembler *frames;
+    /* bits (1 << IG_PROTO_*) of the protocols the client is sent
+       decoded key presses for in place of pulses, 0 for none */
+    uint32_t decodeMask;
+
+    /* requests waiting on the device's transmit queue, oldest first,
+       along with the IG_SEND_* class they wait in and the deadline in
+       milliseconds given to each transmit, 0 for none */
+    listHeader deferred;
+    uint32_t sendClass;
+    uint32_t sendDeadline;
+
+#ifndef WIN32
+    /* the daemon's poller, which is told to report fd as writable
+       while output is queued */
+    struct poller *watch;
+#endif
+
 #ifdef WIN32
     /* used in the win32 driver to keep track of overlapped actions */
     OVERLAPPED over;
@@ -37,12 +75,49 @@ typedef struct client
 
 /* API implemented by the daemon/service code */
 void listenToClients(const char *name, listHeader *clientList, iguanaDev *idev);
+/* ask for flushClient to be called once fd can take more output */
+void watchClientWrites(client *me, bool writes);
+#ifndef WIN32
+/* hand what arrives on fd, a connection a group or pool forwards the
+   sends on me's socket over, to serveMember with member */
+bool watchGroupMember(client *me, PIPE_PTR fd, void *member);
+#endif
+#ifndef WIN32
+/* optional event threads that serve all devices between them */
+bool startReactors(int count);
+bool reactorAddDevice(iguanaDev *idev);
+void stopReactors();
+#endif
 
 /* API used by the daemon/service code */
 void releaseClient(client *target);
 bool handleReader(iguanaDev *idev);
 void clientConnected(PIPE_PTR clientFd, listHeader *clientList, iguanaDev *idev);
 bool handleClient(client *me);
+/* write whatever queued output the client's socket will take */
+void flushClient(client *me);
+/* shorten timeout (ms, -1 for none) to when an open frame is due, and
+   finish the frames that are */
+int framesTimeout(iguanaDev *idev, int timeout);
+void finishFrames(iguanaDev *idev);
+/* shorten timeout to 0 while clients have requests queued, or to
+   just before the next scheduled send is to start, and serve the next
+   of them, so that new requests are taken in between */
+int transmitTimeout(iguanaDev *idev, int timeout);
+void transmitQueued(iguanaDev *idev);
+#ifndef WIN32
+/* answer a send a pool forwarded for target, taking the request and
+   response (NULL with errno set on failure), and then the requests
+   target made while it waited */
+void replyForwarded(client *target, struct dataPacket *request,
+                    struct dataPacket *response);
+#endif
+
+/* device life cycle shared by the worker threads and the reactors */
+bool activateDevice(iguanaDev *idev);
+void deactivateDevice(iguanaDev *idev);
+void stopReader(iguanaDev *idev);
+void destroyDevice(iguanaDev *idev);
 
 /* the worker thread has to check the id at startup */
 void getID(iguanaDev *idev);
@@ -70,6 +70,13 @@ enum
     OFFSET_GETADDRESS  = ARGP_OFFSET + IG_DEV_GETADDRESS,
     OFFSET_LISTDEVS    = ARGP_OFFSET + IG_CTL_LISTDEVS,
     OFFSET_DEVADDR     = ARGP_OFFSET + IG_CTL_DEVADDR,
+    OFFSET_LATENCY     = ARGP_OFFSET + IG_CTL_LATENCY,
+    OFFSET_LOADCODES   = ARGP_OFFSET + IG_CTL_LOADCODES,
+    OFFSET_ENCODESTATS = ARGP_OFFSET + IG_CTL_ENCODESTATS,
+    OFFSET_SENDNAMED   = ARGP_OFFSET + IG_DEV_SENDNAMED,
+    OFFSET_RECVDECODED = ARGP_OFFSET + IG_DEV_RECVDECODED,
+    OFFSET_SENDCLASS   = ARGP_OFFSET + IG_DEV_SENDCLASS,
+    OFFSET_SENDAT      = ARGP_OFFSET + IG_DEV_SENDAT,
 
     /* used to check the receive buffer is empty in the end */
     FINAL_CHECK = 0xFFFF,
@@ -79,7 +86,7 @@ enum
 
     /* match these to the CTL commands that we support */
     IG_FIRST_CTLCMD = IG_CTL_LISTDEVS,
-    IG_LAST_CTLCMD  = IG_CTL_DEVADDR
+    IG_LAST_CTLCMD  = IG_CTL_ENCODESTATS
 };
 
 /* declare and initialize the parameters structure */
@@ -107,6 +114,9 @@ static commandSpec supportedCommands[] =
 
     {"all devices",     false, IG_CTL_LISTDEVS, 0, false},
     {"device address",  false, IG_CTL_DEVADDR,  0, false},
+    {"latency",         false, IG_CTL_LATENCY,  0, false},
+    {"load codes",      false, IG_CTL_LOADCODES, 0, false},
+    {"encode stats",    false, IG_CTL_ENCODESTATS, 0, false},
 
     {"get version",     false, IG_DEV_GETVERSION,      0,      false},
     {"write block",     false, IG_DEV_WRITEBLOCK,      0,      false},
@@ -117,9 +127,13 @@ static commandSpec supportedCommands[] =
     {"get buffer size", false, IG_DEV_GETBUFSIZE,      0,      false},
     {"receiver on",     false, IG_DEV_RECVON,          0,      false},
     {"raw receiver on", false, IG_DEV_RAWRECVON,       0,      false},
+    {"receive decoded", false, IG_DEV_RECVDECODED,     0,      false},
     {"receiver off",    false, IG_DEV_RECVOFF,         0,      false},
     {"send",            false, IG_DEV_SEND,            0,      false},
+    {"named send",      false, IG_DEV_SENDNAMED,       0,      false},
     {"resend",          false, IG_DEV_RESEND,          0,      false},
+    {"transmit class",  false, IG_DEV_SENDCLASS,       0,      false},
+    {"timed send",      false, IG_DEV_SENDAT,          0,      false},
     {"all aliases",     false, IG_DEV_LISTALIASES,     0,      false},
     {"get address",     false, IG_DEV_GETADDRESS,      0,      false},
     {"encoded size",    false, IG_DEV_SENDSIZE,        0,      false},
@@ -297,6 +311,66 @@ static void setSetting(unsigned int setting, const char *pins,
         }
 }
 
+/* print the daemon's per request latency summary as a table */
+static void printLatencies(char *text)
+{
+    char *line;
+
+    message(LOG_NORMAL, "\n  %-3s %-20s %8s %6s %8s %8s %8s %8s %8s",
+            "dev", "request", "count", "failed", "timeouts",
+            "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for(line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n"))
+    {
+        unsigned int id, code, count, failed, timeouts, x;
+        unsigned long long p50, p99, p999, max;
+        const char *name = "unknown";
+
+        if (sscanf(line, "%u %u %u %u %u %llu %llu %llu %llu",
+                   &id, &code, &count, &failed, &timeouts,
+                   &p50, &p99, &p999, &max) != 9)
+            continue;
+
+        for(x = 0; supportedCommands[x].text != NULL; x++)
+            if (! supportedCommands[x].internal &&
+                supportedCommands[x].code == code)
+            {
+                name = supportedCommands[x].text;
+                break;
+            }
+
+        message(LOG_NORMAL, "\n  %-3u %-20s %8u %6u %8u %8llu %8llu %8llu %8llu",
+                id, name, count, failed, timeouts, p50, p99, p999, max);
+    }
+}
+
+/* print how each member of a group fared with a send */
+static void printGroupResults(char *text)
+{
+    char *member;
+
+    for(member = strtok(text, "|"); member != NULL; member = strtok(NULL, "|"))
+    {
+        char *status, *usec;
+
+        /* MEMBER:STATUS:USEC, where only the member may hold colons */
+        usec = strrchr(member, ':');
+        if (usec == NULL)
+            continue;
+        *usec++ = '\0';
+        status = strrchr(member, ':');
+        if (status == NULL)
+            continue;
+        *status++ = '\0';
+
+        if (atoi(status) == 0)
+            message(LOG_NORMAL, "\n  %-12s sent in %.3f ms",
+                    member, strtoull(usec, NULL, 10) / 1000.0);
+        else
+            message(LOG_NORMAL, "\n  %-12s failed: %s",
+                    member, translateError(-atoi(status)));
+    }
+}
+
 static bool processResponse(unsigned char code, igtask *cmd, unsigned int length, void *data)
 {
     bool retval = false;
@@ -321,6 +395,30 @@ static bool processResponse(unsigned char code, igtask *cmd, unsigned int length
                 }
                 /* a receive does not end anything, try again */
             }
+    else if (code == IG_DEV_DECODED)
+            {
+                static const char *names[] = {"unknown", "NEC", "NECx",
+                                              "RC5", "RC6", "Sony", "JVC"};
+                uint32_t *event = (uint32_t*)data;
+
+                if (length >= IG_DECODED_WORDS * sizeof(uint32_t))
+                    message(LOG_NORMAL,
+                            "decoded %s address 0x%x command 0x%x%s",
+                            event[IG_DECODED_PROTOCOL] <= IG_PROTO_JVC ?
+                                names[event[IG_DECODED_PROTOCOL]] : "unknown",
+                            event[IG_DECODED_ADDRESS],
+                            event[IG_DECODED_COMMAND],
+                            event[IG_DECODED_FLAGS] & IG_DECODED_REPEAT ?
+                                " (repeat)" : "");
+            }
+    else if (code == IG_DEV_RECVGAP)
+            {
+                uint32_t dropped = 0;
+                if (length >= sizeof(uint32_t))
+                    dropped = *(uint32_t*)data;
+                message(LOG_NORMAL,
+                        "missed %u receive(s) while not keeping up", dropped);
+            }
             else
             {
                 if (! cmd->isSubTask)
@@ -336,6 +434,38 @@ static bool processResponse(unsigned char code, igtask *cmd, unsigned int length
                         message(LOG_NORMAL, ": %s", (char*)data);
                     break;
 
+                case IG_CTL_LOADCODES:
+                    message(LOG_NORMAL, ": %u codes", *(uint32_t*)data);
+                    break;
+
+                case IG_DEV_SEND:
+                case IG_DEV_SENDNAMED:
+                    /* only group sockets say how each device did */
+                    if (data != NULL)
+                        printGroupResults((char*)data);
+                    break;
+
+                case IG_CTL_ENCODESTATS:
+                {
+                    unsigned long long hits, misses, evictions;
+                    unsigned int entries, bytes, limit;
+
+                    if (sscanf((char*)data, "%llu %llu %llu %u %u %u",
+                               &hits, &misses, &evictions,
+                               &entries, &bytes, &limit) == 6)
+                        message(LOG_NORMAL,
+                                ": %llu hits, %llu misses, %llu evictions, %u entries using %u of %u bytes",
+                                hits, misses, evictions, entries, bytes, limit);
+                    break;
+                }
+
+                case IG_CTL_LATENCY:
+                    if (data == NULL)
+                        message(LOG_NORMAL, ": no requests");
+                    else
+                        printLatencies((char*)data);
+                    break;
+
                 case IG_DEV_GETADDRESS:
                     message(LOG_NORMAL, ": %s", (char*)data);
                     break;
@@ -406,7 +536,12 @@ static bool processResponse(unsigned char code, igtask *cmd, unsigned int length
                 case IG_DEV_SENDSIZE:
                 {
                     message(LOG_NORMAL, ": size=%d", *(uint16_t*)data);
+                    break;
                 }
+
+                case IG_DEV_SENDAT:
+                    message(LOG_NORMAL, ": %lld us late",
+                            (long long)*(int64_t*)data);
                 }
 
                 retval = true;
@@ -525,13 +660,20 @@ static bool transaction(igtask *cmd, PIPE_PTR conn, int amt, void *data)
 {
     bool retval = false;
     iguanaPacket request = NULL;
+    int timeout = 10000;
+    uint64_t now;
+
+    /* a timed send is not answered until it fires */
+    now = microsSinceX();
+    if (cmd->spec->code == IG_DEV_SENDAT && *(uint64_t*)data > now)
+        timeout += (int)((*(uint64_t*)data - now) / 1000);
 
     request = iguanaCreateRequest((unsigned char)cmd->spec->code, amt, data);
     if (request == NULL)
         message(LOG_ERROR, "Out of memory allocating request.\n");
     else if (! iguanaWriteRequest(request, conn))
         message(LOG_ERROR, "Failed to write request to server.\n");
-    else if (receiveResponse(conn, cmd, 10000))
+    else if (receiveResponse(conn, cmd, timeout))
         retval = true;
 
     /* release allocated data buffers (including data ptr) */
@@ -557,10 +699,26 @@ static bool performTask(PIPE_PTR conn, igtask *cmd)
             data = strdup(cmd->arg);
             break;
 
+        case IG_CTL_LATENCY:
+            /* without a device name every device is reported */
+            if (cmd->arg != NULL)
+            {
+                result = strlen(cmd->arg) + 1;
+                data = strdup(cmd->arg);
+            }
+            break;
+
         case IG_DEV_RECVON:
             recvOn = true;
             break;
 
+        case IG_DEV_RECVDECODED:
+            /* key presses of every protocol the daemon knows */
+            recvOn = true;
+            data = calloc(1, sizeof(uint32_t));
+            result = sizeof(uint32_t);
+            break;
+
         case IG_DEV_RECVOFF:
             recvOn = false;
             break;
@@ -659,6 +817,80 @@ static bool performTask(PIPE_PTR conn, igtask *cmd)
             result *= sizeof(uint32_t);
             break;
 
+        case IG_DEV_SENDNAMED:
+            result = strlen(cmd->arg) + 1;
+            data = strdup(cmd->arg);
+            break;
+
+        case IG_DEV_SENDAT:
+        {
+            uint32_t delay, *pulses;
+            char *colon;
+            int count;
+
+            /* MS:FILE fires the pulses in FILE MS from now */
+            errno = EINVAL;
+            result = -1;
+            colon = strchr(cmd->arg, ':');
+            if (colon == NULL)
+                message(LOG_ERROR, "Timed sends take MS:FILE.\n");
+            else
+            {
+                *colon = '\0';
+                if (! parseNumber(cmd->arg, &delay))
+                    message(LOG_ERROR, "Failed to parse the delay.\n");
+                else if ((count = iguanaReadPulseFile(colon + 1,
+                                                      (void**)&pulses)) >= 0)
+                {
+                    uint64_t when = microsSinceX() + (uint64_t)delay * 1000;
+
+                    result = sizeof(uint64_t) + count * sizeof(uint32_t);
+                    data = malloc(result);
+                    memcpy(data, &when, sizeof(uint64_t));
+                    memcpy((char*)data + sizeof(uint64_t), pulses,
+                           count * sizeof(uint32_t));
+                    free(pulses);
+                }
+                *colon = ':';
+            }
+            break;
+        }
+
+        case IG_DEV_SENDCLASS:
+        {
+            uint32_t *settings;
+            size_t length;
+            char *colon;
+
+            /* CLASS[:MS] where MS is an optional deadline */
+            errno = EINVAL;
+            result = -1;
+            settings = (uint32_t*)calloc(2, sizeof(uint32_t));
+            colon = strchr(cmd->arg, ':');
+            length = colon == NULL ? strlen(cmd->arg) : (size_t)(colon - cmd->arg);
+            if (colon != NULL && ! parseNumber(colon + 1, &settings[1]))
+                message(LOG_ERROR, "Failed to parse the deadline.\n");
+            else if (length == 4 && strncmp(cmd->arg, "bulk", 4) == 0)
+            {
+                settings[0] = IG_SEND_BULK;
+                result = 2 * sizeof(uint32_t);
+            }
+            else if (length == 11 && strncmp(cmd->arg, "interactive", 11) == 0)
+            {
+                settings[0] = IG_SEND_INTERACTIVE;
+                result = 2 * sizeof(uint32_t);
+            }
+            else
+                message(LOG_ERROR,
+                        "Transmit class must be interactive or bulk.\n");
+
+            if (result == -1)
+                free(settings);
+            else
+                data = settings;
+            break;
+        }
+
         case IG_DEV_SETID:
             result = strlen(cmd->arg) + 1;
             if (result > 13)
@@ -811,6 +1043,9 @@ static struct argp_option options[] = {
     { NULL, 0, NULL, 0, "General options:", GEN_GROUP },
     { "all-devices", OFFSET_LISTDEVS, NULL,     0, "List all devices known to the daemon.",   GEN_GROUP },
     { "dev-address", OFFSET_DEVADDR,  "ALIAS",  0, "Ask the daemon for an alias' address.",   GEN_GROUP },
+    { "latency",     OFFSET_LATENCY,  "DEVICE", OPTION_ARG_OPTIONAL, "Show the daemon's request latencies for one or all devices.", GEN_GROUP },
+    { "load-codes",  OFFSET_LOADCODES, NULL,    0, "Have the daemon reload the named codes in its --code-dir.", GEN_GROUP },
+    { "encode-stats", OFFSET_ENCODESTATS, NULL, 0, "Show the hit and miss counts of the daemon's encode cache.", GEN_GROUP },
     { "device",      'd',             "DEVICE", 0, "Specify the target device index or id.",  GEN_GROUP },
     { "sleep",       INTERNAL_SLEEP,  "NUM",    0, "Sleep for NUM seconds.",                  GEN_GROUP },
 
@@ -819,11 +1054,15 @@ static struct argp_option options[] = {
     { "get-version",     IG_DEV_GETVERSION,  NULL,       0, "Return the version of the device firmware.",                    DEV_GROUP },
     { "get-features",    IG_DEV_GETFEATURES, NULL,       0, "Return the features associated w/ this device.",                DEV_GROUP },
     { "send",            IG_DEV_SEND,        "FILE",     0, "Send the pulses and spaces from a file.",                       DEV_GROUP },
+    { "send-named",      OFFSET_SENDNAMED,   "NAME",     0, "Send a code the daemon loaded from its --code-dir.",            DEV_GROUP },
+    { "transmit-class",  OFFSET_SENDCLASS,   "CLASS[:MS]", 0, "Queue later sends as interactive or bulk, failing any not started within MS.", DEV_GROUP },
+    { "timed-send",      OFFSET_SENDAT,      "MS:FILE",  0, "Send the pulses and spaces from a file MS milliseconds from now.", DEV_GROUP },
     { "resend",          OFFSET_RESEND,      "DELAY",    0, "Resend the contents of the device buffer after DELAY seconds.", DEV_GROUP },
     { "all-aliases",     OFFSET_LISTALIASES, NULL,       0, "List all the valid names for this device.",                     DEV_GROUP },
     { "get-address",     OFFSET_GETADDRESS,  NULL,       0, "Return the base address for a device.",                         DEV_GROUP },
     { "encoded-size",    OFFSET_SENDSIZE,    "FILE",     0, "Check the encodes size of the pulses and spaces from a file.",  DEV_GROUP },
     { "receiver-on",     IG_DEV_RECVON,      NULL,       0, "Enable the receiver on the usb device.",                        DEV_GROUP },
+    { "receive-decoded", OFFSET_RECVDECODED, NULL,       0, "Receive key presses decoded by the daemon.",                    DEV_GROUP },
     { "receiver-off",    IG_DEV_RECVOFF,     NULL,       0, "Disable the receiver on the usb device.",                       DEV_GROUP },
     { "get-pins",        IG_DEV_GETPINS,     NULL,       0, "Get the pin values.",                                           DEV_GROUP },
     { "set-pins",        IG_DEV_SETPINS,     "PINS",     0, "Set the pin values.",                                           DEV_GROUP },
@@ -915,6 +1154,13 @@ static error_t parseOption(int key, char *arg, struct argp_state *state)
     case OFFSET_GETADDRESS:
     case OFFSET_LISTDEVS:
     case OFFSET_DEVADDR:
+    case OFFSET_LATENCY:
+    case OFFSET_RECVDECODED:
+    case OFFSET_SENDCLASS:
+    case OFFSET_SENDAT:
+    case OFFSET_LOADCODES:
+    case OFFSET_ENCODESTATS:
+    case OFFSET_SENDNAMED:
         enqueueTaskById((unsigned short)(key - ARGP_OFFSET), arg);
         break;
 
@@ -0,0 +1,178 @@
+/****************************************************************************
+ ** codeStore.c *************************************************************
+ ****************************************************************************
+ *
+ * The daemon's store of named IR codes, shared by all devices.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#include "iguanaIR.h"
+#include "compat.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "logging.h"
+#include "encodeCache.h"
+#include "pulseFile.h"
+#include "codeStore.h"
+
+typedef struct namedCode
+{
+    char *name;
+    uint32_t *pulses;
+    int count;
+} namedCode;
+
+/* the codes sorted by name, replaced whole by loadCodes */
+static LOCK_PTR storeLock;
+static namedCode *codes = NULL;
+static int codeCount = 0;
+
+static void freeStored(namedCode *list, int count)
+{
+    int x;
+
+    for(x = 0; x < count; x++)
+    {
+        free(list[x].name);
+        free(list[x].pulses);
+    }
+    free(list);
+}
+
+static int compareCodes(const void *a, const void *b)
+{
+    return strcmp(((const namedCode*)a)->name, ((const namedCode*)b)->name);
+}
+
+void initCodeStore()
+{
+    InitializeCriticalSection(&storeLock);
+}
+
+void cleanupCodeStore()
+{
+    EnterCriticalSection(&storeLock);
+    freeStored(codes, codeCount);
+    codes = NULL;
+    codeCount = 0;
+    LeaveCriticalSection(&storeLock);
+}
+
+int loadCodes(const char *dir)
+{
+    DIR_HANDLE handle = NULL;
+    char buffer[PATH_MAX];
+    namedCode *loaded = NULL, *old;
+    int count = 0, size = 0, oldCount, x;
+
+    if (dir == NULL || strlen(dir) >= PATH_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* read everything before touching the store */
+    strcpy(buffer, dir);
+    while((handle = findNextFile(handle, buffer)) != NULL)
+    {
+        char path[PATH_MAX], *dot;
+        namedCode code;
+
+        /* skip hidden files along with . and .. */
+        if (buffer[0] == '.' ||
+            snprintf(path, PATH_MAX, "%s%c%s",
+                     dir, PATH_SEP, buffer) >= PATH_MAX)
+            continue;
+
+        memset(&code, 0, sizeof(namedCode));
+        code.count = readPulseFile(path, &code.pulses);
+        if (code.count <= 0)
+        {
+            message(LOG_WARN, "Skipping unreadable code file %s\n", path);
+            free(code.pulses);
+            continue;
+        }
+
+        dot = strrchr(buffer, '.');
+        if (dot != NULL && dot != buffer)
+            *dot = '\0';
+        code.name = strdup(buffer);
+
+        if (count == size)
+        {
+            namedCode *bigger;
+
+            size = size * 2 + 32;
+            bigger = (namedCode*)realloc(loaded, sizeof(namedCode) * size);
+            if (bigger == NULL)
+            {
+                free(code.name);
+                free(code.pulses);
+                freeStored(loaded, count);
+                while((handle = findNextFile(handle, buffer)) != NULL)
+                    ;
+                errno = ENOMEM;
+                return -1;
+            }
+            loaded = bigger;
+        }
+        loaded[count++] = code;
+    }
+
+    /* a missing directory looks the same as an empty one */
+    if (count == 0)
+    {
+        message(LOG_ERROR, "No codes found in %s\n", dir);
+        free(loaded);
+        errno = ENOENT;
+        return -1;
+    }
+
+    qsort(loaded, count, sizeof(namedCode), compareCodes);
+    for(x = 1; x < count; x++)
+        if (strcmp(loaded[x - 1].name, loaded[x].name) == 0)
+            message(LOG_WARN, "More than one file holds code %s\n",
+                    loaded[x].name);
+
+    EnterCriticalSection(&storeLock);
+    old = codes;
+    oldCount = codeCount;
+    codes = loaded;
+    codeCount = count;
+    LeaveCriticalSection(&storeLock);
+
+    freeStored(old, oldCount);
+    message(LOG_INFO, "Loaded %d codes from %s\n", count, dir);
+    return count;
+}
+
+int encodeNamedCode(const char *name, int carrier, int compressVersion,
+                    unsigned char **result)
+{
+    namedCode key, *code;
+    int retval = -1;
+
+    key.name = (char*)name;
+    EnterCriticalSection(&storeLock);
+    code = NULL;
+    if (codeCount > 0)
+        code = (namedCode*)bsearch(&key, codes, codeCount,
+                                   sizeof(namedCode), compareCodes);
+    if (code == NULL)
+        errno = ENOENT;
+    else
+        /* the pulses are only safe while the store is locked */
+        retval = encodeCached(carrier, code->pulses, code->count,
+                              result, compressVersion);
+    LeaveCriticalSection(&storeLock);
+
+    return retval;
+}
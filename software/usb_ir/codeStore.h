@@ -0,0 +1,31 @@
+/****************************************************************************
+ ** codeStore.h *************************************************************
+ ****************************************************************************
+ *
+ * Named IR codes loaded from a directory of pulse/space files, so
+ * that clients can send a stored code by name.  The codes are parsed
+ * once as they are loaded and encoded through the encode cache, so
+ * repeated sends skip both the parsing and encoding.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#pragma once
+
+void initCodeStore();
+void cleanupCodeStore();
+
+/* replace the stored codes with every file in dir, each named for
+   the file without its extension.  Returns the number loaded, or -1
+   with the old codes kept when none could be read. */
+int loadCodes(const char *dir);
+
+/* put the named code, encoded for the carrier and compression
+   version, in a newly allocated *codes and return its length.
+   Returns -1 with errno set to ENOENT for names not stored, or as
+   encodeCached does when the encoding fails. */
+int encodeNamedCode(const char *name, int carrier, int compressVersion,
+                    unsigned char **codes);
@@ -16,6 +16,10 @@
 #include "compat.h"
 
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "logging.h"
 
@@ -74,6 +78,43 @@ uint64_t microsSinceX()
 
 #endif
 
+void sleepUntilMicros(uint64_t when)
+{
+#if HAVE_CLOCK_GETTIME && defined(TIMER_ABSTIME)
+    struct timespec tp;
+
+    tp.tv_sec = when / 1000000;
+    tp.tv_nsec = (when % 1000000) * 1000;
+    while(clock_nanosleep(CLOCK_SOURCE, TIMER_ABSTIME, &tp, NULL) == EINTR)
+        ;
+#else
+    uint64_t now = microsSinceX();
+
+    if (now < when)
+        usleep(when - now);
+#endif
+}
+
+void waitConditionUntil(pthread_cond_t *cond, LOCK_PTR *lock,
+                        uint64_t until)
+{
+    uint64_t now = microsSinceX();
+    struct timeval tv;
+    struct timespec ts;
+
+    if (until <= now)
+        return;
+    if (until - now > 1000000)
+        until = now + 1000000;
+
+    /* condition variables time out against the wall clock */
+    gettimeofday(&tv, NULL);
+    until = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec + (until - now);
+    ts.tv_sec = until / 1000000;
+    ts.tv_nsec = (until % 1000000) * 1000;
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
 char* translateError(int errnum)
 {
     return strerror(errnum);
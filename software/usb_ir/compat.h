@@ -40,6 +40,11 @@
     /* lock defines */
     #define LOCK_PTR CRITICAL_SECTION
 
+    /* atomic swap and full fence for the lock-free receive queue */
+    #define atomicExchange(a, b) \
+        (unsigned int)InterlockedExchange((volatile LONG*)(a), (LONG)(b))
+    #define memoryBarrier() MemoryBarrier()
+
     /* windows has no way to flag specific variables as unused */
     #ifndef UNUSED
       #define UNUSED(a) a
@@ -77,9 +82,15 @@
     /* lock defines */
     #define LOCK_PTR pthread_mutex_t
     #define InitializeCriticalSection(a) pthread_mutex_init((a), NULL)
+    #define DeleteCriticalSection pthread_mutex_destroy
     #define EnterCriticalSection pthread_mutex_lock
     #define LeaveCriticalSection pthread_mutex_unlock
 
+    /* atomic swap and full fence for the lock-free receive queue */
+    #define atomicExchange(a, b) \
+        __atomic_exchange_n((a), (b), __ATOMIC_SEQ_CST)
+    #define memoryBarrier() __sync_synchronize()
+
     /* gcc 3.3 has problems with __attribute__ ((unused)) on variables */
     #if (__GNUC__ < 3 || (__GNUC__ == 3 && __GNUC_MINOR__ < 4))
         #define UNUSED(a) a
@@ -106,5 +117,13 @@
 
 /* a few functions must be implemented in each OS */
 uint64_t microsSinceX();
+/* block until microsSinceX() reaches when, as precisely as possible */
+void sleepUntilMicros(uint64_t when);
+#ifndef WIN32
+/* wait on cond (lock held) until microsSinceX() reaches until, or for
+   at most a second so that callers recheck what they wait on */
+void waitConditionUntil(pthread_cond_t *cond, LOCK_PTR *lock,
+                        uint64_t until);
+#endif
 char* translateError(int errnum);
 DIR_HANDLE findNextFile(DIR_HANDLE hFind, char *buffer);
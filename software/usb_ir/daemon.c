@@ -31,6 +31,9 @@
 #include "device-interface.h"
 #include "client-interface.h"
 #include "server.h"
+#include "poller.h"
+#include "dataPackets.h"
+#include "deviceGroup.h"
 
 #ifdef __APPLE__
 extern int darwin_hotplug(const usbId *);
@@ -92,7 +95,23 @@ enum
     ARG_UNBIND,
     ARG_HANDLE_EPIPE,
     ARG_DEVICELIST,
-    ARG_NO_THREADS
+    ARG_NO_THREADS,
+    ARG_RECV_TRANSFERS,
+    ARG_EVENT_THREADS,
+    ARG_RECORD,
+    ARG_REPLAY,
+    ARG_REPLAY_SPEED,
+    ARG_PACKET_POOL,
+    ARG_RECV_QUEUE,
+    ARG_PIPELINE,
+    ARG_LISTEN_BACKLOG,
+    ARG_CLIENT_QUEUE,
+    ARG_CLIENT_OVERFLOW,
+    ARG_RECV_RING,
+    ARG_FRAME_GAP,
+    ARG_NO_AUTO_RESEND,
+    ARG_GROUP,
+    ARG_POOL
 };
 
 static struct argp_option options[] =
@@ -104,6 +123,22 @@ static struct argp_option options[] =
 #endif
     { "receive-timeout", ARG_RECV_TIMEOUT, "MSTIME", 0, "Specify the device receive timeout.",                              OS_GROUP },
     { "send-timeout",    ARG_SEND_TIMEOUT, "MSTIME", 0, "Specify the device send timeout.",                                 OS_GROUP },
+    { "receive-transfers", ARG_RECV_TRANSFERS, "NUM", 0, "Number of receives to keep queued on each device.  0 reads synchronously.", OS_GROUP },
+    { "packet-pool",     ARG_PACKET_POOL,  "NUM",    0, "Number of received packets pooled per device.  0 allocates each one.", OS_GROUP },
+    { "receive-queue",   ARG_RECV_QUEUE,   "NUM",    0, "Number of received packets queued per device before they are dropped.", OS_GROUP },
+    { "receive-ring",    ARG_RECV_RING,    "NUM",    0, "Number of entries in the shared memory ring of received pulses.  0 disables the ring.", OS_GROUP },
+    { "frame-gap",       ARG_FRAME_GAP,    "USEC",   0, "Microseconds of space that end a frame for clients receiving whole frames.", OS_GROUP },
+    { "pipeline",        ARG_PIPELINE,     "NUM",    0, "Number of control requests sent to a device before their acks arrive.  1 waits on each ack.", OS_GROUP },
+    { "no-auto-resend",  ARG_NO_AUTO_RESEND, NULL,   0, "Always transfer sent codes, even when the device still holds the same codes from the last send.", OS_GROUP },
+    { "group",           ARG_GROUP,        "NAME=DEVICES", 0, "Listen on a socket called NAME whose sends go to each of a comma separated list of devices at once.  Repeatable.", OS_GROUP },
+    { "pool",            ARG_POOL,         "NAME=DEVICES", 0, "Listen on a socket called NAME whose sends each go to the least busy of a comma separated list of devices.  Repeatable.", OS_GROUP },
+    { "event-threads",   ARG_EVENT_THREADS, "NUM",  0, "Serve all devices from NUM shared threads instead of two threads per device.", OS_GROUP },
+    { "listen-backlog",  ARG_LISTEN_BACKLOG, "NUM", 0, "Number of connections queued on each socket before they are accepted.", OS_GROUP },
+    { "client-queue",    ARG_CLIENT_QUEUE, "NUM",    0, "Number of received packets queued for a client that is not reading before the overflow policy applies.", OS_GROUP },
+    { "client-overflow", ARG_CLIENT_OVERFLOW, "POLICY", 0, "What to do when a client queue is full: drop-oldest (default), drop-newest or disconnect.", OS_GROUP },
+    { "record",          ARG_RECORD,       "FILE",   0, "Record all usb traffic to FILE for later replay.",                 OS_GROUP },
+    { "replay",          ARG_REPLAY,       "FILE",   0, "Replay a recorded trace or usbmon text capture instead of using hardware.", OS_GROUP },
+    { "replay-speed",    ARG_REPLAY_SPEED, "FACTOR", 0, "Scale the replay timing, 0 replays as fast as possible.  Defaults to 1.", OS_GROUP },
     { "auto-unbind",     ARG_UNBIND,       NULL,     0, "Attempt to unbind busy devices.  Use with caution.",               OS_GROUP },
     { "no-ignore-epipe", ARG_HANDLE_EPIPE, NULL,     0, "Disconnect on EPIPE errors.  Default is to ignore spurious errors generated by some hardware.", OS_GROUP },
     { "devices",         ARG_DEVICELIST,   NULL,     0, "Implies --no-daemon.  List information about connected devices.",  OS_GROUP },
@@ -157,6 +192,188 @@ static error_t parseOption(int key, char *arg, struct argp_state *state)
         break;
     }
 
+    case ARG_RECV_TRANSFERS:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 0 || res > 64 )
+        {
+            argp_error(state, "Receive transfers requires a numeric argument between 0 and 64\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.devSettings.recvTransfers = res;
+        break;
+    }
+
+    case ARG_PACKET_POOL:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 0 || res > 4096 )
+        {
+            argp_error(state, "Packet pool requires a numeric argument between 0 and 4096\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.devSettings.poolPackets = res;
+        break;
+    }
+
+    case ARG_RECV_QUEUE:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 1 || res > 65536 )
+        {
+            argp_error(state, "Receive queue requires a numeric argument between 1 and 65536\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.devSettings.recvQueue = res;
+        break;
+    }
+
+    case ARG_RECV_RING:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 0 || res > 65536 )
+        {
+            argp_error(state, "Receive ring requires a numeric argument between 0 and 65536\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.devSettings.ringEntries = res;
+        break;
+    }
+
+    case ARG_FRAME_GAP:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 1 || res > 1000000 )
+        {
+            argp_error(state, "Frame gap requires a numeric argument between 1 and 1000000\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.devSettings.frameGap = res;
+        break;
+    }
+
+    case ARG_PIPELINE:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 1 || res > 64 )
+        {
+            argp_error(state, "Pipeline requires a numeric argument between 1 and 64\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.devSettings.pipelineDepth = res;
+        break;
+    }
+
+    case ARG_NO_AUTO_RESEND:
+        srvSettings.devSettings.autoResend = false;
+        break;
+
+    case ARG_EVENT_THREADS:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 0 || res > 16 )
+        {
+            argp_error(state, "Event threads requires a numeric argument between 0 and 16\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.eventThreads = res;
+        break;
+    }
+
+    case ARG_LISTEN_BACKLOG:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 1 || res > 65535)
+        {
+            argp_error(state, "Listen backlog requires a numeric argument between 1 and 65535\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.listenBacklog = res;
+        break;
+    }
+
+    case ARG_CLIENT_QUEUE:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 1 || res > 65536 )
+        {
+            argp_error(state, "Client queue requires a numeric argument between 1 and 65536\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.clientQueue = res;
+        break;
+    }
+
+    case ARG_CLIENT_OVERFLOW:
+        if (strcmp(arg, "drop-oldest") == 0)
+            srvSettings.clientOverflow = OVERFLOW_DROP_OLDEST;
+        else if (strcmp(arg, "drop-newest") == 0)
+            srvSettings.clientOverflow = OVERFLOW_DROP_NEWEST;
+        else if (strcmp(arg, "disconnect") == 0)
+            srvSettings.clientOverflow = OVERFLOW_DISCONNECT;
+        else
+        {
+            argp_error(state, "Client overflow must be one of drop-oldest, drop-newest or disconnect\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        break;
+
+    case ARG_GROUP:
+        if (! defineGroup(arg))
+        {
+            argp_error(state, "Groups are given as NAME=DEVICE[,DEVICE...]\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        break;
+
+    case ARG_POOL:
+        if (! definePool(arg))
+        {
+            argp_error(state, "Pools are given as NAME=DEVICE[,DEVICE...]\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        break;
+
+    case ARG_RECORD:
+        srvSettings.recordPath = arg;
+        break;
+
+    case ARG_REPLAY:
+        srvSettings.replayPath = arg;
+        break;
+
+    case ARG_REPLAY_SPEED:
+    {
+        char *end;
+        double res = strtod(arg, &end);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 0 || res > 1000 )
+        {
+            argp_error(state, "Replay speed requires a numeric argument between 0 and 1000\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.replaySpeed = res;
+        break;
+    }
+
     case ARG_UNBIND:
         srvSettings.unbind = true;
         break;
@@ -258,108 +475,197 @@ int main(int argc, char **argv)
     return retval;
 }
 
+static void acceptConnection(PIPE_PTR listener,
+                             listHeader *clientList, iguanaDev *idev)
+{
+    PIPE_PTR clientFd;
+    int flags;
+
+    clientFd = accept(listener, NULL, NULL);
+    flags = fcntl(clientFd, F_GETFL);
+    if (flags == -1)
+        message(LOG_ERROR, "Failed read status flags for socket.\n");
+    else if (fcntl(clientFd, F_SETFL, flags | O_NONBLOCK) == -1)
+        message(LOG_ERROR, "Failed to set client socket to non-blocking mode.\n");
+    else
+        clientConnected(clientFd, clientList, idev);
+}
+
+/* the earlier of timeout and when the oldest pipelined request on
+   idev times out, both in ms and -1 when there is nothing to wait on */
+static int ackTimeout(iguanaDev *idev, int timeout)
+{
+    int wait = responseTimeout(idev);
+
+    if (wait >= 0 && (timeout < 0 || wait < timeout))
+        return wait;
+    return timeout;
+}
+
+/* what each descriptor handed to the poller is for */
+enum
+{
+    WATCH_WAKE,
+    WATCH_READER,
+    WATCH_ACKS,
+    WATCH_LISTENER,
+    WATCH_CLIENT,
+    WATCH_MEMBER
+};
+
+/* accept a client and start watching it */
+static void acceptAndWatch(poller *watch, PIPE_PTR listener,
+                           listHeader *clientList, iguanaDev *idev)
+{
+    unsigned int count = clientList->count;
+
+    acceptConnection(listener, clientList, idev);
+    if (clientList->count > count)
+    {
+        client *john = (client*)clientList->tail;
+        john->watch = watch;
+        if (! pollerAdd(watch, john->fd, WATCH_CLIENT, john))
+        {
+            message(LOG_ERROR, "Failed to watch a new client.\n");
+            releaseClient(john);
+        }
+    }
+}
+
+void watchClientWrites(client *me, bool writes)
+{
+    if (! pollerWatchWrites(me->watch, me->fd, writes))
+        message(LOG_ERROR, "Failed to change the events watched on a client.\n");
+}
+
+bool watchGroupMember(client *me, PIPE_PTR fd, void *member)
+{
+    return pollerAdd(me->watch, fd, WATCH_MEMBER, member);
+}
+
+/* serve a ready client, forgetting it if it was released */
+static void serveClient(poller *watch, client *john, const pollEvent *event)
+{
+    PIPE_PTR fd = john->fd;
+
+    if (event->writable)
+        flushClient(john);
+    if (event->readable && ! handleClient(john))
+        pollerRemove(watch, fd);
+}
+
 void listenToClients(const char *name, listHeader *clientList, iguanaDev *idev)
 {
     PIPE_PTR listener;
+    poller *watch;
 
     /* start the listener */
     char **addrStr = NULL;
     if (idev != NULL)
         addrStr = &idev->addrStr;
-    listener = createServerPipe(name, addrStr);
+    listener = createServerPipe(name, srvSettings.listenBacklog, addrStr);
     if (listener == INVALID_PIPE)
     {
         if (idev == NULL)
-            message(LOG_ERROR, "Server failed to start listening on ctl socket.\n");
+            message(LOG_ERROR, "Server failed to start listening on %s socket.\n", name);
         else
             message(LOG_ERROR, "Worker failed to start listening.\n");
     }
+    else if ((watch = createPoller()) == NULL)
+    {
+        message(LOG_ERROR, "Failed to create a poller for %s.\n", name);
+        closeServerPipe(listener, name);
+    }
     else
     {
-        fd_set fds, fdsin, fdserr;
+        PIPE_PTR reader;
+        bool running;
 
         /* check the initial aliases */
         if (idev != NULL)
             getID(idev);
 
-        /* loop while checking the pipes for activity */
-        FD_ZERO(&fdsin);
-        FD_ZERO(&fdserr);
-        while(true)
-        {
-            PIPE_PTR reader;
-            client *john;
-            int max = 0;
-            FD_ZERO(&fds);
+        /* the reader is either feedback from a device or a way to
+           cleanly shutdown */
+        if (idev == NULL)
+            reader = srvSettings.ctlSockPipe[READ];
+        else
+            reader = idev->readerPipe[READ];
 
-            /* the reader is either feedback from a device or a way to
-               cleanly shutdown */
-            if (idev == NULL)
-                reader = srvSettings.ctlSockPipe[READ];
-            else
-                reader = idev->readerPipe[READ];
+        /* each descriptor is registered once, clients as they arrive */
+        running = pollerAdd(watch, reader, WATCH_READER, NULL) &&
+                  pollerAdd(watch, listener, WATCH_LISTENER, NULL) &&
+                  (idev == NULL ||
+                   pollerAdd(watch, idev->responsePipe[READ], WATCH_ACKS, NULL));
+        if (! running)
+            message(LOG_ERROR, "Failed to watch the %s pipes.\n", name);
 
-            /* check the read pipe for error */
-            if (FD_ISSET(reader, &fdserr))
-                break;
+        while(running)
+        {
+            pollEvent event;
+            bool checkAcks = false;
+            int timeout = -1;
 
-            /* take care of messages from the reader */
-            if (FD_ISSET(reader, &fdsin) &&
-                (idev == NULL || ! handleReader(idev)))
+            /* wait until there is data ready or an ack or group reply is
+               overdue, or not at all while transmits are queued */
+            if (idev != NULL)
+            {
+                timeout = framesTimeout(idev, ackTimeout(idev, timeout));
+                timeout = transmitTimeout(idev, timeout);
+            }
+            else
+                timeout = groupTimeout(clientList, timeout);
+            if (pollerWait(watch, timeout) < 0)
+            {
+                message(LOG_ERROR,
+                        "poll failed: %s\n", translateError(errno));
                 break;
-            FD_SET(reader, &fds);
-            max = reader;
+            }
 
-            /* check the listener for error */
-            if (FD_ISSET(listener, &fdserr))
-                break;
+            while(running && pollerNext(watch, &event))
+                switch(event.kind)
+                {
+                /* take care of messages from the reader */
+                case WATCH_READER:
+                    if (idev == NULL || ! handleReader(idev))
+                        running = false;
+                    break;
 
-            /* next handle incoming connections */
-            if (FD_ISSET(listener, &fdsin))
-            {
-                PIPE_PTR clientFd;
-                int flags;
-
-                clientFd = accept(listener, NULL, NULL);
-                flags = fcntl(clientFd, F_GETFL);
-                if (flags == -1)
-                    message(LOG_ERROR, "Failed read status flags for socket.\n");
-                else if (fcntl(clientFd, F_SETFL, flags | O_NONBLOCK) == -1)
-                    message(LOG_ERROR, "Failed to set client socket to non-blocking mode.\n");
-                else
-                    clientConnected(clientFd, clientList, idev);
-            }
-            FD_SET(listener, &fds);
-            if (listener > max)
-                max = listener;
+                case WATCH_ACKS:
+                    checkAcks = true;
+                    break;
 
-            /* last check the clients */
-            for(john = (client*)clientList->head; john != NULL;)
-            {
-                client *next;
+                /* handle incoming connections */
+                case WATCH_LISTENER:
+                    if (event.error)
+                        running = false;
+                    else
+                        acceptAndWatch(watch, listener, clientList, idev);
+                    break;
 
-                next = (client*)john->header.next;
+                case WATCH_CLIENT:
+                    serveClient(watch, (client*)event.userData, &event);
+                    break;
 
-                if ((! FD_ISSET(john->fd, &fdserr) &&
-                     ! FD_ISSET(john->fd, &fdsin)) ||
-                    handleClient(john))
-                {
-                    FD_SET(john->fd, &fds);
-                    if (john->fd > max)
-                        max = john->fd;
+                /* replies to the sends a group or pool forwarded */
+                case WATCH_MEMBER:
+                    serveMember(event.userData, event.readable,
+                                event.writable);
+                    break;
                 }
 
-                john = next;
-            }
-
-            /* wait until there is data ready */
-            fdsin = fdserr = fds;
-            if (select(max + 1, &fdsin, NULL, &fdserr, NULL) < 0)
+            /* complete pipelined requests as their acks arrive */
+            if (running && idev != NULL &&
+                (checkAcks || idev->inFlight.count > 0))
+                handleResponses(idev);
+            if (running && idev != NULL)
             {
-                message(LOG_ERROR,
-                        "select failed: %s\n", translateError(errno));
-                break;
+                finishFrames(idev);
+                /* one queued request per pass so new ones can cut in */
+                transmitQueued(idev);
             }
+            else if (running)
+                finishGroupSends(clientList);
         }
 
         /* unlink any existing aliases */
@@ -377,5 +683,379 @@ message(LOG_WARN, "CLOSE %d %s(%d)\n", listener, __FILE__, __LINE__);
         /* and release any connected clients */
         while(clientList->count > 0)
             releaseClient((client*)clientList->head);
+        freePoller(watch);
     }
 }
+
+/* In event mode a small fixed set of reactor threads serves the
+   listeners, clients and reader pipes of every device, while one more
+   thread pumps the usb events of all the shared receive engines. */
+typedef struct reactorDev
+{
+    itemHeader header;
+
+    iguanaDev *idev;
+    PIPE_PTR listener;
+    char name[4];
+
+    /* set once the device is on the global device list */
+    bool active;
+} reactorDev;
+
+typedef struct reactor
+{
+    THREAD_PTR thread;
+
+    /* devices are handed over through the pending list */
+    LOCK_PTR lock;
+    listHeader pending;
+    PIPE_PTR wakePipe[2];
+    bool quitting;
+
+    /* only touched by the reactor thread */
+    listHeader devs;
+} reactor;
+
+static reactor *reactors = NULL;
+static int reactorCount = 0, nextReactor = 0;
+
+static THREAD_PTR usbEventThread = INVALID_THREAD_PTR;
+static bool pumpingEvents = false;
+
+static void startServing(poller *watch, reactorDev *rd)
+{
+    iguanaDev *idev = rd->idev;
+
+    message(LOG_INFO, "Worker %d starting\n", idev->usbDev->id);
+    if (! activateDevice(idev))
+        stopReader(idev);
+    else
+    {
+        rd->active = true;
+        rd->listener = createServerPipe(rd->name, srvSettings.listenBacklog,
+                                        &idev->addrStr);
+        if (rd->listener == INVALID_PIPE)
+        {
+            message(LOG_ERROR, "Worker failed to start listening.\n");
+            stopReader(idev);
+        }
+        else if (! pollerAdd(watch, rd->listener, WATCH_LISTENER, rd) ||
+                 ! pollerAdd(watch, idev->responsePipe[READ], WATCH_ACKS, rd))
+        {
+            message(LOG_ERROR, "Worker failed to watch its pipes.\n");
+            stopReader(idev);
+        }
+        else
+            /* check the initial aliases */
+            getID(idev);
+    }
+}
+
+static void stopListening(poller *watch, reactorDev *rd)
+{
+    if (rd->listener != INVALID_PIPE)
+    {
+        /* unlink any existing aliases */
+        setAlias(rd->name, true, NULL);
+        pollerRemove(watch, rd->listener);
+        closeServerPipe(rd->listener, rd->name);
+#if DEBUG
+message(LOG_WARN, "CLOSE %d %s(%d)\n", rd->listener, __FILE__, __LINE__);
+#endif
+        rd->listener = INVALID_PIPE;
+
+        /* and release any connected clients */
+        while(rd->idev->clientList.count > 0)
+        {
+            client *john = (client*)rd->idev->clientList.head;
+            pollerRemove(watch, john->fd);
+            releaseClient(john);
+        }
+    }
+}
+
+/* only called once the reader has closed its pipe */
+static void retireDevice(poller *watch, reactorDev *rd)
+{
+    stopListening(watch, rd);
+    pollerRemove(watch, rd->idev->readerPipe[READ]);
+    pollerRemove(watch, rd->idev->responsePipe[READ]);
+    if (rd->active)
+        deactivateDevice(rd->idev);
+    message(LOG_INFO, "Worker %d exiting\n", rd->idev->usbDev->id);
+    destroyDevice(rd->idev);
+    removeItem((itemHeader*)rd);
+    free(rd);
+}
+
+static void* reactorLoop(void *instance)
+{
+    reactor *me = (reactor*)instance;
+    bool quitting = false;
+    reactorDev *rd;
+    poller *watch;
+
+    watch = createPoller();
+    if (watch == NULL || ! pollerAdd(watch, me->wakePipe[READ], WATCH_WAKE, NULL))
+    {
+        message(LOG_ERROR, "Event thread failed to create its poller.\n");
+        freePoller(watch);
+        watch = NULL;
+    }
+
+    while(watch != NULL)
+    {
+        listHeader added;
+        pollEvent event;
+        int timeout = -1;
+
+        /* collect any new devices */
+        initializeList(&added);
+        EnterCriticalSection(&me->lock);
+        quitting = me->quitting;
+        while((rd = (reactorDev*)removeFirstItem(&me->pending)) != NULL)
+            insertItem(&added, NULL, (itemHeader*)rd);
+        LeaveCriticalSection(&me->lock);
+
+        /* activation talks to the device so do it outside the lock */
+        while((rd = (reactorDev*)removeFirstItem(&added)) != NULL)
+        {
+            /* the reader is watched even if the device never starts so
+               that it is retired once the reader finishes */
+            if (! pollerAdd(watch, rd->idev->readerPipe[READ],
+                            WATCH_READER, rd))
+            {
+                message(LOG_ERROR, "Failed to watch the reader of %d\n",
+                        rd->idev->usbDev->id);
+                stopReader(rd->idev);
+                while(handleReader(rd->idev))
+                    ;
+                insertItem(&me->devs, NULL, (itemHeader*)rd);
+                retireDevice(watch, rd);
+                continue;
+            }
+            if (! quitting)
+                startServing(watch, rd);
+            insertItem(&me->devs, NULL, (itemHeader*)rd);
+        }
+
+        for(rd = (reactorDev*)me->devs.head; rd != NULL;
+            rd = (reactorDev*)rd->header.next)
+        {
+            if (quitting && ! rd->idev->quitRequested)
+                stopReader(rd->idev);
+
+            /* clients may have just started pipelined requests */
+            if (rd->active)
+            {
+                timeout = framesTimeout(rd->idev,
+                                        ackTimeout(rd->idev, timeout));
+                timeout = transmitTimeout(rd->idev, timeout);
+            }
+        }
+
+        /* on shutdown exit once every device has been released */
+        if (quitting && me->devs.count == 0)
+            break;
+
+        /* wait until there is data ready or an ack is overdue */
+        if (pollerWait(watch, timeout) < 0)
+        {
+            message(LOG_ERROR, "poll failed: %s\n", translateError(errno));
+            break;
+        }
+
+        while(pollerNext(watch, &event))
+        {
+            rd = (reactorDev*)event.userData;
+            switch(event.kind)
+            {
+            /* drain the wake pipe, the devices are collected above */
+            case WATCH_WAKE:
+            {
+                char buf[32];
+                if (readPipe(me->wakePipe[READ], buf, sizeof(buf)) < 0)
+                    message(LOG_ERROR, "Failed to read from the wake pipe.\n");
+                break;
+            }
+
+            /* the reader closes its pipe once it is finished, and
+               retiring unwatches the rest of the device */
+            case WATCH_READER:
+                if (! handleReader(rd->idev))
+                    retireDevice(watch, rd);
+                break;
+
+            /* complete pipelined requests as their acks arrive */
+            case WATCH_ACKS:
+                handleResponses(rd->idev);
+                break;
+
+            case WATCH_LISTENER:
+                if (event.error)
+                {
+                    stopListening(watch, rd);
+                    stopReader(rd->idev);
+                }
+                else
+                    acceptAndWatch(watch, rd->listener,
+                                   &rd->idev->clientList, rd->idev);
+                break;
+
+            case WATCH_CLIENT:
+                serveClient(watch, (client*)event.userData, &event);
+                break;
+            }
+        }
+
+        /* acks may be overdue without any arriving, and frames may be
+           due without any more receive data */
+        for(rd = (reactorDev*)me->devs.head; rd != NULL;
+            rd = (reactorDev*)rd->header.next)
+            if (rd->active)
+            {
+                if (rd->idev->inFlight.count > 0)
+                    handleResponses(rd->idev);
+                finishFrames(rd->idev);
+                /* one queued request per pass so new ones can cut in */
+                transmitQueued(rd->idev);
+            }
+    }
+
+    /* only reached with devices left if the poller failed */
+    while((rd = (reactorDev*)me->devs.head) != NULL)
+    {
+        stopListening(watch, rd);
+        stopReader(rd->idev);
+        while(handleReader(rd->idev))
+            ;
+        retireDevice(watch, rd);
+    }
+    freePoller(watch);
+    return NULL;
+}
+
+static void* pumpUsbEvents(void *junk)
+{
+    while(pumpingEvents)
+        if (handleRecvEvents(1000) < 0)
+        {
+            message(LOG_ERROR, "Failed to handle usb events.\n");
+            Sleep(100);
+        }
+    return NULL;
+}
+
+bool startReactors(int count)
+{
+    int x;
+
+    reactors = (reactor*)malloc(sizeof(reactor) * count);
+    if (reactors == NULL)
+    {
+        message(LOG_ERROR, "Out of memory allocating event threads.\n");
+        return false;
+    }
+    memset(reactors, 0, sizeof(reactor) * count);
+
+    for(x = 0; x < count; x++)
+    {
+        reactor *r = reactors + x;
+
+        InitializeCriticalSection(&r->lock);
+        initializeList(&r->pending);
+        initializeList(&r->devs);
+        if (! createPipePair(r->wakePipe))
+        {
+            message(LOG_ERROR, "Failed to create wake pipe: %s\n",
+                    translateError(errno));
+            break;
+        }
+        if (! startThread(&r->thread, reactorLoop, r))
+        {
+            message(LOG_ERROR, "Failed to start event thread %d\n", x);
+            closePipe(r->wakePipe[READ]);
+            closePipe(r->wakePipe[WRITE]);
+            break;
+        }
+        reactorCount++;
+    }
+
+    /* one thread pumps the usb events for every shared receive engine */
+    if (reactorCount == count && sharedRecvSupported())
+    {
+        pumpingEvents = true;
+        if (! startThread(&usbEventThread, pumpUsbEvents, NULL))
+        {
+            message(LOG_ERROR, "Failed to start the usb event thread.\n");
+            pumpingEvents = false;
+            count = -1;
+        }
+    }
+
+    if (reactorCount != count)
+    {
+        stopReactors();
+        return false;
+    }
+    message(LOG_INFO, "Serving devices from %d event threads.\n", count);
+    return true;
+}
+
+bool reactorAddDevice(iguanaDev *idev)
+{
+    reactorDev *rd;
+    reactor *r;
+
+    rd = (reactorDev*)malloc(sizeof(reactorDev));
+    if (rd == NULL)
+    {
+        message(LOG_ERROR,
+                "Out of memory serving device %d\n", idev->usbDev->id);
+        return false;
+    }
+    memset(rd, 0, sizeof(reactorDev));
+    rd->idev = idev;
+    rd->listener = INVALID_PIPE;
+    sprintf(rd->name, "%d", idev->usbDev->id);
+
+    /* spread the devices round robin across the reactors */
+    r = reactors + (nextReactor++ % reactorCount);
+    EnterCriticalSection(&r->lock);
+    insertItem(&r->pending, NULL, (itemHeader*)rd);
+    LeaveCriticalSection(&r->lock);
+    if (! notify(r->wakePipe[WRITE]))
+        message(LOG_ERROR, "Failed to wake event thread.\n");
+    return true;
+}
+
+void stopReactors()
+{
+    int x;
+
+    /* each reactor stops its devices and exits once they are released */
+    for(x = 0; x < reactorCount; x++)
+    {
+        EnterCriticalSection(&reactors[x].lock);
+        reactors[x].quitting = true;
+        LeaveCriticalSection(&reactors[x].lock);
+        notify(reactors[x].wakePipe[WRITE]);
+    }
+    for(x = 0; x < reactorCount; x++)
+    {
+        joinThread(reactors[x].thread, NULL);
+        closePipe(reactors[x].wakePipe[READ]);
+        closePipe(reactors[x].wakePipe[WRITE]);
+    }
+
+    /* the engines are all gone so the event pump can stop */
+    if (pumpingEvents)
+    {
+        pumpingEvents = false;
+        joinThread(usbEventThread, NULL);
+    }
+
+    free(reactors);
+    reactors = NULL;
+    reactorCount = 0;
+}
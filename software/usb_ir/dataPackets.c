@@ -15,6 +15,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <time.h>
 
@@ -101,6 +102,195 @@ bool writeDataPacket(const dataPacket *packet, PIPE_PTR fd, unsigned int timeout
     return retval;
 }
 
+/* how much of timeout is left since then, in milliseconds */
+static unsigned int timeLeft(unsigned int timeout, uint64_t then)
+{
+    unsigned int elapsed;
+
+    if (timeout == WAIT_FOREVER)
+        return timeout;
+    elapsed = (unsigned int)((microsSinceX() - then) / 1000);
+    if (elapsed >= timeout)
+        return 0;
+    return timeout - elapsed;
+}
+
+void initPacketBuffer(packetBuffer *buffer)
+{
+    buffer->start = buffer->end = 0;
+    buffer->passedFd = -1;
+}
+
+void releasePacketBuffer(packetBuffer *buffer)
+{
+#ifndef WIN32
+    if (buffer->passedFd != -1)
+        close(buffer->passedFd);
+#endif
+    buffer->passedFd = -1;
+}
+
+bool framedPacketBuffered(const packetBuffer *buffer)
+{
+    packetHeader header;
+    int have = buffer->end - buffer->start;
+
+    if (have < (int)sizeof(packetHeader))
+        return false;
+    memcpy(&header, buffer->data + buffer->start, sizeof(packetHeader));
+    return header.dataLen <= have - (int)sizeof(packetHeader);
+}
+
+/* move the unread data to the front and read more in after it */
+static int readIntoBuffer(packetBuffer *buffer, PIPE_PTR fd, int timeout)
+{
+    int result;
+
+    memmove(buffer->data, buffer->data + buffer->start,
+            buffer->end - buffer->start);
+    buffer->end -= buffer->start;
+    buffer->start = 0;
+
+#ifdef WIN32
+    result = readPipeSome(fd, buffer->data + buffer->end,
+                          PACKET_BUFFER_SIZE - buffer->end, timeout);
+#else
+    result = readPipeSomeFd(fd, buffer->data + buffer->end,
+                            PACKET_BUFFER_SIZE - buffer->end, timeout,
+                            &buffer->passedFd);
+#endif
+    if (result > 0)
+        buffer->end += result;
+    return result;
+}
+
+bool refillPacketBuffer(packetBuffer *buffer, PIPE_PTR fd)
+{
+    /* a payload too big for the buffer is read directly instead */
+    if (buffer->end - buffer->start < PACKET_BUFFER_SIZE &&
+        readIntoBuffer(buffer, fd, 0) <= 0)
+        return false;
+    return framedPacketBuffered(buffer);
+}
+
+bool readFramedPacket(dataPacket *packet, PIPE_PTR fd,
+                      packetBuffer *buffer, unsigned int timeout)
+{
+    bool retval = false;
+    int result = 1;
+    uint64_t then;
+
+    /* gather a header, taking in whatever else has already arrived */
+    then = microsSinceX();
+    while(buffer->end - buffer->start < (int)sizeof(packetHeader))
+    {
+        result = readIntoBuffer(buffer, fd, timeLeft(timeout, then));
+        if (result <= 0)
+            break;
+    }
+
+    if (result > 0)
+    {
+        packetHeader header;
+
+        memcpy(&header, buffer->data + buffer->start, sizeof(packetHeader));
+        buffer->start += sizeof(packetHeader);
+        packet->code = header.code;
+        packet->dataLen = header.dataLen;
+        packet->data = NULL;
+
+        if (packet->dataLen <= 0)
+            retval = true;
+        else
+        {
+            packet->data = (unsigned char*)malloc(packet->dataLen);
+            if (packet->data != NULL)
+            {
+                int have = buffer->end - buffer->start;
+
+                /* take what is buffered and read the rest directly */
+                if (have > packet->dataLen)
+                    have = packet->dataLen;
+                memcpy(packet->data, buffer->data + buffer->start, have);
+                buffer->start += have;
+                if (have == packet->dataLen)
+                    retval = true;
+                else
+                {
+                    result = readPipeTimed(fd, packet->data + have,
+                                           packet->dataLen - have,
+                                           timeLeft(timeout, then));
+                    if (result == packet->dataLen - have)
+                        retval = true;
+                    else
+                    {
+                        free(packet->data);
+                        packet->data = NULL;
+                    }
+                }
+            }
+        }
+
+        /* rewind an empty buffer to spare the next read a memmove */
+        if (buffer->start == buffer->end)
+            buffer->start = buffer->end = 0;
+    }
+
+    if (result == 0)
+        errno = ETIMEDOUT;
+
+    return retval;
+}
+
+int encodePacketHeader(const dataPacket *packet, bool framed, void *buffer)
+{
+    packetHeader *header = (packetHeader*)buffer;
+
+    if (! framed)
+    {
+        memcpy(buffer, packet, sizeof(dataPacket));
+        return sizeof(dataPacket);
+    }
+
+    header->code = packet->code;
+    header->flags = 0;
+    header->reserved = 0;
+    header->dataLen = packet->dataLen;
+    return sizeof(packetHeader);
+}
+
+bool writeFramedPacket(const dataPacket *packet, PIPE_PTR fd,
+                       unsigned int timeout)
+{
+    packetHeader header;
+    int dataLen = 0;
+
+    encodePacketHeader(packet, true, &header);
+    if (packet->dataLen > 0)
+        dataLen = packet->dataLen;
+
+    return writePipePairTimed(fd, &header, sizeof(packetHeader),
+                              packet->data, dataLen, timeout) ==
+           (int)sizeof(packetHeader) + dataLen;
+}
+
+#ifndef WIN32
+bool writeFramedPacketFd(const dataPacket *packet, PIPE_PTR fd,
+                         unsigned int timeout, int passFd)
+{
+    packetHeader header;
+    int dataLen = 0;
+
+    encodePacketHeader(packet, true, &header);
+    if (packet->dataLen > 0)
+        dataLen = packet->dataLen;
+
+    return writePipePairTimedFd(fd, &header, sizeof(packetHeader),
+                                packet->data, dataLen, timeout, passFd) ==
+           (int)sizeof(packetHeader) + dataLen;
+}
+#endif
+
 void freeDataPacket(dataPacket *packet)
 {
     if (packet != NULL)
@@ -26,7 +26,58 @@ typedef struct dataPacket
     unsigned char *data;
 } dataPacket;
 
+/* Protocol version 1 writes the dataPacket struct itself ahead of
+ * the data, list pointers and all.  Clients that exchange this
+ * version use the same request codes, but frame each packet with the
+ * compact packetHeader instead. */
+#define IG_FRAMED_PROTOCOL 2
+
+typedef struct packetHeader
+{
+    uint8_t code;
+    /* reserved, sent as 0 */
+    uint8_t flags;
+    uint16_t reserved;
+    /* payload size or, on IG_DEV_ERROR packets, -errno */
+    int32_t dataLen;
+} packetHeader;
+
+enum
+{
+    PACKET_BUFFER_SIZE = 4096
+};
+
+/* framed packets are read in bulk through a per connection buffer */
+typedef struct packetBuffer
+{
+    int start, end;
+    unsigned char data[PACKET_BUFFER_SIZE];
+
+    /* a descriptor that arrived with the data, -1 if none, for the
+       reader to claim or for releasePacketBuffer to close */
+    int passedFd;
+} packetBuffer;
+
 bool readDataPacket(dataPacket *packet, PIPE_PTR fd, unsigned int timeout);
 bool writeDataPacket(const dataPacket *packet, PIPE_PTR fd, unsigned int timeout);
+bool readFramedPacket(dataPacket *packet, PIPE_PTR fd,
+                      packetBuffer *buffer, unsigned int timeout);
+bool writeFramedPacket(const dataPacket *packet, PIPE_PTR fd,
+                       unsigned int timeout);
+#ifndef WIN32
+/* also passes the descriptor passFd over the connection */
+bool writeFramedPacketFd(const dataPacket *packet, PIPE_PTR fd,
+                         unsigned int timeout, int passFd);
+#endif
+/* fills buffer, which must hold a dataPacket, with whatever goes ahead
+   of the payload in either framing and returns its size */
+int encodePacketHeader(const dataPacket *packet, bool framed, void *buffer);
+void initPacketBuffer(packetBuffer *buffer);
+void releasePacketBuffer(packetBuffer *buffer);
+/* true when a whole packet can be read without touching fd */
+bool framedPacketBuffered(const packetBuffer *buffer);
+/* takes in whatever has already arrived on fd without waiting and
+   returns true if a whole packet is now buffered */
+bool refillPacketBuffer(packetBuffer *buffer, PIPE_PTR fd);
 void freeDataPacket(dataPacket *packet);
 bool packetIsError(const dataPacket *packet);
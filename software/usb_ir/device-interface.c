@@ -21,6 +21,7 @@
 #include "pipes.h"
 #include "driver.h"
 #include "dataPackets.h"
+#include "sendFormat.h"
 #include "device-interface.h"
 #include "protocol-versions.h"
 #include "server.h"
@@ -33,6 +34,14 @@ enum
     MIN_CTL_LENGTH  = 4,
     CODE_OFFSET     = 3,
 
+    /* largest interrupt packet on a full speed device */
+    MAX_POOLED_PAYLOAD = 64,
+
+    /* latencies are bucketed by power of 2 split in 4, which covers
+       up to 2^30 microseconds */
+    LATENCY_SUB_BITS = 2,
+    LATENCY_BUCKETS  = 30 << LATENCY_SUB_BITS,
+
     /* control packet constants */
     CTL_START      = 0x0000,
     CTL_TODEV      = 0xCD,
@@ -68,12 +77,17 @@ static versionedType types[] =
     /* daemon ctl functionality */
     {1, 1, {IG_CTL_LISTDEVS, CTL_TODEV,  NO_PAYLOAD, true, ANY_PAYLOAD}},
     {1, 1, {IG_CTL_DEVADDR,  CTL_TODEV, ANY_PAYLOAD, true, ANY_PAYLOAD}},
+    {1, 1, {IG_CTL_LATENCY,  CTL_TODEV, ANY_PAYLOAD, true, ANY_PAYLOAD}},
+    {1, 1, {IG_CTL_LOADCODES, CTL_TODEV, NO_PAYLOAD, true, 4}},
+    {1, 1, {IG_CTL_ENCODESTATS, CTL_TODEV, NO_PAYLOAD, true, ANY_PAYLOAD}},
 
     /* device functionality */
     {0,     0,     {IG_DEV_GETVERSION,  CTL_TODEV,  NO_PAYLOAD, true, 2}},
     {0x101, 0x203, {IG_DEV_GETFEATURES, CTL_TODEV,  NO_PAYLOAD, true, 1}},
     {0x204, 0,     {IG_DEV_GETFEATURES, CTL_TODEV,  NO_PAYLOAD, true, 2}},
     {0,     0,     {IG_DEV_SEND,        CTL_TODEV, ANY_PAYLOAD, true, NO_PAYLOAD}},
+    {0,     0,     {IG_DEV_SENDFD,      CTL_TODEV,           8, true, NO_PAYLOAD}},
+    {0,     0,     {IG_DEV_SENDNAMED,   CTL_TODEV, ANY_PAYLOAD, true, NO_PAYLOAD}},
     {0x309, 0,     {IG_DEV_RESEND,      CTL_TODEV,  NO_PAYLOAD, true, NO_PAYLOAD}},
     {0,     0,     {IG_DEV_LISTALIASES, CTL_TODEV,  NO_PAYLOAD, true, ANY_PAYLOAD}},
     {0,     0,     {IG_DEV_GETADDRESS,  CTL_TODEV,  NO_PAYLOAD, true, ANY_PAYLOAD}},
@@ -81,6 +95,11 @@ static versionedType types[] =
     {0,     0,     {IG_DEV_RECVON,      CTL_TODEV,  NO_PAYLOAD, true, NO_PAYLOAD}},
     {0x101, 0,     {IG_DEV_RAWRECVON,   CTL_TODEV,  NO_PAYLOAD, true, NO_PAYLOAD}},
     {0,     0,     {IG_DEV_RECVOFF,     CTL_TODEV,  NO_PAYLOAD, true, NO_PAYLOAD}},
+    {0,     0,     {IG_DEV_MAPRING,     CTL_TODEV,  NO_PAYLOAD, true, NO_PAYLOAD}},
+    {0,     0,     {IG_DEV_RECVFRAMES,  CTL_TODEV,           4, true, NO_PAYLOAD}},
+    {0,     0,     {IG_DEV_RECVDECODED, CTL_TODEV,           4, true, NO_PAYLOAD}},
+    {0,     0,     {IG_DEV_SENDCLASS,   CTL_TODEV,           8, true, NO_PAYLOAD}},
+    {0,     0,     {IG_DEV_SENDAT,      CTL_TODEV, ANY_PAYLOAD, true, 8}},
 
     /* 1 bit per pin of state */
     {0,     0x003, {IG_DEV_GETPINS,    CTL_TODEV,   NO_PAYLOAD, true, 2}},
@@ -138,20 +157,51 @@ static void queueDataPacket(iguanaDev *idev, dataPacket *current, bool fromDev)
     message(LOG_DEBUG3,
             "Notifying of packet: type = 0x%2.2x\n", current->code);
 
-    EnterCriticalSection(&idev->listLock);
     if (fromDev)
     {
-        insertItem(&idev->recvList, NULL, (itemHeader*)current);
-        if (! notify(idev->readerPipe[WRITE]))
+        packetRing *ring = &idev->recvRing;
+        unsigned int tail = ring->tail;
+
+        /* drop the packet rather than grow without bound when the
+           worker falls behind */
+        if (tail - ring->head > ring->mask)
+        {
+            if (ring->overflows++ == 0)
+                message(LOG_WARN,
+                        "Receive queue of %d is full, dropping packets.\n",
+                        idev->usbDev->id);
+            releasePacket(idev, current);
+            return;
+        }
+
+        /* publish the slot before the new tail */
+        ring->slots[tail & ring->mask] = current;
+        memoryBarrier();
+        ring->tail = tail + 1;
+
+        /* only wake the worker if it is not already awake */
+        if (atomicExchange(&ring->signaled, 1) == 0 &&
+            ! notify(idev->readerPipe[WRITE]))
             message(LOG_ERROR, "Failed to signal primary thread.\n");
     }
     else
     {
-        idev->response = current;
+        EnterCriticalSection(&idev->listLock);
+        insertItem(&idev->responses, NULL, (itemHeader*)current);
         if (! notify(idev->responsePipe[WRITE]))
             message(LOG_ERROR, "Failed to signal primary thread.\n");
+        LeaveCriticalSection(&idev->listLock);
     }
+}
+
+static dataPacket* nextResponse(iguanaDev *idev)
+{
+    dataPacket *retval;
+
+    EnterCriticalSection(&idev->listLock);
+    retval = (dataPacket*)removeFirstItem(&idev->responses);
     LeaveCriticalSection(&idev->listLock);
+    return retval;
 }
 
 static void flushToDevResponsePackets(iguanaDev *idev)
@@ -160,8 +210,7 @@ static void flushToDevResponsePackets(iguanaDev *idev)
     /* A 0 timeout performs a poll and never waits */
     while (readPipeTimed(idev->responsePipe[READ], &byte, 1, 0) == 1)
     {
-        freeDataPacket(idev->response);
-        idev->response = NULL;
+        freeDataPacket(nextResponse(idev));
         message(LOG_ERROR, "Flushed extraneous CTL_TODEV response.\n");
     }
 }
@@ -435,6 +484,13 @@ bool checkVersion(iguanaDev *idev)
     return retval;
 }
 
+int sendCompression(const iguanaDev *idev)
+{
+    if ((idev->version & 0xFF) >= 0x08)
+        return COMPRESS_VER1;
+    return COMPRESS_VER0;
+}
+
 bool checkFeatures(iguanaDev *idev, unsigned char targetSet)
 {
     /* only ask for features from devices w a body */
@@ -548,592 +604,1418 @@ bool oldPinConfig(iguanaDev *idev,       /* required */
     return false;
 }
 
-bool deviceTransaction(iguanaDev *idev,       /* required */
-                       dataPacket *request,   /* required */
-                       dataPacket **response) /* optional */
+/* the outcome of every request sent with one code */
+typedef struct latencyStats
 {
-    bool retval = false;
-    packetType *type;
+    /* MUST be listed first for casting */
+    itemHeader header;
 
-    /* For old devices setting pin configs actually becomes 2
-       requests, awkward, but the way it has to be to support old
-       firmware. */
-    if (idev->version <= 3 &&
-        (request->code == IG_DEV_SETPINCONFIG ||
-         request->code == IG_DEV_GETPINCONFIG))
-        return oldPinConfig(idev, request, response);
+    unsigned char code;
+    unsigned int count, failed, timeouts;
+    uint64_t max;
+    /* moving average weighted toward the latest requests */
+    uint64_t recent;
+    unsigned int buckets[LATENCY_BUCKETS];
+} latencyStats;
+
+static unsigned int latencyBucket(uint64_t micros)
+{
+    unsigned int top = 0, bucket;
+
+    if (micros < (1 << LATENCY_SUB_BITS))
+        return (unsigned int)micros;
+
+    /* the highest bit picks the group, the next ones the bucket */
+    while((micros >> top) > 1)
+        top++;
+    bucket = (top - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS |
+             ((micros >> (top - LATENCY_SUB_BITS)) &
+              ((1 << LATENCY_SUB_BITS) - 1));
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+    return bucket;
+}
 
-    type = checkIncomingProtocol(idev, request, response == NULL);
-    if (type)
+/* largest latency that falls in bucket */
+static uint64_t bucketLimit(unsigned int bucket)
+{
+    unsigned int group = bucket >> LATENCY_SUB_BITS;
+    uint64_t base;
+
+    if (group == 0)
+        return bucket;
+    base = (uint64_t)((bucket & ((1 << LATENCY_SUB_BITS) - 1)) |
+                      (1 << LATENCY_SUB_BITS)) << (group - 1);
+    return base + ((uint64_t)1 << (group - 1)) - 1;
+}
+
+static void recordLatency(iguanaDev *idev, unsigned char code,
+                          bool success, uint64_t then)
+{
+    uint64_t micros = microsSinceX() - then;
+    int error = errno;
+    latencyStats *stats;
+
+    EnterCriticalSection(&idev->listLock);
+    for(stats = (latencyStats*)idev->latencies.head; stats != NULL;
+        stats = (latencyStats*)stats->header.next)
+        if (stats->code == code)
+            break;
+    if (stats == NULL)
     {
-        unsigned char msg[MAX_PACKET_SIZE] = {CTL_START, CTL_START, CTL_TODEV};
-        uint64_t then, now;
-        int length = MIN_CTL_LENGTH, result, sent = 0;
+        stats = (latencyStats*)malloc(sizeof(latencyStats));
+        if (stats != NULL)
+        {
+            memset(stats, 0, sizeof(latencyStats));
+            stats->code = code;
+            insertItem(&idev->latencies, NULL, (itemHeader*)stats);
+        }
+    }
 
-#ifdef LIBUSB_NO_THREADS
-        bool unlocked = false;
-#endif
+    if (stats == NULL)
+        ;
+    else if (! success)
+    {
+        stats->failed++;
+        if (error == ETIMEDOUT)
+            stats->timeouts++;
+    }
+    else
+    {
+        stats->count++;
+        stats->buckets[latencyBucket(micros)]++;
+        if (micros > stats->max)
+            stats->max = micros;
+        if (stats->count == 1)
+            stats->recent = micros;
+        else
+            stats->recent = (stats->recent * 7 + micros) / 8;
+    }
+    LeaveCriticalSection(&idev->listLock);
+    errno = error;
+}
 
-        /* possibly change the code, then translate for the device */
-        switch(request->code)
+uint64_t recentLatency(iguanaDev *idev, unsigned char code)
+{
+    uint64_t retval = 0;
+    latencyStats *stats;
+
+    EnterCriticalSection(&idev->listLock);
+    for(stats = (latencyStats*)idev->latencies.head; stats != NULL;
+        stats = (latencyStats*)stats->header.next)
+        if (stats->code == code)
         {
-        case IG_DEV_GETID:
-            msg[CODE_OFFSET] = IG_DEV_EXECUTE;
+            retval = stats->recent;
             break;
+        }
+    LeaveCriticalSection(&idev->listLock);
+    return retval;
+}
 
-        case IG_DEV_SETID:
-        {
-            unsigned char *block;
-            block = generateIDBlock((char*)request->data, idev->version);
-            free(request->data);
-            request->data = block;
-            request->dataLen = 68;
+/* the latency that fraction of the successful requests came in under */
+static uint64_t percentile(latencyStats *stats, double fraction)
+{
+    unsigned int x, seen = 0, target;
 
-            msg[CODE_OFFSET] = IG_DEV_WRITEBLOCK;
+    target = (unsigned int)(stats->count * fraction + 0.999999);
+    if (target == 0)
+        return 0;
+    for(x = 0; x < LATENCY_BUCKETS; x++)
+    {
+        seen += stats->buckets[x];
+        if (seen >= target)
             break;
-        }
+    }
+    if (x == LATENCY_BUCKETS || bucketLimit(x) > stats->max)
+        return stats->max;
+    return bucketLimit(x);
+}
+
+char* latencySummary(iguanaDev *idev)
+{
+    char *buf = NULL;
+    latencyStats *stats;
+    int len = 0;
 
-        /* clear the features if any page is written since this could
-           change the returned timings */
-        case IG_DEV_WRITEBLOCK:
-            idev->features = UNKNOWN_FEATURES;
-        default:
-            msg[CODE_OFFSET] = request->code;
+    EnterCriticalSection(&idev->listLock);
+    for(stats = (latencyStats*)idev->latencies.head; stats != NULL;
+        stats = (latencyStats*)stats->header.next)
+    {
+        char line[160];
+        char *bigger;
+        int size;
+
+        size = sprintf(line, "%d %u %u %u %u %llu %llu %llu %llu\n",
+                       idev->usbDev->id, stats->code, stats->count,
+                       stats->failed, stats->timeouts,
+                       (unsigned long long)percentile(stats, 0.5),
+                       (unsigned long long)percentile(stats, 0.99),
+                       (unsigned long long)percentile(stats, 0.999),
+                       (unsigned long long)stats->max);
+        bigger = (char*)realloc(buf, len + size + 1);
+        if (bigger == NULL)
             break;
-        }
-        if (! translateDevice(msg + CODE_OFFSET, idev->version, true))
-            message(LOG_ERROR, "Failed to translate code for device.\n");
+        buf = bigger;
+        strcpy(buf + len, line);
+        len += size;
+    }
+    LeaveCriticalSection(&idev->listLock);
+
+    return buf;
+}
+
+void freeLatencies(iguanaDev *idev)
+{
+    while(idev->latencies.count > 0)
+        free(removeFirstItem(&idev->latencies));
+}
+
+/* a control request sent without waiting on its ack */
+typedef struct ctlTransaction
+{
+    /* MUST be listed first for casting */
+    itemHeader header;
+
+    dataPacket *request;
+    packetType *type;
+    uint64_t sentAt;
+
+    /* told the outcome once the ack arrives (or does not) */
+    transactionFunc done;
+    void *userData;
+} ctlTransaction;
+
+/* translate the request for the device and send it with any data */
+static bool sendRequest(iguanaDev *idev, dataPacket *request)
+{
+    unsigned char msg[MAX_PACKET_SIZE] = {CTL_START, CTL_START, CTL_TODEV};
+    int length = MIN_CTL_LENGTH, result, sent = 0;
+
+    /* possibly change the code, then translate for the device */
+    switch(request->code)
+    {
+    case IG_DEV_GETID:
+        msg[CODE_OFFSET] = IG_DEV_EXECUTE;
+        break;
+
+    case IG_DEV_SETID:
+    {
+        unsigned char *block;
+        block = generateIDBlock((char*)request->data, idev->version);
+        free(request->data);
+        request->data = block;
+        request->dataLen = 68;
+
+        msg[CODE_OFFSET] = IG_DEV_WRITEBLOCK;
+        break;
+    }
+
+    /* clear the features if any page is written since this could
+       change the returned timings */
+    case IG_DEV_WRITEBLOCK:
+        idev->features = UNKNOWN_FEATURES;
+    default:
+        msg[CODE_OFFSET] = request->code;
+        break;
+    }
+    if (! translateDevice(msg + CODE_OFFSET, idev->version, true))
+        message(LOG_ERROR, "Failed to translate code for device.\n");
+
+    /* compute the outgoing checksum for IG_DEV_WRITEBLOCK */
+    if (msg[CODE_OFFSET] == IG_DEV_WRITEBLOCK &&
+        request->dataLen == 68)
+    {
+        int x;
+        uint32_t chksum = 0;
+        for(x = 4; x < 68; x++)
+            chksum += request->data[x];
+        request->data[2] = (chksum & 0xFF00) >> 8;
+        request->data[3] = chksum & 0xFF;
+    }
 
-        /* compute the outgoing checksum for IG_DEV_WRITEBLOCK */
-        if (msg[CODE_OFFSET] == IG_DEV_WRITEBLOCK &&
-            request->dataLen == 68)
+    /* SEND and PINBURST do not get their data packed into the
+       request packet, unlike everything else. */
+    if (request->code != IG_DEV_SEND &&
+        request->code != IG_DEV_RESEND &&
+        request->code != IG_DEV_PINBURST &&
+        request->code != IG_DEV_REPEATER)
+    {
+        if (request->code != IG_DEV_SETPINCONFIG)
         {
-            int x;
-            uint32_t chksum = 0;
-            for(x = 4; x < 68; x++)
-                chksum += request->data[x];
-            request->data[2] = (chksum & 0xFF00) >> 8;
-            request->data[3] = chksum & 0xFF;
+            sent = request->dataLen;
+            /* this is only used to get addresses in WRITEBLOCK */
+            if (sent > 4)
+                sent = 4;
+            memcpy(msg + MIN_CTL_LENGTH, request->data, sent);
+            length += sent;
         }
-
-        /* SEND and PINBURST do not get their data packed into the
-           request packet, unlike everything else. */
-        if (request->code != IG_DEV_SEND &&
-            request->code != IG_DEV_RESEND &&
-            request->code != IG_DEV_PINBURST &&
-            request->code != IG_DEV_REPEATER)
+    }
+    /* as of version 3 SEND and PINBURST require a length argument */
+    else if (idev->version >= 3)
+    {
+        int dataPos = MIN_CTL_LENGTH;
+        if (request->code == IG_DEV_RESEND)
         {
-            if (request->code != IG_DEV_SETPINCONFIG)
-            {
-                sent = request->dataLen;
-                /* this is only used to get addresses in WRITEBLOCK */
-                if (sent > 4)
-                    sent = 4;
-                memcpy(msg + MIN_CTL_LENGTH, request->data, sent);
-                length += sent;
-            }
+            /* prepare to append the channels and carrier */
+            request->data = realloc(request->data, MAX_PACKET_SIZE);
+            request->dataLen = MAX_PACKET_SIZE;
+
+             /* the size will be overwritten in the device firmware */
+            request->data[dataPos++] = 0xFF;
         }
-        /* as of version 3 SEND and PINBURST require a length argument */
-        else if (idev->version >= 3)
+        else
+            msg[length++] = (unsigned char)request->dataLen;
+
+        /* select which channels to transmit on */
+        if (request->code == IG_DEV_SEND ||
+            request->code == IG_DEV_RESEND ||
+            request->code == IG_DEV_REPEATER)
         {
-            int dataPos = MIN_CTL_LENGTH;
             if (request->code == IG_DEV_RESEND)
-            {
-                /* prepare to append the channels and carrier */
-                request->data = realloc(request->data, MAX_PACKET_SIZE);
-                request->dataLen = MAX_PACKET_SIZE;
-
-                 /* the size will be overwritten in the device firmware */
-                request->data[dataPos++] = 0xFF;
-            }
+                request->data[dataPos++] = idev->channels;
             else
-                msg[length++] = (unsigned char)request->dataLen;
+                msg[length++] = idev->channels;
 
-            /* select which channels to transmit on */
-            if (request->code == IG_DEV_SEND ||
-                request->code == IG_DEV_RESEND ||
-                request->code == IG_DEV_REPEATER)
+            /* is the carrier frequency finally adjustable? */
+            if ((idev->version & 0x00FF) &&
+                (idev->version & 0xFF00))
             {
+                unsigned char *delays;
+                /* the cycle count WAS stable so default to that count: */
+                uint8_t loopCycles = 5 + 5 + 7 + 6 + 6 + 7 + \
+                                     (5 + 7) + (5 + 7) + 5;
+                /* we can use the cycle count provided by the
+                   firmware with body-4 */
+                if ((idev->version & 0x00FF) >= 0x0004 &&
+                    checkFeatures(idev, UNKNOWN_FEATURES))
+                    loopCycles = idev->cycles;
+
+                /* compute the delay length off the carrier */
                 if (request->code == IG_DEV_RESEND)
-                    request->data[dataPos++] = idev->channels;
+                    delays = request->data + dataPos;
                 else
-                    msg[length++] = idev->channels;
-
-                /* is the carrier frequency finally adjustable? */
-                if ((idev->version & 0x00FF) &&
-                    (idev->version & 0xFF00))
                 {
-                    unsigned char *delays;
-                    /* the cycle count WAS stable so default to that count: */
-                    uint8_t loopCycles = 5 + 5 + 7 + 6 + 6 + 7 + \
-                                         (5 + 7) + (5 + 7) + 5;
-                    /* we can use the cycle count provided by the
-                       firmware with body-4 */
-                    if ((idev->version & 0x00FF) >= 0x0004 &&
-                        checkFeatures(idev, UNKNOWN_FEATURES))
-                        loopCycles = idev->cycles;
-
-                    /* compute the delay length off the carrier */
-                    if (request->code == IG_DEV_RESEND)
-                        delays = request->data + dataPos;
-                    else
-                    {
-                        delays = msg + length;
-                        length += 2;
-                    }
-                    computeCarrierDelays(idev->carrier, delays, loopCycles);
+                    delays = msg + length;
+                    length += 2;
                 }
+                computeCarrierDelays(idev->carrier, delays, loopCycles);
             }
         }
+    }
 
+    result = interruptSend(idev->usbDev, msg, length,
+                           idev->settings->sendTimeout);
+    /* error if we were not able to write ALL the data */
+    if (result != length)
+        printError(LOG_ERROR,
+                   "failed to write control packet", idev->usbDev);
+    /* if there is more data need to transmit the data stream
+       before releasing the devLock */
+    else if (request->dataLen > sent &&
+             ! sendData(idev,
+                        request->data + sent, request->dataLen - sent,
+                        idev->version < 3 && request->code == IG_DEV_SEND))
+        message(LOG_ERROR, "Failed to send IR data.\n");
+    else
+        return true;
+    return false;
+}
 
-#ifdef LIBUSB_NO_THREADS_OPTION
-        if (idev->libusbNoThreads)
-#endif
-#ifdef LIBUSB_NO_THREADS
-        {
-            /* force the reader to give up the lock */
-            idev->needToWrite = true;
-            EnterCriticalSection(&idev->devLock);
-            idev->needToWrite = false;
-        }
-#endif
+/* packets the reader has taken from the device, any received signal
+   is written to the same buffer as the codes being sent */
+static unsigned int packetsRead(iguanaDev *idev)
+{
+    return idev->recvRing.tail + idev->recvRing.overflows;
+}
 
-        /* Due to a usb data toggle issue only evident on OS X this
-           code will send a fake get-version request whenever the
-           incoming packet would have the wrong toggle value.  The
-           response will be lost, but the toggle will then match up
-           again for the actual request. */
-        if (srvSettings.fixToggle && idev->willFail)
-        {
-            unsigned char msg[MAX_PACKET_SIZE] = {CTL_START, CTL_START, CTL_TODEV, IG_DEV_GETVERSION};
-            interruptSend(idev->usbDev, msg, 4, 100);
+static void forgetSend(iguanaDev *idev)
+{
+    free(idev->lastSend);
+    idev->lastSend = NULL;
+}
 
-            message(LOG_INFO, "Injected fake get-version to fix toggle\n");
-            idev->willFail = false;
-            idev->firstTimeout = false;
-        }
+/* would sending request leave the buffer as it already is? */
+static bool sameAsLastSend(iguanaDev *idev, const dataPacket *request)
+{
+    return idev->lastSend != NULL &&
+           idev->lastSendLength == request->dataLen &&
+           idev->lastSendRead == packetsRead(idev) &&
+           idev->receiverCount == 0 &&
+           memcmp(idev->lastSend, request->data, request->dataLen) == 0;
+}
 
-        /* flush any extraneous CTL_TODEV responses */
-        flushToDevResponsePackets(idev);
-        /* time the transfer */
-        then = microsSinceX();
-        result = interruptSend(idev->usbDev, msg, length,
-                               idev->settings->sendTimeout);
-        /* error if we were not able to write ALL the data */
-        if (result != length)
-            printError(LOG_ERROR,
-                       "failed to write control packet", idev->usbDev);
-        /* if there is more data need to transmit the data stream
-           before releasing the devLock */
-        else if (request->dataLen > sent &&
-                 ! sendData(idev,
-                            request->data + sent, request->dataLen - sent,
-                            idev->version < 3 && request->code == IG_DEV_SEND))
-            message(LOG_ERROR, "Failed to send IR data.\n");
-        /* if no ack is necessary then return success now */
-        else if (! type->ack)
-            retval = true;
-        else
-        {
-            int amount;
+/* usb packets it takes to write a send carrying length bytes: the
+   control packet, then the data and its terminator */
+static unsigned int sendPackets(iguanaDev *idev, unsigned int length)
+{
+    return 2 + length / idev->maxPacketSize;
+}
 
-#ifdef LIBUSB_NO_THREADS_OPTION
-            if (idev->libusbNoThreads)
-#endif
-#ifdef LIBUSB_NO_THREADS
-            {
-                /* unlock as soon as possible after all data has been sent */
-                LeaveCriticalSection(&idev->devLock);
-                unlocked = true;
-            }
-#endif
+/* note when the last packet of a send went out and how long each of
+   its packets took to get there */
+static void timeTransfer(iguanaDev *idev, dataPacket *request, uint64_t then)
+{
+    unsigned int micros;
 
-            /* using sendTimeout to ensure reader has necessary time
-               to recieve the ack */
-            amount = notified(idev->responsePipe[READ],
-                              idev->settings->sendTimeout);
-            if (amount < 0)
-                message(LOG_ERROR, "Failed to read control ack: %s\n",
-                        translateError(errno));
-            else if (amount > 0)
-            {
-                dataPacket *pos;
+    idev->transferred = microsSinceX();
+    micros = (unsigned int)((idev->transferred - then) /
+                            sendPackets(idev, request->dataLen));
+    if (idev->packetMicros == 0)
+        idev->packetMicros = micros;
+    else
+        idev->packetMicros = (idev->packetMicros * 7 + micros) / 8;
+}
 
-                EnterCriticalSection(&idev->listLock);
-                pos = idev->response;
+uint64_t transferMicros(iguanaDev *idev, const dataPacket *request)
+{
+    unsigned int length = request->dataLen;
+
+    /* codes still in the buffer go out as a one packet resend */
+    if (idev->settings->autoResend && idev->receiverCount == 0 &&
+        length > MAX_PACKET_SIZE &&
+        findTypeEntry(IG_DEV_RESEND, idev->version) != NULL &&
+        sameAsLastSend(idev, request))
+        length = MAX_PACKET_SIZE;
+    return (uint64_t)idev->packetMicros * sendPackets(idev, length);
+}
 
-                /* un-translate the SETID/WRITEBLOCK codes */
-                if (request->code == IG_DEV_SETID &&
-                    pos->code == IG_DEV_WRITEBLOCK)
-                    pos->code = IG_DEV_SETID;
+/* check that the ack pos answers the request, pos is consumed */
+static bool checkAck(iguanaDev *idev, dataPacket *request, packetType *type,
+                     dataPacket *pos, dataPacket **response, uint64_t then)
+{
+    bool retval = false;
 
-                errno = EINVAL;
-                if (pos->code != IG_DEV_INVALID_ARG)
-                {
-                    if (pos->code != request->code)
-                        message(LOG_ERROR,
-                                "Bad ack for send: 0x%x != 0x%x\n",
-                                pos->code, request->code);
-                    else if (! payloadMatch((unsigned char)type->inData, (unsigned char)pos->dataLen))
-                        message(LOG_ERROR, "Response size does not match specification (version 0x%x: %d != %d)\n", idev->version, pos->dataLen,type->inData);
-                    else
-                    {
-                        /* store the retrieved response */
-                        if (response != NULL)
-                            *response = pos;
-                        else
-                            freeDataPacket(pos);
-                        pos = NULL;
-
-                        /* how long did this all take? */
-                        now = microsSinceX();
-                        message(LOG_INFO,
-                                "Transaction: 0x%x (%lld microseconds)\n",
-                                request->code, now - then);
-                        retval = true;
-                    }
-                }
+    /* un-translate the SETID/WRITEBLOCK codes */
+    if (request->code == IG_DEV_SETID &&
+        pos->code == IG_DEV_WRITEBLOCK)
+        pos->code = IG_DEV_SETID;
 
-                freeDataPacket(pos);
-                idev->response = NULL;
-                LeaveCriticalSection(&idev->listLock);
-            }
+    errno = EINVAL;
+    if (pos->code != IG_DEV_INVALID_ARG)
+    {
+        if (pos->code != request->code)
+            message(LOG_ERROR,
+                    "Bad ack for send: 0x%x != 0x%x\n",
+                    pos->code, request->code);
+        else if (! payloadMatch((unsigned char)type->inData, (unsigned char)pos->dataLen))
+            message(LOG_ERROR, "Response size does not match specification (version 0x%x: %d != %d)\n", idev->version, pos->dataLen,type->inData);
+        else
+        {
+            /* store the retrieved response */
+            if (response != NULL)
+                *response = pos;
             else
-            {
-                message(LOG_INFO,
-                        "Timeout while waiting for response from device.\n");
-                errno = ETIMEDOUT;
-            }
-        }
+                freeDataPacket(pos);
+            pos = NULL;
 
-#ifdef LIBUSB_NO_THREADS_OPTION
-        if (idev->libusbNoThreads)
-#endif
-#ifdef LIBUSB_NO_THREADS
-            /* certain errors may result in unlocking here */
-            if (!unlocked)
-                LeaveCriticalSection(&idev->devLock);
-#endif
+            /* how long did this all take? */
+            message(LOG_INFO,
+                    "Transaction: 0x%x (%lld microseconds)\n",
+                    request->code, microsSinceX() - then);
+            retval = true;
+        }
     }
 
+    freeDataPacket(pos);
     return retval;
 }
 
-dataPacket* removeNextPacket(iguanaDev *idev)
+static void completeTransaction(iguanaDev *idev, ctlTransaction *trans,
+                                dataPacket *response, int error)
 {
-    dataPacket *retval;
+    removeItem((itemHeader*)trans);
+    errno = error;
+    recordLatency(idev, trans->request->code, response != NULL,
+                  trans->sentAt);
+    if (trans->done == NULL)
+    {
+        freeDataPacket(trans->request);
+        freeDataPacket(response);
+    }
+    else
+    {
+        errno = error;
+        trans->done(trans->request, response, trans->userData);
+    }
+    free(trans);
+}
 
-    EnterCriticalSection(&idev->listLock);
+/* Acks arrive in the order the requests were sent, so the oldest
+   transaction with a matching code takes the ack and any older ones
+   were skipped by the device.  Returns false if no ack was waiting. */
+static bool takeResponse(iguanaDev *idev, int timeout)
+{
+    ctlTransaction *trans;
+    dataPacket *pos, *response = NULL;
+
+    if (notified(idev->responsePipe[READ], timeout) != 1 ||
+        (pos = nextResponse(idev)) == NULL)
+        return false;
 
-    /* snag the first one off the list (NULL on empty) */
-    retval = (dataPacket*)removeFirstItem(&idev->recvList);
+    for(trans = (ctlTransaction*)idev->inFlight.head; trans != NULL;
+        trans = (ctlTransaction*)trans->header.next)
+        if (pos->code == trans->request->code ||
+            pos->code == IG_DEV_INVALID_ARG)
+            break;
 
-    /* debug logging */
-    if (retval == NULL)
-        message(LOG_DEBUG, "Returning NULL data packet\n");
-    else
-        message(LOG_DEBUG2, "Returning data packet (0x%x, %d byte payload)\n",
-                retval->code, retval->dataLen);
+    if (trans == NULL)
+    {
+        message(LOG_ERROR, "Flushed extraneous CTL_TODEV response.\n");
+        freeDataPacket(pos);
+        return true;
+    }
 
-    LeaveCriticalSection(&idev->listLock);
+    while((ctlTransaction*)idev->inFlight.head != trans)
+    {
+        ctlTransaction *skipped = (ctlTransaction*)idev->inFlight.head;
+        message(LOG_ERROR, "Missing ack for 0x%x\n", skipped->request->code);
+        completeTransaction(idev, skipped, NULL, EIO);
+    }
 
-    return retval;
+    if (checkAck(idev, trans->request, trans->type, pos, &response,
+                 trans->sentAt))
+        completeTransaction(idev, trans, response, 0);
+    else
+        completeTransaction(idev, trans, NULL, errno);
+    return true;
 }
 
-void handleIncomingPackets(iguanaDev *idev)
+static void expireTransactions(iguanaDev *idev)
 {
-    unsigned char *buffer = NULL;
-    int length = 0, prev = 0;
-    dataPacket *current = NULL;
-    bool toggle = 1;
+    uint64_t now = microsSinceX();
+    ctlTransaction *trans;
 
-    if (srvSettings.fixToggle)
+    while((trans = (ctlTransaction*)idev->inFlight.head) != NULL &&
+          now - trans->sentAt >= idev->settings->sendTimeout * 1000ULL)
     {
-        idev->willFail = false;
-        idev->firstTimeout = true;
+        message(LOG_INFO,
+                "Timeout while waiting for response from device.\n");
+        completeTransaction(idev, trans, NULL, ETIMEDOUT);
     }
+}
 
-    /* allocate space for receiving */
-    buffer = (unsigned char*)malloc(idev->maxPacketSize);
-    if (buffer == NULL)
-        message(LOG_ERROR, "Out of memory allocating receive buffer.\n");
-    else
-        /* read and handle packets forever */
-        while(length >= 0 &&
-              ! idev->quitRequested)
-        {
-#ifdef LIBUSB_NO_THREADS_OPTION
-            if (idev->libusbNoThreads)
-#endif
-#ifdef LIBUSB_NO_THREADS
-            {
-                /* writer will set a flag if it need to perform a device
-                 * transaction because otherwise we can spin and keep
-                 * getting the lock before the writer is scheduled */
-                if (idev->needToWrite)
-                    SwitchToThread();
-                EnterCriticalSection(&idev->devLock);
-            }
-#endif
+int responseTimeout(iguanaDev *idev)
+{
+    ctlTransaction *trans = (ctlTransaction*)idev->inFlight.head;
+    uint64_t waited;
 
-            /* wait for data to arrive */
-            length = interruptRecv(idev->usbDev, buffer, idev->maxPacketSize,
-                                   idev->settings->recvTimeout);
-            if (length < 0)
-            {
-                /* loop on timeouts */
-                if (errno == ETIMEDOUT)
-                {
-                    if (srvSettings.fixToggle)
-                    {
-                        /*
-                        message(LOG_WARN, "%d %d %d %d\n", errno, length, EAGAIN, LIBUSB_ERROR_TIMEOUT);
-                        interruptRecv(idev->usbDev, NULL, 0, 424242);
-                        */
-                        if (idev->firstTimeout && toggle)
-                            idev->willFail = true;
-                        /* message(LOG_INFO, "timeout: %d %d %d\n", toggle, idev->willFail, idev->firstTimeout); */
-                        idev->firstTimeout = false;
-                        toggle = 0;
-                    }
-                    length = 0;
-                }
-                /* loop on timeouts */
-                else if (errno == EPIPE)
-                {
-                    if (idev->settings->disconnectOnEPipe || prev < 0)
-                    {
-                        printError(LOG_ERROR,
-                                   "pipe error from USB device",
-                                   idev->usbDev);
-                        break;
-                    }
-                    else
-                    {
-                        message(LOG_INFO,
-                                "Ignoring a pipe error for %d\n",
-                                idev->usbDev->id);
-                        length = 0;
-                    }
-                }
-                /* (somewhat) quietly clean up on disconnect */
-                else if (errno == ENODEV)
-                {
-                    message(LOG_INFO,
-                            "Device %d unplugged\n", idev->usbDev->id);
-                    break;
-                }
-                /* (somewhat) quietly released during shutdown */
-                else if (idev->usbDev->stopped)
-                {
-                    message(LOG_INFO,
-                            "Device %d released\n", idev->usbDev->id);
-                    break;
-                }
-                else /* if (errno != EINVAL) */
-                {
-                    /* log the usb error associated with the problem */
-                    printError(LOG_ERROR,
-                               "can't read from USB device", idev->usbDev);
-
-                    /* Send SIGHUP to trigger rescan and see if we can find
-                    'new' device unless user has disabled that option */
-                    if (srvSettings.autoRescan)
-                    {
-                        Sleep(10);
-                        message(LOG_INFO,
-                            "Rescaning for devices after recent disconnect.\n");
-                        triggerCommand((THREAD_PTR)SCAN_TRIGGER);
-                    }
-                }
-            }
-            else if (length == 0)
+    if (trans == NULL)
+        return -1;
+
+    waited = (microsSinceX() - trans->sentAt) / 1000;
+    if (waited >= idev->settings->sendTimeout)
+        return 0;
+    return idev->settings->sendTimeout - (int)waited;
+}
+
+void handleResponses(iguanaDev *idev)
+{
+    while(takeResponse(idev, 0))
+        ;
+    expireTransactions(idev);
+}
+
+void finishTransactions(iguanaDev *idev)
+{
+    int timeout;
+
+    while((timeout = responseTimeout(idev)) >= 0)
+        if (! takeResponse(idev, timeout))
+            expireTransactions(idev);
+}
+
+void abandonTransactions(iguanaDev *idev, void *userData)
+{
+    ctlTransaction *trans, *next;
+
+    for(trans = (ctlTransaction*)idev->inFlight.head; trans != NULL;
+        trans = next)
+    {
+        next = (ctlTransaction*)trans->header.next;
+        if (userData == NULL)
+            completeTransaction(idev, trans, NULL, ENODEV);
+        else if (trans->userData == userData)
+            /* let the ack be matched, but tell no one */
+            trans->done = NULL;
+    }
+}
+
+bool pipelinedRequest(iguanaDev *idev, dataPacket *request)
+{
+    /* the worker drives the device alone and the ack is all that is
+       returned for these codes */
+    if (idev->settings->pipelineDepth <= 1 || srvSettings.fixToggle)
+        return false;
+#ifdef LIBUSB_NO_THREADS_OPTION
+    if (idev->libusbNoThreads)
+        return false;
+#endif
+#ifdef LIBUSB_NO_THREADS
+    return false;
+#endif
+
+    switch(request->code)
+    {
+    case IG_DEV_GETPINCONFIG:
+    case IG_DEV_SETPINCONFIG:
+        /* old firmware turns these into two requests */
+        return idev->version > 3;
+
+    case IG_DEV_GETPINS:
+    case IG_DEV_SETPINS:
+    case IG_DEV_GETBUFSIZE:
+        return true;
+    }
+    return false;
+}
+
+bool startTransaction(iguanaDev *idev, dataPacket *request,
+                      transactionFunc done, void *userData)
+{
+    ctlTransaction *trans;
+    packetType *type;
+
+    type = checkIncomingProtocol(idev, request, false);
+    if (type == NULL)
+        return false;
+    forgetSend(idev);
+
+    /* make room by waiting on the oldest acks */
+    while(idev->inFlight.count >= idev->settings->pipelineDepth)
+        if (! takeResponse(idev, responseTimeout(idev)))
+            expireTransactions(idev);
+
+    trans = (ctlTransaction*)malloc(sizeof(ctlTransaction));
+    if (trans == NULL)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+    trans->request = (dataPacket*)malloc(sizeof(dataPacket));
+    if (trans->request == NULL)
+    {
+        free(trans);
+        errno = ENOMEM;
+        return false;
+    }
+
+    trans->sentAt = microsSinceX();
+    if (! sendRequest(idev, request))
+    {
+        free(trans->request);
+        free(trans);
+        errno = EIO;
+        return false;
+    }
+
+    /* the transaction owns the request from here */
+    *trans->request = *request;
+    trans->type = type;
+    trans->done = done;
+    trans->userData = userData;
+    insertItem(&idev->inFlight, NULL, (itemHeader*)trans);
+    return true;
+}
+
+bool deviceTransaction(iguanaDev *idev,       /* required */
+                       dataPacket *request,   /* required */
+                       dataPacket **response) /* optional */
+{
+    bool retval = false;
+    packetType *type;
+
+    /* For old devices setting pin configs actually becomes 2
+       requests, awkward, but the way it has to be to support old
+       firmware. */
+    if (idev->version <= 3 &&
+        (request->code == IG_DEV_SETPINCONFIG ||
+         request->code == IG_DEV_GETPINCONFIG))
+        return oldPinConfig(idev, request, response);
+
+    type = checkIncomingProtocol(idev, request, response == NULL);
+    if (type)
+    {
+        uint64_t then;
+        unsigned char *sent = NULL;
+        unsigned int sentRead = 0;
+        bool resent = false;
+
+#ifdef LIBUSB_NO_THREADS
+        bool unlocked = false;
+#endif
+
+        /* earlier requests must see their acks first */
+        finishTransactions(idev);
+
+#ifdef LIBUSB_NO_THREADS_OPTION
+        if (idev->libusbNoThreads)
+#endif
+#ifdef LIBUSB_NO_THREADS
+        {
+            /* force the reader to give up the lock */
+            idev->needToWrite = true;
+            EnterCriticalSection(&idev->devLock);
+            idev->needToWrite = false;
+        }
+#endif
+
+        /* Due to a usb data toggle issue only evident on OS X this
+           code will send a fake get-version request whenever the
+           incoming packet would have the wrong toggle value.  The
+           response will be lost, but the toggle will then match up
+           again for the actual request. */
+        if (srvSettings.fixToggle && idev->willFail)
+        {
+            unsigned char msg[MAX_PACKET_SIZE] = {CTL_START, CTL_START, CTL_TODEV, IG_DEV_GETVERSION};
+            interruptSend(idev->usbDev, msg, 4, 100);
+
+            message(LOG_INFO, "Injected fake get-version to fix toggle\n");
+            idev->willFail = false;
+            idev->firstTimeout = false;
+        }
+
+        /* Everything but a send may reuse the device's buffer.  A
+           send of the codes still in it becomes a resend, sparing the
+           transfer, but only while the receiver is off since received
+           signals are written to the same buffer.  A resend carries
+           one packet of settings, so codes that fit in one gain
+           nothing. */
+        if (request->code == IG_DEV_SEND)
+        {
+            packetType *resend = NULL;
+
+            if (idev->settings->autoResend && idev->receiverCount == 0 &&
+                request->dataLen > MAX_PACKET_SIZE)
+                resend = findTypeEntry(IG_DEV_RESEND, idev->version);
+            if (resend != NULL && sameAsLastSend(idev, request))
             {
-                message(LOG_DEBUG, "0 length recv on %d.\n", idev->usbDev->id);
-                if (srvSettings.fixToggle)
-                {
-                    toggle ^= 1;
-                    idev->willFail = false;
-                    idev->firstTimeout = true;
-                    /* message(LOG_INFO, "packet: %d %d %d\n", toggle, idev->willFail, idev->firstTimeout); */
-                }
+                request->code = IG_DEV_RESEND;
+                type = resend;
+                resent = true;
             }
-            else /* if (length > 0)*/
+            else
             {
-                if (srvSettings.fixToggle)
+                forgetSend(idev);
+                if (resend != NULL &&
+                    (sent = (unsigned char*)malloc(request->dataLen)) != NULL)
                 {
-                    toggle ^= 1;
-                    idev->willFail = false;
-                    idev->firstTimeout = true;
-                    /* message(LOG_INFO, "packet: %d %d %d\n", toggle, idev->willFail, idev->firstTimeout); */
-                }
-
-                /* now we need to store a dataPacket */
-                current = (dataPacket*)malloc(sizeof(dataPacket));
-                if (current == NULL)
-                    message(LOG_FATAL, "Out of memory for data packet.\n");
-                else
-                {
-                    unsigned char *dataStart;
-                    packetType *type = NULL;
-
-                    /* initialize the data packet */
-                    memset(current, 0, sizeof(dataPacket));
-
-                    /* see if we got a control packet */
-                    if (length >= MIN_CTL_LENGTH &&
-                        buffer[0] == CTL_START &&
-                        buffer[1] == CTL_START &&
-                        buffer[2] == CTL_FROMDEV)
-                    {
-                        /* any remaining part of the packet is data */
-                        current->code = buffer[CODE_OFFSET];
-                        current->dataLen = length - MIN_CTL_LENGTH;
-                        dataStart = buffer + MIN_CTL_LENGTH;
-
-                        message(LOG_DEBUG,
-                                "Received ctl header: 0x%x\n", current->code);
-
-                        /* translate the incoming packet code */
-                        if (! translateDevice(&current->code,
-                                              idev->version, false))
-                            message(LOG_ERROR,
-                                    "Failed to translate code from device.\n");
-
-                        /* log incoming errors to the igdaemon output */
-                        if (current->code == IG_DEV_OVERRECV)
-                            message(LOG_WARN, "Error received from device %d: Receive too long.\n", idev->usbDev->id);
-                        else if (current->code == IG_DEV_OVERSEND)
-                            message(LOG_WARN, "Error received from device %d: Transmit too long.\n", idev->usbDev->id);
-                    }
-                    else
-                    {
-                        /* all other data is a receive */
-                        current->code = IG_DEV_RECV;
-                        /* NOTE: last byte is the fill level */
-                        current->dataLen = length - 1;
-                        dataStart = buffer;
-
-                        message(LOG_DEBUG2,
-                                "Data without ctl header assuming IG_DEV_RECV.\n");
-/* DEBUG: sleep here to test overflow on the device
-                        sleep(3);
-*/
-                    }
-
-                    /* if the type demands more data then read it here */
-                    type = findTypeEntry(current->code, idev->version);
-                    if (type == NULL)
-                    {
-                        message(LOG_ERROR, "Unknown packet type received from device: 0x%x\n", current->code);
-                        /* still store the rest of the packet */
-                        current->data = (unsigned char*)malloc(current->dataLen);
-                        memcpy(current->data, dataStart, current->dataLen);
-                    }
-                    else if (type->inData != NO_PAYLOAD &&
-                             type->inData > current->dataLen)
-                    {
-                        current->data = (unsigned char*)malloc(type->inData);
-                        memcpy(current->data, dataStart, current->dataLen);
-
-                        while(type->inData > current->dataLen)
-                        {
-                            length = interruptRecv(idev->usbDev,
-                                                   buffer,
-                                                   idev->maxPacketSize,
-                                                  idev->settings->recvTimeout);
-                            if (srvSettings.fixToggle)
-                                toggle ^= 1;
-                            /* timeouts should never happen, but handle it */
-                            if (length > 0 && length <= idev->maxPacketSize)
-                            {
-                                memcpy(current->data + current->dataLen,
-                                       buffer, length);
-                                current->dataLen += length;
-                            }
-                            else
-                            {
-                                message(LOG_ERROR,
-                                        "Invalid length %d\n", length);
-                                break;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        /* store the data from the packet */
-                        current->data = (unsigned char*)malloc(current->dataLen);
-                        memcpy(current->data, dataStart, current->dataLen);
-                    }
-
-                    queueDataPacket(idev, current,
-                                    ! type || type->direction != CTL_TODEV);
-                    current = NULL;
+                    memcpy(sent, request->data, request->dataLen);
+                    sentRead = packetsRead(idev);
                 }
             }
+        }
+        else if (request->code != IG_DEV_RESEND)
+            forgetSend(idev);
+
+        /* flush any extraneous CTL_TODEV responses */
+        flushToDevResponsePackets(idev);
+        /* time the transfer */
+        then = microsSinceX();
+        if (! sendRequest(idev, request))
+            ;
+        /* if no ack is necessary then return success now */
+        else if (! type->ack)
+            retval = true;
+        else
+        {
+            int amount;
+
+            /* only sends have the packet count timeTransfer divides by */
+            if (request->code == IG_DEV_SEND ||
+                request->code == IG_DEV_RESEND)
+                timeTransfer(idev, request, then);
 
 #ifdef LIBUSB_NO_THREADS_OPTION
             if (idev->libusbNoThreads)
 #endif
 #ifdef LIBUSB_NO_THREADS
-                /* unlock the device between reads */
+            {
+                /* unlock as soon as possible after all data has been sent */
                 LeaveCriticalSection(&idev->devLock);
+                unlocked = true;
+            }
 #endif
 
-            /* save the length to handle the double EPIPE */
-            prev = length;
+            /* using sendTimeout to ensure reader has necessary time
+               to recieve the ack */
+            amount = notified(idev->responsePipe[READ],
+                              idev->settings->sendTimeout);
+            if (amount < 0)
+                message(LOG_ERROR, "Failed to read control ack: %s\n",
+                        translateError(errno));
+            else if (amount > 0)
+                retval = checkAck(idev, request, type, nextResponse(idev),
+                                  response, then);
+            else
+            {
+                message(LOG_INFO,
+                        "Timeout while waiting for response from device.\n");
+                errno = ETIMEDOUT;
+            }
         }
+        recordLatency(idev, request->code, retval, then);
 
-    /* release the buffer */
-    free(buffer);
+        /* only a completed send is known to be in the buffer */
+        if (! retval)
+            forgetSend(idev);
+        else if (sent != NULL)
+        {
+            idev->lastSend = sent;
+            idev->lastSendLength = request->dataLen;
+            idev->lastSendRead = sentRead;
+            sent = NULL;
+        }
+        free(sent);
+        if (resent)
+            request->code = IG_DEV_SEND;
 
-    /* signal worker thread that the reader is exiting */
-#if DEBUG
-message(LOG_WARN, "CLOSE %d %s(%d)\n", idev->readerPipe[WRITE], __FILE__, __LINE__);
+#ifdef LIBUSB_NO_THREADS_OPTION
+        if (idev->libusbNoThreads)
+#endif
+#ifdef LIBUSB_NO_THREADS
+            /* certain errors may result in unlocking here */
+            if (!unlocked)
+                LeaveCriticalSection(&idev->devLock);
 #endif
-    closePipe(idev->readerPipe[WRITE]);
+    }
+
+    return retval;
 }
 
-uint32_t* iguanaDevToPulses(unsigned char *code, int *length)
+dataPacket* removeNextPacket(iguanaDev *idev)
+{
+    packetRing *ring = &idev->recvRing;
+    unsigned int head = ring->head;
+    dataPacket *retval;
+
+    /* the tail must be read before the slot it covers */
+    if (head == ring->tail)
+        return NULL;
+    memoryBarrier();
+    retval = ring->slots[head & ring->mask];
+
+    /* and the slot read before it is handed back to the reader */
+    memoryBarrier();
+    ring->head = head + 1;
+
+    message(LOG_DEBUG2, "Returning data packet (0x%x, %d byte payload)\n",
+            retval->code, retval->dataLen);
+    return retval;
+}
+
+void acknowledgeWakeup(iguanaDev *idev)
+{
+    /* cleared before draining so any packet queued after the drain
+       starts triggers another wakeup */
+    atomicExchange(&idev->recvRing.signaled, 0);
+}
+
+bool initPacketRing(iguanaDev *idev)
+{
+    packetRing *ring = &idev->recvRing;
+    unsigned int size = 1;
+
+    /* round up to a power of two so indices can simply be masked */
+    while(size < idev->settings->recvQueue)
+        size <<= 1;
+
+    ring->slots = (dataPacket**)malloc(sizeof(dataPacket*) * size);
+    if (ring->slots == NULL)
+        return false;
+    ring->mask = size - 1;
+    ring->head = ring->tail = ring->signaled = 0;
+    ring->overflows = 0;
+    return true;
+}
+
+void freePacketRing(iguanaDev *idev)
+{
+    packetRing *ring = &idev->recvRing;
+    dataPacket *packet;
+
+    if (ring->slots == NULL)
+        return;
+
+    /* anything the worker never got to */
+    while((packet = removeNextPacket(idev)) != NULL)
+        releasePacket(idev, packet);
+
+    if (ring->overflows > 0)
+        message(LOG_WARN,
+                "Receive queue of %d overflowed, %u packets dropped\n",
+                idev->usbDev->id, ring->overflows);
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+static int decodePulses(const unsigned char *code, int length,
+                        uint32_t *pulses)
 {
     int x, codeLength = 0, inSpace = 0;
-    uint32_t *retval;
 
-    /* allocate space for the deciphered code */
-    retval = (uint32_t*)malloc(sizeof(uint32_t) * *length);
-    retval[0] = 0;
-    for(x = 0; x < *length + 1; x++)
+    pulses[0] = 0;
+    for(x = 0; x < length + 1; x++)
     {
         if (x > 0 &&
-            (x == *length||
+            (x == length||
              ((code[x] & STATE_MASK) != inSpace) ||
-             ((code[x] & LENGTH_MASK) + retval[codeLength] > IG_PULSE_MASK)))
+             ((code[x] & LENGTH_MASK) + pulses[codeLength] > IG_PULSE_MASK)))
         {
-            retval[codeLength] = (retval[codeLength] << 6) / 3;
+            pulses[codeLength] = (pulses[codeLength] << 6) / 3;
 
             if (! inSpace)
-                retval[codeLength] |= IG_PULSE_BIT;
+                pulses[codeLength] |= IG_PULSE_BIT;
             codeLength++;
 
-            if (x == *length)
+            if (x == length)
                 break;
-            retval[codeLength] = 0;
+            pulses[codeLength] = 0;
         }
 
         /* increase by the maximum pulse length + 1 */
         if ((code[x] & LENGTH_MASK) == 0)
-            retval[codeLength] += 1023 + 1;
+            pulses[codeLength] += 1023 + 1;
         else
-            retval[codeLength] += (code[x] & LENGTH_MASK) + 1;
+            pulses[codeLength] += (code[x] & LENGTH_MASK) + 1;
         inSpace = code[x] & STATE_MASK;
     }
 
     if (codeLength > 1)
         message(LOG_DEBUG,
-                "iguanaDevToPulses: allocated %d, used %d\n",
-                *length, codeLength);
+                "decodePulses: %d bytes, %d pulses\n",
+                length, codeLength);
+    return codeLength;
+}
+
+/* a received packet with room for its payload and pulses inline */
+typedef struct pooledPacket
+{
+    /* MUST be listed first for casting */
+    dataPacket packet;
+
+    unsigned char payload[MAX_POOLED_PAYLOAD];
+    uint32_t pulses[MAX_POOLED_PAYLOAD];
+} pooledPacket;
+
+bool initPacketPool(iguanaDev *idev)
+{
+    packetPool *pool = &idev->pool;
+    unsigned int x;
+
+    initializeList(&pool->free);
+    pool->capacity = idev->settings->poolPackets;
+    if (pool->capacity == 0)
+        return true;
+
+    pool->packets = (pooledPacket*)malloc(sizeof(pooledPacket) *
+                                          pool->capacity);
+    if (pool->packets == NULL)
+        return false;
+
+    for(x = 0; x < pool->capacity; x++)
+        insertItem(&pool->free, NULL, (itemHeader*)(pool->packets + x));
+    return true;
+}
+
+void freePacketPool(iguanaDev *idev)
+{
+    packetPool *pool = &idev->pool;
+
+    if (pool->packets != NULL)
+    {
+        message(LOG_INFO,
+                "Packet pool for %d: %u of %u packets at peak, "
+                "exhausted %u times\n", idev->usbDev->id,
+                pool->highWater, pool->capacity, pool->exhausted);
+        free(pool->packets);
+        pool->packets = NULL;
+    }
+}
+
+static pooledPacket* findPooled(iguanaDev *idev, dataPacket *packet)
+{
+    pooledPacket *pooled = (pooledPacket*)packet;
+
+    if (idev->pool.packets != NULL &&
+        pooled >= idev->pool.packets &&
+        pooled < idev->pool.packets + idev->pool.capacity)
+        return pooled;
+    return NULL;
+}
+
+/* NULL when the pool is empty (or disabled) */
+static dataPacket* takePooledPacket(iguanaDev *idev)
+{
+    packetPool *pool = &idev->pool;
+    pooledPacket *pooled = NULL;
+
+    if (pool->packets == NULL)
+        return NULL;
+
+    EnterCriticalSection(&idev->listLock);
+    pooled = (pooledPacket*)removeFirstItem(&pool->free);
+    if (pooled == NULL)
+        pool->exhausted++;
+    else if (++pool->inUse > pool->highWater)
+        pool->highWater = pool->inUse;
+    LeaveCriticalSection(&idev->listLock);
+
+    if (pooled == NULL)
+        return NULL;
+    memset(&pooled->packet, 0, sizeof(dataPacket));
+    pooled->packet.data = pooled->payload;
+    return &pooled->packet;
+}
+
+void releasePacket(iguanaDev *idev, dataPacket *packet)
+{
+    pooledPacket *pooled = findPooled(idev, packet);
+
+    if (pooled == NULL)
+        freeDataPacket(packet);
+    else
+    {
+        EnterCriticalSection(&idev->listLock);
+        insertItem(&idev->pool.free, NULL, (itemHeader*)pooled);
+        idev->pool.inUse--;
+        LeaveCriticalSection(&idev->listLock);
+    }
+}
+
+void receivedToPulses(iguanaDev *idev, dataPacket *packet)
+{
+    pooledPacket *pooled = findPooled(idev, packet);
+
+    if (pooled == NULL)
+    {
+        uint32_t *pulses;
+
+        pulses = iguanaDevToPulses(packet->data, &packet->dataLen);
+        free(packet->data);
+        packet->data = (unsigned char*)pulses;
+    }
+    else
+    {
+        packet->dataLen = decodePulses(pooled->payload, packet->dataLen,
+                                       pooled->pulses) * sizeof(uint32_t);
+        packet->data = (unsigned char*)pooled->pulses;
+    }
+}
+
+/* reader state carried between calls to handleRecvResult */
+typedef struct recvState
+{
+    iguanaDev *idev;
+
+    /* a packet waiting on more data from the device */
+    dataPacket *current;
+    packetType *type;
+
+    /* to handle the double EPIPE and the OS X toggle issue */
+    int prev;
+    bool toggle;
+} recvState;
+
+static void finishPacket(recvState *state)
+{
+    queueDataPacket(state->idev, state->current,
+                    ! state->type || state->type->direction != CTL_TODEV);
+    state->current = NULL;
+    state->type = NULL;
+}
+
+/* Process one result from the usb layer, either a buffer of length
+   bytes or an error when length < 0.  Returns false when the reader
+   should stop. */
+static bool handleRecvResult(recvState *state,
+                             unsigned char *buffer, int length)
+{
+    iguanaDev *idev = state->idev;
+
+    /* append to a packet that demanded more data */
+    if (state->current != NULL)
+    {
+        if (srvSettings.fixToggle)
+            state->toggle ^= 1;
+        /* timeouts should never happen, but handle it */
+        if (length > 0 && length <= idev->maxPacketSize)
+        {
+            memcpy(state->current->data + state->current->dataLen,
+                   buffer, length);
+            state->current->dataLen += length;
+            if (state->type->inData <= state->current->dataLen)
+                finishPacket(state);
+
+            state->prev = length;
+            return true;
+        }
+
+        message(LOG_ERROR, "Invalid length %d\n", length);
+        finishPacket(state);
+    }
+
+    if (length < 0)
+    {
+        /* loop on timeouts */
+        if (errno == ETIMEDOUT)
+        {
+            if (srvSettings.fixToggle)
+            {
+                /*
+                message(LOG_WARN, "%d %d %d %d\n", errno, length, EAGAIN, LIBUSB_ERROR_TIMEOUT);
+                interruptRecv(idev->usbDev, NULL, 0, 424242);
+                */
+                if (idev->firstTimeout && state->toggle)
+                    idev->willFail = true;
+                /* message(LOG_INFO, "timeout: %d %d %d\n", toggle, idev->willFail, idev->firstTimeout); */
+                idev->firstTimeout = false;
+                state->toggle = 0;
+            }
+            length = 0;
+        }
+        /* loop on timeouts */
+        else if (errno == EPIPE)
+        {
+            if (idev->settings->disconnectOnEPipe || state->prev < 0)
+            {
+                printError(LOG_ERROR,
+                           "pipe error from USB device",
+                           idev->usbDev);
+                return false;
+            }
+            else
+            {
+                message(LOG_INFO,
+                        "Ignoring a pipe error for %d\n",
+                        idev->usbDev->id);
+                length = 0;
+            }
+        }
+        /* (somewhat) quietly clean up on disconnect */
+        else if (errno == ENODEV)
+        {
+            message(LOG_INFO,
+                    "Device %d unplugged\n", idev->usbDev->id);
+            return false;
+        }
+        /* (somewhat) quietly released during shutdown */
+        else if (idev->usbDev->stopped)
+        {
+            message(LOG_INFO,
+                    "Device %d released\n", idev->usbDev->id);
+            return false;
+        }
+        else /* if (errno != EINVAL) */
+        {
+            /* log the usb error associated with the problem */
+            printError(LOG_ERROR,
+                       "can't read from USB device", idev->usbDev);
 
-    *length = codeLength * sizeof(uint32_t);
+            /* Send SIGHUP to trigger rescan and see if we can find
+            'new' device unless user has disabled that option */
+            if (srvSettings.autoRescan)
+            {
+                Sleep(10);
+                message(LOG_INFO,
+                    "Rescaning for devices after recent disconnect.\n");
+                triggerCommand((THREAD_PTR)SCAN_TRIGGER);
+            }
+            return false;
+        }
+    }
+    else if (length == 0)
+    {
+        message(LOG_DEBUG, "0 length recv on %d.\n", idev->usbDev->id);
+        if (srvSettings.fixToggle)
+        {
+            state->toggle ^= 1;
+            idev->willFail = false;
+            idev->firstTimeout = true;
+            /* message(LOG_INFO, "packet: %d %d %d\n", toggle, idev->willFail, idev->firstTimeout); */
+        }
+    }
+    else /* if (length > 0)*/
+    {
+        dataPacket *current = NULL;
+        bool isCtl;
+
+        if (srvSettings.fixToggle)
+        {
+            state->toggle ^= 1;
+            idev->willFail = false;
+            idev->firstTimeout = true;
+            /* message(LOG_INFO, "packet: %d %d %d\n", toggle, idev->willFail, idev->firstTimeout); */
+        }
+
+        isCtl = length >= MIN_CTL_LENGTH &&
+                buffer[0] == CTL_START &&
+                buffer[1] == CTL_START &&
+                buffer[2] == CTL_FROMDEV;
+
+        /* now we need to store a dataPacket, raw receive data comes
+           from the pool while the (rare) control packets use the heap */
+        if (! isCtl && length <= MAX_POOLED_PAYLOAD)
+            current = takePooledPacket(idev);
+        if (current == NULL &&
+            (current = (dataPacket*)malloc(sizeof(dataPacket))) != NULL)
+            /* initialize the data packet */
+            memset(current, 0, sizeof(dataPacket));
+
+        if (current == NULL)
+            message(LOG_FATAL, "Out of memory for data packet.\n");
+        else
+        {
+            unsigned char *dataStart;
+            packetType *type = NULL;
+
+            /* see if we got a control packet */
+            if (isCtl)
+            {
+                /* any remaining part of the packet is data */
+                current->code = buffer[CODE_OFFSET];
+                current->dataLen = length - MIN_CTL_LENGTH;
+                dataStart = buffer + MIN_CTL_LENGTH;
+
+                message(LOG_DEBUG,
+                        "Received ctl header: 0x%x\n", current->code);
+
+                /* translate the incoming packet code */
+                if (! translateDevice(&current->code,
+                                      idev->version, false))
+                    message(LOG_ERROR,
+                            "Failed to translate code from device.\n");
+
+                /* log incoming errors to the igdaemon output */
+                if (current->code == IG_DEV_OVERRECV)
+                    message(LOG_WARN, "Error received from device %d: Receive too long.\n", idev->usbDev->id);
+                else if (current->code == IG_DEV_OVERSEND)
+                    message(LOG_WARN, "Error received from device %d: Transmit too long.\n", idev->usbDev->id);
+            }
+            else
+            {
+                /* all other data is a receive */
+                current->code = IG_DEV_RECV;
+                /* NOTE: last byte is the fill level */
+                current->dataLen = length - 1;
+                dataStart = buffer;
+
+                message(LOG_DEBUG2,
+                        "Data without ctl header assuming IG_DEV_RECV.\n");
+/* DEBUG: sleep here to test overflow on the device
+                sleep(3);
+*/
+            }
+
+            /* if the type demands more data then wait for it */
+            type = findTypeEntry(current->code, idev->version);
+            if (type == NULL)
+            {
+                message(LOG_ERROR, "Unknown packet type received from device: 0x%x\n", current->code);
+                /* still store the rest of the packet */
+                current->data = (unsigned char*)malloc(current->dataLen);
+                memcpy(current->data, dataStart, current->dataLen);
+            }
+            else if (type->inData != NO_PAYLOAD &&
+                     type->inData > current->dataLen)
+            {
+                current->data = (unsigned char*)malloc(type->inData);
+                memcpy(current->data, dataStart, current->dataLen);
+            }
+            else
+            {
+                /* store the data from the packet (pooled packets
+                   already have room for it) */
+                if (current->data == NULL)
+                    current->data = (unsigned char*)malloc(current->dataLen);
+                memcpy(current->data, dataStart, current->dataLen);
+            }
+
+            state->current = current;
+            state->type = type;
+            if (type == NULL ||
+                type->inData == NO_PAYLOAD ||
+                type->inData <= current->dataLen)
+                finishPacket(state);
+        }
+    }
+
+    /* save the length to handle the double EPIPE */
+    state->prev = length;
+    return true;
+}
+
+static void stopReading(recvState *state)
+{
+    /* pass along anything left incomplete */
+    if (state->current != NULL)
+        finishPacket(state);
+
+    /* signal worker thread that the reader is exiting */
+#if DEBUG
+message(LOG_WARN, "CLOSE %d %s(%d)\n", state->idev->readerPipe[WRITE], __FILE__, __LINE__);
+#endif
+    closePipe(state->idev->readerPipe[WRITE]);
+}
+
+/* called by the driver's asynchronous receive engine */
+static bool recvCallback(void *userData, unsigned char *buffer, int length)
+{
+    recvState *state = (recvState*)userData;
+
+    if (state->idev->quitRequested)
+        return false;
+    return handleRecvResult(state, buffer, length);
+}
+
+static bool useAsyncRecv(iguanaDev *idev)
+{
+    /* the OS X toggle workaround relies on receive timeouts */
+    if (idev->settings->recvTransfers <= 0 ||
+        srvSettings.fixToggle ||
+        ! asyncRecvSupported())
+        return false;
+
+#ifdef LIBUSB_NO_THREADS_OPTION
+    if (idev->libusbNoThreads)
+        return false;
+#endif
+#ifdef LIBUSB_NO_THREADS
+    return false;
+#else
+    return true;
+#endif
+}
+
+void handleIncomingPackets(iguanaDev *idev)
+{
+    recvState state;
+
+    memset(&state, 0, sizeof(recvState));
+    state.idev = idev;
+    state.toggle = 1;
+
+    if (srvSettings.fixToggle)
+    {
+        idev->willFail = false;
+        idev->firstTimeout = true;
+    }
+
+    /* keep several transfers queued if the driver supports it */
+    if (useAsyncRecv(idev))
+    {
+        message(LOG_DEBUG, "Using %d asynchronous receive transfers on %d.\n",
+                idev->settings->recvTransfers, idev->usbDev->id);
+        if (asyncRecv(idev->usbDev, idev->settings->recvTransfers,
+                      idev->maxPacketSize, recvCallback, &state) < 0)
+            printError(LOG_ERROR,
+                       "failed to start asynchronous receive", idev->usbDev);
+        else if (idev->usbDev->stopped)
+            message(LOG_INFO, "Device %d released\n", idev->usbDev->id);
+    }
+    else
+    {
+        unsigned char *buffer = NULL;
+
+        /* allocate space for receiving */
+        buffer = (unsigned char*)malloc(idev->maxPacketSize);
+        if (buffer == NULL)
+            message(LOG_ERROR, "Out of memory allocating receive buffer.\n");
+        else
+            /* read and handle packets forever */
+            while(! idev->quitRequested)
+            {
+                int length;
+                bool keepReading;
+
+#ifdef LIBUSB_NO_THREADS_OPTION
+                if (idev->libusbNoThreads)
+#endif
+#ifdef LIBUSB_NO_THREADS
+                {
+                    /* writer will set a flag if it need to perform a device
+                     * transaction because otherwise we can spin and keep
+                     * getting the lock before the writer is scheduled */
+                    if (idev->needToWrite)
+                        SwitchToThread();
+                    EnterCriticalSection(&idev->devLock);
+                }
+#endif
+
+                /* wait for data to arrive */
+                length = interruptRecv(idev->usbDev, buffer, idev->maxPacketSize,
+                                       idev->settings->recvTimeout);
+                keepReading = handleRecvResult(&state, buffer, length);
+
+#ifdef LIBUSB_NO_THREADS_OPTION
+                if (idev->libusbNoThreads)
+#endif
+#ifdef LIBUSB_NO_THREADS
+                    /* unlock the device between reads */
+                    LeaveCriticalSection(&idev->devLock);
+#endif
+
+                if (! keepReading)
+                    break;
+            }
+
+        /* release the buffer */
+        free(buffer);
+    }
+
+    stopReading(&state);
+}
+
+/* called by a shared receive engine, the NULL buffer marks its end */
+static bool sharedRecvCallback(void *userData,
+                               unsigned char *buffer, int length)
+{
+    recvState *state = (recvState*)userData;
+
+    if (buffer == NULL)
+    {
+        if (state->idev->usbDev->stopped)
+            message(LOG_INFO,
+                    "Device %d released\n", state->idev->usbDev->id);
+        stopReading(state);
+        free(state);
+        return false;
+    }
+    return recvCallback(userData, buffer, length);
+}
+
+bool startIncomingPackets(iguanaDev *idev)
+{
+    recvState *state;
+
+    if (! useAsyncRecv(idev) || ! sharedRecvSupported())
+        return false;
+
+    state = (recvState*)malloc(sizeof(recvState));
+    if (state == NULL)
+        return false;
+    memset(state, 0, sizeof(recvState));
+    state->idev = idev;
+    state->toggle = 1;
+
+    message(LOG_DEBUG, "Using %d shared receive transfers on %d.\n",
+            idev->settings->recvTransfers, idev->usbDev->id);
+    if (! startRecv(idev->usbDev, idev->settings->recvTransfers,
+                    idev->maxPacketSize, sharedRecvCallback, state))
+    {
+        printError(LOG_ERROR,
+                   "failed to start shared receive", idev->usbDev);
+        free(state);
+        return false;
+    }
+    return true;
+}
+
+uint32_t* iguanaDevToPulses(unsigned char *code, int *length)
+{
+    uint32_t *retval;
+
+    /* allocate space for the deciphered code */
+    retval = (uint32_t*)malloc(sizeof(uint32_t) * (*length > 0 ? *length : 1));
+    *length = decodePulses(code, *length, retval) * sizeof(uint32_t);
     return retval;
 }
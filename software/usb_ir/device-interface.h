@@ -26,6 +26,7 @@ enum
 
 /* forward declaration */
 struct dataPacket;
+struct receiveRing;
 
 typedef struct deviceSettings
 {
@@ -33,17 +34,72 @@ typedef struct deviceSettings
     unsigned int recvTimeout;
     unsigned int sendTimeout;
 
+    /* number of receive transfers kept queued, 0 reads synchronously */
+    int recvTransfers;
+
+    /* size of the per device pool of received packets, 0 allocates
+       every packet from the heap */
+    unsigned int poolPackets;
+
+    /* received packets the worker may fall behind by before the
+       reader starts dropping them */
+    unsigned int recvQueue;
+
+    /* control requests sent before the earlier acks arrive, 1 waits
+       on each ack before sending the next request */
+    unsigned int pipelineDepth;
+
+    /* entries in the shared memory ring of received pulses handed to
+       local receivers, 0 disables the ring */
+    unsigned int ringEntries;
+
+    /* microseconds of space that end a frame for clients receiving
+       whole frames and not choosing their own gap */
+    unsigned int frameGap;
+
+    /* replay the device's buffer with IG_DEV_RESEND when a send
+       would transfer the same codes it already holds */
+    bool autoResend;
+
     /* some hardware throws seemingly erroneous EPIPEs */
     bool disconnectOnEPipe;
 } deviceSettings;
 
+/* received packets are recycled through a fixed pool per device so
+   that steady state receiving does not touch the heap */
+typedef struct packetPool
+{
+    struct pooledPacket *packets;
+    listHeader free;
+
+    /* statistics on how well the pool is sized */
+    unsigned int capacity, inUse, highWater, exhausted;
+} packetPool;
+
+/* the reader hands packets to the worker through a bounded single
+   producer, single consumer ring */
+typedef struct packetRing
+{
+    struct dataPacket **slots;
+    unsigned int mask;
+
+    /* head is only written by the worker and tail by the reader */
+    volatile unsigned int head, tail;
+
+    /* set while a wakeup is outstanding on the readerPipe */
+    volatile unsigned int signaled;
+
+    /* packets dropped because the ring was full */
+    unsigned int overflows;
+} packetRing;
+
 typedef struct iguanaDev
 {
     /* we keep a list of iguanaDevs for ctl queries */
     itemHeader header;
 
-    /* used to pass data from the reader to the worker, closed to
-       notify worker to terminate */
+    /* wakes the worker when data is queued for it, closed to notify
+       the worker to terminate */
     PIPE_PTR readerPipe[2];
     PIPE_PTR responsePipe[2];
 
@@ -57,15 +113,52 @@ typedef struct iguanaDev
     THREAD_PTR worker, reader;
     bool quitRequested;
 
-    /* all data will go in this list as it's read */
-    listHeader recvList;
-    struct dataPacket *response;
+    /* all data will go in this ring as it's read */
+    packetRing recvRing;
+
+    /* acks from the reader, and the requests the worker has sent
+       that are still waiting on theirs */
+    listHeader responses;
+    listHeader inFlight;
 
     /* how many clients are currently receiving? */
     unsigned int receiverCount;
 
-    /* must lock the list of received packets */
+    /* requests clients have queued to take their turn at the device */
+    unsigned int queuedRequests;
+
+    /* sends waiting on the time they are to fire, earliest first, and
+       the average microseconds each usb packet of a send took along
+       with when the last send's final packet went out */
+    listHeader scheduled;
+    unsigned int packetMicros;
+    uint64_t transferred;
+
+    /* a copy of the codes the last send left in the device's buffer,
+       NULL once anything may have overwritten them, and how many
+       packets had been read from the device when they were sent */
+    unsigned char *lastSend;
+    int lastSendLength;
+    unsigned int lastSendRead;
+
+    /* pulses are also published here once a client maps the ring */
+    struct receiveRing *ring;
+
+    /* the earliest time a client's open frame must be finished, 0 if
+       none are open */
+    uint64_t framesDue;
+
+    /* decodes received pulses while any of the decodeClients want key
+       presses, created for the first of them */
+    struct irDecoder *decoder;
+    unsigned int decodeClients;
+
+    /* must lock the responses (and the pool and latencies) */
     LOCK_PTR listLock;
+    packetPool pool;
+
+    /* a latency histogram per request code sent to the device */
+    listHeader latencies;
 
     /* need to know what protocol version to support. */
     uint16_t version;
@@ -109,6 +202,9 @@ bool checkVersion(iguanaDev *idev);
 /* check that the device features match the targetSet */
 bool checkFeatures(iguanaDev *idev, unsigned char targetSet);
 
+/* the COMPRESS_VER* the device's firmware understands in sends */
+int sendCompression(const iguanaDev *idev);
+
 /* check that the client is using the proper protocol */
 struct packetType* checkIncomingProtocol(iguanaDev *idev,
                                          struct dataPacket *request,
@@ -119,11 +215,72 @@ bool deviceTransaction(iguanaDev *idev,
                        struct dataPacket *request,
                        struct dataPacket **response);
 
-/* for using data on the packet list */
+/* Told the result of a pipelined request and takes ownership of the
+   request and response.  The response is NULL with errno set when
+   the request failed. */
+typedef void (*transactionFunc)(struct dataPacket *request,
+                                struct dataPacket *response,
+                                void *userData);
+
+/* whether the request may be sent before earlier acks arrive */
+bool pipelinedRequest(iguanaDev *idev, struct dataPacket *request);
+
+/* send without waiting on the ack, the transaction takes the request
+   data on success and false leaves it with the caller */
+bool startTransaction(iguanaDev *idev, struct dataPacket *request,
+                      transactionFunc done, void *userData);
+
+/* milliseconds until the oldest request times out, -1 if none */
+int responseTimeout(iguanaDev *idev);
+
+/* complete the requests whose acks have arrived or timed out */
+void handleResponses(iguanaDev *idev);
+
+/* wait on every request in flight */
+void finishTransactions(iguanaDev *idev);
+
+/* fail every request in flight, or just forget who to tell about
+   the ones started with userData */
+void abandonTransactions(iguanaDev *idev, void *userData);
+
+/* Lines of "id code count failed timeouts p50 p99 p999 max" with the
+   latencies in microseconds for each request code sent to the device.
+   Returns NULL if nothing was sent. */
+char* latencySummary(iguanaDev *idev);
+/* microseconds that writing the IG_DEV_SEND request to the device
+   should take, by how long the packets of recent sends took */
+uint64_t transferMicros(iguanaDev *idev, const struct dataPacket *request);
+/* microseconds the latest successful requests with code took, 0 if
+   none have been sent */
+uint64_t recentLatency(iguanaDev *idev, unsigned char code);
+void freeLatencies(iguanaDev *idev);
+
+/* for using data on the packet ring, NULL when it is empty */
 struct dataPacket* removeNextPacket(iguanaDev *idev);
 
+/* the worker calls this before draining the ring after a wakeup */
+void acknowledgeWakeup(iguanaDev *idev);
+
+/* manage the ring of received packets */
+bool initPacketRing(iguanaDev *idev);
+void freePacketRing(iguanaDev *idev);
+
+/* manage the pool of received packets */
+bool initPacketPool(iguanaDev *idev);
+void freePacketPool(iguanaDev *idev);
+
+/* return a packet from removeNextPacket to the pool (or the heap) */
+void releasePacket(iguanaDev *idev, struct dataPacket *packet);
+
+/* replace the data of a received packet with its pulses */
+void receivedToPulses(iguanaDev *idev, struct dataPacket *packet);
+
 /* read incoming data into the buffer */
 void handleIncomingPackets(iguanaDev *idev);
 
+/* receive on the driver's shared event thread instead, false if the
+   caller must run handleIncomingPackets on a thread of its own */
+bool startIncomingPackets(iguanaDev *idev);
+
 /* translation of data for transmission */
 uint32_t* iguanaDevToPulses(unsigned char *code, int *length);
@@ -0,0 +1,1016 @@
+/****************************************************************************
+ ** deviceGroup.c ***********************************************************
+ ****************************************************************************
+ *
+ * Group sockets, which pass each send on to the sockets of several
+ * devices at once, and pool sockets, which pass it to one of them.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#include "iguanaIR.h"
+#include "compat.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "driver.h"
+#include "devicebase.h"
+#include "pipes.h"
+#include "dataPackets.h"
+#include "device-interface.h"
+#include "client-interface.h"
+#include "server.h"
+#include "poller.h"
+#include "encodeCache.h"
+#include "codeStore.h"
+#include "deviceGroup.h"
+
+enum
+{
+    /* ms a group waits on its members' replies */
+    GROUP_TIMEOUT = 5000,
+
+    /* ms a pool passes over a member after it fails */
+    POOL_HOLDOFF = 1000
+};
+
+typedef struct groupMember
+{
+    /* device index or alias, connected to like any other client */
+    char *name;
+    PIPE_PTR conn;
+    struct deviceGroup *group;
+
+    /* results of the current send, a status of -ETIMEDOUT while its
+       reply is awaited */
+    int status;
+    uint64_t replied;
+
+    /* whether the listener's poller watches conn, and for pools the
+       sends forwarded that it has not answered and when it last
+       failed */
+    bool watched;
+    unsigned int forwarded;
+    uint64_t failedAt;
+
+    /* the listener never waits on a member: what its socket has not
+       taken is kept until the poller finds room for it, and a reply
+       is gathered as its pieces arrive.  The first reply on a new
+       connection answers the version exchange. */
+    unsigned char *out;
+    int outSize, outSent;
+    bool blocked;
+    dataPacket in;
+    int inHave;
+    bool exchanging;
+} groupMember;
+
+typedef struct deviceGroup
+{
+    itemHeader header;
+
+    char *name;
+    listHeader clients;
+    THREAD_PTR thread;
+    bool started;
+
+    /* a pool forwards each send to one member, keeping the sends not
+       yet answered in the order they were written to their members.
+       A group takes its sends in turn, the first on the list is the
+       one out once sending is set. */
+    bool pool;
+    struct poller *watch;
+    listHeader forwards;
+    int nextMember;
+    bool sending;
+    uint64_t sentAt;
+    int awaited;
+
+    int memberCount;
+    groupMember members[1];
+} deviceGroup;
+
+/* a send a group or pool has taken on */
+typedef struct groupSend
+{
+    itemHeader header;
+
+    /* NULL once the client is released */
+    client *owner;
+    dataPacket *request;
+
+    /* pools only: the member that has it, NULL while it needs one,
+       and how many members it has been tried on */
+    groupMember *member;
+    int tries;
+} groupSend;
+
+static listHeader groups;
+
+static bool addGroup(const char *spec, bool pool)
+{
+    deviceGroup *group;
+    const char *equals, *pos;
+    int count = 1, x;
+
+    equals = strchr(spec, '=');
+    if (equals == NULL || equals == spec || equals[1] == '\0')
+        return false;
+    for(pos = equals + 1; *pos != '\0'; pos++)
+        if (*pos == ',')
+            count++;
+
+    group = (deviceGroup*)calloc(1, sizeof(deviceGroup) +
+                                    sizeof(groupMember) * (count - 1));
+    if (group == NULL)
+        return false;
+    group->pool = pool;
+    group->name = (char*)malloc(equals - spec + 1);
+    if (group->name != NULL)
+    {
+        memcpy(group->name, spec, equals - spec);
+        group->name[equals - spec] = '\0';
+    }
+
+    /* split the members on commas, none of them may be empty */
+    pos = equals + 1;
+    for(x = 0; x < count && group->name != NULL; x++)
+    {
+        const char *end = strchr(pos, ',');
+        int length = end == NULL ? (int)strlen(pos) : (int)(end - pos);
+
+        if (length == 0)
+            break;
+        group->members[x].conn = INVALID_PIPE;
+        group->members[x].group = group;
+        group->members[x].name = (char*)malloc(length + 1);
+        if (group->members[x].name == NULL)
+            break;
+        memcpy(group->members[x].name, pos, length);
+        group->members[x].name[length] = '\0';
+        group->memberCount++;
+        pos += length + 1;
+    }
+
+    if (group->memberCount != count)
+    {
+        for(x = 0; x < group->memberCount; x++)
+            free(group->members[x].name);
+        free(group->name);
+        free(group);
+        return false;
+    }
+
+    insertItem(&groups, NULL, (itemHeader*)group);
+    return true;
+}
+
+bool defineGroup(const char *spec)
+{
+    return addGroup(spec, false);
+}
+
+bool definePool(const char *spec)
+{
+    return addGroup(spec, true);
+}
+
+static void* groupListener(void *instance)
+{
+    deviceGroup *group = (deviceGroup*)instance;
+
+    listenToClients(group->name, &group->clients, NULL);
+    return NULL;
+}
+
+bool startGroups()
+{
+    deviceGroup *group;
+    bool retval = true;
+
+    for(group = (deviceGroup*)groups.head; group != NULL;
+        group = (deviceGroup*)group->header.next)
+    {
+        message(LOG_INFO, "Listening for %s %s of %d devices.\n",
+                group->pool ? "pool" : "group", group->name,
+                group->memberCount);
+        group->started = startThread(&group->thread, groupListener, group);
+        if (! group->started)
+        {
+            message(LOG_ERROR, "Failed to start the listener for group %s.\n",
+                    group->name);
+            retval = false;
+        }
+    }
+
+    return retval;
+}
+
+/* close a member's connection, along with whatever was left of its
+   output and of a reply partly read */
+static void dropMember(groupMember *member, int error)
+{
+    if (member->conn != INVALID_PIPE)
+        closePipe(member->conn);
+    member->conn = INVALID_PIPE;
+    member->status = -error;
+
+    free(member->out);
+    member->out = NULL;
+    member->outSize = member->outSent = 0;
+    member->blocked = false;
+    if (member->inHave >= (int)sizeof(dataPacket))
+        free(member->in.data);
+    member->inHave = 0;
+    member->exchanging = false;
+}
+
+void stopGroups()
+{
+    deviceGroup *group;
+
+    while((group = (deviceGroup*)removeFirstItem(&groups)) != NULL)
+    {
+        groupSend *send;
+        int x;
+
+        if (group->started)
+            joinThread(group->thread, NULL);
+        while((send = (groupSend*)removeFirstItem(&group->forwards)) != NULL)
+        {
+            freeDataPacket(send->request);
+            free(send);
+        }
+        for(x = 0; x < group->memberCount; x++)
+        {
+            dropMember(&group->members[x], 0);
+            free(group->members[x].name);
+        }
+        free(group->name);
+        free(group);
+    }
+}
+
+static deviceGroup* listGroup(const listHeader *clients)
+{
+    deviceGroup *group;
+
+    for(group = (deviceGroup*)groups.head; group != NULL;
+        group = (deviceGroup*)group->header.next)
+        if (clients == &group->clients)
+            return group;
+    return NULL;
+}
+
+static deviceGroup* clientGroup(const client *target)
+{
+    return listGroup(target->header.list);
+}
+
+/* leave the member's encoding in the cache its device thread uses */
+static void encodeForMember(groupMember *member, dataPacket *request)
+{
+    unsigned char *codes = NULL;
+    int carrier, compression;
+
+    if (! deviceSendSettings(member->name, &carrier, &compression))
+        return;
+
+    if (request->code == IG_DEV_SEND)
+        encodeCached(carrier, (uint32_t*)request->data,
+                     request->dataLen / sizeof(uint32_t), &codes,
+                     compression);
+    else
+    {
+        char *name = (char*)malloc(request->dataLen + 1);
+
+        if (name == NULL)
+            return;
+        memcpy(name, request->data, request->dataLen);
+        name[request->dataLen] = '\0';
+        encodeNamedCode(name, carrier, compression, &codes);
+        free(name);
+    }
+    free(codes);
+}
+
+/* "MEMBER:STATUS:USEC|..." for the finished send */
+static char* groupResults(deviceGroup *group)
+{
+    char *buf;
+    int x, length = 1, used = 0;
+
+    for(x = 0; x < group->memberCount; x++)
+        length += strlen(group->members[x].name) + 32;
+    buf = (char*)malloc(length);
+    if (buf != NULL)
+    {
+        buf[0] = '\0';
+        for(x = 0; x < group->memberCount; x++)
+            used += sprintf(buf + used, "%s%s:%d:%llu", x == 0 ? "" : "|",
+                            group->members[x].name, group->members[x].status,
+                            (unsigned long long)group->members[x].replied);
+    }
+    return buf;
+}
+
+/* close a member's connection along with the listener's watch on it */
+static void unwatchMember(deviceGroup *group, groupMember *member,
+                          int error)
+{
+    if (member->watched)
+        pollerRemove(group->watch, member->conn);
+    member->watched = false;
+    dropMember(member, error);
+}
+
+/* write what the member's socket will take without waiting, and
+   have the poller report it once there is room for the rest */
+static bool flushMember(groupMember *member)
+{
+    if (member->outSent < member->outSize)
+    {
+        int result;
+
+        result = writePipePairSome(member->conn,
+                                   member->out + member->outSent,
+                                   member->outSize - member->outSent,
+                                   NULL, 0);
+        if (result < 0)
+        {
+            errno = EIO;
+            return false;
+        }
+        member->outSent += result;
+    }
+    if (member->outSent == member->outSize)
+        member->outSize = member->outSent = 0;
+
+    if (member->blocked != (member->outSize > 0))
+    {
+        member->blocked = member->outSize > 0;
+        if (! pollerWatchWrites(member->group->watch, member->conn,
+                                member->blocked))
+        {
+            errno = ENOMEM;
+            return false;
+        }
+    }
+    return true;
+}
+
+/* queue packet behind the member's earlier output and write it */
+static bool writeMember(groupMember *member, const dataPacket *packet)
+{
+    unsigned char *out;
+    int dataLen = 0;
+
+    if (packet->dataLen > 0)
+        dataLen = packet->dataLen;
+    out = (unsigned char*)realloc(member->out, member->outSize +
+                                               sizeof(dataPacket) + dataLen);
+    if (out == NULL)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+    member->out = out;
+    member->outSize += encodePacketHeader(packet, false,
+                                          out + member->outSize);
+    if (dataLen > 0)
+        memcpy(out + member->outSize, packet->data, dataLen);
+    member->outSize += dataLen;
+
+    return flushMember(member);
+}
+
+/* connect to a member's device socket as an unframed client and
+   start the version exchange, which the device answers ahead of any
+   send written after it */
+static bool connectMember(client *owner, groupMember *member)
+{
+    deviceGroup *group = member->group;
+    dataPacket request = DATA_PACKET_INIT;
+    uint16_t version = IG_PROTOCOL_VERSION;
+
+    member->conn = connectToPipe(member->name);
+    if (member->conn == INVALID_PIPE)
+    {
+        member->status = -ENODEV;
+        return false;
+    }
+
+    group->watch = owner->watch;
+    member->watched = watchGroupMember(owner, member->conn, member);
+    if (! member->watched)
+    {
+        dropMember(member, ENOMEM);
+        return false;
+    }
+
+    request.code = IG_EXCH_VERSIONS;
+    request.dataLen = sizeof(version);
+    request.data = (unsigned char*)&version;
+    member->exchanging = true;
+    if (! writeMember(member, &request))
+    {
+        unwatchMember(group, member, errno);
+        return false;
+    }
+    return true;
+}
+
+/* take in what has arrived of the member's next reply without
+   waiting, 1 once it is whole, 0 until then, and -1 with errno set
+   if the connection failed */
+static int readMember(groupMember *member, dataPacket *reply)
+{
+    int result, have, dataLen = 0;
+
+    if (member->inHave < (int)sizeof(dataPacket))
+    {
+        result = readPipeSome(member->conn,
+                              (char*)&member->in + member->inHave,
+                              sizeof(dataPacket) - member->inHave, 0);
+        if (result < 0)
+            errno = EIO;
+        if (result <= 0)
+            return result;
+        member->inHave += result;
+        if (member->inHave < (int)sizeof(dataPacket))
+            return 0;
+
+        /* the data pointer read is the sender's, the buffer is ours */
+        member->in.data = NULL;
+        if (member->in.dataLen > 0)
+        {
+            member->in.data = (unsigned char*)malloc(member->in.dataLen);
+            if (member->in.data == NULL)
+            {
+                member->inHave = 0;
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    }
+
+    if (member->in.dataLen > 0)
+        dataLen = member->in.dataLen;
+    have = member->inHave - sizeof(dataPacket);
+    if (have < dataLen)
+    {
+        result = readPipeSome(member->conn, member->in.data + have,
+                              dataLen - have, 0);
+        if (result < 0)
+            errno = EIO;
+        if (result <= 0)
+            return result;
+        member->inHave += result;
+        if (have + result < dataLen)
+            return 0;
+    }
+
+    *reply = member->in;
+    member->inHave = 0;
+    return 1;
+}
+
+/* the next whole reply to a send, passing over the version exchange's */
+static int readReply(groupMember *member, dataPacket *reply)
+{
+    int result;
+
+    while((result = readMember(member, reply)) == 1 && member->exchanging)
+    {
+        member->exchanging = false;
+        free(reply->data);
+        if (packetIsError(reply))
+            return -1;
+    }
+    return result;
+}
+
+/* forget a pool member's connection for a while, leaving the sends
+   it had for failOver to place elsewhere */
+static void dropPoolMember(deviceGroup *group, groupMember *member,
+                           int error)
+{
+    groupSend *send;
+
+    message(LOG_INFO, "Pool %s member %s failed: %s\n",
+            group->name, member->name, translateError(error));
+    unwatchMember(group, member, error);
+    member->failedAt = microsSinceX();
+
+    for(send = (groupSend*)group->forwards.head; send != NULL;
+        send = (groupSend*)send->header.next)
+        if (send->member == member)
+            send->member = NULL;
+    member->forwarded = 0;
+}
+
+/* The member a send should wait the least on, by the requests its
+   device has pending and the time its recent sends took.  Members
+   that failed lately, or whose device is gone, are passed over. */
+static groupMember* leastBusy(deviceGroup *group)
+{
+    groupMember *chosen = NULL;
+    uint64_t now, best = 0;
+    int x;
+
+    now = microsSinceX();
+    for(x = 0; x < group->memberCount; x++)
+    {
+        /* ties go round the members in turn */
+        groupMember *member = &group->members[(group->nextMember + x) %
+                                              group->memberCount];
+        unsigned int pending;
+        uint64_t latency, wait;
+
+        if (member->failedAt != 0 &&
+            now < member->failedAt + POOL_HOLDOFF * 1000)
+            continue;
+        if (! deviceLoad(member->name, &pending, &latency))
+            continue;
+
+        /* until a device has sent anything assume it is quick */
+        if (latency == 0)
+            latency = 1;
+        wait = (pending + member->forwarded + 1) * latency;
+        if (chosen == NULL || wait < best)
+        {
+            chosen = member;
+            best = wait;
+        }
+    }
+
+    group->nextMember = (group->nextMember + 1) % group->memberCount;
+    return chosen;
+}
+
+/* write the send to the least busy member that takes it */
+static bool placeSend(deviceGroup *group, groupSend *send)
+{
+    groupMember *member;
+
+    while(send->tries < group->memberCount &&
+          (member = leastBusy(group)) != NULL)
+    {
+        send->tries++;
+        if (member->conn == INVALID_PIPE &&
+            ! connectMember(send->owner, member))
+        {
+            member->failedAt = microsSinceX();
+            continue;
+        }
+
+        encodeForMember(member, send->request);
+        if (writeMember(member, send->request))
+        {
+            send->member = member;
+            member->forwarded++;
+            return true;
+        }
+        dropPoolMember(group, member, errno);
+    }
+
+    errno = ENODEV;
+    return false;
+}
+
+/* place the sends that failed members left behind, answering those
+   that no member will take */
+static void failOver(deviceGroup *group)
+{
+    groupSend *send = (groupSend*)group->forwards.head;
+
+    while(send != NULL)
+    {
+        if (send->member != NULL)
+        {
+            send = (groupSend*)send->header.next;
+            continue;
+        }
+
+        /* replies come in the order the sends were written, so a
+           placed send goes to the end of the list */
+        removeItem((itemHeader*)send);
+        if (send->owner != NULL && placeSend(group, send))
+            insertItem(&group->forwards, NULL, (itemHeader*)send);
+        else
+        {
+            if (send->owner == NULL)
+                freeDataPacket(send->request);
+            else
+                replyForwarded(send->owner, send->request, NULL);
+            free(send);
+        }
+
+        /* placing or answering may have failed any of the others */
+        send = (groupSend*)group->forwards.head;
+    }
+}
+
+static bool forwardToPool(deviceGroup *group, client *owner,
+                          dataPacket *request)
+{
+    groupSend *send;
+
+    send = (groupSend*)calloc(1, sizeof(groupSend));
+    if (send != NULL)
+        send->request = (dataPacket*)malloc(sizeof(dataPacket));
+    if (send == NULL || send->request == NULL)
+    {
+        free(send);
+        errno = ENOMEM;
+        return false;
+    }
+    *send->request = *request;
+    send->owner = owner;
+
+    if (! placeSend(group, send))
+    {
+        int error = errno;
+
+        free(send->request);
+        free(send);
+        failOver(group);
+        errno = error;
+        return false;
+    }
+
+    /* the pool owns the request data from here on */
+    insertItem(&group->forwards, NULL, (itemHeader*)send);
+    failOver(group);
+    return true;
+}
+
+/* does the error a member answered with mean it should be left out? */
+static bool memberFailed(int error)
+{
+    switch(error)
+    {
+    case ENODEV:
+    case EIO:
+    case ETIMEDOUT:
+        return true;
+    }
+    return false;
+}
+
+/* a member of a pool answered the oldest send it has, or with no reply
+   failed with error */
+static void poolMemberReplied(groupMember *member, dataPacket *reply,
+                              int error)
+{
+    deviceGroup *group = member->group;
+    dataPacket *response = NULL;
+    groupSend *send;
+
+    /* the oldest send the member has is the one answered */
+    for(send = (groupSend*)group->forwards.head; send != NULL;
+        send = (groupSend*)send->header.next)
+        if (send->member == member)
+            break;
+
+    if (reply != NULL)
+    {
+        response = (dataPacket*)malloc(sizeof(dataPacket));
+        if (response != NULL)
+            *response = *reply;
+        else
+        {
+            free(reply->data);
+            error = ENOMEM;
+        }
+    }
+
+    /* an unplugged device closes the connection, and a reply to no
+       send leaves the rest out of step */
+    if (response == NULL || send == NULL)
+    {
+        freeDataPacket(response);
+        dropPoolMember(group, member, response == NULL ? error : EIO);
+    }
+    else if (packetIsError(response) && memberFailed(errno))
+    {
+        error = errno;
+        freeDataPacket(response);
+        dropPoolMember(group, member, error);
+    }
+    else
+    {
+        removeItem((itemHeader*)send);
+        member->forwarded--;
+        if (send->owner == NULL)
+        {
+            freeDataPacket(send->request);
+            freeDataPacket(response);
+        }
+        else if (packetIsError(response))
+        {
+            error = errno;
+            freeDataPacket(response);
+            errno = error;
+            replyForwarded(send->owner, send->request, NULL);
+        }
+        else
+            replyForwarded(send->owner, send->request, response);
+        free(send);
+    }
+    failOver(group);
+}
+
+/* write the first send on the group's list to every member at once,
+   false if none of them took it */
+static bool startGroupSend(deviceGroup *group)
+{
+    groupSend *send = (groupSend*)group->forwards.head;
+    int x;
+
+    /* a released client's send is not worth making */
+    group->awaited = 0;
+    if (send->owner == NULL)
+        return false;
+
+    /* do everything but the send itself ahead of time: connect to any
+       members not already connected and encode the code, which the
+       later members with the same carrier find in the cache */
+    for(x = 0; x < group->memberCount; x++)
+    {
+        groupMember *member = &group->members[x];
+
+        member->status = 0;
+        member->replied = 0;
+        if (member->conn == INVALID_PIPE &&
+            ! connectMember(send->owner, member))
+            continue;
+        encodeForMember(member, send->request);
+    }
+
+    /* release the sends back to back so that the members start
+       transmitting together, their replies are timed as they come */
+    group->sentAt = microsSinceX();
+    for(x = 0; x < group->memberCount; x++)
+        if (group->members[x].conn != INVALID_PIPE)
+        {
+            if (writeMember(&group->members[x], send->request))
+            {
+                group->members[x].status = -ETIMEDOUT;
+                group->awaited++;
+            }
+            else
+                unwatchMember(group, &group->members[x], errno);
+        }
+
+    group->sending = group->awaited > 0;
+    return group->sending;
+}
+
+/* the error of the first member whose send failed, 0 if none did */
+static int groupError(const deviceGroup *group)
+{
+    int x;
+
+    for(x = 0; x < group->memberCount; x++)
+        if (group->members[x].status != 0)
+            return -group->members[x].status;
+    return 0;
+}
+
+/* take the first send off the group's list and answer it with each
+   member's result */
+static void finishGroupSend(deviceGroup *group)
+{
+    groupSend *send;
+    dataPacket *response = NULL;
+    int x, failed = 0;
+
+    send = (groupSend*)removeFirstItem(&group->forwards);
+    group->sending = false;
+    for(x = 0; x < group->memberCount; x++)
+        if (group->members[x].status != 0)
+        {
+            message(LOG_INFO, "Group %s member %s failed to send: %s\n",
+                    group->name, group->members[x].name,
+                    translateError(-group->members[x].status));
+            failed++;
+        }
+
+    if (send->owner == NULL)
+    {
+        freeDataPacket(send->request);
+        free(send);
+        return;
+    }
+
+    errno = groupError(group);
+    if (failed < group->memberCount)
+    {
+        response = (dataPacket*)calloc(1, sizeof(dataPacket));
+        if (response != NULL)
+        {
+            response->data = (unsigned char*)groupResults(group);
+            if (response->data == NULL)
+            {
+                free(response);
+                response = NULL;
+            }
+            else
+                response->dataLen = strlen((char*)response->data) + 1;
+        }
+        if (response == NULL)
+            errno = ENOMEM;
+    }
+    replyForwarded(send->owner, send->request, response);
+    free(send);
+}
+
+/* start the sends queued behind the one that finished, answering any
+   that no member took */
+static void nextGroupSends(deviceGroup *group)
+{
+    while(! group->sending && group->forwards.head != NULL &&
+          ! startGroupSend(group))
+        finishGroupSend(group);
+}
+
+/* a member of a group answered, or with no reply failed with error */
+static void groupMemberReplied(groupMember *member, dataPacket *reply,
+                               int error)
+{
+    deviceGroup *group = member->group;
+
+    /* between replies a member can only be going away, and what it
+       last answered stands */
+    if (! group->sending || member->status != -ETIMEDOUT)
+    {
+        int status = member->status;
+
+        unwatchMember(group, member, reply == NULL ? error : EIO);
+        member->status = status;
+        if (reply != NULL)
+            free(reply->data);
+        return;
+    }
+
+    member->replied = microsSinceX() - group->sentAt;
+    if (reply == NULL)
+        unwatchMember(group, member, error);
+    else
+    {
+        member->status = 0;
+        if (packetIsError(reply))
+            member->status = reply->dataLen;
+        free(reply->data);
+    }
+
+    if (--group->awaited == 0)
+    {
+        finishGroupSend(group);
+        nextGroupSends(group);
+    }
+}
+
+static void memberReplied(groupMember *member, dataPacket *reply,
+                          int error)
+{
+    if (member->group->pool)
+        poolMemberReplied(member, reply, error);
+    else
+        groupMemberReplied(member, reply, error);
+}
+
+void serveMember(void *instance, bool readable, bool writable)
+{
+    groupMember *member = (groupMember*)instance;
+    dataPacket reply;
+    int result = 0;
+
+    if (writable && ! flushMember(member))
+        result = -1;
+    /* take each whole reply that has arrived, any of which may see
+       the member dropped */
+    else if (readable)
+        while(member->conn != INVALID_PIPE &&
+              (result = readReply(member, &reply)) == 1)
+            memberReplied(member, &reply, 0);
+
+    if (result < 0 && member->conn != INVALID_PIPE)
+        memberReplied(member, NULL, errno);
+}
+
+bool groupSending(const client *me)
+{
+    deviceGroup *group = clientGroup(me);
+    groupSend *send;
+
+    if (group != NULL)
+        for(send = (groupSend*)group->forwards.head; send != NULL;
+            send = (groupSend*)send->header.next)
+            if (send->owner == me)
+                return true;
+    return false;
+}
+
+void abandonGroupSends(client *target)
+{
+    deviceGroup *group = clientGroup(target);
+    groupSend *send;
+
+    if (group != NULL)
+        for(send = (groupSend*)group->forwards.head; send != NULL;
+            send = (groupSend*)send->header.next)
+            if (send->owner == target)
+                send->owner = NULL;
+}
+
+bool sendToGroup(client *target, dataPacket *request, bool *forwarded)
+{
+    deviceGroup *group;
+    groupSend *send;
+
+    group = clientGroup(target);
+    if (group == NULL)
+    {
+        message(LOG_ERROR, "Sends must be made to a device, group or pool socket.\n");
+        errno = EINVAL;
+        return false;
+    }
+    if (group->pool)
+    {
+        *forwarded = forwardToPool(group, target, request);
+        return *forwarded;
+    }
+
+    send = (groupSend*)calloc(1, sizeof(groupSend));
+    if (send != NULL)
+        send->request = (dataPacket*)malloc(sizeof(dataPacket));
+    if (send == NULL || send->request == NULL)
+    {
+        free(send);
+        errno = ENOMEM;
+        return false;
+    }
+    *send->request = *request;
+    send->owner = target;
+    group->watch = target->watch;
+
+    /* behind another client's send it waits its turn, otherwise it
+       goes out now and fails here if no member takes it */
+    insertItem(&group->forwards, NULL, (itemHeader*)send);
+    if (! group->sending && group->forwards.head == (itemHeader*)send &&
+        ! startGroupSend(group))
+    {
+        removeItem((itemHeader*)send);
+        free(send->request);
+        free(send);
+        errno = groupError(group);
+        return false;
+    }
+
+    /* the group owns the request data from here on */
+    *forwarded = true;
+    return true;
+}
+
+int groupTimeout(listHeader *clients, int timeout)
+{
+    deviceGroup *group = listGroup(clients);
+    uint64_t due, now;
+    int wait = 0;
+
+    if (group == NULL || ! group->sending)
+        return timeout;
+
+    due = group->sentAt + GROUP_TIMEOUT * 1000;
+    now = microsSinceX();
+    if (due > now)
+        wait = (int)((due - now + 999) / 1000);
+    if (timeout < 0 || wait < timeout)
+        timeout = wait;
+    return timeout;
+}
+
+void finishGroupSends(listHeader *clients)
+{
+    deviceGroup *group = listGroup(clients);
+    int x;
+
+    if (group == NULL || ! group->sending ||
+        microsSinceX() < group->sentAt + GROUP_TIMEOUT * 1000)
+        return;
+
+    /* a late reply would be taken for the next send's */
+    for(x = 0; x < group->memberCount; x++)
+        if (group->members[x].status == -ETIMEDOUT)
+            unwatchMember(group, &group->members[x], ETIMEDOUT);
+    finishGroupSend(group);
+    nextGroupSends(group);
+}
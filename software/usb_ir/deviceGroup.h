@@ -0,0 +1,60 @@
+/****************************************************************************
+ ** deviceGroup.h ***********************************************************
+ ****************************************************************************
+ *
+ * Named groups of devices, each listening on a socket of its own.  A
+ * send on a group socket is encoded once and then released to every
+ * member device together, so that their transmits start as close to
+ * the same moment as the devices allow.  A pool is a group of
+ * interchangeable devices, and each send on its socket goes to just
+ * the member that should get to it first.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#pragma once
+
+/* add a group from NAME=MEMBER[,MEMBER...] where members are device
+   indices or aliases, false if spec is malformed */
+bool defineGroup(const char *spec);
+/* add a pool from a spec in the same form */
+bool definePool(const char *spec);
+
+/* listen on the socket of each group, and stop once the ctl socket
+   pipe is closed */
+bool startGroups();
+void stopGroups();
+
+/* send request, an IG_DEV_SEND or IG_DEV_SENDNAMED, to each member
+   of the group whose socket target connected to, and set forwarded.
+   The group takes the request, data and all, and once every member
+   has answered passes replyForwarded a reply holding
+   "MEMBER:STATUS:USEC|..." text giving each member's 0 or -errno and
+   the microseconds from the release of the sends to its reply.  The
+   reply fails only if every member failed.  Sends on a group go out
+   one at a time, and a send that is not waiting behind another fails
+   here if no member takes it.
+
+   On a pool socket the request is instead forwarded to the member
+   whose device has the least pending work, weighted by how long its
+   recent sends took.  Its reply is passed on in the same way, and
+   sends a member had not answered when it failed or was unplugged go
+   to the others. */
+bool sendToGroup(client *target, dataPacket *request, bool *forwarded);
+
+/* shorten timeout (ms, -1 for none) to when the members of the group
+   listening for clients must have answered its send, and fail those
+   that have not once it is due */
+int groupTimeout(listHeader *clients, int timeout);
+void finishGroupSends(listHeader *clients);
+
+/* write to or read from the member handed to watchGroupMember once
+   the poller finds its connection ready, without waiting on it */
+void serveMember(void *member, bool readable, bool writable);
+/* whether a send me made on a group or pool socket is still out */
+bool groupSending(const client *me);
+/* the client is going away, so drop the replies to its sends */
+void abandonGroupSends(client *target);
@@ -47,5 +47,15 @@ typedef struct deviceInfo
 /* prototype of the function called when a new device is found */
 typedef void (*deviceFunc)(deviceInfo *info);
 
+/* prototype of the function called as asynchronous receives
+   complete.  A negative length signals an error (errno is set) and
+   returning false stops the receive engine.  Engines started with
+   startRecv make one last call with a NULL buffer once stopped. */
+typedef bool (*recvFunc)(void *userData, unsigned char *buffer, int length);
+
+/* prototype of the function a driver calls (from any thread) when
+   hotplug events are waiting for handleHotplug */
+typedef void (*hotplugFunc)();
+
 /* hide type that we pass to list functions */
 typedef void deviceList;
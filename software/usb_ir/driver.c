@@ -16,6 +16,7 @@
 #include "compat.h"
 
 #include "stdio.h"
+#include "errno.h"
 #include "string.h"
 #include "limits.h"
 #include "sys/types.h"
@@ -23,6 +24,9 @@
 #include "driver.h"
 #include "driverapi.h"
 #include "logging.h"
+#ifndef WIN32
+  #include "trace.h"
+#endif
 
 /* will hold driver-supplied function pointers */
 static driverImpl *implementation = NULL;
@@ -245,6 +249,24 @@ bool findDriver(const char *driverDir, const char **preferred, bool onlyPreferre
     return false;
 }
 
+#ifndef WIN32
+bool recordDriver(const char *path)
+{
+    driverImpl *recorder;
+
+    if (implementation == NULL ||
+        (recorder = traceRecorder(implementation, path)) == NULL)
+        return false;
+    implementation = recorder;
+    return true;
+}
+
+bool replayDriver(const char *path, double speed)
+{
+    return (implementation = traceReplayer(path, speed)) != NULL;
+}
+#endif
+
 bool initializeDriver()
 {
     return implementation->initializeDriver();
@@ -317,6 +339,19 @@ bool updateDeviceList(deviceList *devList)
     return implementation->updateDeviceList(devList);
 }
 
+bool enableHotplug(deviceList *devList, hotplugFunc notify)
+{
+    if (implementation->enableHotplug == NULL)
+        return false;
+    return implementation->enableHotplug(devList, notify);
+}
+
+void handleHotplug(deviceList *devList)
+{
+    if (implementation->handleHotplug != NULL)
+        implementation->handleHotplug(devList);
+}
+
 unsigned int stopDevices(deviceList *devList)
 {
     return implementation->stopDevices(devList);
@@ -326,3 +361,48 @@ unsigned int releaseDevices(deviceList *devList)
 {
     return implementation->releaseDevices(devList);
 }
+
+bool asyncRecvSupported()
+{
+    return implementation->asyncRecv != NULL;
+}
+
+int asyncRecv(deviceInfo *info, int transfers, int bufSize,
+              recvFunc callback, void *userData)
+{
+    if (implementation->asyncRecv == NULL)
+        return -(errno = ENOSYS);
+    return implementation->asyncRecv(info, transfers, bufSize,
+                                     callback, userData);
+}
+
+void cancelRecv(deviceInfo *info)
+{
+    if (implementation->cancelRecv != NULL)
+        implementation->cancelRecv(info);
+}
+
+bool sharedRecvSupported()
+{
+    return implementation->startRecv != NULL &&
+           implementation->handleRecvEvents != NULL;
+}
+
+bool startRecv(deviceInfo *info, int transfers, int bufSize,
+               recvFunc callback, void *userData)
+{
+    if (implementation->startRecv == NULL)
+    {
+        errno = ENOSYS;
+        return false;
+    }
+    return implementation->startRecv(info, transfers, bufSize,
+                                     callback, userData);
+}
+
+int handleRecvEvents(int timeout)
+{
+    if (implementation->handleRecvEvents == NULL)
+        return -(errno = ENOSYS);
+    return implementation->handleRecvEvents(timeout);
+}
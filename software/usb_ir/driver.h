@@ -23,6 +23,14 @@ DIRECT_API void initializeDriverLayer(struct logSettings *globalSettings);
 /* remaining function calls are illegal until this returns true */
 DIRECT_API bool findDriver(const char *path, const char **preferred, bool onlyPreferred);
 
+#ifndef WIN32
+/* record all traffic through the driver found by findDriver to path */
+DIRECT_API bool recordDriver(const char *path);
+
+/* instead of findDriver, play back a recorded trace or usbmon capture */
+DIRECT_API bool replayDriver(const char *path, double speed);
+#endif
+
 /* initialization and cleanup */
 DIRECT_API bool initializeDriver();
 DIRECT_API void cleanupDriver();
@@ -45,8 +53,20 @@ DIRECT_API void freeDevice(deviceInfo *info);
 DIRECT_API deviceList* prepareDeviceList(usbId *ids, deviceFunc ndf);
 DIRECT_API void claimDevices(deviceList *devList, bool claim, bool force);
 DIRECT_API bool updateDeviceList(deviceList *devList);
+DIRECT_API bool enableHotplug(deviceList *devList, hotplugFunc notify);
+DIRECT_API void handleHotplug(deviceList *devList);
 DIRECT_API unsigned int stopDevices(deviceList *devList);
 DIRECT_API unsigned int releaseDevices(deviceList *devList);
 
 /* dump errors to a stream */
 DIRECT_API void printError(int level, char *msg, deviceInfo *info);
+
+/* optional asynchronous receive engine */
+DIRECT_API bool asyncRecvSupported();
+DIRECT_API int asyncRecv(deviceInfo *info, int transfers, int bufSize,
+                         recvFunc callback, void *userData);
+DIRECT_API void cancelRecv(deviceInfo *info);
+DIRECT_API bool sharedRecvSupported();
+DIRECT_API bool startRecv(deviceInfo *info, int transfers, int bufSize,
+                          recvFunc callback, void *userData);
+DIRECT_API int handleRecvEvents(int timeout);
@@ -62,6 +62,22 @@ typedef struct driverImpl
     /* dump errors to stream */
     void (*printError)(int level, char *msg, deviceInfo *info);
 
+    /* optional asynchronous receive engine, NULL when unsupported */
+    int (*asyncRecv)(deviceInfo *info, int transfers, int bufSize,
+                     recvFunc callback, void *userData);
+    void (*cancelRecv)(deviceInfo *info);
+
+    /* optional: start an engine without blocking and pump the events
+       of every started engine from one thread */
+    bool (*startRecv)(deviceInfo *info, int transfers, int bufSize,
+                      recvFunc callback, void *userData);
+    int (*handleRecvEvents)(int timeout);
+
+    /* optional: queue hotplug events for the list and call notify,
+       the list owner then attaches/detaches in handleHotplug */
+    bool (*enableHotplug)(deviceList *devList, hotplugFunc notify);
+    void (*handleHotplug)(deviceList *devList);
+
 } driverImpl;
 
 struct logSettings;
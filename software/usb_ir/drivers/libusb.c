@@ -57,9 +57,63 @@ typedef struct usbDevice
     /* set when device is logically removed from list */
     bool removed;
 
+    /* the asynchronous receive engine (if running) and its lock */
+    struct recvEngine *recv;
+    LOCK_PTR recvLock;
+
     deviceInfo info;
 } usbDevice;
 
+typedef struct recvEngine
+{
+    /* transfers kept queued on the in endpoint */
+    struct libusb_transfer **transfers;
+    int count;
+
+    /* number still submitted, set to 0 when all have retired */
+    int active, completed;
+    bool stopping;
+
+    /* where completed buffers are delivered */
+    recvFunc callback;
+    void *userData;
+
+    /* detached engines are pumped by handleRecvEvents, free themselves
+       and report their end with a NULL buffer */
+    bool detached;
+} recvEngine;
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+  #define HAVE_HOTPLUG
+#endif
+
+typedef struct hotplugEvent
+{
+    itemHeader header;
+
+    /* referenced until the event is handled */
+    struct libusb_device *dev;
+    bool arrived;
+} hotplugEvent;
+
+typedef struct hotplugState
+{
+#ifdef HAVE_HOTPLUG
+    /* one registration per supported usb id */
+    libusb_hotplug_callback_handle *handles;
+    int count;
+#endif
+
+    /* events queued by libusb for the list owner */
+    LOCK_PTR lock;
+    listHeader events;
+    hotplugFunc notify;
+
+    /* thread that pumps libusb so that hotplug callbacks fire */
+    THREAD_PTR thread;
+    int stop;
+} hotplugState;
+
 typedef struct usbDeviceList
 {
     /* for keeping the list of devices */
@@ -79,6 +133,9 @@ typedef struct usbDeviceList
 
     /* if claiming attempt to unbind other drivers */
     bool force;
+
+    /* set while hotplug events replace full bus scans */
+    hotplugState *hotplug;
 } usbDeviceList;
 
 #define handleFromInfoPtr(ptr) (usbDevice*)((char*)ptr - offsetof(usbDevice, info))
@@ -240,6 +297,267 @@ static int interruptSend(deviceInfo *info,
     return amount;
 }
 
+/* must be called with the recvLock held */
+static void stopEngine(usbDevice *handle)
+{
+    recvEngine *engine = handle->recv;
+
+    if (engine != NULL && ! engine->stopping)
+    {
+        int x;
+
+        engine->stopping = true;
+        for(x = 0; x < engine->count; x++)
+            libusb_cancel_transfer(engine->transfers[x]);
+    }
+}
+
+static void freeEngine(recvEngine *engine)
+{
+    int x;
+
+    for(x = 0; x < engine->count; x++)
+        libusb_free_transfer(engine->transfers[x]);
+    free(engine->transfers);
+    free(engine);
+}
+
+static void LIBUSB_CALL recvComplete(struct libusb_transfer *transfer)
+{
+    usbDevice *handle = (usbDevice*)transfer->user_data;
+    recvEngine *engine = handle->recv;
+    bool resubmit = false, finished = false, stopping;
+    int length = -1;
+
+    switch(transfer->status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+        length = transfer->actual_length;
+        message(LOG_DEBUG2, "i");
+        appendHex(LOG_DEBUG2, transfer->buffer, length);
+        break;
+
+    case LIBUSB_TRANSFER_CANCELLED:
+        break;
+
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        setError(handle, "Failed to read (interrupt end point)",
+                 LIBUSB_ERROR_TIMEOUT);
+        break;
+
+    case LIBUSB_TRANSFER_STALL:
+        setError(handle, "Failed to read (interrupt end point)",
+                 LIBUSB_ERROR_PIPE);
+        break;
+
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        setError(handle, "Failed to read (interrupt end point)",
+                 LIBUSB_ERROR_NO_DEVICE);
+        break;
+
+    default:
+        setError(handle, "Failed to read (interrupt end point)",
+                 LIBUSB_ERROR_IO);
+        break;
+    }
+
+    /* hand the buffer (or error) up unless we are shutting down, but
+       without holding the lock over the callback */
+    EnterCriticalSection(&handle->recvLock);
+    stopping = engine->stopping;
+    LeaveCriticalSection(&handle->recvLock);
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+        ! stopping && ! handle->info.stopped)
+        resubmit = engine->callback(engine->userData,
+                                    transfer->buffer, length);
+
+    EnterCriticalSection(&handle->recvLock);
+    if (resubmit && ! engine->stopping)
+    {
+        int retval;
+
+        /* re-queue the same buffer at the end of the endpoint queue */
+        if ((retval = libusb_submit_transfer(transfer)) < 0)
+        {
+            setError(handle, "Failed to resubmit receive transfer", retval);
+            printError(LOG_ERROR, NULL, &handle->info);
+            resubmit = false;
+        }
+    }
+    else
+        resubmit = false;
+
+    /* retire this transfer and cancel the rest */
+    if (! resubmit)
+    {
+        stopEngine(handle);
+        if (--engine->active == 0)
+        {
+            engine->completed = 1;
+            if (engine->detached)
+            {
+                handle->recv = NULL;
+                finished = true;
+            }
+        }
+    }
+    LeaveCriticalSection(&handle->recvLock);
+
+    /* nothing else will reference a detached engine */
+    if (finished)
+    {
+        engine->callback(engine->userData, NULL, 0);
+        freeEngine(engine);
+    }
+}
+
+static int startEngine(usbDevice *handle, int transfers, int bufSize,
+                       recvFunc callback, void *userData, bool detached,
+                       recvEngine **result)
+{
+    recvEngine *engine;
+    int x, retval = 0;
+
+    *result = NULL;
+    if (handle->info.stopped)
+        return -(errno = ENXIO);
+
+    engine = (recvEngine*)malloc(sizeof(recvEngine));
+    if (engine == NULL)
+        return -(errno = ENOMEM);
+    memset(engine, 0, sizeof(recvEngine));
+    engine->callback = callback;
+    engine->userData = userData;
+    engine->detached = detached;
+
+    /* allocate each transfer with its own buffer */
+    engine->transfers = (struct libusb_transfer**)malloc(sizeof(struct libusb_transfer*) * transfers);
+    if (engine->transfers == NULL)
+    {
+        free(engine);
+        return -(errno = ENOMEM);
+    }
+    for(x = 0; x < transfers; x++)
+    {
+        struct libusb_transfer *transfer;
+        unsigned char *buffer;
+
+        transfer = libusb_alloc_transfer(0);
+        buffer = (unsigned char*)malloc(bufSize);
+        if (transfer == NULL || buffer == NULL)
+        {
+            libusb_free_transfer(transfer);
+            free(buffer);
+            break;
+        }
+
+        /* a 0 timeout means never time out so idle lines never wake us */
+        libusb_fill_interrupt_transfer(transfer, handle->device,
+                                       handle->epIn->bEndpointAddress,
+                                       buffer, bufSize,
+                                       recvComplete, handle, 0);
+        transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        engine->transfers[engine->count++] = transfer;
+    }
+
+    /* queue all the transfers at once */
+    EnterCriticalSection(&handle->recvLock);
+    handle->recv = engine;
+    for(x = 0; x < engine->count; x++)
+    {
+        if ((retval = libusb_submit_transfer(engine->transfers[x])) < 0)
+        {
+            setError(handle, "Failed to submit receive transfer", retval);
+            stopEngine(handle);
+            break;
+        }
+        engine->active++;
+    }
+    if (engine->active == 0)
+    {
+        handle->recv = NULL;
+        LeaveCriticalSection(&handle->recvLock);
+        freeEngine(engine);
+        if (retval < 0)
+            return retval;
+        return -(errno = ENOMEM);
+    }
+    LeaveCriticalSection(&handle->recvLock);
+
+    *result = engine;
+    return retval;
+}
+
+static int asyncRecv(deviceInfo *info, int transfers, int bufSize,
+                     recvFunc callback, void *userData)
+{
+    usbDevice *handle = handleFromInfoPtr(info);
+    recvEngine *engine;
+    int retval;
+
+    retval = startEngine(handle, transfers, bufSize,
+                         callback, userData, false, &engine);
+    if (engine == NULL)
+        return retval;
+
+    /* pump events until every transfer has been retired */
+    while(! engine->completed)
+    {
+        int result;
+
+        result = libusb_handle_events_completed(NULL, &engine->completed);
+        if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED)
+        {
+            setError(handle, "Failed to handle usb events", result);
+            printError(LOG_ERROR, NULL, &handle->info);
+            EnterCriticalSection(&handle->recvLock);
+            stopEngine(handle);
+            LeaveCriticalSection(&handle->recvLock);
+        }
+    }
+
+    EnterCriticalSection(&handle->recvLock);
+    handle->recv = NULL;
+    LeaveCriticalSection(&handle->recvLock);
+    freeEngine(engine);
+
+    if (retval < 0)
+        return retval;
+    return 0;
+}
+
+static bool startRecv(deviceInfo *info, int transfers, int bufSize,
+                      recvFunc callback, void *userData)
+{
+    recvEngine *engine;
+
+    startEngine(handleFromInfoPtr(info), transfers, bufSize,
+                callback, userData, true, &engine);
+    return engine != NULL;
+}
+
+static int handleRecvEvents(int timeout)
+{
+    struct timeval tv;
+    int retval;
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    retval = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+    if (retval == LIBUSB_ERROR_INTERRUPTED)
+        retval = 0;
+    return retval;
+}
+
+static void cancelRecv(deviceInfo *info)
+{
+    usbDevice *handle = handleFromInfoPtr(info);
+
+    EnterCriticalSection(&handle->recvLock);
+    stopEngine(handle);
+    LeaveCriticalSection(&handle->recvLock);
+}
+
 static void releaseDevice(deviceInfo *info)
 {
     usbDevice *handle = handleFromInfoPtr(info);
@@ -271,6 +589,7 @@ static void releaseDevice(deviceInfo *info)
 static void freeDevice(deviceInfo *info)
 {
     usbDevice *handle = handleFromInfoPtr(info);
+    DeleteCriticalSection(&handle->recvLock);
     free(handle);
 }
 
@@ -392,6 +711,7 @@ static bool claimDevice(struct libusb_device *dev, usbId *id, usbDeviceList *lis
 
     newDev = (usbDevice*)malloc(sizeof(usbDevice));
     memset(newDev, 0, sizeof(usbDevice));
+    InitializeCriticalSection(&newDev->recvLock);
 
     /* basic stuff */
     newDev->info.type = *id;
@@ -454,6 +774,7 @@ static bool claimDevice(struct libusb_device *dev, usbId *id, usbDeviceList *lis
 
         if (newDev->device != NULL)
             libusb_close(newDev->device);
+        DeleteCriticalSection(&newDev->recvLock);
         free(newDev);
     }
     return success;
@@ -469,12 +790,85 @@ static void cleanupDriver()
     libusb_exit(NULL);
 }
 
+/* returns the supported id the device matches, if any */
+static usbId* findUsbId(usbDeviceList *list, struct libusb_device *dev)
+{
+    struct libusb_device_descriptor descriptor;
+    unsigned int pos;
+
+    libusb_get_device_descriptor(dev, &descriptor);
+    for(pos = 0; list->ids[pos].idVendor != INVALID_VENDOR; pos++)
+        if (descriptor.idVendor  == list->ids[pos].idVendor &&
+            descriptor.idProduct == list->ids[pos].idProduct)
+            return list->ids + pos;
+    return NULL;
+}
+
+/* Claim (or describe) the device unless it is already in our sorted
+   list.  Returns true when the device was not already known. */
+static bool addDevice(usbDeviceList *list, struct libusb_device *dev,
+                      usbId *id, bool *claimed)
+{
+    usbDevice *devPos, *match;
+    int busIndex;
+
+    /* couldn't find the bus index as a number anywhere */
+    busIndex = libusb_get_bus_number(dev);
+
+    /* found a device instance, now find position in current list */
+    devPos = (usbDevice*)firstItem(&list->deviceList);
+    setError(devPos, NULL, LIBUSB_SUCCESS);
+    while(devPos != NULL &&
+          (devPos->busIndex < busIndex ||
+           (devPos->busIndex == busIndex &&
+            devPos->devIndex < libusb_get_port_number(dev))))
+        /* used to release devices here, since they are no longer
+         * used, however, this races with reinsertion of the device,
+         * and therefore reuse of the ID.  Additionally, unplugs are
+         * detected now, so it is no longer necessary. */
+        devPos = (usbDevice*)devPos->header.next;
+
+    /* a device unplugged and plugged back in quickly returns on the
+       same port while its stopped entry waits to be released, so only
+       a live entry or one for this very device means it is known */
+    *claimed = false;
+    for(match = devPos;
+        match != NULL &&
+        match->busIndex == busIndex &&
+        match->devIndex == libusb_get_port_number(dev);
+        match = (usbDevice*)match->header.next)
+        if (! match->info.stopped ||
+            libusb_get_device(match->device) == dev)
+            return false;
+
+    /* append or insert a new device */
+    if (list->describe)
+        checkInUse(dev, true);
+    else
+        *claimed = claimDevice(dev, id, list, devPos);
+    return true;
+}
+
+static void listDevices(usbDeviceList *list, unsigned int count)
+{
+    unsigned int index = 0;
+    usbDevice *devPos;
+
+    message(LOG_DEBUG, "Handling %d device(s):\n", count);
+    devPos = (usbDevice*)list->deviceList.head;
+
+    for(; devPos; devPos = (usbDevice*)devPos->header.next)
+        message(LOG_DEBUG,
+                "  %d) usb:%d.%d id=%d addr=%p\n", index++,
+                devPos->busIndex, devPos->devIndex,
+                devPos->info.id, (void*)devPos);
+}
+
 static bool updateDeviceList(deviceList *devList)
 {
     usbDeviceList *list = (usbDeviceList*)devList;
-    struct libusb_device *dev, **usbList;
-    unsigned int pos, count = 0, newCount = 0;
-    usbDevice *devPos;
+    struct libusb_device **usbList;
+    unsigned int count = 0, newCount = 0;
     ssize_t listSize, listPos;
 
     /* fedora 19 seems to process udev triggers before the device is ready */
@@ -486,76 +880,239 @@ static bool updateDeviceList(deviceList *devList)
     /* search for the first device we find */
     for(listPos = 0; listPos < listSize; listPos++)
     {
-        struct libusb_device_descriptor descriptor;
+        usbId *id;
+        bool claimed;
 
-        dev = usbList[listPos];
-        libusb_get_device_descriptor(dev, &descriptor);
+        /* continue if we are not examining the correct device */
+        if ((id = findUsbId(list, usbList[listPos])) != NULL &&
+            addDevice(list, usbList[listPos], id, &claimed))
+        {
+            /* count how many devices we added */
+            if (claimed)
+                newCount++;
 
-        for(pos = 0; list->ids[pos].idVendor != INVALID_VENDOR; pos++)
-            /* continue if we are not examining the correct device */
-            if (descriptor.idVendor  == list->ids[pos].idVendor &&
-                descriptor.idProduct == list->ids[pos].idProduct)
-            {
-                int busIndex;
-
-                /* couldn't find the bus index as a number anywhere */
-                busIndex = libusb_get_bus_number(dev);
-
-                /* found a device instance, now find position in
-                 * current list */
-                devPos = (usbDevice*)firstItem(&list->deviceList);
-                setError(devPos, NULL, LIBUSB_SUCCESS);
-                while(devPos != NULL &&
-                      (devPos->busIndex < busIndex ||
-                       (devPos->busIndex == busIndex &&
-                        devPos->devIndex < libusb_get_port_number(dev))))
-                    /* used to release devices here, since they
-                     * are no longer used, however, this races
-                     * with reinsertion of the device, and
-                     * therefore reuse of the ID.  Additionally,
-                     * unplugs are detected now, so it is no
-                     * longer necessary. */
-                    devPos = (usbDevice*)devPos->header.next;
-
-                /* append or insert a new device */
-                if (devPos == NULL ||
-                    devPos->busIndex != busIndex ||
-                    devPos->devIndex != libusb_get_port_number(dev))
-                {
-                    if (list->describe)
-                        checkInUse(dev, true);
-                    else if (claimDevice(dev, list->ids + pos, list, devPos))
-                        /* count how many devices we added */
-                        newCount++;
-
-                    /* keep a count of the number of devices */
-                    count++;
-                }
-            }
+            /* keep a count of the number of devices */
+            count++;
+        }
     }
     libusb_free_device_list(usbList, 0); /* deref devices */
 
     if (wouldOutput(LOG_DEBUG) && newCount > 0)
+        listDevices(list, count);
+
+    return true;
+}
+
+#ifdef HAVE_HOTPLUG
+static int LIBUSB_CALL hotplugCallback(libusb_context UNUSED(*ctx),
+                                       struct libusb_device *dev,
+                                       libusb_hotplug_event event,
+                                       void *userData)
+{
+    usbDeviceList *list = (usbDeviceList*)userData;
+    hotplugEvent *entry;
+
+    /* just queue the event, claiming happens on the list owner's thread */
+    entry = (hotplugEvent*)malloc(sizeof(hotplugEvent));
+    if (entry == NULL)
+        message(LOG_ERROR, "Out of memory queuing hotplug event.\n");
+    else
     {
-        unsigned int index = 0;
+        memset(entry, 0, sizeof(hotplugEvent));
+        entry->dev = libusb_ref_device(dev);
+        entry->arrived = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+
+        EnterCriticalSection(&list->hotplug->lock);
+        insertItem(&list->hotplug->events, NULL, (itemHeader*)entry);
+        LeaveCriticalSection(&list->hotplug->lock);
+        list->hotplug->notify();
+    }
 
-        message(LOG_DEBUG, "Handling %d device(s):\n", count);
-        devPos = (usbDevice*)list->deviceList.head;
+    /* stay registered */
+    return 0;
+}
+
+static void* pumpHotplugEvents(void *userData)
+{
+    hotplugState *hotplug = (hotplugState*)userData;
 
-        for(; devPos; devPos = (usbDevice*)devPos->header.next)
-            message(LOG_DEBUG,
-                    "  %d) usb:%d.%d id=%d addr=%p\n", index++,
-                    devPos->busIndex, devPos->devIndex,
-                    devPos->info.id, (void*)devPos);
+    while(! hotplug->stop)
+    {
+        int retval;
+  #if LIBUSB_API_VERSION >= 0x01000105
+        retval = libusb_handle_events_completed(NULL, &hotplug->stop);
+  #else
+        struct timeval tv = {1, 0};
+        retval = libusb_handle_events_timeout_completed(NULL, &tv,
+                                                        &hotplug->stop);
+  #endif
+        if (retval < 0 && retval != LIBUSB_ERROR_INTERRUPTED)
+        {
+            message(LOG_ERROR, "Failed to handle hotplug events.\n");
+            Sleep(100);
+        }
     }
+    return NULL;
+}
+#endif
 
+static void disableHotplug(usbDeviceList *list)
+{
+    hotplugState *hotplug = list->hotplug;
+    hotplugEvent *entry;
+
+    if (hotplug == NULL)
+        return;
+
+#ifdef HAVE_HOTPLUG
+    while(hotplug->count > 0)
+        libusb_hotplug_deregister_callback(NULL,
+                                           hotplug->handles[--hotplug->count]);
+    free(hotplug->handles);
+
+    if (hotplug->thread != INVALID_THREAD_PTR)
+    {
+        hotplug->stop = 1;
+  #if LIBUSB_API_VERSION >= 0x01000105
+        libusb_interrupt_event_handler(NULL);
+  #endif
+        joinThread(hotplug->thread, NULL);
+    }
+#endif
+
+    /* drop anything that was never handled */
+    while((entry = (hotplugEvent*)removeFirstItem(&hotplug->events)) != NULL)
+    {
+        libusb_unref_device(entry->dev);
+        free(entry);
+    }
+    DeleteCriticalSection(&hotplug->lock);
+    free(hotplug);
+    list->hotplug = NULL;
+}
+
+static bool enableHotplug(deviceList *devList, hotplugFunc notify)
+{
+#ifdef HAVE_HOTPLUG
+    usbDeviceList *list = (usbDeviceList*)devList;
+    hotplugState *hotplug;
+    unsigned int pos;
+
+    if (! libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return false;
+
+    hotplug = (hotplugState*)malloc(sizeof(hotplugState));
+    if (hotplug == NULL)
+        return false;
+    memset(hotplug, 0, sizeof(hotplugState));
+    InitializeCriticalSection(&hotplug->lock);
+    initializeList(&hotplug->events);
+    hotplug->notify = notify;
+    hotplug->thread = INVALID_THREAD_PTR;
+    list->hotplug = hotplug;
+
+    for(pos = 0; list->ids[pos].idVendor != INVALID_VENDOR; pos++)
+        ;
+    hotplug->handles = (libusb_hotplug_callback_handle*)malloc(sizeof(libusb_hotplug_callback_handle) * pos);
+    if (hotplug->handles == NULL)
+    {
+        disableHotplug(list);
+        return false;
+    }
+
+    /* the initial scan finds devices already present so no ENUMERATE */
+    for(pos = 0; list->ids[pos].idVendor != INVALID_VENDOR; pos++)
+    {
+        int retval;
+
+        retval = libusb_hotplug_register_callback(
+            NULL,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+            LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            0, list->ids[pos].idVendor, list->ids[pos].idProduct,
+            LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback, list,
+            hotplug->handles + hotplug->count);
+        if (retval != LIBUSB_SUCCESS)
+        {
+            message(LOG_ERROR, "Failed to register hotplug callback: %s\n",
+                    libusb_error_name(retval));
+            disableHotplug(list);
+            return false;
+        }
+        hotplug->count++;
+    }
+
+    /* callbacks only fire while someone is handling libusb events */
+    if (! startThread(&hotplug->thread, pumpHotplugEvents, hotplug))
+    {
+        hotplug->thread = INVALID_THREAD_PTR;
+        disableHotplug(list);
+        return false;
+    }
     return true;
+#else
+    return false;
+#endif
+}
+
+static bool matchesDevice(itemHeader *item, void *userData)
+{
+    usbDevice *usbDev = (usbDevice*)item;
+    hotplugEvent *entry = (hotplugEvent*)userData;
+
+    /* stop the departed device now rather than waiting on a failed read */
+    if (! usbDev->removed && usbDev->device != NULL &&
+        libusb_get_device(usbDev->device) == entry->dev)
+    {
+        message(LOG_INFO, "Device %d unplugged\n", usbDev->info.id);
+        usbDev->info.stopped = true;
+        cancelRecv(&usbDev->info);
+        return false;
+    }
+    return true;
+}
+
+static void handleHotplug(deviceList *devList)
+{
+    usbDeviceList *list = (usbDeviceList*)devList;
+    listHeader events;
+    hotplugEvent *entry;
+
+    if (list->hotplug == NULL)
+        return;
+
+    /* take everything queued so far */
+    initializeList(&events);
+    EnterCriticalSection(&list->hotplug->lock);
+    while((entry = (hotplugEvent*)removeFirstItem(&list->hotplug->events)) != NULL)
+        insertItem(&events, NULL, (itemHeader*)entry);
+    LeaveCriticalSection(&list->hotplug->lock);
+
+    while((entry = (hotplugEvent*)removeFirstItem(&events)) != NULL)
+    {
+        if (! entry->arrived)
+            forEach(&list->deviceList, matchesDevice, entry);
+        else
+        {
+            usbId *id;
+            bool claimed;
+
+            if ((id = findUsbId(list, entry->dev)) != NULL &&
+                addDevice(list, entry->dev, id, &claimed) &&
+                claimed && wouldOutput(LOG_DEBUG))
+                listDevices(list, list->deviceList.count);
+        }
+
+        libusb_unref_device(entry->dev);
+        free(entry);
+    }
 }
 
 static bool setStopped(itemHeader *item, void UNUSED(*userData))
 {
     usbDevice *head = (usbDevice*)item;
     head->info.stopped = true;
+    cancelRecv(&head->info);
     return true;
 }
 
@@ -575,6 +1132,9 @@ static unsigned int releaseDevices(deviceList *devList)
     unsigned int count = list->deviceList.count;
     usbDevice *head, *prev = NULL;
 
+    /* no more events may reference the list */
+    disableHotplug(list);
+
     /* loop, but if head does not change then sleep a bit */
     while((head = (usbDevice*)firstItem(&list->deviceList)) != NULL)
     {
@@ -680,7 +1240,13 @@ driverImpl impl_libusb = {
     updateDeviceList,
     stopDevices,
     releaseDevices,
-    printError
+    printError,
+    asyncRecv,
+    cancelRecv,
+    startRecv,
+    handleRecvEvents,
+    enableHotplug,
+    handleHotplug
 };
 
 driverImpl* getImplementation(struct logSettings *globalSettings)
@@ -0,0 +1,1090 @@
+/****************************************************************************
+ ** simulator.c *************************************************************
+ ****************************************************************************
+ *
+ * A driver that emulates IguanaWorks devices in software so that the
+ * daemon can be load tested and profiled without hardware.  The
+ * simulated firmware speaks the same control protocol as the real
+ * thing and is configured through the IGUANAIR_SIM environment
+ * variable, a comma separated list of key=value pairs:
+ *
+ *   devices=N       number of virtual devices (1)
+ *   latency=USEC    delay added to every packet in either direction (1000)
+ *   jitter=USEC     random extra delay of up to USEC per packet (0)
+ *   bufsize=BYTES   size of the transmit buffer reported, up to 255 (150)
+ *   packetsize=N    size of the usb packets (8)
+ *   interval=MSEC   synthetic NEC frame every MSEC while receiving (0)
+ *   version=VER     firmware version reported (0x0309)
+ *   label=PREFIX    devices report ids PREFIX0, PREFIX1, ... (sim)
+ *   txdelay=0|1     delay send acks by the length of the signal (1)
+ *   unplug=MSEC     unplug device 0 MSEC after it appears (0, never)
+ *
+ * The driver refuses to load when IGUANAIR_SIM is not set so that it
+ * is never picked up by accident while searching for a driver.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#include "../iguanaIR.h"
+#include "../compat.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../logging.h"
+#include "../driverapi.h"
+#include "../list.h"
+
+/* wire protocol constants, matching device-interface.c */
+enum
+{
+    CTL_START   = 0x00,
+    CTL_TODEV   = 0xCD,
+    CTL_FROMDEV = 0xDC,
+    CTL_LENGTH  = 4,
+
+    MAX_SIM_PACKET = 64,
+    ID_LENGTH      = 12,
+    ID_PAGE        = 0x7F,
+    BLOCK_LENGTH   = 64,
+
+    /* one device unit of IR time is 64/3 microseconds */
+    STATE_MASK  = 0x80,
+    LENGTH_MASK = 0x7F
+};
+
+typedef struct simPacket
+{
+    itemHeader header;
+
+    /* when the packet becomes visible to the host */
+    uint64_t due;
+    int length;
+    unsigned char data[MAX_SIM_PACKET];
+} simPacket;
+
+typedef struct simEngine
+{
+    recvFunc callback;
+    void *userData;
+
+    bool stopping;
+
+    /* detached engines are pumped by handleRecvEvents */
+    bool detached;
+} simEngine;
+
+typedef struct simDevice
+{
+    /* fields for the linked list of devices */
+    /* MUST be listed first for casting */
+    itemHeader header;
+
+    unsigned int index;
+    bool removed;
+    /* when the device will be unplugged, 0 for never */
+    uint64_t unplugAt;
+
+    /* emulated firmware state */
+    unsigned char pins[2], pinConfig[8];
+    char label[ID_LENGTH + 1];
+    bool receiving;
+    uint64_t nextFrame;
+    unsigned int frames;
+
+    /* a command still waiting on its data packets */
+    unsigned char command, args[CTL_LENGTH];
+    unsigned char *inData;
+    int inLength, inExpected;
+
+    /* the last transmission for RESEND */
+    unsigned char *lastSend;
+    int lastSendLength;
+
+    /* packets on their way to the host */
+    listHeader toHost;
+    simEngine *engine;
+
+    deviceInfo info;
+} simDevice;
+
+typedef struct simDeviceList
+{
+    listHeader deviceList;
+
+    /* ids that are in this list */
+    usbId *ids;
+
+    /* callback when creating a device */
+    deviceFunc newDev;
+
+    /* just describe the devices or claim them? */
+    bool describe;
+
+    /* all devices are "plugged in" on the first scan */
+    bool created;
+} simDeviceList;
+
+static struct
+{
+    int devices, latency, jitter, bufSize, packetSize, interval, unplug;
+    uint16_t version;
+    const char *label;
+    bool txDelay;
+} config = { 1, 1000, 0, 150, 8, 0, 0, 0x0309, "sim", true };
+
+/* one lock protects all simulated devices, the condition is
+   broadcast whenever a packet is queued or an engine stops */
+static LOCK_PTR simLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t simCond = PTHREAD_COND_INITIALIZER;
+static unsigned int simSeed = 1;
+
+/* devices with detached engines are found through this list */
+static simDeviceList *simList = NULL;
+
+/* delivered packets are kept for reuse so that the simulator does
+   not show up when measuring the daemon's allocations */
+static listHeader sparePackets;
+
+#define deviceFromInfoPtr(ptr) (simDevice*)((char*)ptr - offsetof(simDevice, info))
+
+/* must be called with the simLock held */
+static unsigned int packetDelay()
+{
+    unsigned int delay = config.latency;
+
+    if (config.jitter > 0)
+        delay += rand_r(&simSeed) % (config.jitter + 1);
+    return delay;
+}
+
+static void queueToHost(simDevice *dev, const unsigned char *data,
+                        int length, uint64_t due)
+{
+    simPacket *packet, *tail;
+
+    packet = (simPacket*)removeFirstItem(&sparePackets);
+    if (packet == NULL)
+        packet = (simPacket*)malloc(sizeof(simPacket));
+    if (packet == NULL)
+    {
+        message(LOG_ERROR, "Out of memory queuing simulated packet.\n");
+        return;
+    }
+    memset(packet, 0, sizeof(simPacket));
+
+    /* packets must arrive in the order they were queued */
+    tail = (simPacket*)dev->toHost.tail;
+    if (tail != NULL && tail->due > due)
+        due = tail->due;
+    packet->due = due;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+
+    insertItem(&dev->toHost, NULL, (itemHeader*)packet);
+    pthread_cond_broadcast(&simCond);
+}
+
+/* send a control packet, splitting the payload across usb packets */
+static void sendCtl(simDevice *dev, unsigned char code,
+                    const unsigned char *payload, int length, uint64_t due)
+{
+    unsigned char buffer[MAX_SIM_PACKET] = {CTL_START, CTL_START,
+                                            CTL_FROMDEV};
+    int amount;
+
+    buffer[3] = code;
+    amount = config.packetSize - CTL_LENGTH;
+    if (amount > length)
+        amount = length;
+    memcpy(buffer + CTL_LENGTH, payload, amount);
+    queueToHost(dev, buffer, CTL_LENGTH + amount, due);
+
+    for(; amount < length; amount += config.packetSize)
+    {
+        int size = length - amount;
+        if (size > config.packetSize)
+            size = config.packetSize;
+        queueToHost(dev, payload + amount, size, due);
+    }
+}
+
+/* append the device encoding of one pulse or space */
+static int encodeSignal(unsigned char *codes, int pos, int max,
+                        unsigned int micros, bool space)
+{
+    unsigned int units = micros * 3 / 64;
+
+    while(units > 1 && pos < max)
+    {
+        unsigned int count = units;
+
+        /* a length of 0 means 1024 units so stick to 2..128 */
+        if (count > LENGTH_MASK + 1)
+            count = LENGTH_MASK + 1;
+        codes[pos++] = (space ? STATE_MASK : 0) | (count - 1);
+        units -= count;
+    }
+    return pos;
+}
+
+/* microseconds of IR time encoded in the device format */
+static uint64_t signalLength(const unsigned char *codes, int length)
+{
+    uint64_t units = 0;
+    int x;
+
+    for(x = 0; x < length; x++)
+        if ((codes[x] & LENGTH_MASK) == 0)
+            units += 1024;
+        else
+            units += (codes[x] & LENGTH_MASK) + 1;
+    return units * 64 / 3;
+}
+
+/* queue a synthetic NEC frame (address 0, command = frame count) */
+static void queueFrame(simDevice *dev, uint64_t due)
+{
+    unsigned char codes[256], packet[MAX_SIM_PACKET];
+    uint32_t bits;
+    int len = 0, x;
+
+    bits = (dev->frames & 0xFF) << 16 | (~dev->frames & 0xFF) << 24 | 0xFF00;
+    dev->frames++;
+
+    len = encodeSignal(codes, len, sizeof(codes), 9000, false);
+    len = encodeSignal(codes, len, sizeof(codes), 4500, true);
+    for(x = 0; x < 32; x++)
+    {
+        len = encodeSignal(codes, len, sizeof(codes), 560, false);
+        len = encodeSignal(codes, len, sizeof(codes),
+                           (bits >> x) & 1 ? 1690 : 560, true);
+    }
+    len = encodeSignal(codes, len, sizeof(codes), 560, false);
+
+    /* each packet carries data followed by the buffer fill level */
+    for(x = 0; x < len; x += config.packetSize - 1)
+    {
+        int size = len - x;
+        if (size > config.packetSize - 1)
+            size = config.packetSize - 1;
+        memcpy(packet, codes + x, size);
+        packet[size] = (unsigned char)(len - x - size);
+        queueToHost(dev, packet, size + 1, due);
+    }
+}
+
+/* generate any receive traffic that is due */
+static void advance(simDevice *dev, uint64_t now)
+{
+    /* departs the way a hotplug removal stops a real device */
+    if (dev->unplugAt != 0 && dev->unplugAt <= now)
+    {
+        message(LOG_INFO, "Simulated device %d unplugged\n", dev->index);
+        dev->unplugAt = 0;
+        dev->info.stopped = true;
+        if (dev->engine != NULL)
+            dev->engine->stopping = true;
+    }
+
+    while(dev->receiving && config.interval > 0 && dev->nextFrame <= now)
+    {
+        queueFrame(dev, dev->nextFrame + packetDelay());
+        dev->nextFrame += config.interval * 1000;
+    }
+}
+
+/* earliest time something will happen on the device */
+static uint64_t nextEvent(simDevice *dev, uint64_t until)
+{
+    simPacket *head = (simPacket*)dev->toHost.head;
+
+    if (head != NULL && head->due < until)
+        until = head->due;
+    if (dev->receiving && config.interval > 0 && dev->nextFrame < until)
+        until = dev->nextFrame;
+    if (dev->unplugAt != 0 && dev->unplugAt < until)
+        until = dev->unplugAt;
+    return until;
+}
+
+static simPacket* dueToHost(simDevice *dev, uint64_t now)
+{
+    simPacket *head;
+
+    advance(dev, now);
+    head = (simPacket*)dev->toHost.head;
+    if (head != NULL && head->due <= now)
+        return (simPacket*)removeItem((itemHeader*)head);
+    return NULL;
+}
+
+static void extractLabel(simDevice *dev, const unsigned char *block)
+{
+    int x, count = 0;
+
+    /* the id block stores 16 bytes (header and id) with 0x55 moves */
+    memset(dev->label, 0, sizeof(dev->label));
+    for(x = 0; x + 2 < BLOCK_LENGTH && count < 16; x++)
+        if (block[x] == 0x55)
+        {
+            if (count >= CTL_LENGTH)
+                dev->label[count - CTL_LENGTH] = block[x + 2];
+            count++;
+            x += 2;
+        }
+}
+
+/* the buffer the last send was in has been put to another use */
+static void forgetSend(simDevice *dev)
+{
+    free(dev->lastSend);
+    dev->lastSend = NULL;
+    dev->lastSendLength = 0;
+}
+
+/* handle a command once all of its data has arrived */
+static void finishCommand(simDevice *dev, uint64_t due)
+{
+    unsigned char reply[2];
+
+    switch(dev->command)
+    {
+    case IG_DEV_SEND:
+        if (dev->inLength > config.bufSize)
+        {
+            sendCtl(dev, IG_DEV_OVERSEND, NULL, 0, due);
+            break;
+        }
+        free(dev->lastSend);
+        dev->lastSend = dev->inData;
+        dev->lastSendLength = dev->inLength;
+        dev->inData = NULL;
+        /* fall through */
+
+    case IG_DEV_RESEND:
+        if (dev->lastSend == NULL)
+            message(LOG_WARN, "Simulated device %d: resend of an overwritten buffer\n",
+                    dev->info.id);
+        else if (config.txDelay)
+            due += signalLength(dev->lastSend, dev->lastSendLength);
+        sendCtl(dev, dev->command, NULL, 0, due);
+
+        /* the receiver shares the buffer like the firmware's does */
+        if (dev->receiving)
+            forgetSend(dev);
+        break;
+
+    case IG_DEV_SETPINCONFIG:
+        memcpy(dev->pinConfig, dev->inData, sizeof(dev->pinConfig));
+        sendCtl(dev, dev->command, NULL, 0, due);
+        break;
+
+    case IG_DEV_WRITEBLOCK:
+        if (dev->args[0] == ID_PAGE)
+            extractLabel(dev, dev->inData);
+        if (config.version >= 0x200)
+            sendCtl(dev, dev->command, dev->args + 2, 2, due);
+        else
+            sendCtl(dev, dev->command, NULL, 0, due);
+        break;
+
+    default:
+        reply[0] = 0;
+        sendCtl(dev, dev->command, reply, 0, due);
+        break;
+    }
+
+    free(dev->inData);
+    dev->inData = NULL;
+    dev->inLength = dev->inExpected = 0;
+}
+
+/* expect length bytes of data before finishing the command */
+static void expectData(simDevice *dev, int length, uint64_t due)
+{
+    if (length <= 0)
+        finishCommand(dev, due);
+    else
+    {
+        dev->inData = (unsigned char*)malloc(length);
+        dev->inLength = 0;
+        dev->inExpected = length;
+    }
+}
+
+static void handleCommand(simDevice *dev, const unsigned char *args,
+                          int argLength, uint64_t due)
+{
+    unsigned char reply[8];
+
+    memset(dev->args, 0, sizeof(dev->args));
+    memcpy(dev->args, args, argLength > CTL_LENGTH ? CTL_LENGTH : argLength);
+
+    switch(dev->command)
+    {
+    case IG_DEV_GETVERSION:
+        reply[0] = config.version & 0xFF;
+        reply[1] = config.version >> 8;
+        sendCtl(dev, dev->command, reply, 2, due);
+        break;
+
+    case IG_DEV_GETFEATURES:
+        reply[0] = 0;
+        reply[1] = 65;
+        sendCtl(dev, dev->command, reply,
+                config.version >= 0x204 ? 2 : 1, due);
+        break;
+
+    case IG_DEV_GETBUFSIZE:
+        reply[0] = (unsigned char)config.bufSize;
+        sendCtl(dev, dev->command, reply, 1, due);
+        break;
+
+    case IG_DEV_RECVON:
+    case IG_DEV_RAWRECVON:
+        forgetSend(dev);
+        if (! dev->receiving)
+            dev->nextFrame = due + config.interval * 1000;
+        dev->receiving = true;
+        sendCtl(dev, dev->command, NULL, 0, due);
+        break;
+
+    case IG_DEV_RECVOFF:
+        dev->receiving = false;
+        sendCtl(dev, dev->command, NULL, 0, due);
+        break;
+
+    case IG_DEV_PINBURST:
+        forgetSend(dev);
+        /* fall through */
+    case IG_DEV_SEND:
+        expectData(dev, dev->args[0], due);
+        break;
+
+    /* the channels and carrier follow in a data packet */
+    case IG_DEV_RESEND:
+        expectData(dev, 8, due);
+        break;
+
+    case IG_DEV_SETPINCONFIG:
+        forgetSend(dev);
+        expectData(dev, sizeof(dev->pinConfig), due);
+        break;
+
+    /* the first 4 bytes of the block ride in the control packet */
+    case IG_DEV_WRITEBLOCK:
+        forgetSend(dev);
+        expectData(dev, BLOCK_LENGTH, due);
+        break;
+
+    case IG_DEV_GETPINS:
+        sendCtl(dev, dev->command, dev->pins, 2, due);
+        break;
+
+    case IG_DEV_SETPINS:
+        memcpy(dev->pins, dev->args, 2);
+        sendCtl(dev, dev->command, NULL, 0, due);
+        break;
+
+    case IG_DEV_GETPINCONFIG:
+        sendCtl(dev, dev->command,
+                dev->pinConfig, sizeof(dev->pinConfig), due);
+        break;
+
+    case IG_DEV_CHECKSUM:
+        memset(reply, 0, 2);
+        sendCtl(dev, dev->command, reply, 2, due);
+        break;
+
+    case IG_DEV_REPEATER:
+        sendCtl(dev, dev->command, NULL, 0, due);
+        break;
+
+    /* executing the id page "transmits" the stored label */
+    case IG_DEV_EXECUTE:
+        if (dev->label[0] != '\0')
+            sendCtl(dev, IG_DEV_GETID,
+                    (unsigned char*)dev->label, ID_LENGTH, due);
+        break;
+
+    case IG_DEV_RESET:
+        dev->receiving = false;
+        break;
+
+    default:
+        message(LOG_DEBUG, "Simulated device %d: unknown command 0x%x\n",
+                dev->index, dev->command);
+        sendCtl(dev, IG_DEV_INVALID_ARG, NULL, 0, due);
+        break;
+    }
+}
+
+static int interruptRecv(deviceInfo *info,
+                         void *buffer, int bufSize, int timeout)
+{
+    simDevice *dev = deviceFromInfoPtr(info);
+    uint64_t deadline = microsSinceX() + (uint64_t)timeout * 1000;
+    int retval;
+
+    EnterCriticalSection(&simLock);
+    while(true)
+    {
+        simPacket *packet;
+        uint64_t now = microsSinceX();
+
+        if (dev->info.stopped)
+        {
+            retval = -(errno = ENXIO);
+            break;
+        }
+        else if ((packet = dueToHost(dev, now)) != NULL)
+        {
+            retval = packet->length;
+            if (retval > bufSize)
+                retval = bufSize;
+            memcpy(buffer, packet->data, retval);
+            insertItem(&sparePackets, NULL, (itemHeader*)packet);
+
+            message(LOG_DEBUG2, "i");
+            appendHex(LOG_DEBUG2, buffer, retval);
+            break;
+        }
+        else if (now >= deadline)
+        {
+            retval = -(errno = ETIMEDOUT);
+            break;
+        }
+        waitConditionUntil(&simCond, &simLock, nextEvent(dev, deadline));
+    }
+    LeaveCriticalSection(&simLock);
+
+    return retval;
+}
+
+static int interruptSend(deviceInfo *info,
+                         void *buffer, int bufSize, int UNUSED(timeout))
+{
+    simDevice *dev = deviceFromInfoPtr(info);
+    unsigned char *data = (unsigned char*)buffer;
+    unsigned int delay;
+
+    message(LOG_DEBUG2, "o");
+    appendHex(LOG_DEBUG2, buffer, bufSize);
+
+    /* the transfer itself takes a while */
+    EnterCriticalSection(&simLock);
+    delay = packetDelay();
+    LeaveCriticalSection(&simLock);
+    usleep(delay);
+
+    EnterCriticalSection(&simLock);
+    if (dev->info.stopped)
+    {
+        LeaveCriticalSection(&simLock);
+        return -(errno = ENXIO);
+    }
+
+    /* data packets for the command in progress */
+    if (dev->inExpected > 0)
+    {
+        int amount = bufSize;
+
+        if (amount > dev->inExpected - dev->inLength)
+            amount = dev->inExpected - dev->inLength;
+        memcpy(dev->inData + dev->inLength, data, amount);
+        dev->inLength += amount;
+        if (dev->inLength == dev->inExpected)
+            finishCommand(dev, microsSinceX() + packetDelay());
+    }
+    else if (bufSize >= CTL_LENGTH &&
+             data[0] == CTL_START && data[1] == CTL_START &&
+             data[2] == CTL_TODEV)
+    {
+        dev->command = data[3];
+        handleCommand(dev, data + CTL_LENGTH, bufSize - CTL_LENGTH,
+                      microsSinceX() + packetDelay());
+    }
+    else
+        message(LOG_WARN,
+                "Simulated device %d ignoring unexpected packet\n",
+                dev->index);
+    LeaveCriticalSection(&simLock);
+
+    return bufSize;
+}
+
+static int clearHalt(deviceInfo *UNUSED(info), unsigned int UNUSED(ep))
+{
+    return 0;
+}
+
+static int resetDevice(deviceInfo *info)
+{
+    simDevice *dev = deviceFromInfoPtr(info);
+
+    EnterCriticalSection(&simLock);
+    dev->receiving = false;
+    dev->inLength = dev->inExpected = 0;
+    free(dev->inData);
+    dev->inData = NULL;
+    LeaveCriticalSection(&simLock);
+    return 0;
+}
+
+static void getDeviceLocation(deviceInfo *info, uint8_t loc[2])
+{
+    simDevice *dev = deviceFromInfoPtr(info);
+    loc[0] = 1;
+    loc[1] = dev->index + 1;
+}
+
+static void printError(int level, char *msg, deviceInfo *UNUSED(info))
+{
+    if (msg != NULL)
+        message(level, "%s: %s\n", msg, strerror(errno));
+    else
+        message(level, "%s\n", strerror(errno));
+}
+
+/* deliver due packets to an engine, called with the simLock held */
+static bool pumpEngine(simDevice *dev, uint64_t now)
+{
+    simEngine *engine = dev->engine;
+    simPacket *packet;
+    bool delivered = false;
+
+    while(! engine->stopping && (packet = dueToHost(dev, now)) != NULL)
+    {
+        bool keepGoing;
+
+        LeaveCriticalSection(&simLock);
+        keepGoing = engine->callback(engine->userData,
+                                     packet->data, packet->length);
+        EnterCriticalSection(&simLock);
+        insertItem(&sparePackets, NULL, (itemHeader*)packet);
+
+        if (! keepGoing)
+            engine->stopping = true;
+        delivered = true;
+    }
+    return delivered;
+}
+
+static simEngine* createEngine(simDevice *dev, recvFunc callback,
+                               void *userData, bool detached)
+{
+    simEngine *engine;
+
+    if (dev->info.stopped)
+    {
+        errno = ENXIO;
+        return NULL;
+    }
+    if (dev->engine != NULL)
+    {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    engine = (simEngine*)malloc(sizeof(simEngine));
+    if (engine == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(engine, 0, sizeof(simEngine));
+    engine->callback = callback;
+    engine->userData = userData;
+    engine->detached = detached;
+    dev->engine = engine;
+    return engine;
+}
+
+static int asyncRecv(deviceInfo *info, int UNUSED(transfers),
+                     int UNUSED(bufSize), recvFunc callback, void *userData)
+{
+    simDevice *dev = deviceFromInfoPtr(info);
+    simEngine *engine;
+
+    EnterCriticalSection(&simLock);
+    if ((engine = createEngine(dev, callback, userData, false)) == NULL)
+    {
+        LeaveCriticalSection(&simLock);
+        return -errno;
+    }
+
+    /* this thread is the only one delivering to the engine */
+    while(! engine->stopping)
+        if (! pumpEngine(dev, microsSinceX()))
+            waitConditionUntil(&simCond, &simLock,
+                               nextEvent(dev, microsSinceX() + 1000000));
+
+    dev->engine = NULL;
+    LeaveCriticalSection(&simLock);
+    free(engine);
+    return 0;
+}
+
+static void cancelRecv(deviceInfo *info)
+{
+    simDevice *dev = deviceFromInfoPtr(info);
+
+    EnterCriticalSection(&simLock);
+    if (dev->engine != NULL)
+        dev->engine->stopping = true;
+    pthread_cond_broadcast(&simCond);
+    LeaveCriticalSection(&simLock);
+}
+
+static bool startRecv(deviceInfo *info, int UNUSED(transfers),
+                      int UNUSED(bufSize), recvFunc callback, void *userData)
+{
+    simDevice *dev = deviceFromInfoPtr(info);
+    bool retval;
+
+    EnterCriticalSection(&simLock);
+    retval = createEngine(dev, callback, userData, true) != NULL;
+    pthread_cond_broadcast(&simCond);
+    LeaveCriticalSection(&simLock);
+    return retval;
+}
+
+static int handleRecvEvents(int timeout)
+{
+    uint64_t deadline = microsSinceX() + (uint64_t)timeout * 1000;
+    int handled = 0;
+
+    EnterCriticalSection(&simLock);
+    while(simList != NULL)
+    {
+        uint64_t now = microsSinceX(), next = deadline;
+        simDevice *dev;
+
+        /* callbacks drop the lock so restart the walk after each one */
+        for(dev = (simDevice*)simList->deviceList.head; dev != NULL;)
+        {
+            simEngine *engine = dev->engine;
+
+            if (engine == NULL || ! engine->detached)
+                dev = (simDevice*)dev->header.next;
+            else if (engine->stopping)
+            {
+                /* report the end and retire the engine */
+                dev->engine = NULL;
+                LeaveCriticalSection(&simLock);
+                engine->callback(engine->userData, NULL, 0);
+                free(engine);
+                EnterCriticalSection(&simLock);
+                handled++;
+                dev = (simDevice*)simList->deviceList.head;
+            }
+            else if (pumpEngine(dev, now))
+            {
+                handled++;
+                dev = (simDevice*)simList->deviceList.head;
+            }
+            else
+            {
+                next = nextEvent(dev, next);
+                dev = (simDevice*)dev->header.next;
+            }
+        }
+
+        if (handled > 0 || now >= deadline)
+            break;
+        waitConditionUntil(&simCond, &simLock, next);
+    }
+    LeaveCriticalSection(&simLock);
+
+    return 0;
+}
+
+static void freePackets(simDevice *dev)
+{
+    simPacket *packet;
+
+    while((packet = (simPacket*)removeFirstItem(&dev->toHost)) != NULL)
+        insertItem(&sparePackets, NULL, (itemHeader*)packet);
+}
+
+static void releaseDevice(deviceInfo *info)
+{
+    simDevice *dev = deviceFromInfoPtr(info);
+
+    EnterCriticalSection(&simLock);
+    if (info != NULL && ! dev->removed)
+    {
+        dev->removed = true;
+        freePackets(dev);
+        removeItem((itemHeader*)dev);
+    }
+    LeaveCriticalSection(&simLock);
+}
+
+static void freeDevice(deviceInfo *info)
+{
+    simDevice *dev = deviceFromInfoPtr(info);
+
+    free(dev->inData);
+    free(dev->lastSend);
+    free(dev);
+}
+
+static deviceList* prepareDeviceList(usbId *ids, deviceFunc ndf)
+{
+    simDeviceList *list;
+
+    list = (simDeviceList*)malloc(sizeof(simDeviceList));
+    if (list != NULL)
+    {
+        memset(list, 0, sizeof(simDeviceList));
+        list->ids = ids;
+        list->newDev = ndf;
+        simList = list;
+    }
+    return list;
+}
+
+static void claimDevices(deviceList *devList, bool claim, bool UNUSED(force))
+{
+    ((simDeviceList*)devList)->describe = ! claim;
+}
+
+static bool updateDeviceList(deviceList *devList)
+{
+    simDeviceList *list = (simDeviceList*)devList;
+    listHeader added;
+    simDevice *dev;
+    int x;
+
+    /* every simulated device is present from the first scan on */
+    if (list->created)
+        return true;
+    list->created = true;
+
+    initializeList(&added);
+    for(x = 0; x < config.devices; x++)
+    {
+        if (list->describe)
+        {
+            message(LOG_NORMAL, "  Simulated IR device %d\n", x);
+            continue;
+        }
+
+        dev = (simDevice*)malloc(sizeof(simDevice));
+        if (dev == NULL)
+        {
+            message(LOG_ERROR, "Out of memory creating simulated device.\n");
+            break;
+        }
+        memset(dev, 0, sizeof(simDevice));
+        dev->index = x;
+        dev->info.id = x;
+        dev->info.type = list->ids[0];
+        if (x == 0 && config.unplug > 0)
+            dev->unplugAt = microsSinceX() + (uint64_t)config.unplug * 1000;
+        snprintf(dev->label, sizeof(dev->label), "%s%d", config.label, x);
+        initializeList(&dev->toHost);
+        insertItem(&added, NULL, (itemHeader*)dev);
+    }
+
+    /* hand the devices over without holding the lock */
+    while((dev = (simDevice*)removeFirstItem(&added)) != NULL)
+    {
+        EnterCriticalSection(&simLock);
+        insertItem(&list->deviceList, NULL, (itemHeader*)dev);
+        LeaveCriticalSection(&simLock);
+
+        if (list->newDev != NULL)
+            list->newDev(&dev->info);
+    }
+
+    return true;
+}
+
+static unsigned int stopDevices(deviceList *devList)
+{
+    simDeviceList *list = (simDeviceList*)devList;
+    unsigned int count;
+    simDevice *dev;
+
+    EnterCriticalSection(&simLock);
+    count = list->deviceList.count;
+    for(dev = (simDevice*)list->deviceList.head;
+        dev != NULL; dev = (simDevice*)dev->header.next)
+    {
+        dev->info.stopped = true;
+        if (dev->engine != NULL)
+            dev->engine->stopping = true;
+    }
+    pthread_cond_broadcast(&simCond);
+    LeaveCriticalSection(&simLock);
+
+    return count;
+}
+
+static unsigned int releaseDevices(deviceList *devList)
+{
+    simDeviceList *list = (simDeviceList*)devList;
+    unsigned int count = list->deviceList.count;
+    simDevice *head, *prev = NULL;
+
+    /* loop, but if head does not change then sleep a bit */
+    while((head = (simDevice*)firstItem(&list->deviceList)) != NULL)
+    {
+        if (head != prev)
+            releaseDevice(&head->info);
+        else
+            Sleep(100);
+        prev = head;
+    }
+
+    /* illegal to access the list after this call */
+    EnterCriticalSection(&simLock);
+    simList = NULL;
+    LeaveCriticalSection(&simLock);
+    free(list);
+    return count;
+}
+
+static bool findDeviceEndpoints(deviceInfo *UNUSED(info), int *maxPacketSize)
+{
+    *maxPacketSize = config.packetSize;
+    return true;
+}
+
+static bool initializeDriver()
+{
+    message(LOG_INFO,
+            "Simulating %d device(s), latency %dus, jitter %dus\n",
+            config.devices, config.latency, config.jitter);
+    return true;
+}
+
+static void cleanupDriver()
+{
+    simPacket *packet;
+
+    EnterCriticalSection(&simLock);
+    while((packet = (simPacket*)removeFirstItem(&sparePackets)) != NULL)
+        free(packet);
+    LeaveCriticalSection(&simLock);
+}
+
+static bool parseConfig(const char *text)
+{
+    char *copy, *item, *save = NULL;
+    bool retval = true;
+
+    copy = strdup(text);
+    for(item = strtok_r(copy, ",", &save);
+        item != NULL && retval;
+        item = strtok_r(NULL, ",", &save))
+    {
+        char *value, *end;
+        long int res;
+
+        value = strchr(item, '=');
+        if (value == NULL)
+        {
+            message(LOG_ERROR, "IGUANAIR_SIM: expected key=value: %s\n", item);
+            retval = false;
+            break;
+        }
+        *value++ = '\0';
+
+        if (strcmp(item, "label") == 0)
+        {
+            config.label = strdup(value);
+            continue;
+        }
+
+        res = strtol(value, &end, 0);
+        if (value[0] == '\0' || end[0] != '\0' || res < 0)
+        {
+            message(LOG_ERROR, "IGUANAIR_SIM: bad value for %s\n", item);
+            retval = false;
+        }
+        else if (strcmp(item, "devices") == 0 && res <= 255)
+            config.devices = res;
+        else if (strcmp(item, "latency") == 0 && res <= 1000000)
+            config.latency = res;
+        else if (strcmp(item, "jitter") == 0 && res <= 1000000)
+            config.jitter = res;
+        else if (strcmp(item, "bufsize") == 0 && res <= 0xFF)
+            config.bufSize = res;
+        else if (strcmp(item, "packetsize") == 0 &&
+                 res >= 8 && res <= MAX_SIM_PACKET)
+            config.packetSize = res;
+        else if (strcmp(item, "interval") == 0 && res <= 3600000)
+            config.interval = res;
+        else if (strcmp(item, "version") == 0 &&
+                 res >= 0x0101 && res < 0x0400)
+            config.version = res;
+        else if (strcmp(item, "txdelay") == 0)
+            config.txDelay = res != 0;
+        else if (strcmp(item, "unplug") == 0 && res <= 3600000)
+            config.unplug = res;
+        else
+        {
+            message(LOG_ERROR,
+                    "IGUANAIR_SIM: unknown key or value out of range: %s\n",
+                    item);
+            retval = false;
+        }
+    }
+    free(copy);
+
+    return retval;
+}
+
+driverImpl impl_simulator = {
+    initializeDriver,
+    cleanupDriver,
+    findDeviceEndpoints,
+    interruptRecv,
+    interruptSend,
+    clearHalt,
+    resetDevice,
+    getDeviceLocation,
+    releaseDevice,
+    freeDevice,
+    prepareDeviceList,
+    claimDevices,
+    updateDeviceList,
+    stopDevices,
+    releaseDevices,
+    printError,
+    asyncRecv,
+    cancelRecv,
+    startRecv,
+    handleRecvEvents,
+    NULL,
+    NULL
+};
+
+driverImpl* getImplementation(struct logSettings *globalSettings)
+{
+    const char *text;
+
+    initializeLogging(globalSettings);
+
+    /* only load when explicitly configured */
+    text = getenv("IGUANAIR_SIM");
+    if (text == NULL)
+    {
+        message(LOG_DEBUG, "IGUANAIR_SIM not set, skipping the simulator\n");
+        return NULL;
+    }
+    if (! parseConfig(text))
+        return NULL;
+    initializeList(&sparePackets);
+    return &impl_simulator;
+}
@@ -0,0 +1,278 @@
+/****************************************************************************
+ ** encodeCache.c ***********************************************************
+ ****************************************************************************
+ *
+ * The daemon's cache of encoded sends, shared by all devices.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#include "iguanaIR.h"
+#include "compat.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "logging.h"
+#include "sendFormat.h"
+#include "encodeCache.h"
+
+enum
+{
+    /* a guess at the size of an entry, used to size the table */
+    TYPICAL_ENTRY = 512,
+    MIN_BUCKETS = 16,
+    MAX_BUCKETS = 65536,
+
+    /* entries bigger than this fraction of the limit are not kept so
+       that one long send cannot empty the cache */
+    LARGEST_SHARE = 8
+};
+
+typedef struct cacheEntry
+{
+    /* chain within a bucket */
+    struct cacheEntry *next;
+    /* least recently used order, newest at the head */
+    struct cacheEntry *newer, *older;
+
+    uint64_t hash;
+    int carrier, compress;
+    int count, length;
+    size_t size;
+
+    /* both are stored after the entry itself */
+    uint32_t *pulses;
+    unsigned char *codes;
+} cacheEntry;
+
+static LOCK_PTR cacheLock;
+static cacheEntry **buckets = NULL;
+static unsigned int bucketCount = 0;
+static cacheEntry *newest = NULL, *oldest = NULL;
+
+static size_t limit = 0, used = 0;
+static unsigned int entries = 0;
+static uint64_t hits = 0, misses = 0, evictions = 0;
+
+/* FNV-1a taken a word at a time, the pulses are already well mixed */
+static uint64_t hashSend(int carrier, const uint32_t *pulses, int count,
+                         int compress)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int x;
+
+    hash = (hash ^ (uint32_t)carrier) * 0x100000001b3ULL;
+    hash = (hash ^ (uint32_t)compress) * 0x100000001b3ULL;
+    for(x = 0; x < count; x++)
+        hash = (hash ^ pulses[x]) * 0x100000001b3ULL;
+    return hash;
+}
+
+static cacheEntry* findEntry(uint64_t hash, int carrier,
+                             const uint32_t *pulses, int count, int compress)
+{
+    cacheEntry *entry;
+
+    for(entry = buckets[hash & (bucketCount - 1)];
+        entry != NULL;
+        entry = entry->next)
+        if (entry->hash == hash &&
+            entry->carrier == carrier &&
+            entry->compress == compress &&
+            entry->count == count &&
+            memcmp(entry->pulses, pulses, count * sizeof(uint32_t)) == 0)
+            break;
+    return entry;
+}
+
+static void unlinkAge(cacheEntry *entry)
+{
+    if (entry->newer == NULL)
+        newest = entry->older;
+    else
+        entry->newer->older = entry->older;
+    if (entry->older == NULL)
+        oldest = entry->newer;
+    else
+        entry->older->newer = entry->newer;
+}
+
+static void linkNewest(cacheEntry *entry)
+{
+    entry->newer = NULL;
+    entry->older = newest;
+    if (newest == NULL)
+        oldest = entry;
+    else
+        newest->newer = entry;
+    newest = entry;
+}
+
+static void evictOldest()
+{
+    cacheEntry *entry = oldest, **prev;
+
+    for(prev = &buckets[entry->hash & (bucketCount - 1)];
+        *prev != entry;
+        prev = &(*prev)->next)
+        ;
+    *prev = entry->next;
+    unlinkAge(entry);
+
+    used -= entry->size;
+    entries--;
+    evictions++;
+    free(entry);
+}
+
+void initEncodeCache(unsigned int bytes)
+{
+    InitializeCriticalSection(&cacheLock);
+    limit = bytes;
+    if (limit == 0)
+        return;
+
+    for(bucketCount = MIN_BUCKETS;
+        bucketCount < MAX_BUCKETS && bucketCount * TYPICAL_ENTRY < limit;
+        bucketCount *= 2)
+        ;
+    buckets = (cacheEntry**)calloc(bucketCount, sizeof(cacheEntry*));
+    if (buckets == NULL)
+    {
+        message(LOG_ERROR, "Failed to allocate the encode cache, sends will not be cached.\n");
+        limit = 0;
+    }
+}
+
+void cleanupEncodeCache()
+{
+    EnterCriticalSection(&cacheLock);
+    if (limit != 0)
+        message(LOG_INFO, "Encode cache: %llu hits, %llu misses, %llu evictions\n",
+                (unsigned long long)hits, (unsigned long long)misses,
+                (unsigned long long)evictions);
+    while(oldest != NULL)
+        evictOldest();
+    free(buckets);
+    buckets = NULL;
+    bucketCount = 0;
+    limit = 0;
+    LeaveCriticalSection(&cacheLock);
+}
+
+static unsigned char* copyCodes(const unsigned char *codes, int length)
+{
+    unsigned char *copy;
+
+    copy = (unsigned char*)malloc(length);
+    if (copy != NULL)
+        memcpy(copy, codes, length);
+    return copy;
+}
+
+/* pulsesToIguanaSend answers 0 for an empty encoding and also when
+   it could not allocate the codes, which leaves errno set to ENOMEM */
+static int encodeSend(int carrier, const uint32_t *pulses, int count,
+                      unsigned char **results, int compress)
+{
+    int length;
+
+    errno = 0;
+    length = pulsesToIguanaSend(carrier, (uint32_t*)pulses, count,
+                                results, compress);
+    if (results != NULL && *results == NULL && errno == ENOMEM)
+        return -1;
+    return length;
+}
+
+int encodeCached(int carrier, const uint32_t *pulses, int count,
+                 unsigned char **results, int compress)
+{
+    cacheEntry *entry;
+    uint64_t hash;
+    int length;
+
+    if (limit == 0 || count <= 0)
+        return encodeSend(carrier, pulses, count, results, compress);
+
+    hash = hashSend(carrier, pulses, count, compress);
+    EnterCriticalSection(&cacheLock);
+    entry = findEntry(hash, carrier, pulses, count, compress);
+    if (entry != NULL)
+    {
+        hits++;
+        unlinkAge(entry);
+        linkNewest(entry);
+
+        length = entry->length;
+        if (results != NULL &&
+            (*results = copyCodes(entry->codes, length)) == NULL)
+        {
+            errno = ENOMEM;
+            length = -1;
+        }
+        LeaveCriticalSection(&cacheLock);
+        return length;
+    }
+    misses++;
+    LeaveCriticalSection(&cacheLock);
+
+    /* only real sends are worth keeping, not size queries */
+    length = encodeSend(carrier, pulses, count, results, compress);
+    if (results == NULL || length <= 0)
+        return length;
+
+    entry = (cacheEntry*)malloc(sizeof(cacheEntry) +
+                                count * sizeof(uint32_t) + length);
+    if (entry == NULL)
+        return length;
+    entry->hash = hash;
+    entry->carrier = carrier;
+    entry->compress = compress;
+    entry->count = count;
+    entry->length = length;
+    entry->size = sizeof(cacheEntry) + count * sizeof(uint32_t) + length;
+    entry->pulses = (uint32_t*)(entry + 1);
+    entry->codes = (unsigned char*)(entry->pulses + count);
+    memcpy(entry->pulses, pulses, count * sizeof(uint32_t));
+    memcpy(entry->codes, *results, length);
+
+    EnterCriticalSection(&cacheLock);
+    /* another thread may have encoded the same send meanwhile */
+    if (limit == 0 || entry->size > limit / LARGEST_SHARE ||
+        findEntry(hash, carrier, pulses, count, compress) != NULL)
+        free(entry);
+    else
+    {
+        while(used + entry->size > limit)
+            evictOldest();
+
+        entry->next = buckets[hash & (bucketCount - 1)];
+        buckets[hash & (bucketCount - 1)] = entry;
+        linkNewest(entry);
+        used += entry->size;
+        entries++;
+    }
+    LeaveCriticalSection(&cacheLock);
+
+    return length;
+}
+
+char* encodeCacheSummary()
+{
+    char buffer[128];
+
+    EnterCriticalSection(&cacheLock);
+    snprintf(buffer, sizeof(buffer), "%llu %llu %llu %u %u %u",
+             (unsigned long long)hits, (unsigned long long)misses,
+             (unsigned long long)evictions, entries,
+             (unsigned int)used, (unsigned int)limit);
+    LeaveCriticalSection(&cacheLock);
+    return strdup(buffer);
+}
@@ -0,0 +1,30 @@
+/****************************************************************************
+ ** encodeCache.h ***********************************************************
+ ****************************************************************************
+ *
+ * A bounded cache of encoded transmit buffers keyed by the pulses,
+ * carrier and compression version they were encoded from.  Clients
+ * that send the same few codes over and over, as most do, only pay
+ * for the encoding the first time.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#pragma once
+
+/* limit is the most memory, in bytes, the cache may hold; 0 leaves
+   every send to be encoded */
+void initEncodeCache(unsigned int limit);
+void cleanupEncodeCache();
+
+/* a drop in for pulsesToIguanaSend that answers from the cache when
+   it can, *results is always a copy the caller frees.  -1 with errno
+   set to ENOMEM means the copy could not be made. */
+int encodeCached(int carrier, const uint32_t *pulses, int count,
+                 unsigned char **results, int compress);
+
+/* "hits misses evictions entries bytes limit" as newly allocated text */
+char* encodeCacheSummary();
@@ -0,0 +1,153 @@
+/****************************************************************************
+ ** frameAssembly.c *********************************************************
+ ****************************************************************************
+ *
+ * Assembly of received pulses into whole IR frames.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#include "iguanaIR.h"
+#include "compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frameAssembly.h"
+
+enum
+{
+    /* the device holds back up to a packet's worth of signals, so an
+       open frame gets this long past the gap before it is finished */
+    FRAME_SLACK = 20000,
+
+    /* a frame this long is handed over without waiting for a gap,
+       which keeps constant noise from growing the buffer forever */
+    MAX_FRAME_PULSES = 1024
+};
+
+struct frameAssembler
+{
+    uint32_t gap;
+
+    /* the frame so far, empty between frames */
+    uint32_t *pulses;
+    int count, size;
+
+    /* when the last signal of the open frame arrived */
+    uint64_t lastData;
+};
+
+frameAssembler* createAssembler(uint32_t gap)
+{
+    frameAssembler *frames;
+
+    frames = (frameAssembler*)malloc(sizeof(frameAssembler));
+    if (frames != NULL)
+    {
+        memset(frames, 0, sizeof(frameAssembler));
+        frames->gap = gap;
+        if (frames->gap > IG_PULSE_MASK)
+            frames->gap = IG_PULSE_MASK;
+    }
+    return frames;
+}
+
+void freeAssembler(frameAssembler *frames)
+{
+    if (frames != NULL)
+    {
+        free(frames->pulses);
+        free(frames);
+    }
+}
+
+static void handOver(frameAssembler *frames,
+                     frameHandler handler, void *userData)
+{
+    handler(frames->pulses, frames->count, userData);
+    frames->count = 0;
+}
+
+void assemblePulses(frameAssembler *frames, const uint32_t *pulses,
+                    int count, uint64_t now,
+                    frameHandler handler, void *userData)
+{
+    int x;
+
+    for(x = 0; x < count; x++)
+    {
+        uint32_t *last;
+
+        /* spaces between frames are already covered by the gap */
+        if (frames->count == 0 && (pulses[x] & IG_PULSE_BIT) == 0)
+            continue;
+
+        last = frames->count == 0 ? NULL :
+               frames->pulses + frames->count - 1;
+        if (last != NULL &&
+            (*last & IG_PULSE_BIT) == (pulses[x] & IG_PULSE_BIT))
+        {
+            /* a signal split across device packets */
+            uint32_t length = (*last & IG_PULSE_MASK) +
+                              (pulses[x] & IG_PULSE_MASK);
+
+            if (length > IG_PULSE_MASK)
+                length = IG_PULSE_MASK;
+            *last = (*last & IG_PULSE_BIT) | length;
+        }
+        else
+        {
+            if (frames->count == frames->size)
+            {
+                int size = frames->size * 2 + 64;
+                uint32_t *bigger;
+
+                bigger = (uint32_t*)realloc(frames->pulses,
+                                            size * sizeof(uint32_t));
+                if (bigger == NULL)
+                {
+                    /* drop the frame rather than hand over part of it */
+                    frames->count = 0;
+                    continue;
+                }
+                frames->pulses = bigger;
+                frames->size = size;
+            }
+            last = frames->pulses + frames->count++;
+            *last = pulses[x];
+        }
+
+        if ((*last & IG_PULSE_BIT) == 0 &&
+            (*last & IG_PULSE_MASK) >= frames->gap)
+            handOver(frames, handler, userData);
+        else if (frames->count >= MAX_FRAME_PULSES)
+            handOver(frames, handler, userData);
+    }
+
+    if (frames->count > 0)
+        frames->lastData = now;
+}
+
+uint64_t frameDeadline(const frameAssembler *frames)
+{
+    if (frames->count == 0)
+        return 0;
+    return frames->lastData + frames->gap + FRAME_SLACK;
+}
+
+void finishFrame(frameAssembler *frames,
+                 frameHandler handler, void *userData)
+{
+    uint32_t space[1];
+
+    if (frames->count == 0)
+        return;
+
+    /* the space has lasted at least the gap */
+    space[0] = frames->gap;
+    assemblePulses(frames, space, 1, frames->lastData, handler, userData);
+}
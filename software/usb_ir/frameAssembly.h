@@ -0,0 +1,40 @@
+/****************************************************************************
+ ** frameAssembly.h *********************************************************
+ ****************************************************************************
+ *
+ * Joins received pulses back into whole IR frames for the clients
+ * that ask for them.  The device reports signals in small packets
+ * that split long pulses and spaces, so adjacent signals of the same
+ * kind are merged and a frame ends at the first space of at least
+ * the gap the client chose.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#pragma once
+
+typedef struct frameAssembler frameAssembler;
+
+/* called with each frame, which ends in a space of at least the gap */
+typedef void (*frameHandler)(const uint32_t *pulses, int count,
+                             void *userData);
+
+/* gap is in microseconds */
+frameAssembler* createAssembler(uint32_t gap);
+void freeAssembler(frameAssembler *frames);
+
+/* merge pulses (in the IG_PULSE_BIT format) that arrived at now,
+   which is in microseconds, into the frame being built */
+void assemblePulses(frameAssembler *frames, const uint32_t *pulses,
+                    int count, uint64_t now,
+                    frameHandler handler, void *userData);
+
+/* when the device goes quiet the trailing space is never reported, so
+   an open frame is finished at this time, or 0 if none is open */
+uint64_t frameDeadline(const frameAssembler *frames);
+/* finish the open frame with a space of the gap */
+void finishFrame(frameAssembler *frames,
+                 frameHandler handler, void *userData);
@@ -18,19 +18,605 @@
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#ifndef WIN32
+    #include <stddef.h>
+    #include <poll.h>
+#endif
 
 #include "pipes.h"
 #include "logging.h"
 #include "dataPackets.h"
+#include "receiveRing.h"
+#include "pulseFd.h"
+#include "pulseFile.h"
 
 #define OLD_IGSOCK_NAME "/dev/iguanaIR/"
 
-enum
+PIPE_PTR iguanaConnect_internal(const char *name, unsigned int protocol, bool checkVersion);
+
+#ifndef WIN32
+/* a request waiting on its response */
+typedef struct pendingRequest
 {
-    MAX_LINE = 1024
-};
+    struct pendingRequest *next;
+    iguanaCallback done;
+    void *context;
+} pendingRequest;
 
-PIPE_PTR iguanaConnect_internal(const char *name, unsigned int protocol, bool checkVersion);
+/* an encoded request the socket has not taken all of */
+typedef struct outRequest
+{
+    struct outRequest *next;
+
+    /* a descriptor to pass with the first byte, -1 if none */
+    int passFd;
+    int length, sent;
+    unsigned char bytes[1];
+} outRequest;
+
+/* a packet that arrived with no request waiting on it */
+typedef struct unclaimedPacket
+{
+    struct unclaimedPacket *next;
+    dataPacket *packet;
+} unclaimedPacket;
+
+/* connections that exchanged IG_FRAMED_PROTOCOL, with their buffers
+   and the state of requests made through them */
+typedef struct framedConn
+{
+    struct framedConn *next;
+    PIPE_PTR fd;
+    packetBuffer buffer;
+
+    /* responses come back in the order requests were written */
+    pendingRequest *pending, *lastPending;
+    outRequest *out, *lastOut;
+
+    /* a packet whose payload is still arriving */
+    dataPacket *partial;
+    int partialHave;
+
+    /* packets without a request go to the receiver if there is one,
+       and are otherwise kept for iguanaReadResponse */
+    iguanaCallback receiver;
+    void *receiverContext;
+    unclaimedPacket *unclaimed, *lastUnclaimed;
+
+    /* while callbacks run iguanaClose only marks the connection */
+    int busy;
+    bool closed;
+} framedConn;
+
+static framedConn *framedConns = NULL;
+static LOCK_PTR framedLock = PTHREAD_MUTEX_INITIALIZER;
+
+static framedConn* findConn(PIPE_PTR fd)
+{
+    framedConn *conn;
+
+    EnterCriticalSection(&framedLock);
+    for(conn = framedConns; conn != NULL; conn = conn->next)
+        if (conn->fd == fd)
+            break;
+    LeaveCriticalSection(&framedLock);
+
+    return conn;
+}
+
+static packetBuffer* findFraming(PIPE_PTR fd)
+{
+    framedConn *conn = findConn(fd);
+
+    if (conn == NULL)
+        return NULL;
+    return &conn->buffer;
+}
+
+/* answer everything still waiting with NULL and errno set to error */
+static void failPending(framedConn *conn, int error)
+{
+    while(conn->pending != NULL)
+    {
+        pendingRequest *req = conn->pending;
+
+        conn->pending = req->next;
+        if (req->done != NULL)
+        {
+            errno = error;
+            req->done(conn->fd, NULL, req->context);
+        }
+        free(req);
+    }
+    conn->lastPending = NULL;
+}
+
+static void freeConn(framedConn *conn)
+{
+    while(conn->out != NULL)
+    {
+        outRequest *out = conn->out;
+
+        conn->out = out->next;
+        if (out->passFd != -1)
+            close(out->passFd);
+        free(out);
+    }
+    while(conn->unclaimed != NULL)
+    {
+        unclaimedPacket *item = conn->unclaimed;
+
+        conn->unclaimed = item->next;
+        freeDataPacket(item->packet);
+        free(item);
+    }
+    freeDataPacket(conn->partial);
+    releasePacketBuffer(&conn->buffer);
+    free(conn);
+}
+
+static void removeFraming(PIPE_PTR fd)
+{
+    framedConn **pos, *conn = NULL;
+
+    EnterCriticalSection(&framedLock);
+    for(pos = &framedConns; *pos != NULL; pos = &(*pos)->next)
+        if ((*pos)->fd == fd)
+        {
+            conn = *pos;
+            *pos = conn->next;
+            break;
+        }
+    LeaveCriticalSection(&framedLock);
+
+    if (conn != NULL)
+    {
+        conn->closed = true;
+        failPending(conn, ECANCELED);
+        if (conn->busy == 0)
+            freeConn(conn);
+    }
+}
+
+static bool addFraming(PIPE_PTR fd)
+{
+    framedConn *conn;
+
+    /* a descriptor closed without iguanaClose may have been reused */
+    removeFraming(fd);
+
+    conn = (framedConn*)malloc(sizeof(framedConn));
+    if (conn == NULL)
+        return false;
+    memset(conn, 0, sizeof(framedConn));
+    conn->fd = fd;
+    initPacketBuffer(&conn->buffer);
+
+    EnterCriticalSection(&framedLock);
+    conn->next = framedConns;
+    framedConns = conn;
+    LeaveCriticalSection(&framedLock);
+
+    return true;
+}
+
+/* encode count requests onto the end of the output so that they go
+   out together, passFd (-1 for none) is duplicated to go with them */
+static bool queueRequests(framedConn *conn, const iguanaPacket *requests,
+                          unsigned int count, int passFd)
+{
+    outRequest *out;
+    size_t length = 0;
+    unsigned int x;
+
+    for(x = 0; x < count; x++)
+    {
+        const dataPacket *request = (const dataPacket*)requests[x];
+
+        length += sizeof(packetHeader);
+        if (request->dataLen > 0)
+            length += request->dataLen;
+    }
+    if (length > INT_MAX - offsetof(outRequest, bytes))
+    {
+        errno = E2BIG;
+        return false;
+    }
+    out = (outRequest*)malloc(offsetof(outRequest, bytes) + length);
+    if (out == NULL)
+        return false;
+
+    out->next = NULL;
+    out->passFd = -1;
+    out->sent = 0;
+    out->length = 0;
+    for(x = 0; x < count; x++)
+    {
+        const dataPacket *request = (const dataPacket*)requests[x];
+
+        out->length += encodePacketHeader(request, true,
+                                          out->bytes + out->length);
+        if (request->dataLen > 0)
+        {
+            memcpy(out->bytes + out->length, request->data,
+                   request->dataLen);
+            out->length += request->dataLen;
+        }
+    }
+    if (passFd != -1 && (out->passFd = dup(passFd)) == -1)
+    {
+        free(out);
+        return false;
+    }
+
+    if (conn->lastOut == NULL)
+        conn->out = out;
+    else
+        conn->lastOut->next = out;
+    conn->lastOut = out;
+    return true;
+}
+
+/* queue requests with done to be called on each of their responses */
+static bool submitRequests(framedConn *conn, const iguanaPacket *requests,
+                           unsigned int count, int passFd,
+                           iguanaCallback done, void *context)
+{
+    pendingRequest *first = NULL, *last = NULL;
+    unsigned int x;
+
+    for(x = 0; x < count; x++)
+    {
+        pendingRequest *req;
+
+        req = (pendingRequest*)malloc(sizeof(pendingRequest));
+        if (req == NULL)
+            break;
+        req->next = NULL;
+        req->done = done;
+        req->context = context;
+        if (last == NULL)
+            first = req;
+        else
+            last->next = req;
+        last = req;
+    }
+
+    if (x < count || ! queueRequests(conn, requests, count, passFd))
+    {
+        while(first != NULL)
+        {
+            pendingRequest *req = first;
+
+            first = req->next;
+            free(req);
+        }
+        return false;
+    }
+
+    if (conn->lastPending == NULL)
+        conn->pending = first;
+    else
+        conn->lastPending->next = first;
+    conn->lastPending = last;
+    return true;
+}
+
+/* write what the socket takes without waiting */
+static bool flushRequests(framedConn *conn)
+{
+    while(conn->out != NULL)
+    {
+        outRequest *out = conn->out;
+        int result;
+
+        result = writePipePairSomeFd(conn->fd, out->bytes + out->sent,
+                                     out->length - out->sent, NULL, 0,
+                                     out->sent == 0 ? out->passFd : -1);
+        if (result == -1)
+            return false;
+        if (result == 0)
+            break;
+
+        out->sent += result;
+        if (out->sent < out->length)
+            break;
+
+        conn->out = out->next;
+        if (conn->out == NULL)
+            conn->lastOut = NULL;
+        if (out->passFd != -1)
+            close(out->passFd);
+        free(out);
+    }
+    return true;
+}
+
+/* move whatever has arrived into conn->partial without waiting,
+   returns 1 once it holds a whole packet, 0 if more is needed, and
+   -1 on failure */
+static int readSome(framedConn *conn)
+{
+    packetBuffer *buffer = &conn->buffer;
+
+    for(;;)
+    {
+        int have = buffer->end - buffer->start, result;
+
+        if (conn->partial == NULL && have >= (int)sizeof(packetHeader))
+        {
+            packetHeader header;
+
+            memcpy(&header, buffer->data + buffer->start, sizeof(packetHeader));
+            buffer->start += sizeof(packetHeader);
+            conn->partial = (dataPacket*)iguanaCreateRequest(header.code, 0,
+                                                             NULL);
+            if (conn->partial == NULL)
+                return -1;
+            conn->partial->dataLen = header.dataLen;
+            conn->partialHave = 0;
+            if (header.dataLen > 0)
+            {
+                conn->partial->data = (unsigned char*)malloc(header.dataLen);
+                if (conn->partial->data == NULL)
+                    return -1;
+            }
+            continue;
+        }
+
+        if (conn->partial != NULL)
+        {
+            int need = 0;
+
+            if (conn->partial->dataLen > 0)
+                need = conn->partial->dataLen - conn->partialHave;
+            if (need > have)
+                need = have;
+            memcpy(conn->partial->data + conn->partialHave,
+                   buffer->data + buffer->start, need);
+            buffer->start += need;
+            conn->partialHave += need;
+            if (conn->partial->dataLen <= conn->partialHave)
+                return 1;
+        }
+
+        /* everything buffered is used up, so start over */
+        memmove(buffer->data, buffer->data + buffer->start,
+                buffer->end - buffer->start);
+        buffer->end -= buffer->start;
+        buffer->start = 0;
+
+        result = readPipeSomeFd(conn->fd, buffer->data + buffer->end,
+                                PACKET_BUFFER_SIZE - buffer->end, 0,
+                                &buffer->passedFd);
+        if (result <= 0)
+            return result;
+        buffer->end += result;
+    }
+}
+
+static bool unsolicited(unsigned char code)
+{
+    return code == IG_DEV_RECV ||
+           code == IG_DEV_OVERRECV ||
+           code == IG_DEV_RECVGAP ||
+           code == IG_DEV_DECODED;
+}
+
+static void deliver(framedConn *conn, dataPacket *packet)
+{
+    if (! unsolicited(packet->code) && conn->pending != NULL)
+    {
+        pendingRequest *req = conn->pending;
+
+        conn->pending = req->next;
+        if (conn->pending == NULL)
+            conn->lastPending = NULL;
+
+        /* abandoned requests still have their answer taken */
+        if (req->done == NULL)
+            freeDataPacket(packet);
+        else
+            req->done(conn->fd, packet, req->context);
+        free(req);
+    }
+    else if (unsolicited(packet->code) && conn->receiver != NULL)
+        conn->receiver(conn->fd, packet, conn->receiverContext);
+    else
+    {
+        unclaimedPacket *item;
+
+        item = (unclaimedPacket*)malloc(sizeof(unclaimedPacket));
+        if (item == NULL)
+            freeDataPacket(packet);
+        else
+        {
+            item->next = NULL;
+            item->packet = packet;
+            if (conn->lastUnclaimed == NULL)
+                conn->unclaimed = item;
+            else
+                conn->lastUnclaimed->next = item;
+            conn->lastUnclaimed = item;
+        }
+    }
+}
+
+static bool processEvents(framedConn *conn)
+{
+    bool retval;
+    int result = 0;
+
+    conn->busy++;
+    retval = flushRequests(conn);
+    while(retval && ! conn->closed &&
+          (result = readSome(conn)) == 1)
+    {
+        dataPacket *packet = conn->partial;
+
+        conn->partial = NULL;
+        deliver(conn, packet);
+    }
+    if (result == -1)
+        retval = false;
+
+    /* the callbacks failing the requests may close the connection too,
+       so it is held until they are done */
+    if (! retval && ! conn->closed)
+        failPending(conn, errno);
+    conn->busy--;
+
+    if (conn->closed)
+    {
+        if (conn->busy == 0)
+            freeConn(conn);
+        errno = EBADF;
+        retval = false;
+    }
+
+    return retval;
+}
+
+/* process events until done says to stop or timeout ms pass */
+static bool waitOnConn(framedConn *conn, bool (*done)(framedConn*, void*),
+                       void *userData, unsigned int timeout)
+{
+    uint64_t then = microsSinceX();
+
+    for(;;)
+    {
+        struct pollfd pfd;
+        int wait = -1;
+
+        if (! processEvents(conn))
+            return false;
+        if (done(conn, userData))
+            return true;
+
+        if (timeout != WAIT_FOREVER)
+        {
+            uint64_t elapsed = (microsSinceX() - then) / 1000;
+
+            if (elapsed >= timeout)
+            {
+                errno = ETIMEDOUT;
+                return false;
+            }
+            wait = timeout - elapsed;
+        }
+
+        pfd.fd = conn->fd;
+        pfd.events = POLLIN;
+        if (conn->out != NULL)
+            pfd.events |= POLLOUT;
+        if (poll(&pfd, 1, wait) == -1 && errno != EINTR)
+            return false;
+    }
+}
+
+static bool requestsWritten(framedConn *conn, void *UNUSED(userData))
+{
+    return conn->out == NULL;
+}
+
+static bool packetUnclaimed(framedConn *conn, void *UNUSED(userData))
+{
+    return conn->unclaimed != NULL;
+}
+
+/* responses gathered for framedBatch */
+typedef struct batch
+{
+    iguanaPacket *responses;
+    unsigned int count, received;
+} batch;
+
+static void batchResponse(PIPE_PTR UNUSED(connection),
+                          iguanaPacket response, void *context)
+{
+    batch *requests = (batch*)context;
+
+    /* responses arrive in request order */
+    requests->responses[requests->received++] = response;
+}
+
+static bool batchFinished(framedConn *UNUSED(conn), void *userData)
+{
+    batch *requests = (batch*)userData;
+
+    return requests->received == requests->count;
+}
+
+/* write count requests at once, with passFd (-1 for none) sent along,
+   and fill responses with their answers or NULL where none came */
+static bool framedBatch(framedConn *conn, const iguanaPacket *requests,
+                        unsigned int count, int passFd,
+                        iguanaPacket *responses, unsigned int timeout)
+{
+    batch gathered;
+
+    memset(responses, 0, count * sizeof(iguanaPacket));
+    gathered.responses = responses;
+    gathered.count = count;
+    gathered.received = 0;
+    if (! submitRequests(conn, requests, count, passFd,
+                         batchResponse, &gathered))
+        return false;
+
+    if (! waitOnConn(conn, batchFinished, &gathered, timeout))
+    {
+        /* failures and closes answer everything pending, but a late
+           response must not find gathered gone */
+        pendingRequest *req;
+        int error = errno;
+
+        if (gathered.received < gathered.count)
+            for(req = conn->pending; req != NULL; req = req->next)
+                if (req->context == &gathered)
+                    req->done = NULL;
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+static dataPacket* framedTransaction(framedConn *conn,
+                                     const dataPacket *request,
+                                     int passFd, unsigned int timeout)
+{
+    iguanaPacket response;
+
+    if (! framedBatch(conn, (const iguanaPacket*)&request, 1, passFd,
+                      &response, timeout))
+        return NULL;
+    return (dataPacket*)response;
+}
+#else
+  /* windows clients keep to the original framing */
+  #define findFraming(fd) ((packetBuffer*)NULL)
+  #define removeFraming(fd)
+#endif
+
+/* agreed is set to the version the server answers with */
+static bool exchangeVersions(PIPE_PTR conn, uint16_t version, uint16_t *agreed)
+{
+    bool retval = false;
+    dataPacket *response = NULL,
+        *request = iguanaCreateRequest(IG_EXCH_VERSIONS, 2, &version);
+
+    if (iguanaTransaction(conn, (iguanaPacket)request, (iguanaPacket*)&response))
+    {
+        *agreed = IG_PROTOCOL_VERSION;
+        if (response->dataLen == 2)
+            *agreed = *(uint16_t*)response->data;
+        freeDataPacket(response);
+        retval = true;
+    }
+    request->data = NULL;
+    freeDataPacket(request);
+
+    return retval;
+}
 
 char* iguanaListDevices()
 {
@@ -92,17 +678,33 @@ PIPE_PTR iguanaConnect_internal(const char *name, unsigned int protocol, bool ch
         }
         else if (checkVersion)
         {
-            uint16_t clientVersion = IG_PROTOCOL_VERSION;
-            dataPacket *request = iguanaCreateRequest(IG_EXCH_VERSIONS, 2, &clientVersion);
-            if (! iguanaTransaction(conn, (iguanaPacket)request, NULL))
+            uint16_t agreed;
+            bool exchanged;
+
+#ifdef WIN32
+            exchanged = exchangeVersions(conn, IG_PROTOCOL_VERSION, &agreed);
+#else
+            /* ask for compact framing, but older daemons answer with
+               their own version and need that repeated back to them */
+            exchanged = exchangeVersions(conn, IG_FRAMED_PROTOCOL, &agreed);
+            if (exchanged && agreed < IG_FRAMED_PROTOCOL)
+                exchanged = exchangeVersions(conn, IG_PROTOCOL_VERSION,
+                                             &agreed);
+            else if (exchanged && ! addFraming(conn))
+            {
+                message(LOG_ERROR, "Out of memory for the connection buffer.\n");
+                iguanaClose(conn);
+                errno = ENOMEM;
+                return INVALID_PIPE;
+            }
+#endif
+            if (! exchanged)
             {
                 message(LOG_ERROR, "Server did not understand version request, aborting.  Is the igdaemon is up to date?\n");
                 iguanaClose(conn);
                 errno = 0;
                 conn = INVALID_PIPE;
             }
-            request->data = NULL;
-            freeDataPacket(request);
         }
     }
 
@@ -131,6 +733,7 @@ void iguanaClose(PIPE_PTR connection)
 #if DEBUG
 message(LOG_WARN, "CLOSE %d %s(%d)\n", connection, __FILE__, __LINE__);
 #endif
+        removeFraming(connection);
         closePipe(connection);
     }
 }
@@ -187,7 +790,18 @@ void iguanaFreePacket(iguanaPacket pkt)
 
 bool iguanaWriteRequest(const iguanaPacket request, PIPE_PTR connection)
 {
-    if (writeDataPacket((dataPacket*)request, connection, WAIT_FOREVER))
+    bool written;
+#ifndef WIN32
+    framedConn *conn = findConn(connection);
+
+    if (conn != NULL)
+        written = queueRequests(conn, &request, 1, -1) &&
+                  waitOnConn(conn, requestsWritten, NULL, WAIT_FOREVER);
+    else
+#endif
+        written = writeDataPacket((dataPacket*)request, connection,
+                                  WAIT_FOREVER);
+    if (written)
         return 1;
     return 0;
 }
@@ -198,13 +812,32 @@ iguanaPacket iguanaReadResponse(PIPE_PTR connection, unsigned int timeout)
 
     if (connection != INVALID_PIPE)
     {
+#ifndef WIN32
+        framedConn *conn = findConn(connection);
+
+        if (conn != NULL)
+        {
+            /* whatever arrived without a request waiting on it */
+            if (waitOnConn(conn, packetUnclaimed, NULL, timeout))
+            {
+                unclaimedPacket *item = conn->unclaimed;
+
+                conn->unclaimed = item->next;
+                if (conn->unclaimed == NULL)
+                    conn->lastUnclaimed = NULL;
+                response = item->packet;
+                free(item);
+            }
+            return response;
+        }
+#endif
         response = (dataPacket*)malloc(sizeof(dataPacket));
         if (response != NULL &&
             ! readDataPacket(response, connection, timeout))
-            {
-                free(response);
-                response = NULL;
-            }
+        {
+            free(response);
+            response = NULL;
+        }
     }
     else
         errno = EPIPE;
@@ -221,135 +854,341 @@ bool iguanaTransaction(PIPE_PTR connection, const iguanaPacket request,
                        iguanaPacket *response)
 {
     bool retval = false;
-    dataPacket *req = (dataPacket*)request;
+    dataPacket *req = (dataPacket*)request, *result = NULL;
+#ifndef WIN32
+    framedConn *conn = findConn(connection);
+#endif
+
+    if (req == NULL)
+        return false;
+#ifndef WIN32
+    if (conn != NULL)
+        result = framedTransaction(conn, req, -1, 10000);
+    else
+#endif
+    if (iguanaWriteRequest(req, connection))
+        result = iguanaReadResponse(connection, 10000);
 
-    /* check versions of the client and server */
-    if (req &&
-        iguanaWriteRequest(req, connection))
+    if (iguanaResponseIsError(result))
+        freeDataPacket(result);
+    else
     {
-        dataPacket *result = iguanaReadResponse(connection, 10000);
-        if (iguanaResponseIsError(result))
-            freeDataPacket(result);
+        if (response != NULL)
+            *(dataPacket**)response = result;
         else
+            freeDataPacket(result);
+        retval = true;
+    }
+
+    return retval;
+}
+
+bool iguanaTransactionBatch(PIPE_PTR connection, const iguanaPacket *requests,
+                            unsigned int count, iguanaPacket *responses)
+{
+    bool retval = true;
+    iguanaPacket *results = responses;
+    unsigned int x;
+    int error = 0;
+#ifndef WIN32
+    framedConn *conn = findConn(connection);
+#endif
+
+    if (count == 0)
+        return true;
+    if (requests == NULL)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    if (results == NULL)
+    {
+        results = (iguanaPacket*)malloc(count * sizeof(iguanaPacket));
+        if (results == NULL)
+            return false;
+    }
+
+#ifndef WIN32
+    if (conn != NULL)
+        retval = framedBatch(conn, requests, count, -1, results, 10000);
+    else
+#endif
+    {
+        /* the original framing cannot be sent in one write, but the
+           requests still go out before any response is waited on */
+        memset(results, 0, count * sizeof(iguanaPacket));
+        for(x = 0; retval && x < count; x++)
+            retval = iguanaWriteRequest(requests[x], connection);
+        for(x = 0; retval && x < count; x++)
+            retval = (results[x] = iguanaReadResponse(connection,
+                                                      10000)) != NULL;
+    }
+    if (! retval)
+        error = errno;
+
+    /* report the first request the device refused */
+    for(x = 0; x < count; x++)
+        if (iguanaResponseIsError(results[x]) && retval)
         {
-            if (response != NULL)
-                *(dataPacket**)response = result;
+            retval = false;
+            error = errno;
+        }
+
+    if (results != responses)
+    {
+        for(x = 0; x < count; x++)
+            freeDataPacket((dataPacket*)results[x]);
+        free(results);
+    }
+    errno = error;
+    return retval;
+}
+
+bool iguanaSubmitRequest(PIPE_PTR connection, const iguanaPacket request,
+                         iguanaCallback done, void *context)
+{
+#ifdef WIN32
+    errno = ENOSYS;
+    return false;
+#else
+    framedConn *conn = findConn(connection);
+
+    if (conn == NULL)
+    {
+        errno = EPROTO;
+        return false;
+    }
+    if (request == NULL || done == NULL)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    if (! submitRequests(conn, &request, 1, -1, done, context))
+        return false;
+
+    /* write errors reach done through iguanaProcessEvents */
+    flushRequests(conn);
+    return true;
+#endif
+}
+
+bool iguanaSetReceiveCallback(PIPE_PTR connection, iguanaCallback received,
+                              void *context)
+{
+#ifdef WIN32
+    errno = ENOSYS;
+    return false;
+#else
+    framedConn *conn = findConn(connection);
+
+    if (conn == NULL)
+    {
+        errno = EPROTO;
+        return false;
+    }
+    conn->receiver = received;
+    conn->receiverContext = context;
+    return true;
+#endif
+}
+
+int iguanaPollEvents(PIPE_PTR connection)
+{
+#ifdef WIN32
+    errno = ENOSYS;
+    return -1;
+#else
+    framedConn *conn = findConn(connection);
+
+    if (conn == NULL)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    if (conn->out != NULL)
+        return IG_POLL_READ | IG_POLL_WRITE;
+    return IG_POLL_READ;
+#endif
+}
+
+bool iguanaProcessEvents(PIPE_PTR connection)
+{
+#ifdef WIN32
+    errno = ENOSYS;
+    return false;
+#else
+    framedConn *conn = findConn(connection);
+
+    if (conn == NULL)
+    {
+        errno = EPROTO;
+        return false;
+    }
+    return processEvents(conn);
+#endif
+}
+
+iguanaReceiveRing iguanaMapReceiveRing(PIPE_PTR connection)
+{
+    receiveRing *retval = NULL;
+    packetBuffer *buffer = findFraming(connection);
+
+    if (buffer == NULL)
+        errno = EPROTO;
+    else
+    {
+        dataPacket *response = NULL,
+            *request = iguanaCreateRequest(IG_DEV_MAPRING, 0, NULL);
+
+        if (iguanaTransaction(connection, (iguanaPacket)request,
+                              (iguanaPacket*)&response))
+        {
+            /* the ring's descriptor arrives along with the reply */
+            if (buffer->passedFd == -1)
+                errno = EPROTO;
             else
-                freeDataPacket(result);
-            retval = true;
+                retval = mapReceiveRing(buffer->passedFd);
+            freeDataPacket(response);
         }
+        freeDataPacket(request);
+        releasePacketBuffer(buffer);
     }
 
     return retval;
 }
 
-int iguanaReadPulseFile(const char *filename, void **pulses)
+iguanaPacket iguanaReadReceiveRing(iguanaReceiveRing ring,
+                                   unsigned int timeout)
 {
-    bool success = false;
-    int count = 0;
-    char buffer[MAX_LINE], *line, inSpace = 1;
-    FILE *input;
+    dataPacket *retval = NULL;
+    uint32_t pulses[RECEIVE_RING_PULSES], missed;
+    int count;
+
+    count = readReceiveRing((receiveRing*)ring, pulses, &missed, timeout);
+    if (count > 0)
+    {
+        void *data = malloc(count * sizeof(uint32_t));
+        if (data != NULL)
+        {
+            memcpy(data, pulses, count * sizeof(uint32_t));
+            retval = iguanaCreateRequest(IG_DEV_RECV,
+                                         count * sizeof(uint32_t), data);
+        }
+    }
+    else if (count == 0 && missed > 0)
+    {
+        uint32_t *data = (uint32_t*)malloc(sizeof(uint32_t));
+        if (data != NULL)
+        {
+            *data = missed;
+            retval = iguanaCreateRequest(IG_DEV_RECVGAP,
+                                         sizeof(uint32_t), data);
+        }
+    }
 
-    /* start with no pulses, then realloc as needed */
-    *pulses = NULL;
+    return retval;
+}
 
-    /* open the file and read it line by line */
-    errno = EINVAL;
-    input = fopen(filename, "r");
-    if (input != NULL)
+void iguanaUnmapReceiveRing(iguanaReceiveRing ring)
+{
+    unmapReceiveRing((receiveRing*)ring);
+}
+
+bool iguanaSendPulsesFd(PIPE_PTR connection, int fd,
+                        unsigned int offset, unsigned int count)
+{
+    bool retval = false;
+#ifdef WIN32
+    errno = ENOSYS;
+#else
+    uint32_t *where;
+
+    if (findConn(connection) == NULL)
+        errno = EPROTO;
+    else if (sealPulseFd(fd) &&
+             (where = (uint32_t*)malloc(2 * sizeof(uint32_t))) != NULL)
     {
-        int lineNumber = 0;
-        while(fgets(buffer, MAX_LINE, input))
+        dataPacket *request, *response;
+
+        where[0] = offset;
+        where[1] = count;
+        request = (dataPacket*)iguanaCreateRequest(IG_DEV_SENDFD,
+                                                   2 * sizeof(uint32_t),
+                                                   where);
+        if (request == NULL)
+            free(where);
+        else
         {
-            char *temp;
-            int value;
-            bool discard = false;
-
-            line = buffer;
-            success = false;
-            lineNumber++;
-
-            /* allocate space for one more (not it's not efficient) */
-            *pulses = realloc(*pulses, sizeof(uint32_t) * (count + 1));
-            if (*pulses == NULL)
-                break;
-
-            /* ignore anything after a # in the line */
-            temp = strchr(line, '#');
-            if (temp != NULL)
-                temp[0] = '\0';
-
-            /* skip blank lines (or comments that got truncated) */
-            line += strspn(line, " \t\r\n");
-            if (line[0] == '\0')
-            {
-                success = true;
-                continue;
-            }
+            /* the daemon finds fd along with the request */
+            response = framedTransaction(findConn(connection), request,
+                                         fd, 10000);
+            if (! iguanaResponseIsError(response))
+                retval = true;
+            freeDataPacket(response);
+            freeDataPacket(request);
+        }
+    }
+#endif
 
-            /* try to read the pulse or space (in a couple formats) */
-            if (sscanf(line, "pulse %d", &value) == 1 ||
-                sscanf(line, "pulse: %d", &value) == 1)
-            {
-                if (! inSpace)
-                {
-                    ((uint32_t*)(*pulses))[count - 1] += value;
-                    message(LOG_WARN,
-                            "Combining pulses in pulse/space file %s(%d)\n",
-                            filename, lineNumber);
-                    discard = true;
-                }
-            }
-            else if (sscanf(line, "space %d", &value) == 1 ||
-                     sscanf(line, "space: %d", &value) == 1)
-            {
-                /* ignore any leading spaces */
-                if (count == 0)
-                    discard = true;
-                else if (inSpace)
-                {
-                    ((uint32_t*)(*pulses))[count - 1] += value;
-                    message(LOG_WARN,
-                            "Combining spaces in pulse/space file %s(%d)\n",
-                            filename, lineNumber);
-                    discard = true;
-                }
-            }
-            /* A simple list of numbers is also acceptable.  I believe
-               this was to support some sort of LIRC raw codes. */
-            else if (sscanf(line, "%d", &value) != 1)
-            {
-                message(LOG_WARN,
-                       "Skipping unparsable line in pulse/space file %s(%d)\n",
-                        filename, lineNumber);
-                discard = true;
-            }
+    return retval;
+}
+
+bool iguanaSendPulsesAt(PIPE_PTR connection, const void *pulses,
+                        unsigned int count, unsigned long long when,
+                        long long *skew)
+{
+    bool retval = false;
+    unsigned char *data;
+    int length = sizeof(uint64_t) + count * sizeof(uint32_t);
+#ifndef WIN32
+    framedConn *conn = findConn(connection);
+#endif
 
-            /* bump to the next code */
-            if (! discard)
+    data = (unsigned char*)malloc(length);
+    if (data != NULL)
+    {
+        dataPacket *request, *response = NULL;
+        uint64_t fire = when, now = microsSinceX();
+        unsigned int timeout = 10000;
+
+        memcpy(data, &fire, sizeof(uint64_t));
+        memcpy(data + sizeof(uint64_t), pulses, count * sizeof(uint32_t));
+        request = (dataPacket*)iguanaCreateRequest(IG_DEV_SENDAT, length,
+                                                   data);
+        if (request == NULL)
+            free(data);
+        else
+        {
+            /* the answer only comes once the send fires */
+            if (fire > now)
+                timeout += (unsigned int)((fire - now) / 1000);
+#ifndef WIN32
+            /* receive packets may arrive first on a framed connection */
+            if (conn != NULL)
+                response = framedTransaction(conn, request, -1, timeout);
+            else
+#endif
+            if (iguanaWriteRequest((iguanaPacket)request, connection))
+                response = (dataPacket*)iguanaReadResponse(connection,
+                                                           timeout);
+            if (response != NULL && ! iguanaResponseIsError(response) &&
+                response->dataLen == sizeof(int64_t))
             {
-                if (inSpace)
-                    value |= IG_PULSE_BIT;
-                ((uint32_t*)(*pulses))[count++] = value;
-                inSpace ^= 1;
+                if (skew != NULL)
+                    *skew = *(int64_t*)response->data;
+                retval = true;
             }
-            success = true;
+            freeDataPacket(response);
+            freeDataPacket(request);
         }
-
-        fclose(input);
     }
 
-    /* free the buffer on failure */
-    if (! success)
-    {
-        free(*pulses);
-        count = -1;
-    }
-    /* trim a trailing space */
-    else if (inSpace)
-        count--;
+    return retval;
+}
 
-    return count;
+int iguanaReadPulseFile(const char *filename, void **pulses)
+{
+    return readPulseFile(filename, (uint32_t**)pulses);
 }
 
 int iguanaReadBlockFile(const char *filename, void **data)
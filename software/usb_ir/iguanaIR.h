@@ -73,6 +73,13 @@ enum
     /* used to ask the daemon about devices */
     IG_CTL_LISTDEVS = 0x80,
     IG_CTL_DEVADDR  = 0x81,
+    IG_CTL_LATENCY  = 0x82,
+    /* reload the daemon's --code-dir, answered with the uint32_t
+       number of codes loaded */
+    IG_CTL_LOADCODES = 0x83,
+    /* the daemon's encode cache counters as the text
+       "hits misses evictions entries bytes limit" */
+    IG_CTL_ENCODESTATS = 0x84,
 
     /* used in response packets */
     IG_DEV_ERROR = 0x00,
@@ -114,12 +121,68 @@ enum
     IG_DEV_SENDSIZE     = 0x28, /* internal to client/daemon */
     IG_DEV_LISTALIASES  = 0x29, /* internal to client/daemon */
     IG_DEV_GETADDRESS   = 0x2A, /* internal to client/daemon */
+    IG_DEV_MAPRING      = 0x2B, /* internal to client/daemon */
+    IG_DEV_SENDFD       = 0x2C, /* internal to client/daemon */
+    /* IG_DEV_RECVON, but each IG_DEV_RECV holds a whole frame ending
+       in a space of at least the uint32_t gap in microseconds passed
+       with the request, 0 for the daemon's --frame-gap */
+    IG_DEV_RECVFRAMES   = 0x2D, /* internal to client/daemon */
+    /* IG_DEV_RECVON, but decoded key presses arrive as IG_DEV_DECODED
+       in place of the pulses, for the protocols whose bits are set in
+       the uint32_t mask (1 << IG_PROTO_*) passed with the request, all
+       of them for 0 */
+    IG_DEV_RECVDECODED  = 0x2E, /* internal to client/daemon */
+    /* IG_DEV_SEND of a code the daemon loaded from its --code-dir,
+       named by the string passed with the request */
+    IG_DEV_SENDNAMED    = 0x2F, /* internal to client/daemon */
 
     /* FILE:body.inc packets initiated by the device */
     IG_DEV_RECV         = 0x30,
     IG_DEV_OVERRECV     = 0x31,
     IG_DEV_OVERSEND     = 0x32,
 
+    /* sent in place of receive data a client fell too far behind to
+       get, carries a uint32_t count of the dropped packets */
+    IG_DEV_RECVGAP      = 0x3F, /* internal to client/daemon */
+    /* a key press, IG_DECODED_WORDS uint32_t values indexed below */
+    IG_DEV_DECODED      = 0x3E, /* internal to client/daemon */
+
+    /* how the daemon queues a client's transmits behind those of
+       other clients, set with a uint32_t IG_SEND_* class and a
+       uint32_t deadline in milliseconds, 0 for none.  A transmit that
+       cannot start before its deadline fails with ETIME. */
+    IG_DEV_SENDCLASS    = 0x40, /* internal to client/daemon */
+    /* IG_DEV_SEND of the uint32_t pulses that follow a uint64_t time
+       to fire them at, in CLOCK_MONOTONIC microseconds.  Answered once
+       the device has the code with an int64_t count of microseconds
+       it was late by, or early by when negative. */
+    IG_DEV_SENDAT       = 0x41, /* internal to client/daemon */
+
+    /* transmit classes, interactive transmits go before bulk ones */
+    IG_SEND_INTERACTIVE = 0,
+    IG_SEND_BULK        = 1,
+
+    /* the protocols the daemon decodes */
+    IG_PROTO_NEC  = 1,
+    IG_PROTO_NECX = 2, /* NEC with a 16 bit address */
+    IG_PROTO_RC5  = 3,
+    IG_PROTO_RC6  = 4, /* mode 0 */
+    IG_PROTO_SONY = 5,
+    IG_PROTO_JVC  = 6,
+
+    /* the contents of IG_DEV_DECODED, the time is the 64 bit
+       monotonic microsecond the frame ended split in two halves */
+    IG_DECODED_PROTOCOL  = 0,
+    IG_DECODED_FLAGS     = 1,
+    IG_DECODED_ADDRESS   = 2,
+    IG_DECODED_COMMAND   = 3,
+    IG_DECODED_TIME_LOW  = 4,
+    IG_DECODED_TIME_HIGH = 5,
+    IG_DECODED_WORDS     = 6,
+
+    /* flags: the key is being held, the press was already reported */
+    IG_DECODED_REPEAT = 0x01,
+
     /* for interpretting codes */
     IG_PULSE_BIT  = 0x01000000,
     IG_PULSE_MASK = 0x00FFFFFF,
@@ -162,7 +225,9 @@ IGUANAIR_API unsigned char* iguanaRemoveData(iguanaPacket pkt,
 IGUANAIR_API unsigned char iguanaCode(const iguanaPacket pkt);
 IGUANAIR_API void iguanaFreePacket(iguanaPacket pkt);
 
-/* for communication with the server */
+/* for communication with the server, note that responses are read
+ * in bulk so a caller that selects on the connection should first
+ * drain it with a 0 timeout */
 IGUANAIR_API bool iguanaWriteRequest(const iguanaPacket request,
                                      PIPE_PTR connection);
 IGUANAIR_API iguanaPacket iguanaReadResponse(PIPE_PTR connection,
@@ -171,6 +236,82 @@ IGUANAIR_API bool iguanaResponseIsError(const iguanaPacket response);
 IGUANAIR_API bool iguanaTransaction(PIPE_PTR connection,
                                     const iguanaPacket request,
                                     iguanaPacket *response);
+/* write count requests at once and wait (up to 10 seconds in all) for
+ * their responses.  Each of responses, when it is not NULL, is set to
+ * the answer to the matching request, an IG_DEV_ERROR packet if the
+ * device refused it, or NULL if none arrived, and the caller frees
+ * them.  Returns true only if every request succeeded, otherwise
+ * errno is set from the first that did not. */
+IGUANAIR_API bool iguanaTransactionBatch(PIPE_PTR connection,
+                                         const iguanaPacket *requests,
+                                         unsigned int count,
+                                         iguanaPacket *responses);
+
+/* for event loops that manage many connections on one thread (Unix,
+ * protocol 2 connections only).  Submitting encodes the request right
+ * away, so the caller keeps ownership of it.  Whenever
+ * iguanaPollEvents says the connection is ready, iguanaProcessEvents
+ * writes what it can, reads what has arrived without waiting for the
+ * rest, and calls done for each response in the order the requests
+ * were submitted.  Callbacks own the packet they are handed, which is
+ * NULL with errno set if the connection failed or was closed first.
+ * Packets without a request behind them (IG_DEV_RECV and the like)
+ * go to the receive callback, or are kept for iguanaReadResponse if
+ * there is none.  The blocking calls above are built on the same
+ * queues, but a connection should only be used from one thread. */
+typedef void (*iguanaCallback)(PIPE_PTR connection, iguanaPacket response,
+                               void *context);
+enum
+{
+    IG_POLL_READ  = 1,
+    IG_POLL_WRITE = 2
+};
+IGUANAIR_API bool iguanaSubmitRequest(PIPE_PTR connection,
+                                      const iguanaPacket request,
+                                      iguanaCallback done, void *context);
+IGUANAIR_API bool iguanaSetReceiveCallback(PIPE_PTR connection,
+                                           iguanaCallback received,
+                                           void *context);
+/* IG_POLL_* flags to wait on, or -1 with errno set */
+IGUANAIR_API int iguanaPollEvents(PIPE_PTR connection);
+IGUANAIR_API bool iguanaProcessEvents(PIPE_PTR connection);
+
+/* receivers on the same machine may read pulses from a ring the
+ * daemon shares with them rather than over the connection (Linux
+ * only, and the connection must use protocol 2).  Mapping the ring
+ * turns the receiver on in place of IG_DEV_RECVON until the
+ * connection is closed.  Reads return IG_DEV_RECV packets of pulses,
+ * or IG_DEV_RECVGAP packets holding a uint32_t count of the entries
+ * the reader fell too far behind to get, and NULL with errno set to
+ * ETIMEDOUT if nothing arrived in time. */
+typedef void* iguanaReceiveRing;
+IGUANAIR_API iguanaReceiveRing iguanaMapReceiveRing(PIPE_PTR connection);
+IGUANAIR_API iguanaPacket iguanaReadReceiveRing(iguanaReceiveRing ring,
+                                                unsigned int timeout);
+IGUANAIR_API void iguanaUnmapReceiveRing(iguanaReceiveRing ring);
+
+/* transmit count pulses found offset pulses into fd, a memfd created
+ * with MFD_ALLOW_SEALING, without copying them over the connection.
+ * The memfd is sealed against shrinking and may be refilled for the
+ * next send once this returns.  Linux and protocol 2 only, like the
+ * receive ring. */
+IGUANAIR_API bool iguanaSendPulsesFd(PIPE_PTR connection, int fd,
+                                     unsigned int offset,
+                                     unsigned int count);
+
+/* transmit count uint32_t pulses once CLOCK_MONOTONIC (the
+ * performance counter on Windows) reaches when, in microseconds.  The
+ * daemon encodes them ahead of time and starts the transfer early
+ * enough for the device to have the whole code at that moment, and
+ * skew (if not NULL) is set to how many microseconds late it was,
+ * negative if early.  A daemon run with --event-threads starts the
+ * transfer to the millisecond rather than waiting out the last of it
+ * on the clock. */
+IGUANAIR_API bool iguanaSendPulsesAt(PIPE_PTR connection,
+                                     const void *pulses,
+                                     unsigned int count,
+                                     unsigned long long when,
+                                     long long *skew);
 
 /* a few helper functions for dealing with function arguments */
 IGUANAIR_API int iguanaReadPulseFile(const char *filename, void **pulses);
@@ -33,6 +33,9 @@
 %rename(readBlockFile)   iguanaReadBlockFile;
 %rename(pinSpecToData)   iguanaPinSpecToData;
 %rename(dataToPinSpec)   iguanaDataToPinSpec;
+%rename(mapReceiveRing)  iguanaMapReceiveRing;
+/* iguanaReadReceiveRing handled below */
+%rename(unmapReceiveRing) iguanaUnmapReceiveRing;
 
 %typemap(default) (unsigned int dataLength, void *data)
 {
@@ -100,6 +103,29 @@ iguanaPacket readResponse(PIPE_PTR connection, unsigned int timeout)
 }
 %}
 
+/* reading the receive ring blocks the same way */
+%ignore iguanaReadReceiveRing;
+%inline %{
+iguanaPacket readReceiveRing(iguanaReceiveRing ring, unsigned int timeout)
+{
+    iguanaPacket retval;
+
+    Py_BEGIN_ALLOW_THREADS;
+    retval = iguanaReadReceiveRing(ring, timeout);
+    Py_END_ALLOW_THREADS;
+
+    return retval;
+}
+%}
+
+/* batches and the asynchronous calls take C arrays and callbacks, so
+ * they are left to C clients */
+%ignore iguanaTransactionBatch;
+%ignore iguanaSubmitRequest;
+%ignore iguanaSetReceiveCallback;
+%ignore iguanaPollEvents;
+%ignore iguanaProcessEvents;
+
 /* Remove the old connect call and replace it with a call with a
  * default value. */
 %rename(connect) iguanaConnect_python;
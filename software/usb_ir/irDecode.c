@@ -0,0 +1,412 @@
+/****************************************************************************
+ ** irDecode.c **************************************************************
+ ****************************************************************************
+ *
+ * Table driven decoders for the NEC, extended NEC, JVC, Sony SIRC, RC5
+ * and RC6 (mode 0) remote control protocols.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#include "iguanaIR.h"
+#include "compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frameAssembly.h"
+#include "irDecode.h"
+
+enum
+{
+    /* a frame matching the last one this soon after it is a repeat */
+    REPEAT_WINDOW = 250000,
+
+    /* most half bits in any of the bi-phase frames */
+    MAX_HALVES = 64
+};
+
+typedef enum
+{
+    /* bits in the length of the space after each pulse */
+    PULSE_DISTANCE,
+    /* bits in the length of each pulse */
+    PULSE_WIDTH,
+    /* bits in the order of the two halves of each bit time */
+    BIPHASE
+} coding;
+
+typedef struct protocolSpec
+{
+    coding kind;
+
+    /* microseconds of the leading pulse and space, 0 when there are
+       none, and the shortened space of a repeat code where used */
+    uint32_t headerPulse, headerSpace, repeatSpace;
+
+    /* for PULSE_DISTANCE the pulse and the two spaces, for PULSE_WIDTH
+       the space and the two pulses, for BIPHASE the half bit */
+    uint32_t fixed, zero, one;
+
+    /* bits in a frame, the smallest where it varies */
+    int bits, maxBits;
+
+    /* BIPHASE only: whether a pulse leads a 1, whether the frame
+       starts with an invisible space half, and the double width bit */
+    bool pulseFirstIsOne, leadingSpace;
+    int trailerBit;
+
+    /* turn the bits into an event, false if they are not valid */
+    bool (*interpret)(uint32_t value, int bits, uint32_t *event);
+} protocolSpec;
+
+struct irDecoder
+{
+    frameAssembler *frames;
+
+    /* the last event for repeat detection */
+    uint32_t last[IG_DECODED_WORDS];
+    uint64_t lastTime;
+    uint32_t lastToggle;
+
+    /* state for the frame handler */
+    uint64_t now;
+    decodeHandler handler;
+    void *userData;
+};
+
+static bool interpretNEC(uint32_t value, int UNUSED(bits), uint32_t *event)
+{
+    uint32_t address = value & 0xFF, command = (value >> 16) & 0xFF;
+
+    if ((command ^ (value >> 24)) != 0xFF)
+        return false;
+
+    /* the extended form spends the address check on 8 more bits */
+    if ((address ^ ((value >> 8) & 0xFF)) == 0xFF)
+        event[IG_DECODED_PROTOCOL] = IG_PROTO_NEC;
+    else
+    {
+        event[IG_DECODED_PROTOCOL] = IG_PROTO_NECX;
+        address = value & 0xFFFF;
+    }
+    event[IG_DECODED_ADDRESS] = address;
+    event[IG_DECODED_COMMAND] = command;
+    return true;
+}
+
+static bool interpretJVC(uint32_t value, int UNUSED(bits), uint32_t *event)
+{
+    event[IG_DECODED_PROTOCOL] = IG_PROTO_JVC;
+    event[IG_DECODED_ADDRESS] = value & 0xFF;
+    event[IG_DECODED_COMMAND] = (value >> 8) & 0xFF;
+    return true;
+}
+
+static bool interpretSony(uint32_t value, int bits, uint32_t *event)
+{
+    if (bits != 12 && bits != 15 && bits != 20)
+        return false;
+
+    event[IG_DECODED_PROTOCOL] = IG_PROTO_SONY;
+    event[IG_DECODED_ADDRESS] = value >> 7;
+    event[IG_DECODED_COMMAND] = value & 0x7F;
+    return true;
+}
+
+/* the toggle bit is passed back in the flags for repeat detection */
+static bool interpretRC5(uint32_t value, int UNUSED(bits), uint32_t *event)
+{
+    /* the first start bit is always 1, the second is an inverted
+       seventh command bit */
+    if ((value & 0x2000) == 0)
+        return false;
+
+    event[IG_DECODED_PROTOCOL] = IG_PROTO_RC5;
+    event[IG_DECODED_ADDRESS] = (value >> 6) & 0x1F;
+    event[IG_DECODED_COMMAND] = (value & 0x3F) |
+                                ((value & 0x1000) ? 0 : 0x40);
+    event[IG_DECODED_FLAGS] = (value >> 11) & 1;
+    return true;
+}
+
+static bool interpretRC6(uint32_t value, int UNUSED(bits), uint32_t *event)
+{
+    /* a start bit of 1 and mode 0 */
+    if ((value >> 17) != 0x8)
+        return false;
+
+    event[IG_DECODED_PROTOCOL] = IG_PROTO_RC6;
+    event[IG_DECODED_ADDRESS] = (value >> 8) & 0xFF;
+    event[IG_DECODED_COMMAND] = value & 0xFF;
+    event[IG_DECODED_FLAGS] = (value >> 16) & 1;
+    return true;
+}
+
+static const protocolSpec protocols[] =
+{
+    /* NEC and its extended form, which differ only in the address */
+    {PULSE_DISTANCE, 9000, 4500, 2250,  560,  560, 1690, 32, 32,
+     false, false, -1, interpretNEC},
+    {PULSE_DISTANCE, 8400, 4200,    0,  526,  526, 1574, 16, 16,
+     false, false, -1, interpretJVC},
+    {PULSE_WIDTH,    2400,  600,    0,  600,  600, 1200, 12, 20,
+     false, false, -1, interpretSony},
+    {BIPHASE,           0,    0,    0,  889,    0,    0, 14, 14,
+     false, true,  -1, interpretRC5},
+    {BIPHASE,        2666,  889,    0,  444,    0,    0, 21, 21,
+     true,  false,  4, interpretRC6},
+    {0}
+};
+
+static bool isPulse(uint32_t signal)
+{
+    return (signal & IG_PULSE_BIT) != 0;
+}
+
+/* within the slop of common receivers, which stretch pulses and
+   shorten spaces */
+static bool near(uint32_t signal, uint32_t expected)
+{
+    uint32_t length = signal & IG_PULSE_MASK, slop = expected / 4 + 150;
+
+    return length + slop >= expected && length <= expected + slop;
+}
+
+/* the value, least significant bit first, of count bits in the
+   pulse lengths or space lengths */
+static bool readLengths(const protocolSpec *spec, const uint32_t *frame,
+                        int count, uint32_t *value)
+{
+    int x, step = spec->kind == PULSE_DISTANCE ? 1 : 0;
+
+    *value = 0;
+    for(x = 0; x < count; x++)
+    {
+        const uint32_t *pair = frame + x * 2;
+
+        /* the part of each bit that carries nothing */
+        if (! near(pair[1 - step], spec->fixed))
+        {
+            /* the last Sony space runs into the gap */
+            if (step == 1 || x < count - 1)
+                return false;
+        }
+
+        if (near(pair[step], spec->one))
+            *value |= (uint32_t)1 << x;
+        else if (! near(pair[step], spec->zero))
+            return false;
+    }
+    return true;
+}
+
+static bool decodeLengths(const protocolSpec *spec, const uint32_t *frame,
+                          int count, uint32_t *event)
+{
+    uint32_t value;
+    int bits;
+
+    /* NEC style repeat codes carry no data */
+    if (spec->repeatSpace != 0 && count == 4 &&
+        near(frame[0], spec->headerPulse) &&
+        near(frame[1], spec->repeatSpace) &&
+        near(frame[2], spec->fixed))
+    {
+        event[IG_DECODED_FLAGS] = IG_DECODED_REPEAT;
+        return true;
+    }
+
+    if (near(frame[0], spec->headerPulse) && near(frame[1], spec->headerSpace))
+    {
+        frame += 2;
+        count -= 2;
+    }
+    /* JVC repeats the frame without the header */
+    else if (spec->repeatSpace != 0 || spec->kind != PULSE_DISTANCE)
+        return false;
+
+    /* pulse distance frames end with a stop pulse */
+    bits = count / 2;
+    if (spec->kind == PULSE_DISTANCE)
+        bits = (count - 1) / 2;
+    if (bits < spec->bits || bits > spec->maxBits ||
+        (spec->kind == PULSE_DISTANCE && ! near(frame[bits * 2], spec->fixed)))
+        return false;
+
+    return readLengths(spec, frame, bits, &value) &&
+           spec->interpret(value, bits, event);
+}
+
+static bool decodeBiphase(const protocolSpec *spec, const uint32_t *frame,
+                          int count, uint32_t *event)
+{
+    uint32_t value = 0;
+    bool halves[MAX_HALVES];
+    int used = 0, needed, x, pos;
+
+    if (spec->headerPulse != 0)
+    {
+        if (count < 2 ||
+            ! near(frame[0], spec->headerPulse) ||
+            ! near(frame[1], spec->headerSpace))
+            return false;
+        frame += 2;
+        count -= 2;
+    }
+
+    /* the trailer bit counts twice */
+    needed = spec->bits * 2;
+    if (spec->trailerBit >= 0)
+        needed += 2;
+
+    /* lay the signals out as half bit times, true for pulse */
+    if (spec->leadingSpace)
+        halves[used++] = false;
+    for(x = 0; x < count; x++)
+    {
+        uint32_t units = ((frame[x] & IG_PULSE_MASK) + spec->fixed / 2) /
+                         spec->fixed;
+
+        /* the final space runs into the gap */
+        if (! isPulse(frame[x]) && x == count - 1)
+            break;
+        if (units < 1 || units > 3 || used + (int)units > needed)
+            return false;
+        while(units-- > 0)
+            halves[used++] = isPulse(frame[x]);
+    }
+    while(used < needed)
+        halves[used++] = false;
+
+    for(x = 0, pos = 0; x < spec->bits; x++)
+    {
+        int width = x == spec->trailerBit ? 2 : 1, y;
+        bool first = halves[pos];
+
+        /* each half is uniform and the two differ */
+        for(y = 0; y < width * 2; y++)
+            if (halves[pos + y] != (y < width ? first : ! first))
+                return false;
+        pos += width * 2;
+
+        value = (value << 1) | (first == spec->pulseFirstIsOne ? 1 : 0);
+    }
+
+    return spec->interpret(value, spec->bits, event);
+}
+
+/* the frame handler for the assembler underneath */
+static void decodeFrame(const uint32_t *frame, int count, void *userData)
+{
+    irDecoder *decoder = (irDecoder*)userData;
+    const protocolSpec *spec;
+    uint32_t event[IG_DECODED_WORDS];
+
+    /* a frame ends with its trailing space */
+    if (count < 2)
+        return;
+
+    for(spec = protocols; spec->interpret != NULL; spec++)
+    {
+        bool found;
+
+        memset(event, 0, sizeof(event));
+        if (spec->kind == BIPHASE)
+            found = decodeBiphase(spec, frame, count, event);
+        else
+            found = decodeLengths(spec, frame, count, event);
+        if (! found)
+            continue;
+
+        if (event[IG_DECODED_FLAGS] == IG_DECODED_REPEAT &&
+            event[IG_DECODED_PROTOCOL] == 0)
+        {
+            /* a repeat code stands for the last NEC frame */
+            if ((decoder->last[IG_DECODED_PROTOCOL] != IG_PROTO_NEC &&
+                 decoder->last[IG_DECODED_PROTOCOL] != IG_PROTO_NECX) ||
+                decoder->now - decoder->lastTime > REPEAT_WINDOW)
+                return;
+            memcpy(event, decoder->last, sizeof(event));
+            event[IG_DECODED_FLAGS] = IG_DECODED_REPEAT;
+        }
+        else
+        {
+            uint32_t toggle = event[IG_DECODED_FLAGS];
+
+            /* the same key again soon after, with the same toggle where
+               the protocol has one, is being held down */
+            event[IG_DECODED_FLAGS] = 0;
+            if (decoder->now - decoder->lastTime <= REPEAT_WINDOW &&
+                memcmp(event, decoder->last,
+                       sizeof(uint32_t) * IG_DECODED_TIME_LOW) == 0 &&
+                toggle == decoder->lastToggle)
+                event[IG_DECODED_FLAGS] = IG_DECODED_REPEAT;
+            decoder->lastToggle = toggle;
+        }
+
+        event[IG_DECODED_TIME_LOW] = (uint32_t)decoder->now;
+        event[IG_DECODED_TIME_HIGH] = (uint32_t)(decoder->now >> 32);
+        memcpy(decoder->last, event, sizeof(event));
+        decoder->last[IG_DECODED_FLAGS] = 0;
+        decoder->lastTime = decoder->now;
+
+        decoder->handler(event, decoder->userData);
+        return;
+    }
+}
+
+irDecoder* createDecoder(uint32_t gap)
+{
+    irDecoder *decoder;
+
+    decoder = (irDecoder*)malloc(sizeof(irDecoder));
+    if (decoder != NULL)
+    {
+        memset(decoder, 0, sizeof(irDecoder));
+        decoder->frames = createAssembler(gap);
+        if (decoder->frames == NULL)
+        {
+            free(decoder);
+            decoder = NULL;
+        }
+    }
+    return decoder;
+}
+
+void freeDecoder(irDecoder *decoder)
+{
+    if (decoder != NULL)
+    {
+        freeAssembler(decoder->frames);
+        free(decoder);
+    }
+}
+
+void irDecodePulses(irDecoder *decoder, const uint32_t *pulses, int count,
+                    uint64_t now, decodeHandler handler, void *userData)
+{
+    decoder->now = now;
+    decoder->handler = handler;
+    decoder->userData = userData;
+    assemblePulses(decoder->frames, pulses, count, now,
+                   decodeFrame, decoder);
+}
+
+uint64_t decoderDeadline(const irDecoder *decoder)
+{
+    return frameDeadline(decoder->frames);
+}
+
+void finishDecoding(irDecoder *decoder,
+                    decodeHandler handler, void *userData)
+{
+    /* stamped with the time the frame was given up on */
+    decoder->now = frameDeadline(decoder->frames);
+    decoder->handler = handler;
+    decoder->userData = userData;
+    finishFrame(decoder->frames, decodeFrame, decoder);
+}
@@ -0,0 +1,33 @@
+/****************************************************************************
+ ** irDecode.h **************************************************************
+ ****************************************************************************
+ *
+ * Decoding of common remote control protocols inside the daemon, so
+ * that clients wanting key presses do not each decode the pulses.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#pragma once
+
+typedef struct irDecoder irDecoder;
+
+/* called with the IG_DECODED_WORDS words of each decoded frame */
+typedef void (*decodeHandler)(const uint32_t *event, void *userData);
+
+/* frames are split at spaces of at least gap microseconds */
+irDecoder* createDecoder(uint32_t gap);
+void freeDecoder(irDecoder *decoder);
+
+/* feed received pulses, which arrived at now in microseconds */
+void irDecodePulses(irDecoder *decoder, const uint32_t *pulses, int count,
+                    uint64_t now, decodeHandler handler, void *userData);
+
+/* like the frame assembly this is built on, a frame still open when
+   the device goes quiet is decoded at this time, 0 if none is open */
+uint64_t decoderDeadline(const irDecoder *decoder);
+void finishDecoding(irDecoder *decoder,
+                    decodeHandler handler, void *userData);
@@ -21,6 +21,8 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #include "pipes.h"
 #include "logging.h"
@@ -57,7 +59,7 @@ static bool mkdirs(char *path)
     return retval;
 }
 
-PIPE_PTR createServerPipe(const char *name, char **addrStr)
+PIPE_PTR createServerPipe(const char *name, int backlog, char **addrStr)
 {
     int sockfd, attempt = 0;
     struct sockaddr_un server = {0};
@@ -108,7 +110,7 @@ message(LOG_WARN, "OPEN %d %s(%d)\n", sockfd,   __FILE__, __LINE__);
                         translateError(errno));
         }
         /* start listening */
-        else if (listen(sockfd, 5) == -1)
+        else if (listen(sockfd, backlog) == -1)
             message(LOG_ERROR,
                     "failed to put server socket in a listening state.\n");
         /* set the proper permissions */
@@ -239,33 +241,30 @@ void setAlias(const char *target, bool deleteAll, const char *alias)
     }
 }
 
-static int timedPipeOperation(PIPE_PTR fd, void *inBuf, const void *outBuf, int size, int timeout)
+/* wait until fd can be read (or written), returns 1 once it can, 0
+   on timeout, and -1 on error */
+static int waitForPipe(PIPE_PTR fd, bool forWrite, int timeout, int64_t stoptime)
 {
-    int retval = -1, res;
-    fd_set fds, fdserr;
-    struct timeval tv = {0,0}, *tvp = NULL;
-    int64_t stoptime = (int64_t)microsSinceX() + timeout * 1000;
+    int retval = -1, res, wait = -1;
+    struct pollfd pfd;
+
+    /* poll, unlike select, is not limited to descriptors below
+       FD_SETSIZE */
+    pfd.fd = fd;
+    pfd.events = forWrite ? POLLOUT : POLLIN;
 
-    /* prepare the fds for the select call */
     eintr_loop:
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-    fdserr = fds;
+    pfd.revents = 0;
 
     /* configure the timeout if there was one*/
     if (timeout >= 0)
     {
         int64_t timeremaining = stoptime - (int64_t)microsSinceX();
-        tvp = &tv;
         if (timeremaining < 0) timeremaining = 0;
-        tv.tv_sec = timeremaining / 1000000;
-        tv.tv_usec = timeremaining % 1000000;
+        wait = (int)((timeremaining + 999) / 1000);
     }
 
-    if (outBuf == NULL)
-        res = select(fd + 1, &fds, NULL, &fdserr, tvp);
-    else
-        res = select(fd + 1, NULL, &fds, &fdserr, tvp);
+    res = poll(&pfd, 1, wait);
     switch(res)
     {
     /* error */
@@ -281,54 +280,230 @@ static int timedPipeOperation(PIPE_PTR fd, void *inBuf, const void *outBuf, int
         break;
 
     default:
-        if (FD_ISSET(fd, &fds))
+        /* a hang up still lets the read see EOF */
+        if (pfd.revents & (pfd.events | POLLHUP))
+            retval = 1;
+        else
+            errno = EIO;
+        break;
+    }
+    return retval;
+}
+
+/* partial stops after the first successful read or write */
+static int timedPipeOperation(PIPE_PTR fd, void *inBuf, const void *outBuf, int size, int timeout, bool partial)
+{
+    int retval;
+    int64_t stoptime = (int64_t)microsSinceX() + timeout * 1000;
+
+    retval = waitForPipe(fd, outBuf != NULL, timeout, stoptime);
+    if (retval == 1)
+    {
+        int goal = size;
+
+        retval = 0;
+        while(goal > 0)
         {
-            int goal = size;
+            int amount;
 
-            retval = 0;
-            while(goal > 0)
+            if (outBuf == NULL)
+                amount = read(fd, (char*)inBuf + retval, goal);
+            else
+                amount = write(fd, (const char*)outBuf + retval, goal);
+            switch(amount)
             {
-                int amount;
-
-                if (outBuf == NULL)
-                    amount = read(fd, (char*)inBuf + retval, goal);
-                else
-                    amount = write(fd, (const char*)outBuf + retval, goal);
-                switch(amount)
+            case -1:
+                retval = -1;
+            case 0:
+                /* break out on error or EOF */
+                if (retval == 0)
                 {
-                case -1:
                     retval = -1;
-                case 0:
-                    /* break out on error or EOF */
-                    if (retval == 0)
-                    {
-                        retval = -1;
-                        errno = EPIPE;
-                    }
-                    goal = 0;
-                    break;
-
-                default:
-                    retval += amount;
-                    goal -= amount;
+                    errno = EPIPE;
                 }
+                goal = 0;
+                break;
+
+            default:
+                retval += amount;
+                goal -= amount;
+                if (partial)
+                    goal = 0;
             }
         }
-        else
-            errno = EIO;
-        break;
     }
     return retval;
 }
 
 int readPipeTimed(PIPE_PTR fd, void *buffer, int size, int timeout)
 {
-    return timedPipeOperation(fd, buffer, NULL, size, timeout);
+    return timedPipeOperation(fd, buffer, NULL, size, timeout, false);
+}
+
+int readPipeSome(PIPE_PTR fd, void *buffer, int size, int timeout)
+{
+    return timedPipeOperation(fd, buffer, NULL, size, timeout, true);
 }
 
 int writePipeTimed(PIPE_PTR fd, const void *buffer, int size, int timeout)
 {
-    return timedPipeOperation(fd, NULL, buffer, size, timeout);
+    return timedPipeOperation(fd, NULL, buffer, size, timeout, false);
+}
+
+int writePipePairTimed(PIPE_PTR fd, const void *head, int headSize,
+                       const void *body, int bodySize, int timeout)
+{
+    return writePipePairTimedFd(fd, head, headSize, body, bodySize,
+                                timeout, -1);
+}
+
+int writePipePairTimedFd(PIPE_PTR fd, const void *head, int headSize,
+                         const void *body, int bodySize, int timeout,
+                         int passFd)
+{
+    int retval = 1, sent = 0, total = headSize + bodySize;
+    int64_t stoptime = (int64_t)microsSinceX() + timeout * 1000;
+
+    /* client sockets are non-blocking, so a full socket buffer can
+       cut a write short or refuse it with EAGAIN, in which case wait
+       for room and carry on from where it stopped */
+    while(sent < total &&
+          (retval = waitForPipe(fd, true, timeout, stoptime)) == 1)
+    {
+        int amount;
+
+        if (sent < headSize)
+            amount = writePipePairSomeFd(fd, (const char*)head + sent,
+                                         headSize - sent, body, bodySize,
+                                         passFd);
+        else
+            amount = writePipePairSomeFd(fd,
+                                         (const char*)body + sent - headSize,
+                                         total - sent, NULL, 0, -1);
+        if (amount < 0)
+        {
+            retval = -1;
+            break;
+        }
+
+        /* passFd went along with the first byte */
+        if (amount > 0)
+            passFd = -1;
+        sent += amount;
+    }
+
+    if (retval == 1)
+        retval = total;
+    /* a packet cut off part way through cannot be finished later */
+    else if (retval == 0 && sent > 0)
+    {
+        errno = ETIMEDOUT;
+        retval = -1;
+    }
+    return retval;
+}
+
+int readPipeSomeFd(PIPE_PTR fd, void *buffer, int size, int timeout,
+                   int *passed)
+{
+    int retval;
+    int64_t stoptime = (int64_t)microsSinceX() + timeout * 1000;
+
+    retval = waitForPipe(fd, false, timeout, stoptime);
+    if (retval == 1)
+    {
+        struct msghdr msg;
+        struct iovec part;
+        struct cmsghdr *cmsg;
+        union
+        {
+            struct cmsghdr align;
+            char space[CMSG_SPACE(sizeof(int))];
+        } control;
+
+        part.iov_base = buffer;
+        part.iov_len = size;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &part;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof(control.space);
+        do
+        {
+            retval = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        } while(retval == -1 && errno == EINTR);
+
+        if (retval == 0)
+        {
+            retval = -1;
+            errno = EPIPE;
+        }
+        else if (retval > 0)
+            for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                cmsg = CMSG_NXTHDR(&msg, cmsg))
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_RIGHTS &&
+                    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+                {
+                    /* only the latest descriptor is kept */
+                    if (*passed != -1)
+                        close(*passed);
+                    memcpy(passed, CMSG_DATA(cmsg), sizeof(int));
+                }
+    }
+    return retval;
+}
+
+int writePipePairSome(PIPE_PTR fd, const void *head, int headSize,
+                      const void *body, int bodySize)
+{
+    return writePipePairSomeFd(fd, head, headSize, body, bodySize, -1);
+}
+
+int writePipePairSomeFd(PIPE_PTR fd, const void *head, int headSize,
+                        const void *body, int bodySize, int passFd)
+{
+    int retval;
+    struct iovec parts[2];
+    struct msghdr msg;
+    union
+    {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    parts[0].iov_base = (void*)head;
+    parts[0].iov_len = headSize;
+    parts[1].iov_base = (void*)body;
+    parts[1].iov_len = bodySize;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = parts;
+    msg.msg_iovlen = bodySize > 0 ? 2 : 1;
+    if (passFd != -1)
+    {
+        struct cmsghdr *cmsg;
+
+        /* the descriptor rides along with the first byte */
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof(control.space);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+    }
+
+    /* the socket itself may block, this call never does */
+    do
+    {
+        retval = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while(retval == -1 && errno == EINTR);
+
+    /* a full non-blocking socket is not an error */
+    if (retval == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        retval = 0;
+    return retval;
 }
 
 int notified(PIPE_PTR fd, int timeout)
@@ -41,7 +41,7 @@ enum
 #endif
 
 /* functions managing server sockets */
-PIPE_PTR createServerPipe(const char *name, char **addrStr);
+PIPE_PTR createServerPipe(const char *name, int backlog, char **addrStr);
 void closeServerPipe(PIPE_PTR fd, const char *name);
 void setAlias(const char *target, bool deleteAll, const char *alias);
 
@@ -51,6 +51,29 @@ PIPE_PTR connectToPipe(const char *name);
 /* read/write with timeouts */
 int readPipeTimed(PIPE_PTR fd, void *buffer, int size, int timeout);
 int writePipeTimed(PIPE_PTR fd, const void *buffer, int size, int timeout);
+/* returns after one read of whatever is available, for buffered readers */
+int readPipeSome(PIPE_PTR fd, void *buffer, int size, int timeout);
+/* writes a header and its payload, with a single system call unless
+   the socket is full, in which case it waits for room up to timeout
+   and finishes what the first write left */
+int writePipePairTimed(PIPE_PTR fd, const void *head, int headSize,
+                       const void *body, int bodySize, int timeout);
+/* writes what the socket takes without waiting, returning the number
+   of bytes written (0 when it is full) or -1 on error */
+int writePipePairSome(PIPE_PTR fd, const void *head, int headSize,
+                      const void *body, int bodySize);
+
+#ifndef WIN32
+/* as above, but also pass a descriptor over the socket (-1 for none)
+   or collect one into *passed, closing any it already held */
+int writePipePairSomeFd(PIPE_PTR fd, const void *head, int headSize,
+                        const void *body, int bodySize, int passFd);
+int writePipePairTimedFd(PIPE_PTR fd, const void *head, int headSize,
+                         const void *body, int bodySize, int timeout,
+                         int passFd);
+int readPipeSomeFd(PIPE_PTR fd, void *buffer, int size, int timeout,
+                   int *passed);
+#endif
 
 /* used for notification of packet arrival */
 int notified(PIPE_PTR fd, int timeout);
@@ -0,0 +1,343 @@
+/****************************************************************************
+ ** poller.c ****************************************************************
+ ****************************************************************************
+ *
+ * epoll and poll backends for the daemon's event loops.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#include "iguanaIR.h"
+#include "compat.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_SYS_EPOLL_H
+    #include <sys/epoll.h>
+#else
+    #include <poll.h>
+#endif
+
+#include "logging.h"
+#include "poller.h"
+
+enum
+{
+    /* events taken from the kernel per wait */
+    READY_BATCH = 64
+};
+
+typedef struct pollEntry
+{
+    PIPE_PTR fd;
+    int kind;
+    void *userData;
+
+    /* removed entries stay allocated until the next wait since the
+       events already collected may still point at them */
+    bool removed;
+    struct pollEntry *nextRemoved;
+
+#ifndef HAVE_SYS_EPOLL_H
+    /* position in fds and the events seen on the last wait */
+    int index;
+    short revents;
+#endif
+} pollEntry;
+
+struct poller
+{
+    /* the registered entries indexed by descriptor */
+    pollEntry **entries;
+    int entryCount;
+    pollEntry *removed;
+
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd;
+    struct epoll_event ready[READY_BATCH];
+#else
+    /* the descriptors packed for poll and their entries */
+    struct pollfd *fds;
+    pollEntry **watched, **ready;
+    int used, size;
+#endif
+    int readyCount, readyPos;
+};
+
+poller* createPoller()
+{
+    poller *p;
+
+    p = (poller*)malloc(sizeof(poller));
+    if (p != NULL)
+    {
+        memset(p, 0, sizeof(poller));
+#ifdef HAVE_SYS_EPOLL_H
+        p->epfd = epoll_create(READY_BATCH);
+        if (p->epfd == -1)
+        {
+            message(LOG_ERROR, "epoll_create failed: %s\n",
+                    translateError(errno));
+            free(p);
+            p = NULL;
+        }
+#endif
+    }
+
+    return p;
+}
+
+static void releaseRemoved(poller *p)
+{
+    while(p->removed != NULL)
+    {
+        pollEntry *entry = p->removed;
+        p->removed = entry->nextRemoved;
+        free(entry);
+    }
+}
+
+void freePoller(poller *p)
+{
+    int x;
+
+    if (p == NULL)
+        return;
+
+    releaseRemoved(p);
+    for(x = 0; x < p->entryCount; x++)
+        free(p->entries[x]);
+    free(p->entries);
+#ifdef HAVE_SYS_EPOLL_H
+    close(p->epfd);
+#else
+    free(p->fds);
+    free(p->watched);
+    free(p->ready);
+#endif
+    free(p);
+}
+
+bool pollerAdd(poller *p, PIPE_PTR fd, int kind, void *userData)
+{
+    pollEntry *entry;
+
+    if (fd < 0)
+        return false;
+
+    /* grow the table to cover fd */
+    if (fd >= p->entryCount)
+    {
+        pollEntry **bigger;
+        int count = p->entryCount * 2;
+
+        if (count <= fd)
+            count = fd + 1;
+        bigger = (pollEntry**)realloc(p->entries, sizeof(pollEntry*) * count);
+        if (bigger == NULL)
+            return false;
+        memset(bigger + p->entryCount, 0,
+               sizeof(pollEntry*) * (count - p->entryCount));
+        p->entries = bigger;
+        p->entryCount = count;
+    }
+
+    /* a descriptor closed without being removed has been reused */
+    if (p->entries[fd] != NULL)
+        pollerRemove(p, fd);
+
+    entry = (pollEntry*)malloc(sizeof(pollEntry));
+    if (entry == NULL)
+        return false;
+    memset(entry, 0, sizeof(pollEntry));
+    entry->fd = fd;
+    entry->kind = kind;
+    entry->userData = userData;
+
+#ifdef HAVE_SYS_EPOLL_H
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = entry;
+        if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+        {
+            message(LOG_ERROR, "epoll_ctl failed to add %d: %s\n",
+                    fd, translateError(errno));
+            free(entry);
+            return false;
+        }
+    }
+#else
+    if (p->used == p->size)
+    {
+        int size = p->size * 2 + 8;
+        struct pollfd *fds;
+        pollEntry **watched, **ready;
+
+        fds = (struct pollfd*)realloc(p->fds, sizeof(struct pollfd) * size);
+        if (fds != NULL)
+            p->fds = fds;
+        watched = (pollEntry**)realloc(p->watched, sizeof(pollEntry*) * size);
+        if (watched != NULL)
+            p->watched = watched;
+        ready = (pollEntry**)realloc(p->ready, sizeof(pollEntry*) * size);
+        if (ready != NULL)
+            p->ready = ready;
+        if (fds == NULL || watched == NULL || ready == NULL)
+        {
+            free(entry);
+            return false;
+        }
+        p->size = size;
+    }
+    entry->index = p->used++;
+    p->fds[entry->index].fd = fd;
+    p->fds[entry->index].events = POLLIN;
+    p->fds[entry->index].revents = 0;
+    p->watched[entry->index] = entry;
+#endif
+
+    p->entries[fd] = entry;
+    return true;
+}
+
+bool pollerWatchWrites(poller *p, PIPE_PTR fd, bool writes)
+{
+    pollEntry *entry;
+
+    if (p == NULL || fd < 0 || fd >= p->entryCount ||
+        p->entries[fd] == NULL)
+        return false;
+    entry = p->entries[fd];
+
+#ifdef HAVE_SYS_EPOLL_H
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        if (writes)
+            event.events |= EPOLLOUT;
+        event.data.ptr = entry;
+        if (epoll_ctl(p->epfd, EPOLL_CTL_MOD, fd, &event) == -1)
+        {
+            message(LOG_ERROR, "epoll_ctl failed to modify %d: %s\n",
+                    fd, translateError(errno));
+            return false;
+        }
+    }
+#else
+    p->fds[entry->index].events = POLLIN;
+    if (writes)
+        p->fds[entry->index].events |= POLLOUT;
+#endif
+
+    return true;
+}
+
+void pollerRemove(poller *p, PIPE_PTR fd)
+{
+    pollEntry *entry;
+
+    if (p == NULL || fd < 0 || fd >= p->entryCount ||
+        p->entries[fd] == NULL)
+        return;
+    entry = p->entries[fd];
+    p->entries[fd] = NULL;
+
+#ifdef HAVE_SYS_EPOLL_H
+    /* closing the descriptor already dropped it from the set */
+    epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    /* move the last descriptor into the hole */
+    p->used--;
+    if (entry->index != p->used)
+    {
+        p->fds[entry->index] = p->fds[p->used];
+        p->watched[entry->index] = p->watched[p->used];
+        p->watched[entry->index]->index = entry->index;
+    }
+#endif
+
+    entry->removed = true;
+    entry->nextRemoved = p->removed;
+    p->removed = entry;
+}
+
+int pollerWait(poller *p, int timeout)
+{
+    int count;
+
+    releaseRemoved(p);
+    p->readyCount = p->readyPos = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+    count = epoll_wait(p->epfd, p->ready, READY_BATCH, timeout);
+#else
+    count = poll(p->fds, p->used, timeout);
+    if (count > 0)
+    {
+        int x;
+
+        /* collect the ready entries since removals reorder fds */
+        count = 0;
+        for(x = 0; x < p->used; x++)
+            if (p->fds[x].revents != 0)
+            {
+                p->watched[x]->revents = p->fds[x].revents;
+                p->ready[count++] = p->watched[x];
+            }
+    }
+#endif
+
+    if (count == -1 && errno == EINTR)
+        count = 0;
+    if (count > 0)
+        p->readyCount = count;
+    return count;
+}
+
+bool pollerNext(poller *p, pollEvent *event)
+{
+    while(p->readyPos < p->readyCount)
+    {
+        pollEntry *entry;
+        bool error, readable, writable;
+
+#ifdef HAVE_SYS_EPOLL_H
+        uint32_t events = p->ready[p->readyPos].events;
+
+        entry = (pollEntry*)p->ready[p->readyPos].data.ptr;
+        error = (events & (EPOLLERR | EPOLLHUP)) != 0;
+        readable = (events & EPOLLIN) != 0;
+        writable = (events & EPOLLOUT) != 0;
+#else
+        entry = p->ready[p->readyPos];
+        error = (entry->revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+        readable = (entry->revents & POLLIN) != 0;
+        writable = (entry->revents & POLLOUT) != 0;
+#endif
+        p->readyPos++;
+
+        if (! entry->removed)
+        {
+            event->fd = entry->fd;
+            event->kind = entry->kind;
+            event->userData = entry->userData;
+            event->error = error;
+            /* errors are found by reading */
+            event->readable = readable || error;
+            event->writable = writable;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,53 @@
+/****************************************************************************
+ ** poller.h ****************************************************************
+ ****************************************************************************
+ *
+ * Readiness notification for the daemon's event loops.  Descriptors
+ * are registered once and each wait reports only those that are
+ * ready, through epoll where it exists and poll elsewhere.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+
+#pragma once
+
+typedef struct poller poller;
+
+typedef struct pollEvent
+{
+    PIPE_PTR fd;
+
+    /* as given to pollerAdd */
+    int kind;
+    void *userData;
+
+    /* an error or hang up was reported, possibly along with data */
+    bool error;
+
+    /* which directions are ready, writable only if it was asked for */
+    bool readable, writable;
+} pollEvent;
+
+poller* createPoller();
+void freePoller(poller *p);
+
+/* watch fd for input, replacing any stale registration of it */
+bool pollerAdd(poller *p, PIPE_PTR fd, int kind, void *userData);
+
+/* also report fd once it can take more output, or stop doing so */
+bool pollerWatchWrites(poller *p, PIPE_PTR fd, bool writes);
+
+/* stop watching fd, which may already be closed, before it is reused;
+   safe while stepping through the events of a wait */
+void pollerRemove(poller *p, PIPE_PTR fd);
+
+/* wait up to timeout ms (-1 forever), returns the number of ready
+   descriptors, 0 on timeout or interruption, and -1 on error */
+int pollerWait(poller *p, int timeout);
+
+/* step through the events of the last wait, skipping removed fds */
+bool pollerNext(poller *p, pollEvent *event);
@@ -17,6 +17,7 @@
 #include "compat.h"
 
 #include "logging.h"
+#include "dataPackets.h"
 #include "protocol-versions.h"
 
 typedef uint8_t codeMap[][2];
@@ -55,6 +56,10 @@ bool translateProtocol(uint8_t *code, uint16_t protocolVersion, bool toVersion)
 {
     bool retval = false;
 
+    /* the framed protocol only changes how packets are sent */
+    if (protocolVersion == IG_FRAMED_PROTOCOL)
+        protocolVersion = IG_PROTOCOL_VERSION;
+
     /* special case the protocol we use prior to knowing the versions */
     if (protocolVersion == IG_PROTOCOL_VERSION || *code == IG_EXCH_VERSIONS)
         retval = true;
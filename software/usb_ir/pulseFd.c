@@ -0,0 +1,119 @@
+/****************************************************************************
+ ** pulseFd.c ***************************************************************
+ ****************************************************************************
+ *
+ * Sealing and mapping the memfds that carry pulses to igdaemon.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the LGPL version 2.1.
+ * See LICENSE-LGPL for license details.
+ */
+#include "config.h"
+#ifdef HAVE_MEMFD_CREATE
+    /* for the file seals, which compat.h hides */
+    #define _GNU_SOURCE
+#endif
+#include "iguanaIR.h"
+#ifndef HAVE_MEMFD_CREATE
+    #include "compat.h"
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "pulseFd.h"
+
+#ifdef HAVE_MEMFD_CREATE
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool sealPulseFd(int fd)
+{
+    int seals = fcntl(fd, F_GET_SEALS);
+
+    if (seals == -1)
+        return false;
+    if ((seals & F_SEAL_SHRINK) == 0 &&
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == -1)
+        return false;
+    return true;
+}
+
+const uint32_t* mapPulseFd(int fd, unsigned int offset, unsigned int count,
+                           pulseMap *map)
+{
+    struct stat info;
+    uint64_t end;
+
+    if (fstat(fd, &info) != 0)
+        return NULL;
+    end = ((uint64_t)offset + count) * sizeof(uint32_t);
+    if (count == 0 || end > (uint64_t)info.st_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* the seals only ever grow, so a memfd mapped before still has
+       them and is only remapped if it has grown past the mapping */
+    if (map->base == NULL || map->device != (uint64_t)info.st_dev ||
+        map->inode != (uint64_t)info.st_ino || end > map->size)
+    {
+        int seals;
+
+        /* without the seal a truncate would fault the daemon */
+        seals = fcntl(fd, F_GET_SEALS);
+        if (seals == -1 || (seals & F_SEAL_SHRINK) == 0)
+        {
+            errno = EPERM;
+            return NULL;
+        }
+
+        unmapPulseFd(map);
+        map->base = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map->base == MAP_FAILED)
+        {
+            map->base = NULL;
+            return NULL;
+        }
+        map->size = info.st_size;
+        map->device = info.st_dev;
+        map->inode = info.st_ino;
+    }
+
+    return (const uint32_t*)map->base + offset;
+}
+
+void unmapPulseFd(pulseMap *map)
+{
+    if (map->base != NULL)
+        munmap(map->base, map->size);
+    map->base = NULL;
+}
+
+#else
+/* without memfds there are no seals to rely on */
+
+bool sealPulseFd(int UNUSED(fd))
+{
+    errno = ENOSYS;
+    return false;
+}
+
+const uint32_t* mapPulseFd(int UNUSED(fd), unsigned int UNUSED(offset),
+                           unsigned int UNUSED(count),
+                           pulseMap *UNUSED(map))
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void unmapPulseFd(pulseMap *UNUSED(map))
+{
+}
+#endif
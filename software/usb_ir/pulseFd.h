@@ -0,0 +1,36 @@
+/****************************************************************************
+ ** pulseFd.h ***************************************************************
+ ****************************************************************************
+ *
+ * Pulse arrays handed to igdaemon in a memfd rather than over the
+ * socket.  The client seals the memfd against shrinking so that the
+ * daemon can encode straight from its mapping without the pages
+ * disappearing underneath it.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the LGPL version 2.1.
+ * See LICENSE-LGPL for license details.
+ */
+#pragma once
+
+typedef struct pulseMap
+{
+    /* the mapped memfd, NULL when there is none */
+    void *base;
+    size_t size;
+
+    /* identifies the memfd behind whichever descriptor mapped it */
+    uint64_t device, inode;
+} pulseMap;
+
+/* used by clients to make fd safe for the daemon to map */
+bool sealPulseFd(int fd);
+
+/* used by the daemon to find count pulses offset pulses into fd,
+   failing with EPERM unless fd is sealed.  map starts zeroed and is
+   kept between calls, so repeated sends from one memfd map it once. */
+const uint32_t* mapPulseFd(int fd, unsigned int offset, unsigned int count,
+                           pulseMap *map);
+void unmapPulseFd(pulseMap *map);
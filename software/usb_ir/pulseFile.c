@@ -0,0 +1,137 @@
+/****************************************************************************
+ ** pulseFile.c *************************************************************
+ ****************************************************************************
+ *
+ * Reading of the pulse/space files used to describe IR codes.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the LGPL version 2.1.
+ * See LICENSE-LGPL for license details.
+ */
+#include "iguanaIR.h"
+#include "compat.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "logging.h"
+#include "pulseFile.h"
+
+enum
+{
+    MAX_LINE = 1024
+};
+
+int readPulseFile(const char *filename, uint32_t **pulses)
+{
+    bool success = false;
+    int count = 0;
+    char buffer[MAX_LINE], *line, inSpace = 1;
+    FILE *input;
+
+    /* start with no pulses, then realloc as needed */
+    *pulses = NULL;
+
+    /* open the file and read it line by line */
+    errno = EINVAL;
+    input = fopen(filename, "r");
+    if (input != NULL)
+    {
+        int lineNumber = 0;
+        while(fgets(buffer, MAX_LINE, input))
+        {
+            char *temp;
+            int value;
+            bool discard = false;
+
+            line = buffer;
+            success = false;
+            lineNumber++;
+
+            /* allocate space for one more (not it's not efficient) */
+            *pulses = (uint32_t*)realloc(*pulses,
+                                        sizeof(uint32_t) * (count + 1));
+            if (*pulses == NULL)
+                break;
+
+            /* ignore anything after a # in the line */
+            temp = strchr(line, '#');
+            if (temp != NULL)
+                temp[0] = '\0';
+
+            /* skip blank lines (or comments that got truncated) */
+            line += strspn(line, " \t\r\n");
+            if (line[0] == '\0')
+            {
+                success = true;
+                continue;
+            }
+
+            /* try to read the pulse or space (in a couple formats) */
+            if (sscanf(line, "pulse %d", &value) == 1 ||
+                sscanf(line, "pulse: %d", &value) == 1)
+            {
+                if (! inSpace)
+                {
+                    (*pulses)[count - 1] += value;
+                    message(LOG_WARN,
+                            "Combining pulses in pulse/space file %s(%d)\n",
+                            filename, lineNumber);
+                    discard = true;
+                }
+            }
+            else if (sscanf(line, "space %d", &value) == 1 ||
+                     sscanf(line, "space: %d", &value) == 1)
+            {
+                /* ignore any leading spaces */
+                if (count == 0)
+                    discard = true;
+                else if (inSpace)
+                {
+                    (*pulses)[count - 1] += value;
+                    message(LOG_WARN,
+                            "Combining spaces in pulse/space file %s(%d)\n",
+                            filename, lineNumber);
+                    discard = true;
+                }
+            }
+            /* A simple list of numbers is also acceptable.  I believe
+               this was to support some sort of LIRC raw codes. */
+            else if (sscanf(line, "%d", &value) != 1)
+            {
+                message(LOG_WARN,
+                       "Skipping unparsable line in pulse/space file %s(%d)\n",
+                        filename, lineNumber);
+                discard = true;
+            }
+
+            /* bump to the next code */
+            if (! discard)
+            {
+                if (inSpace)
+                    value |= IG_PULSE_BIT;
+                (*pulses)[count++] = value;
+                inSpace ^= 1;
+            }
+            success = true;
+        }
+
+        fclose(input);
+    }
+
+    /* free the buffer on failure */
+    if (! success)
+    {
+        free(*pulses);
+        count = -1;
+    }
+    /* trim a trailing space */
+    else if (inSpace)
+        count--;
+
+    return count;
+}
@@ -0,0 +1,19 @@
+/****************************************************************************
+ ** pulseFile.h *************************************************************
+ ****************************************************************************
+ *
+ * Pulse/space files hold one signal per line, "pulse 560" or
+ * "space 1690" (or a bare number, alternating), with # comments.
+ * Both the client library and igdaemon read them.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the LGPL version 2.1.
+ * See LICENSE-LGPL for license details.
+ */
+#pragma once
+
+/* returns the number of signals, in the IG_PULSE_BIT format, read
+   into a newly allocated *pulses, or -1 */
+int readPulseFile(const char *filename, uint32_t **pulses);
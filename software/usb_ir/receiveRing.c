@@ -0,0 +1,370 @@
+/****************************************************************************
+ ** receiveRing.c ***********************************************************
+ ****************************************************************************
+ *
+ * Shared memory rings of received pulses, written by igdaemon and
+ * read by the client library.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the LGPL version 2.1.
+ * See LICENSE-LGPL for license details.
+ */
+#include "config.h"
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_LINUX_FUTEX_H)
+    #define RECEIVE_RINGS 1
+    /* for memfd_create and the file seals, which compat.h hides */
+    #define _GNU_SOURCE
+#endif
+#include "iguanaIR.h"
+#ifndef RECEIVE_RINGS
+    #include "compat.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pipes.h"
+#include "receiveRing.h"
+
+#ifdef RECEIVE_RINGS
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+struct receiveRing
+{
+    receiveRingHeader *header;
+    size_t size;
+
+    /* the layout as checked when the ring was created or mapped, never
+       read back from the shared header */
+    char *entries;
+    size_t entrySize;
+    uint32_t entryCount;
+
+    /* the daemon keeps the memfd to hand out */
+    int fd;
+    /* entries were published since readers were last woken */
+    bool unwoken;
+
+    /* the sequence number a reader will take next */
+    uint64_t next;
+};
+
+static receiveRingEntry* ringEntry(receiveRing *ring, uint64_t sequence)
+{
+    return (receiveRingEntry*)(ring->entries + ring->entrySize *
+                               (sequence & (ring->entryCount - 1)));
+}
+
+receiveRing* createReceiveRing(unsigned int entries)
+{
+    receiveRing *ring;
+    unsigned int count = 1;
+
+    while(count < entries)
+        count *= 2;
+
+    ring = (receiveRing*)malloc(sizeof(receiveRing));
+    if (ring == NULL)
+        return NULL;
+    memset(ring, 0, sizeof(receiveRing));
+    ring->size = sizeof(receiveRingHeader) + sizeof(receiveRingEntry) * count;
+
+    ring->fd = memfd_create("igdaemon-receive-ring",
+                            MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring->fd != -1)
+    {
+        if (ftruncate(ring->fd, ring->size) == 0)
+        {
+            ring->header = (receiveRingHeader*)mmap(NULL, ring->size,
+                                                    PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED, ring->fd, 0);
+            if (ring->header == MAP_FAILED)
+                ring->header = NULL;
+        }
+
+        if (ring->header != NULL)
+        {
+            receiveRingHeader *header = ring->header;
+
+            header->magic = RECEIVE_RING_MAGIC;
+            header->version = RECEIVE_RING_VERSION;
+            header->headerSize = sizeof(receiveRingHeader);
+            header->entrySize = sizeof(receiveRingEntry);
+            header->entryCount = count;
+            header->head = 1;
+
+            ring->entries = (char*)header + sizeof(receiveRingHeader);
+            ring->entrySize = sizeof(receiveRingEntry);
+            ring->entryCount = count;
+
+            /* receivers get the same descriptor, so keep them from
+               resizing the ring or mapping it for writing */
+            fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#ifdef F_SEAL_FUTURE_WRITE
+            fcntl(ring->fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+            fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SEAL);
+            return ring;
+        }
+        close(ring->fd);
+    }
+
+    free(ring);
+    return NULL;
+}
+
+int receiveRingFd(const receiveRing *ring)
+{
+    return ring->fd;
+}
+
+void publishPulses(receiveRing *ring, const uint32_t *pulses, int count)
+{
+    receiveRingHeader *header = ring->header;
+
+    while(count > 0)
+    {
+        uint64_t sequence = header->head;
+        receiveRingEntry *entry = ringEntry(ring, sequence);
+        int length = count;
+
+        if (length > RECEIVE_RING_PULSES)
+            length = RECEIVE_RING_PULSES;
+
+        /* readers of the old contents see the change and skip it */
+        __atomic_store_n(&entry->sequence, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(entry->pulses, pulses, length * sizeof(uint32_t));
+        entry->count = length;
+        __atomic_store_n(&entry->sequence, sequence, __ATOMIC_RELEASE);
+        __atomic_store_n(&header->head, sequence + 1, __ATOMIC_RELEASE);
+
+        pulses += length;
+        count -= length;
+        ring->unwoken = true;
+    }
+}
+
+static void wakeAll(receiveRing *ring)
+{
+    __atomic_add_fetch(&ring->header->wakeups, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &ring->header->wakeups, FUTEX_WAKE, INT_MAX,
+            NULL, NULL, 0);
+    ring->unwoken = false;
+}
+
+void wakeReceivers(receiveRing *ring)
+{
+    if (ring->unwoken)
+        wakeAll(ring);
+}
+
+void closeReceiveRing(receiveRing *ring)
+{
+    if (ring == NULL)
+        return;
+
+    __atomic_store_n(&ring->header->closed, 1, __ATOMIC_RELEASE);
+    wakeAll(ring);
+    munmap(ring->header, ring->size);
+    close(ring->fd);
+    free(ring);
+}
+
+receiveRing* mapReceiveRing(int fd)
+{
+    receiveRing *ring;
+    struct stat info;
+    receiveRingHeader *header;
+    uint32_t entryCount;
+    uint16_t headerSize;
+
+    if (fstat(fd, &info) != 0)
+        return NULL;
+    if ((size_t)info.st_size < sizeof(receiveRingHeader))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    header = (receiveRingHeader*)mmap(NULL, info.st_size, PROT_READ,
+                                      MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+        return NULL;
+
+    /* make sure the daemon and library agree on the layout, reading
+       each field once so the checked values are the ones kept */
+    entryCount = header->entryCount;
+    headerSize = header->headerSize;
+    if (header->magic != RECEIVE_RING_MAGIC ||
+        header->version != RECEIVE_RING_VERSION ||
+        header->entrySize != sizeof(receiveRingEntry) ||
+        headerSize < sizeof(receiveRingHeader) ||
+        entryCount == 0 ||
+        (entryCount & (entryCount - 1)) != 0 ||
+        headerSize + sizeof(receiveRingEntry) *
+                     entryCount > (size_t)info.st_size)
+    {
+        munmap(header, info.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    ring = (receiveRing*)malloc(sizeof(receiveRing));
+    if (ring == NULL)
+        munmap(header, info.st_size);
+    else
+    {
+        memset(ring, 0, sizeof(receiveRing));
+        ring->header = header;
+        ring->size = info.st_size;
+        ring->entries = (char*)header + headerSize;
+        ring->entrySize = sizeof(receiveRingEntry);
+        ring->entryCount = entryCount;
+        ring->fd = -1;
+        ring->next = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    }
+    return ring;
+}
+
+int readReceiveRing(receiveRing *ring, uint32_t *pulses,
+                    uint32_t *missed, unsigned int timeout)
+{
+    receiveRingHeader *header = ring->header;
+    struct timespec deadline;
+
+    /* futexes take an absolute CLOCK_MONOTONIC deadline */
+    if (timeout != WAIT_FOREVER)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    *missed = 0;
+    for(;;)
+    {
+        uint64_t head;
+        uint32_t wakeups;
+
+        wakeups = __atomic_load_n(&header->wakeups, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        if (ring->next < head)
+        {
+            receiveRingEntry *entry = ringEntry(ring, ring->next);
+            uint32_t count;
+
+            /* entries the writer has lapped are reported as missed */
+            if (head - ring->next > ring->entryCount)
+            {
+                *missed = head - ring->entryCount - ring->next;
+                ring->next = head - ring->entryCount;
+                return 0;
+            }
+
+            if (__atomic_load_n(&entry->sequence,
+                                __ATOMIC_ACQUIRE) == ring->next)
+            {
+                count = entry->count;
+                if (count > RECEIVE_RING_PULSES)
+                    count = RECEIVE_RING_PULSES;
+                memcpy(pulses, entry->pulses, count * sizeof(uint32_t));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&entry->sequence,
+                                    __ATOMIC_RELAXED) == ring->next)
+                {
+                    ring->next++;
+                    return count;
+                }
+            }
+
+            /* rewritten while it was being read */
+            ring->next++;
+            *missed = 1;
+            return 0;
+        }
+
+        if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+        {
+            errno = ENODEV;
+            return -1;
+        }
+
+        /* sleep until the next batch changes wakeups */
+        if (syscall(SYS_futex, &header->wakeups, FUTEX_WAIT_BITSET, wakeups,
+                    timeout == WAIT_FOREVER ? NULL : &deadline,
+                    NULL, FUTEX_BITSET_MATCH_ANY) == -1 &&
+            errno == ETIMEDOUT)
+            return 0;
+    }
+}
+
+void unmapReceiveRing(receiveRing *ring)
+{
+    if (ring != NULL)
+    {
+        munmap(ring->header, ring->size);
+        free(ring);
+    }
+}
+
+#else
+/* without memfds and futexes there are no receive rings */
+
+receiveRing* createReceiveRing(unsigned int UNUSED(entries))
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int receiveRingFd(const receiveRing *UNUSED(ring))
+{
+    return -1;
+}
+
+void publishPulses(receiveRing *UNUSED(ring), const uint32_t *UNUSED(pulses),
+                   int UNUSED(count))
+{
+}
+
+void wakeReceivers(receiveRing *UNUSED(ring))
+{
+}
+
+void closeReceiveRing(receiveRing *UNUSED(ring))
+{
+}
+
+receiveRing* mapReceiveRing(int UNUSED(fd))
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int readReceiveRing(receiveRing *UNUSED(ring), uint32_t *UNUSED(pulses),
+                    uint32_t *UNUSED(missed), unsigned int UNUSED(timeout))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void unmapReceiveRing(receiveRing *UNUSED(ring))
+{
+}
+#endif
@@ -0,0 +1,77 @@
+/****************************************************************************
+ ** receiveRing.h ***********************************************************
+ ****************************************************************************
+ *
+ * A ring of decoded pulses that igdaemon publishes in shared memory.
+ * The daemon is the only writer, and any number of local receivers
+ * map the ring read only and wait on it with a futex, so publishing
+ * costs the same however many receivers there are.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the LGPL version 2.1.
+ * See LICENSE-LGPL for license details.
+ */
+#pragma once
+
+#define RECEIVE_RING_MAGIC 0x69677272
+#define RECEIVE_RING_VERSION 1
+
+enum
+{
+    /* pulses per entry, longer receives take several entries */
+    RECEIVE_RING_PULSES = 64
+};
+
+typedef struct receiveRingHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    /* the entries start headerSize bytes into the mapping */
+    uint16_t headerSize;
+    uint32_t entrySize;
+    /* always a power of two */
+    uint32_t entryCount;
+
+    /* sequence number the next entry will be published with, the
+       first entry is number 1 */
+    volatile uint64_t head;
+
+    /* bumped after each batch of entries for readers to wait on */
+    volatile uint32_t wakeups;
+    /* set once the device is gone and nothing more will be published */
+    volatile uint32_t closed;
+} receiveRingHeader;
+
+typedef struct receiveRingEntry
+{
+    /* sequence number of the pulses held, 0 while they are rewritten */
+    volatile uint64_t sequence;
+    uint32_t count;
+    uint32_t reserved;
+    uint32_t pulses[RECEIVE_RING_PULSES];
+} receiveRingEntry;
+
+typedef struct receiveRing receiveRing;
+
+/* used by the daemon, which passes receiveRingFd on to receivers */
+receiveRing* createReceiveRing(unsigned int entries);
+int receiveRingFd(const receiveRing *ring);
+void publishPulses(receiveRing *ring, const uint32_t *pulses, int count);
+/* wake the readers if anything was published since the last call */
+void wakeReceivers(receiveRing *ring);
+/* mark the ring closed to its readers and release it */
+void closeReceiveRing(receiveRing *ring);
+
+/* used by clients, which read from the entries published after the
+   ring was mapped; the mapping does not need fd to stay open */
+receiveRing* mapReceiveRing(int fd);
+/* copy the next entry into pulses, which holds RECEIVE_RING_PULSES,
+   and return the count.  0 is returned either with *missed set to
+   the number of entries overwritten before they could be read, or on
+   timeout with errno set to ETIMEDOUT.  -1 is an error, ENODEV once
+   the ring has been closed. */
+int readReceiveRing(receiveRing *ring, uint32_t *pulses,
+                    uint32_t *missed, unsigned int timeout);
+void unmapReceiveRing(receiveRing *ring);
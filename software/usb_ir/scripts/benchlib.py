@@ -0,0 +1,161 @@
+#
+# Helpers shared by the *-benchmark scripts in this directory, which
+# import it from their own directory: the client library and libc
+# through ctypes, connecting to igdaemon through the library or a raw
+# socket, the packet layouts written to that socket, building and
+# sending pulses, and the cpu time a process has used.
+
+import ctypes
+import os
+import socket
+import struct
+import sys
+import time
+
+IG_DEV_ERROR = 0x00
+IG_DEV_SEND = 0x15
+IG_EXCH_VERSIONS = 0xFE
+IG_PROTOCOL_VERSION = 1
+
+# mirrors dataPacket, which protocol 1 writes to the socket as is
+class DataPacket(ctypes.Structure):
+    _fields_ = [ ('prev', ctypes.c_void_p),
+                 ('next', ctypes.c_void_p),
+                 ('list', ctypes.c_void_p),
+                 ('code', ctypes.c_ubyte),
+                 ('dataLen', ctypes.c_int),
+                 ('data', ctypes.c_void_p) ]
+
+# mirrors packetHeader from protocol 2 on
+FRAME = struct.Struct('=BBHi')
+
+libc = ctypes.CDLL(None)
+libc.malloc.restype = ctypes.c_void_p
+libc.malloc.argtypes = [ ctypes.c_size_t ]
+libc.free.argtypes = [ ctypes.c_void_p ]
+libc.strdup.restype = ctypes.c_void_p
+libc.strdup.argtypes = [ ctypes.c_char_p ]
+
+def loadLibrary(path):
+    lib = ctypes.CDLL(path, use_errno = True)
+    lib.iguanaConnect_real.restype = ctypes.c_int
+    lib.iguanaConnect_real.argtypes = [ ctypes.c_char_p, ctypes.c_uint ]
+    lib.iguanaClose.argtypes = [ ctypes.c_int ]
+    lib.iguanaCreateRequest.restype = ctypes.c_void_p
+    lib.iguanaCreateRequest.argtypes = [ ctypes.c_ubyte, ctypes.c_uint,
+                                         ctypes.c_void_p ]
+    # responses are collected through a byref(c_void_p) or skipped
+    # with None
+    lib.iguanaTransaction.restype = ctypes.c_bool
+    lib.iguanaTransaction.argtypes = [ ctypes.c_int, ctypes.c_void_p,
+                                       ctypes.c_void_p ]
+    lib.iguanaWriteRequest.restype = ctypes.c_bool
+    lib.iguanaWriteRequest.argtypes = [ ctypes.c_void_p, ctypes.c_int ]
+    lib.iguanaReadResponse.restype = ctypes.c_void_p
+    lib.iguanaReadResponse.argtypes = [ ctypes.c_int, ctypes.c_uint ]
+    lib.iguanaResponseIsError.restype = ctypes.c_bool
+    lib.iguanaResponseIsError.argtypes = [ ctypes.c_void_p ]
+    lib.iguanaCode.restype = ctypes.c_ubyte
+    lib.iguanaCode.argtypes = [ ctypes.c_void_p ]
+    lib.iguanaRemoveData.restype = ctypes.c_void_p
+    lib.iguanaRemoveData.argtypes = [ ctypes.c_void_p,
+                                      ctypes.POINTER(ctypes.c_uint) ]
+    lib.iguanaFreePacket.argtypes = [ ctypes.c_void_p ]
+    lib.iguanaReadPulseFile.restype = ctypes.c_int
+    lib.iguanaReadPulseFile.argtypes = [ ctypes.c_char_p,
+                                         ctypes.POINTER(ctypes.c_void_p) ]
+    lib.iguanaSendPulsesFd.restype = ctypes.c_bool
+    lib.iguanaSendPulsesFd.argtypes = [ ctypes.c_int, ctypes.c_int,
+                                        ctypes.c_uint, ctypes.c_uint ]
+    lib.iguanaSendPulsesAt.restype = ctypes.c_bool
+    lib.iguanaSendPulsesAt.argtypes = [ ctypes.c_int, ctypes.c_void_p,
+                                        ctypes.c_uint, ctypes.c_ulonglong,
+                                        ctypes.POINTER(ctypes.c_longlong) ]
+    lib.iguanaMapReceiveRing.restype = ctypes.c_void_p
+    lib.iguanaMapReceiveRing.argtypes = [ ctypes.c_int ]
+    lib.iguanaReadReceiveRing.restype = ctypes.c_void_p
+    lib.iguanaReadReceiveRing.argtypes = [ ctypes.c_void_p, ctypes.c_uint ]
+    lib.iguanaUnmapReceiveRing.argtypes = [ ctypes.c_void_p ]
+    return lib
+
+def connect(lib, timeout, name = '0'):
+    # retry while igdaemon starts and finds its devices
+    end = time.time() + timeout
+    while True:
+        conn = lib.iguanaConnect_real(name.encode(), IG_PROTOCOL_VERSION)
+        if conn != -1:
+            return conn
+        if time.time() > end:
+            sys.exit('failed to connect to %s' % name)
+        time.sleep(0.1)
+
+def connectSocket(path, timeout = 0, rcvbuf = 0):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    if rcvbuf:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+    end = time.time() + timeout
+    while True:
+        try:
+            sock.connect(path)
+            return sock
+        except socket.error:
+            if time.time() > end:
+                raise
+            time.sleep(0.1)
+
+def request(code, data = b''):
+    # a protocol 1 request, header and payload
+    packet = DataPacket()
+    packet.code = code
+    packet.dataLen = len(data)
+    return bytes(bytearray(packet)) + data
+
+def readExactly(sock, size):
+    data = b''
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            sys.exit('igdaemon closed the connection')
+        data += chunk
+    return data
+
+def response(sock):
+    # a protocol 1 response as (code, data), exiting on an error
+    packet = DataPacket.from_buffer_copy(readExactly(sock, ctypes.sizeof(DataPacket)))
+    data = b''
+    if packet.dataLen > 0:
+        data = readExactly(sock, packet.dataLen)
+    if packet.code == IG_DEV_ERROR:
+        sys.exit('request failed: %s' % os.strerror(-packet.dataLen))
+    return packet.code, data
+
+def pulseArray(count, which = 0):
+    # NEC style bits, each which a different pattern of ones and zeros
+    # and 0 an even run of 560us pulses and spaces
+    lengths = []
+    for x in range(count):
+        if x % 2 == 0 or (which >> (x // 2 % 16)) & 1 == 0:
+            lengths.append(560)
+        else:
+            lengths.append(1690)
+    return (ctypes.c_uint32 * count)(*lengths)
+
+def sendPulses(lib, conn, pulses, response = None):
+    # the request owns a copy of the pulses, as a client building one
+    # would, and the response is collected as for iguanaTransaction
+    size = ctypes.sizeof(pulses)
+    data = libc.malloc(size)
+    ctypes.memmove(data, pulses, size)
+    request = lib.iguanaCreateRequest(IG_DEV_SEND, size, data)
+    success = lib.iguanaTransaction(conn, request, response)
+    lib.iguanaFreePacket(request)
+    return success
+
+def sendSocket(lib, conn, pulses):
+    if not sendPulses(lib, conn, pulses):
+        sys.exit('send failed: %s' % os.strerror(ctypes.get_errno()))
+
+def cpuTime(pid):
+    with open('/proc/%d/stat' % pid) as stat:
+        fields = stat.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK'))
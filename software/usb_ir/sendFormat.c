@@ -27,10 +27,20 @@ int pulsesToIguanaSend(int carrier,
 {
     int x, codeLength = 0, inSpace = 0;
     uint32_t lastCycles = 0;
+    unsigned char *codes = NULL;
 
     /* prepare/clear the output buffer */
     if (results != NULL)
+    {
+        /* size the buffer up front rather than growing it per pulse */
         *results = NULL;
+        codeLength = pulsesToIguanaSend(carrier, sendCode, length,
+                                        NULL, compress);
+        if (codeLength == 0 ||
+            (codes = (unsigned char*)malloc(codeLength)) == NULL)
+            return 0;
+        codeLength = 0;
+    }
 
     /* convert each pulse */
     for(x = 0; x < length; x++)
@@ -47,8 +57,9 @@ int pulsesToIguanaSend(int carrier,
         fprintf(stderr, "%5d ", sendCode[x] & IG_PULSE_MASK);
 #endif
 
-        cycles = (uint32_t)((sendCode[x] & IG_PULSE_MASK) /
-                            1000000.0 * carrier + 0.5);
+        /* rounded to the nearest cycle without going through a double */
+        cycles = (uint32_t)(((uint64_t)(sendCode[x] & IG_PULSE_MASK) *
+                             carrier + 500000) / 1000000);
         numBytes = (cycles / MAX_DATA_BYTE) + 1;
         cycles %= MAX_DATA_BYTE;
         if (cycles == 0)
@@ -76,20 +87,16 @@ int pulsesToIguanaSend(int carrier,
                 cycles |= STATE_MASK;
 
             /* store the codes to return to the user if requested */
-            if (results != NULL)
+            if (codes != NULL)
             {
-                /* allocate space as we go */
-                *results = realloc(*results,
-                                   sizeof(char) * (codeLength + numBytes));
-
                 /* populate the buffer with max bytes */
-                memset(*results + codeLength,
+                memset(codes + codeLength,
                        LENGTH_MASK | (inSpace * STATE_MASK),
                        numBytes - 1);
 
                 /* store the last byte
                    (cast is alright due to %= MAX_DATA_BYTE) */
-                (*results)[codeLength + numBytes - 1] = (unsigned char)cycles;
+                codes[codeLength + numBytes - 1] = (unsigned char)cycles;
             }
 
 #if DEBUG_TRANSMIT_BUFFER
@@ -109,6 +116,7 @@ int pulsesToIguanaSend(int carrier,
         inSpace ^= 1;
     }
 
+    if (results != NULL)
+        *results = codes;
     return codeLength;
 }
-
@@ -27,6 +27,12 @@
 #include "server.h"
 #include "pipes.h"
 #include "client-interface.h"
+#include "codeStore.h"
+#include "encodeCache.h"
+#ifndef WIN32
+    #include "dataPackets.h"
+    #include "deviceGroup.h"
+#endif
 
 /* global variables, internal and shared */
 serverSettings srvSettings;
@@ -37,12 +43,14 @@ usbId usbIds[] = {
 
 void triggerCommand(THREAD_PTR cmd)
 {
-    THREAD_PTR flg = INVALID_THREAD_PTR;
+    THREAD_PTR msg[2] = {INVALID_THREAD_PTR};
     if (cmd == (THREAD_PTR)QUIT_TRIGGER)
         message(LOG_INFO, "Triggering shutdown.\n");
 
-    if (writePipe(srvSettings.commPipe[WRITE], &flg, sizeof(THREAD_PTR)) != sizeof(THREAD_PTR) ||
-        writePipe(srvSettings.commPipe[WRITE], &cmd, sizeof(THREAD_PTR)) != sizeof(THREAD_PTR))
+    /* flag and command go in one write so that triggers from several
+       threads cannot interleave */
+    msg[1] = cmd;
+    if (writePipe(srvSettings.commPipe[WRITE], msg, sizeof(msg)) != sizeof(msg))
         message(LOG_ERROR, "failed to write flag and command over commPipe: %s\n",
                 translateError(errno));
 }
@@ -59,6 +67,17 @@ void initServerSettings()
     srvSettings.preferredCount = 0;
     srvSettings.preferred[srvSettings.preferredCount++] = NULL;
 
+    /* no named codes unless given a directory of them */
+    srvSettings.codeDir = NULL;
+
+    /* enough for a few hundred typical codes */
+    srvSettings.encodeCache = 256 * 1024;
+
+    /* talk to the real hardware unless asked to replay a trace */
+    srvSettings.recordPath = NULL;
+    srvSettings.replayPath = NULL;
+    srvSettings.replaySpeed = 1;
+
     /* timeouts that can be adjusted for different conditions */
 #ifdef LIBUSB_NO_THREADS
   #ifdef LIBUSB_NO_THREADS_OPTION
@@ -71,6 +90,32 @@ void initServerSettings()
 #endif
     srvSettings.devSettings.sendTimeout = 1000;
 
+    /* keep a few receives queued when the driver can do so */
+    srvSettings.devSettings.recvTransfers = 4;
+
+    /* enough pooled packets to absorb a burst while the worker is busy */
+    srvSettings.devSettings.poolPackets = 32;
+
+    /* a worker stuck on a slow client may fall this far behind */
+    srvSettings.devSettings.recvQueue = 256;
+
+    /* local receivers that map the ring may fall this far behind */
+    srvSettings.devSettings.ringEntries = 1024;
+
+    /* longer than the spaces inside any common remote's frames */
+    srvSettings.devSettings.frameGap = 10000;
+
+    /* keep a few control requests in flight, but the windows service
+       does not watch for acks outside of a transaction */
+#ifdef WIN32
+    srvSettings.devSettings.pipelineDepth = 1;
+#else
+    srvSettings.devSettings.pipelineDepth = 4;
+#endif
+
+    /* replaying the device's buffer skips moving repeated codes */
+    srvSettings.devSettings.autoResend = true;
+
     /* EPIPE usually means device disconnect, but not reliably */
     srvSettings.devSettings.disconnectOnEPipe = false;
 
@@ -80,6 +125,9 @@ void initServerSettings()
     /* default to rescaning when a device is lost */
     srvSettings.autoRescan = true;
 
+    /* default to hotplug events where the driver supports them */
+    srvSettings.hotplug = true;
+
     /* default to claiming the hardware devices */
     srvSettings.justDescribe = false;
 
@@ -94,6 +142,16 @@ void initServerSettings()
     srvSettings.ctlSockThread = INVALID_THREAD_PTR;
     initializeList(&srvSettings.ctlClients);
 
+    /* default to a reader and worker thread per device */
+    srvSettings.eventThreads = 0;
+
+    /* leave room for bursts of short lived connections */
+    srvSettings.listenBacklog = 128;
+
+    /* keep the newest receive data for clients that fall behind */
+    srvSettings.clientQueue = 64;
+    srvSettings.clientOverflow = OVERFLOW_DROP_OLDEST;
+
     /* list of known devices */
     InitializeCriticalSection(&srvSettings.devsLock);
     initializeList(&srvSettings.devs);
@@ -120,9 +178,12 @@ static struct argp_option options[] =
 
     { NULL, 0, NULL, 0, "Miscellaneous options:", MSC_GROUP },
     { "no-auto-rescan",  ARG_NO_RESCAN,    NULL,     0, "Do not automatically rescan the USB bus after device disconnect.",              MSC_GROUP },
+    { "no-hotplug",      ARG_NO_HOTPLUG,   NULL,     0, "Do not use driver hotplug events, only rescan the USB bus on SIGHUP.",          MSC_GROUP },
     { "no-ids",          ARG_NO_IDS,       NULL,     0, "Do not query the device for its label.",                                        MSC_GROUP },
     { "no-labels",       ARG_NO_IDS,       NULL,     0, "DEPRECATED: same as --no-ids",                                                  MSC_GROUP },
     { "scan-timer",      ARG_SCANWHEN,   "SECS",     0, "Periodically rescan the USB bus for new devices regardless of hotplug events.", MSC_GROUP },
+    { "code-dir",        ARG_CODE_DIR,    "DIR",     0, "Load each pulse/space file in DIR as a code clients can send by name.",        MSC_GROUP },
+    { "encode-cache",    ARG_ENCODE_CACHE, "KB",     0, "Keep up to KB kilobytes of encoded sends for reuse, 0 disables the cache.",     MSC_GROUP },
 #ifdef __APPLE__
     { "no-bad-toggle-fix", ARG_BADTOGGLE,  NULL,     0, "On OS X our hardware has a data toggle mismatch and this disables the works around.", MSC_GROUP },
 #else
@@ -161,6 +222,10 @@ static error_t parseOption(int key, char *arg, struct argp_state *state)
         srvSettings.autoRescan = false;
         break;
 
+    case ARG_NO_HOTPLUG:
+        srvSettings.hotplug = false;
+        break;
+
     case ARG_SCANWHEN:
     {
         char *end;
@@ -175,6 +240,24 @@ static error_t parseOption(int key, char *arg, struct argp_state *state)
         break;
     }
 
+    case ARG_CODE_DIR:
+        srvSettings.codeDir = arg;
+        break;
+
+    case ARG_ENCODE_CACHE:
+    {
+        char *end;
+        long int res = strtol(arg, &end, 0);
+        if (arg[0] == '\0' || end[0] != '\0' || res < 0 || res > 1024 * 1024)
+        {
+            argp_error(state, "Encode cache requires a size in kilobytes between 0 and 1048576\n");
+            return ARGP_HELP_STD_ERR;
+        }
+        else
+            srvSettings.encodeCache = res * 1024;
+        break;
+    }
+
     case ARG_BADTOGGLE:
 #ifdef __APPLE__
         srvSettings.fixToggle = false;
@@ -212,6 +295,11 @@ static void* scanTrigger(void *junk)
     return NULL;
 }
 
+static void hotplugNotify()
+{
+    triggerCommand((THREAD_PTR)HOTPLUG_TRIGGER);
+}
+
 static bool ctlSockListening = true;
 static void* ctlSockListener(void *junk)
 {
@@ -223,6 +311,24 @@ static void* ctlSockListener(void *junk)
     return NULL;
 }
 
+static bool loadDriverLayer()
+{
+#ifndef WIN32
+    if (srvSettings.replayPath != NULL)
+        return replayDriver(srvSettings.replayPath, srvSettings.replaySpeed);
+#endif
+
+    if (! findDriver(srvSettings.driverDir,
+                     srvSettings.preferred, srvSettings.onlyPreferred))
+        return false;
+
+#ifndef WIN32
+    if (srvSettings.recordPath != NULL)
+        return recordDriver(srvSettings.recordPath);
+#endif
+    return true;
+}
+
 bool initServer()
 {
     bool retval = false;
@@ -236,8 +342,41 @@ bool initServer()
             "  recvTimeout: %d\n", srvSettings.devSettings.recvTimeout);
     message(LOG_DEBUG,
             "  sendTimeout: %d\n", srvSettings.devSettings.sendTimeout);
+    message(LOG_DEBUG,
+            "  recvTransfers: %d\n", srvSettings.devSettings.recvTransfers);
+    message(LOG_DEBUG,
+            "  poolPackets: %d\n", srvSettings.devSettings.poolPackets);
+    message(LOG_DEBUG,
+            "  recvQueue: %d\n", srvSettings.devSettings.recvQueue);
+    message(LOG_DEBUG,
+            "  ringEntries: %d\n", srvSettings.devSettings.ringEntries);
+    message(LOG_DEBUG,
+            "  frameGap: %d\n", srvSettings.devSettings.frameGap);
+    message(LOG_DEBUG,
+            "  pipelineDepth: %d\n", srvSettings.devSettings.pipelineDepth);
+    message(LOG_DEBUG,
+            "  autoResend: %d\n", srvSettings.devSettings.autoResend);
+    message(LOG_DEBUG,
+            "  eventThreads: %d\n", srvSettings.eventThreads);
+    message(LOG_DEBUG,
+            "  listenBacklog: %d\n", srvSettings.listenBacklog);
+    message(LOG_DEBUG,
+            "  clientQueue: %d\n", srvSettings.clientQueue);
+    message(LOG_DEBUG,
+            "  clientOverflow: %d\n", srvSettings.clientOverflow);
+    message(LOG_DEBUG,
+            "  codeDir: %s\n",
+            srvSettings.codeDir == NULL ? "none" : srvSettings.codeDir);
+    message(LOG_DEBUG,
+            "  encodeCache: %u\n", srvSettings.encodeCache);
     initializeDriverLayer(currentLogSettings());
 
+    /* clients may start sending named codes as soon as they connect */
+    initCodeStore();
+    if (srvSettings.codeDir != NULL)
+        loadCodes(srvSettings.codeDir);
+    initEncodeCache(srvSettings.encodeCache);
+
     /* prepare the pipe for shutting down any scan thread */
     if (! createPipePair(srvSettings.scanTimerPipe))
         message(LOG_ERROR, "failed to create the scan timer pipe pair\n");
@@ -268,16 +407,31 @@ bool initServer()
             message(LOG_ERROR, "failed to open communication pipe.\n");
 #endif
         }
-        else if (! findDriver(srvSettings.driverDir,
-                              srvSettings.preferred, srvSettings.onlyPreferred))
+        else if (! loadDriverLayer())
             message(LOG_ERROR, "failed to find a loadable driver layer.\n");
         else if (! initializeDriver())
             message(LOG_ERROR, "failed to initialize the loadable driver layer.\n");
+#ifndef WIN32
+        else if (srvSettings.eventThreads > 0 &&
+                 ! startReactors(srvSettings.eventThreads))
+            message(LOG_ERROR, "failed to start the event threads.\n");
+        else if (! srvSettings.justDescribe && ! startGroups())
+            message(LOG_ERROR, "failed to start the group listeners.\n");
+#endif
         else if ((srvSettings.list = prepareDeviceList(usbIds, startWorker)) == NULL)
             message(LOG_ERROR, "failed to initialize the device list.\n");
         else
         {
             claimDevices(srvSettings.list, ! srvSettings.justDescribe, srvSettings.unbind);
+
+            /* rescans remain available as a fallback */
+            if (srvSettings.hotplug && ! srvSettings.justDescribe)
+            {
+                if (enableHotplug(srvSettings.list, hotplugNotify))
+                    message(LOG_INFO, "Using hotplug events to track devices.\n");
+                else
+                    message(LOG_INFO, "Hotplug events unavailable, relying on rescans.\n");
+            }
             retval = true;
         }
     }
@@ -327,6 +481,9 @@ void waitOnCommPipe()
         /* handle the shutdown command */
         else if (thread == (THREAD_PTR)QUIT_TRIGGER)
             quit = true;
+        /* attach/detach just the devices that changed */
+        else if (thread == (THREAD_PTR)HOTPLUG_TRIGGER)
+            handleHotplug(srvSettings.list);
         /* complain about unknown commands */
         else if (thread != (THREAD_PTR)SCAN_TRIGGER)
             message(LOG_ERROR,
@@ -476,9 +633,107 @@ char* deviceAddress(const char *name)
     return strdup(info.result);
 }
 
+/* does the index or one of the aliases of idev match name? */
+static bool deviceNamed(const iguanaDev *idev, const char *name)
+{
+    char idBuf[8];
+
+    sprintf(idBuf, "%d", idev->usbDev->id);
+    return strcmp(idBuf, name) == 0 ||
+           (idev->locAlias != NULL && strcmp(idev->locAlias, name) == 0) ||
+           (idev->userAlias != NULL && strcmp(idev->userAlias, name) == 0);
+}
+
+static bool gatherLatencies(itemHeader *item, void *userData)
+{
+    findAddrInfo *info = (findAddrInfo*)userData;
+    iguanaDev *idev = (iguanaDev*)item;
+    char *lines;
+
+    /* only the named device if there is a name */
+    if (info->name != NULL && ! deviceNamed(idev, info->name))
+        return true;
+
+    lines = latencySummary(idev);
+    if (lines != NULL)
+    {
+        int len = 0;
+
+        if (info->result != NULL)
+            len = strlen(info->result);
+        info->result = (char*)realloc(info->result, len + strlen(lines) + 1);
+        strcpy(info->result + len, lines);
+        free(lines);
+    }
+    return true;
+}
+
+char* deviceLatencies(const char *name)
+{
+    findAddrInfo info = {NULL, NULL};
+
+    info.name = name;
+    EnterCriticalSection(&srvSettings.devsLock);
+    forEach(&srvSettings.devs, gatherLatencies, &info);
+    LeaveCriticalSection(&srvSettings.devsLock);
+    return info.result;
+}
+
+bool deviceSendSettings(const char *name, int *carrier, int *compression)
+{
+    bool retval = false;
+    itemHeader *item;
+
+    EnterCriticalSection(&srvSettings.devsLock);
+    for(item = srvSettings.devs.head; item != NULL; item = item->next)
+        if (deviceNamed((iguanaDev*)item, name))
+        {
+            *carrier = ((iguanaDev*)item)->carrier;
+            *compression = sendCompression((iguanaDev*)item);
+            retval = true;
+            break;
+        }
+    LeaveCriticalSection(&srvSettings.devsLock);
+
+    return retval;
+}
+
+bool deviceLoad(const char *name, unsigned int *pending, uint64_t *latency)
+{
+    bool retval = false;
+    itemHeader *item;
+
+    EnterCriticalSection(&srvSettings.devsLock);
+    for(item = srvSettings.devs.head; item != NULL; item = item->next)
+        if (deviceNamed((iguanaDev*)item, name))
+        {
+            iguanaDev *idev = (iguanaDev*)item;
+
+            /* the counts belong to the device thread, but a stale
+               value only skews the next choice a little */
+            *pending = idev->queuedRequests + idev->inFlight.count;
+            *latency = recentLatency(idev, IG_DEV_SEND);
+            retval = true;
+            break;
+        }
+    LeaveCriticalSection(&srvSettings.devsLock);
+
+    return retval;
+}
+
 void cleanupServer()
 {
+    /* shut down the ctl listener, and with it the group listeners,
+       before what their clients use is released */
+    closePipe(srvSettings.ctlSockPipe[WRITE]);
+    joinThread(srvSettings.ctlSockThread, NULL);
+#ifndef WIN32
+    stopGroups();
+#endif
+
     cleanupDriver();
+    cleanupCodeStore();
+    cleanupEncodeCache();
     closePipe(srvSettings.commPipe[WRITE]);
     closePipe(srvSettings.commPipe[READ]);
 #if DEBUG
@@ -486,10 +741,6 @@ message(LOG_WARN, "CLOSE %d %s(%d)\n", srvSettings.commPipe[WRITE], __FILE__, __
 message(LOG_WARN, "CLOSE %d %s(%d)\n", srvSettings.commPipe[READ],  __FILE__, __LINE__);
 #endif
 
-    /* shut down the ctl listener */
-    closePipe(srvSettings.ctlSockPipe[WRITE]);
-    joinThread(srvSettings.ctlSockThread, NULL);
-
     /* shut down any scan timer */
     closePipe(srvSettings.scanTimerPipe[WRITE]);
     if (srvSettings.scanSeconds > 0)
@@ -20,7 +20,8 @@ enum
     /* start possible commands that can be triggered by signals at an
        arbitrary but recognizable value */
     SCAN_TRIGGER = 0x55,
-    QUIT_TRIGGER
+    QUIT_TRIGGER,
+    HOTPLUG_TRIGGER
 };
 void triggerCommand(THREAD_PTR cmd);
 
@@ -33,6 +34,9 @@ enum
     ARG_BADTOGGLE,
     ARG_ONLY_PREFER,
     ARG_DRIVER_DIR,
+    ARG_NO_HOTPLUG,
+    ARG_CODE_DIR,
+    ARG_ENCODE_CACHE,
     LAST_BASE_ARG,
 
     /* defines for argp */
@@ -41,6 +45,14 @@ enum
     HELP_GROUP
 };
 
+/* ways to handle receive data that does not fit a client's queue */
+enum
+{
+    OVERFLOW_DROP_OLDEST,
+    OVERFLOW_DROP_NEWEST,
+    OVERFLOW_DISCONNECT
+};
+
 typedef struct
 {
     /* driver location and prefered driver information */
@@ -49,6 +61,16 @@ typedef struct
               **preferred;
     int preferredCount;
 
+    /* pulse/space files loaded as named codes, or NULL for none */
+    const char *codeDir;
+
+    /* bytes of encoded sends kept for reuse, 0 for none */
+    unsigned int encodeCache;
+
+    /* record the usb traffic to, or replay it from, a trace file */
+    const char *recordPath, *replayPath;
+    double replaySpeed;
+
     /* timeouts and other device settings */
     deviceSettings devSettings;
 
@@ -58,6 +80,9 @@ typedef struct
     /* should the server rescan the usb bus after a disconnect */
     bool autoRescan;
 
+    /* use driver hotplug events instead of rescans when possible */
+    bool hotplug;
+
     /* user may request that we just print information about devices */
     bool justDescribe;
 
@@ -74,6 +99,19 @@ typedef struct
     listHeader ctlClients;
     PIPE_PTR ctlSockPipe[2];
 
+    /* number of shared threads serving all devices, 0 gives each
+       device a reader and worker thread of its own */
+    int eventThreads;
+
+    /* connections each listening socket queues before they are
+       accepted */
+    int listenBacklog;
+
+    /* received packets queued for a client that is not reading, and
+       what happens to the ones that do not fit */
+    int clientQueue;
+    int clientOverflow;
+
     /* a locked list of known devices */
     LOCK_PTR devsLock;
     listHeader devs;
@@ -101,6 +139,14 @@ void waitOnCommPipe();
 char* aliasSummary();
 char* deviceSummary();
 char* deviceAddress(const char *name);
+char* deviceLatencies(const char *name);
+/* the carrier and COMPRESS_VER* a send to the named device is
+   encoded with, false if there is no such device */
+bool deviceSendSettings(const char *name, int *carrier, int *compression);
+/* the requests waiting on or in flight to the named device and the
+   recent microseconds its sends took, false if there is no such
+   device */
+bool deviceLoad(const char *name, unsigned int *pending, uint64_t *latency);
 void cleanupServer();
 
 /* usb ids that we support */
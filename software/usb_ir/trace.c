@@ -0,0 +1,1100 @@
+/****************************************************************************
+ ** trace.c *****************************************************************
+ ****************************************************************************
+ *
+ * Record the traffic between the daemon and a driver to a compact
+ * binary trace and replay such a trace (or a usbmon text capture)
+ * later in place of the hardware.  A trace is the magic "IGTR", a
+ * version byte and the starting microsSinceX() as a varint, followed
+ * by records of:
+ *
+ *   type (1 byte), device id, microseconds since the previous record
+ *
+ * plus, for device records, the max packet size, bus, device index,
+ * vendor and product, and for transfers a zigzag encoded return
+ * value, errno (only if negative), payload length and payload.  All
+ * numbers are unsigned LEB128 varints.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+#include "iguanaIR.h"
+#include "compat.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "logging.h"
+#include "list.h"
+#include "trace.h"
+
+enum
+{
+    TRACE_VERSION = 1,
+
+    /* record types */
+    TRACE_DEVICE = 'D',
+    TRACE_SEND   = 'S',
+    TRACE_RECV   = 'R',
+
+    /* the largest record header (type plus 6 varints) */
+    MAX_HEADER = 1 + 6 * 10,
+
+    /* packet size assumed for devices that never said */
+    DEFAULT_PACKET_SIZE = 8,
+
+    /* a response whose request never came is released once the
+       daemon has made no request for this long */
+    REPLAY_GRACE = 5000000
+};
+
+static const char traceMagic[4] = {'I', 'G', 'T', 'R'};
+
+/* shared by the recorder and the replayer, only one is ever in use */
+static LOCK_PTR traceLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int putVarint(unsigned char *buffer, uint64_t value)
+{
+    int length = 0;
+
+    do
+    {
+        buffer[length] = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            buffer[length] |= 0x80;
+        length++;
+    } while(value != 0);
+
+    return length;
+}
+
+static bool getVarint(const unsigned char **pos, const unsigned char *end,
+                      uint64_t *value)
+{
+    int shift;
+
+    *value = 0;
+    for(shift = 0; *pos < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *(*pos)++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+/****************************************************************************
+ ** recording ***************************************************************
+ ****************************************************************************/
+
+static driverImpl *realImpl = NULL;
+static driverImpl recordImpl;
+static FILE *traceFile = NULL;
+static uint64_t lastRecord;
+
+typedef struct recordedRecv
+{
+    deviceInfo *info;
+    recvFunc callback;
+    void *userData;
+} recordedRecv;
+
+static void writeRecord(unsigned char type, unsigned int id,
+                        const uint64_t *fields, int count,
+                        const void *data, int length)
+{
+    unsigned char header[MAX_HEADER];
+    uint64_t now;
+    int used = 0, x;
+
+    EnterCriticalSection(&traceLock);
+    if (traceFile != NULL)
+    {
+        now = microsSinceX();
+        header[used++] = type;
+        used += putVarint(header + used, id);
+        used += putVarint(header + used, now - lastRecord);
+        for(x = 0; x < count; x++)
+            used += putVarint(header + used, fields[x]);
+        lastRecord = now;
+
+        if (fwrite(header, 1, used, traceFile) != (size_t)used ||
+            (length > 0 &&
+             fwrite(data, 1, length, traceFile) != (size_t)length))
+        {
+            message(LOG_ERROR, "Failed to write the trace, stopping: %s\n",
+                    translateError(errno));
+            fclose(traceFile);
+            traceFile = NULL;
+        }
+    }
+    LeaveCriticalSection(&traceLock);
+}
+
+static void recordTransfer(unsigned char type, deviceInfo *info,
+                           int retval, int error, const void *data, int length)
+{
+    uint64_t fields[3];
+    int count = 0;
+
+    /* zigzag so small negative results stay small */
+    fields[count++] = retval < 0 ? ((uint64_t)-(int64_t)retval << 1) - 1
+                                 : (uint64_t)retval << 1;
+    if (retval < 0)
+        fields[count++] = error;
+    if (length < 0)
+        length = 0;
+    fields[count++] = length;
+
+    writeRecord(type, info->id, fields, count, data, length);
+}
+
+static bool recordFindDeviceEndpoints(deviceInfo *info, int *maxPacketSize)
+{
+    uint64_t fields[5];
+    uint8_t loc[2];
+
+    if (! realImpl->findDeviceEndpoints(info, maxPacketSize))
+        return false;
+
+    realImpl->getDeviceLocation(info, loc);
+    fields[0] = *maxPacketSize;
+    fields[1] = loc[0];
+    fields[2] = loc[1];
+    fields[3] = info->type.idVendor;
+    fields[4] = info->type.idProduct;
+    writeRecord(TRACE_DEVICE, info->id, fields, 5, NULL, 0);
+    return true;
+}
+
+static int recordInterruptRecv(deviceInfo *info,
+                               void *buffer, int bufSize, int timeout)
+{
+    int retval, error;
+
+    retval = realImpl->interruptRecv(info, buffer, bufSize, timeout);
+    error = errno;
+    recordTransfer(TRACE_RECV, info, retval, error, buffer, retval);
+    errno = error;
+    return retval;
+}
+
+static int recordInterruptSend(deviceInfo *info,
+                               void *buffer, int bufSize, int timeout)
+{
+    int retval, error;
+
+    retval = realImpl->interruptSend(info, buffer, bufSize, timeout);
+    error = errno;
+    recordTransfer(TRACE_SEND, info, retval, error, buffer, bufSize);
+    errno = error;
+    return retval;
+}
+
+/* sits between an asynchronous engine and the daemon's callback */
+static bool recordRecvCallback(void *userData,
+                               unsigned char *buffer, int length)
+{
+    recordedRecv *rec = (recordedRecv*)userData;
+    bool retval;
+
+    if (buffer == NULL)
+    {
+        retval = rec->callback(rec->userData, buffer, length);
+        free(rec);
+        return retval;
+    }
+
+    recordTransfer(TRACE_RECV, rec->info, length, errno, buffer, length);
+    return rec->callback(rec->userData, buffer, length);
+}
+
+static recordedRecv* wrapCallback(deviceInfo *info,
+                                  recvFunc callback, void *userData)
+{
+    recordedRecv *rec;
+
+    rec = (recordedRecv*)malloc(sizeof(recordedRecv));
+    if (rec == NULL)
+        errno = ENOMEM;
+    else
+    {
+        rec->info = info;
+        rec->callback = callback;
+        rec->userData = userData;
+    }
+    return rec;
+}
+
+static int recordAsyncRecv(deviceInfo *info, int transfers, int bufSize,
+                           recvFunc callback, void *userData)
+{
+    recordedRecv *rec;
+    int retval;
+
+    if ((rec = wrapCallback(info, callback, userData)) == NULL)
+        return -errno;
+    retval = realImpl->asyncRecv(info, transfers, bufSize,
+                                 recordRecvCallback, rec);
+    free(rec);
+    return retval;
+}
+
+static bool recordStartRecv(deviceInfo *info, int transfers, int bufSize,
+                            recvFunc callback, void *userData)
+{
+    recordedRecv *rec;
+
+    /* freed by recordRecvCallback on the final call */
+    if ((rec = wrapCallback(info, callback, userData)) == NULL)
+        return false;
+    if (realImpl->startRecv(info, transfers, bufSize,
+                            recordRecvCallback, rec))
+        return true;
+    free(rec);
+    return false;
+}
+
+static void recordCleanupDriver()
+{
+    if (realImpl->cleanupDriver != NULL)
+        realImpl->cleanupDriver();
+
+    EnterCriticalSection(&traceLock);
+    if (traceFile != NULL)
+    {
+        fclose(traceFile);
+        traceFile = NULL;
+    }
+    LeaveCriticalSection(&traceLock);
+}
+
+driverImpl* traceRecorder(driverImpl *real, const char *path)
+{
+    unsigned char header[sizeof(traceMagic) + 1 + 10];
+    int used = 0;
+
+    traceFile = fopen(path, "wb");
+    if (traceFile == NULL)
+    {
+        message(LOG_ERROR, "Failed to open trace %s: %s\n",
+                path, translateError(errno));
+        return NULL;
+    }
+
+    memcpy(header, traceMagic, sizeof(traceMagic));
+    used += sizeof(traceMagic);
+    header[used++] = TRACE_VERSION;
+    lastRecord = microsSinceX();
+    used += putVarint(header + used, lastRecord);
+    if (fwrite(header, 1, used, traceFile) != (size_t)used)
+    {
+        message(LOG_ERROR, "Failed to write trace %s: %s\n",
+                path, translateError(errno));
+        fclose(traceFile);
+        traceFile = NULL;
+        return NULL;
+    }
+
+    /* pass everything through, only wrapping what moves data */
+    realImpl = real;
+    recordImpl = *real;
+    recordImpl.cleanupDriver = recordCleanupDriver;
+    recordImpl.findDeviceEndpoints = recordFindDeviceEndpoints;
+    recordImpl.interruptRecv = recordInterruptRecv;
+    recordImpl.interruptSend = recordInterruptSend;
+    if (real->asyncRecv != NULL)
+        recordImpl.asyncRecv = recordAsyncRecv;
+    if (real->startRecv != NULL)
+        recordImpl.startRecv = recordStartRecv;
+
+    message(LOG_INFO, "Recording usb traffic to %s\n", path);
+    return &recordImpl;
+}
+
+/****************************************************************************
+ ** replay ******************************************************************
+ ****************************************************************************/
+
+typedef struct traceEvent
+{
+    /* microseconds from the start of the trace */
+    uint64_t when;
+
+    int retval, error;
+    int length;
+    unsigned char *data;
+
+    /* receives wait for the sends that preceded them */
+    unsigned int gate;
+} traceEvent;
+
+typedef struct eventArray
+{
+    traceEvent *events;
+    unsigned int count, size, pos;
+} eventArray;
+
+typedef struct replayDevice
+{
+    /* fields for the linked list of devices */
+    /* MUST be listed first for casting */
+    itemHeader header;
+
+    bool removed, finished;
+    int maxPacketSize;
+    uint8_t loc[2];
+
+    eventArray sends, recvs;
+
+    /* when the daemon actually made each of the recorded sends */
+    uint64_t *sentAt;
+
+    deviceInfo info;
+} replayDevice;
+
+typedef struct replayDeviceList
+{
+    listHeader deviceList;
+
+    /* ids that are in this list */
+    usbId *ids;
+
+    /* callback when creating a device */
+    deviceFunc newDev;
+
+    /* just describe the devices or claim them? */
+    bool describe;
+} replayDeviceList;
+
+static struct
+{
+    /* devices read from the trace, moved to the list on first scan */
+    listHeader loaded;
+
+    double speed;
+    uint64_t start;
+    bool started, reported;
+
+    /* what happened during the replay */
+    unsigned int delivered, sends, differed, extra, early;
+} replay;
+
+static pthread_cond_t replayCond = PTHREAD_COND_INITIALIZER;
+
+#define deviceFromInfoPtr(ptr) (replayDevice*)((char*)ptr - offsetof(replayDevice, info))
+
+static replayDevice* findLoaded(unsigned int id)
+{
+    replayDevice *dev;
+
+    for(dev = (replayDevice*)replay.loaded.head;
+        dev != NULL; dev = (replayDevice*)dev->header.next)
+        if (dev->info.id == id)
+            return dev;
+
+    dev = (replayDevice*)malloc(sizeof(replayDevice));
+    if (dev != NULL)
+    {
+        memset(dev, 0, sizeof(replayDevice));
+        dev->info.id = id;
+        dev->info.type.idVendor = 0x1781;
+        dev->info.type.idProduct = 0x0938;
+        dev->maxPacketSize = DEFAULT_PACKET_SIZE;
+        dev->loc[0] = 1;
+        dev->loc[1] = id + 1;
+        insertItem(&replay.loaded, NULL, (itemHeader*)dev);
+    }
+    return dev;
+}
+
+static bool addEvent(replayDevice *dev, unsigned char type, uint64_t when,
+                     int retval, int error,
+                     const unsigned char *data, int length)
+{
+    eventArray *array = type == TRACE_SEND ? &dev->sends : &dev->recvs;
+    traceEvent *event;
+
+    if (array->count == array->size)
+    {
+        traceEvent *bigger;
+
+        bigger = (traceEvent*)realloc(array->events,
+                                      sizeof(traceEvent) *
+                                      (array->size * 2 + 16));
+        if (bigger == NULL)
+            return false;
+        array->events = bigger;
+        array->size = array->size * 2 + 16;
+    }
+
+    event = array->events + array->count;
+    memset(event, 0, sizeof(traceEvent));
+    event->when = when;
+    event->retval = retval;
+    event->error = error;
+    event->gate = dev->sends.count;
+    if (length > 0)
+    {
+        event->data = (unsigned char*)malloc(length);
+        if (event->data == NULL)
+            return false;
+        memcpy(event->data, data, length);
+        event->length = length;
+    }
+    array->count++;
+
+    if (length > dev->maxPacketSize)
+        dev->maxPacketSize = length;
+    return true;
+}
+
+static bool loadTrace(const unsigned char *pos, const unsigned char *end)
+{
+    uint64_t when = 0, value;
+
+    if (pos >= end || *pos++ != TRACE_VERSION ||
+        ! getVarint(&pos, end, &value))
+    {
+        message(LOG_ERROR, "Unsupported trace version.\n");
+        return false;
+    }
+
+    while(pos < end)
+    {
+        unsigned char type = *pos++;
+        uint64_t id, delta, fields[5];
+        replayDevice *dev;
+        int x, count;
+
+        if (! getVarint(&pos, end, &id) || ! getVarint(&pos, end, &delta) ||
+            (dev = findLoaded((unsigned int)id)) == NULL)
+            break;
+        when += delta;
+
+        if (type == TRACE_DEVICE)
+        {
+            for(x = 0; x < 5; x++)
+                if (! getVarint(&pos, end, fields + x))
+                    break;
+            if (x != 5)
+                break;
+            dev->maxPacketSize = (int)fields[0];
+            dev->loc[0] = (uint8_t)fields[1];
+            dev->loc[1] = (uint8_t)fields[2];
+            dev->info.type.idVendor = (unsigned short)fields[3];
+            dev->info.type.idProduct = (unsigned short)fields[4];
+        }
+        else if (type == TRACE_SEND || type == TRACE_RECV)
+        {
+            int retval, error = 0;
+
+            if (! getVarint(&pos, end, &value))
+                break;
+            retval = (value & 1) ? -(int)((value + 1) >> 1)
+                                 : (int)(value >> 1);
+            if (retval < 0 && getVarint(&pos, end, &value))
+                error = (int)value;
+            if (! getVarint(&pos, end, &value) ||
+                value > (uint64_t)(end - pos))
+                break;
+            count = (int)value;
+            if (! addEvent(dev, type, when, retval, error, pos, count))
+            {
+                message(LOG_ERROR, "Out of memory loading the trace.\n");
+                return false;
+            }
+            pos += count;
+        }
+        else
+            break;
+    }
+
+    if (pos < end)
+        message(LOG_WARN, "Trace is truncated or corrupt, using %d bytes.\n",
+                (int)(end - pos));
+    return true;
+}
+
+/* usbmon text lines look like:
+     tag timestamp S|C|E Ii:[bus:]dev:ep status length = data words */
+static bool loadUsbmon(char *text)
+{
+    uint32_t lastStamp = 0;
+    uint64_t when = 0;
+    bool haveStamp = false;
+    char *line, *save = NULL;
+    int used = 0;
+
+    for(line = strtok_r(text, "\n", &save);
+        line != NULL;
+        line = strtok_r(NULL, "\n", &save))
+    {
+        char *words[8], *pipe[4], *end, *next = NULL, *word;
+        unsigned char data[256];
+        int count, pipeCount, status, length, x;
+        unsigned long stamp;
+        unsigned int bus = 1, addr;
+        replayDevice *dev;
+        bool out;
+
+        for(count = 0, word = strtok_r(line, " \t", &next);
+            count < 7 && word != NULL;
+            word = strtok_r(NULL, " \t", &next))
+            words[count++] = word;
+        if (count < 6 || strlen(words[2]) != 1)
+            continue;
+
+        stamp = strtoul(words[1], &end, 10);
+        if (*end != '\0')
+            continue;
+
+        for(pipeCount = 0, word = strtok_r(words[3], ":", &end);
+            pipeCount < 4 && word != NULL;
+            word = strtok_r(NULL, ":", &end))
+            pipe[pipeCount++] = word;
+        /* only interrupt and bulk transfers carry iguana traffic */
+        if ((pipeCount != 3 && pipeCount != 4) ||
+            strlen(pipe[0]) != 2 || strchr("IB", pipe[0][0]) == NULL)
+            continue;
+        out = pipe[0][1] == 'o';
+        if (pipeCount == 4)
+            bus = atoi(pipe[1]);
+        addr = atoi(pipe[pipeCount - 2]);
+
+        status = strtol(words[4], &end, 10);
+        if (*end != '\0')
+            continue;
+        length = atoi(words[5]);
+
+        /* captured data follows an = */
+        x = 0;
+        if (count > 6 && strcmp(words[6], "=") == 0)
+            for(word = strtok_r(NULL, " \t", &next);
+                word != NULL;
+                word = strtok_r(NULL, " \t", &next))
+                for(; word[0] != '\0' && word[1] != '\0' &&
+                      x < (int)sizeof(data); word += 2)
+                {
+                    char hex[3] = {word[0], word[1], '\0'};
+                    data[x++] = (unsigned char)strtoul(hex, NULL, 16);
+                }
+        if (x > length)
+            x = length;
+
+        /* the 32 bit timestamps wrap roughly every 71 minutes */
+        if (haveStamp)
+            when += (uint32_t)((uint32_t)stamp - lastStamp);
+        lastStamp = (uint32_t)stamp;
+        haveStamp = true;
+
+        /* sends carry data at submission, receives at completion */
+        if (out && words[2][0] == 'S')
+        {
+            if ((dev = findLoaded(bus * 1000 + addr)) == NULL ||
+                ! addEvent(dev, TRACE_SEND, when, x, 0, data, x))
+                return false;
+        }
+        else if (! out && words[2][0] == 'C')
+        {
+            /* cancelled transfers are how receives stop, skip them */
+            if (status == -ENOENT || status == -ECONNRESET ||
+                status == -ESHUTDOWN)
+                continue;
+            if ((dev = findLoaded(bus * 1000 + addr)) == NULL ||
+                ! addEvent(dev, TRACE_RECV, when,
+                           status < 0 ? -1 : x, status < 0 ? -status : 0,
+                           data, status < 0 ? 0 : x))
+                return false;
+        }
+        else
+            continue;
+        dev->loc[0] = bus;
+        dev->loc[1] = addr;
+        used++;
+    }
+
+    if (used == 0)
+    {
+        message(LOG_ERROR,
+                "Found no interrupt or bulk transfers in the capture.\n");
+        return false;
+    }
+
+    /* number the devices in the order they appeared */
+    {
+        replayDevice *dev;
+        unsigned int id = 0;
+
+        for(dev = (replayDevice*)replay.loaded.head;
+            dev != NULL; dev = (replayDevice*)dev->header.next)
+            dev->info.id = id++;
+    }
+    return true;
+}
+
+static uint64_t scaled(uint64_t micros)
+{
+    if (replay.speed <= 0)
+        return 0;
+    return (uint64_t)(micros / replay.speed);
+}
+
+/* when the event is due, must be called with the traceLock held */
+static uint64_t dueTime(replayDevice *dev, traceEvent *event, bool *early)
+{
+    uint64_t due = replay.start + scaled(event->when);
+
+    *early = false;
+    if (event->gate > dev->sends.pos)
+    {
+        /* the daemon has not (yet) made the request for this, give up
+           waiting once it has been quiet for a while */
+        uint64_t quiet = dev->sends.pos > 0 ?
+                         dev->sentAt[dev->sends.pos - 1] : replay.start;
+        if (quiet > due)
+            due = quiet;
+        *early = true;
+        due += REPLAY_GRACE;
+    }
+    /* anything after a request keeps its spacing from that request */
+    else if (event->gate > 0)
+    {
+        traceEvent *send = dev->sends.events + event->gate - 1;
+        due = dev->sentAt[event->gate - 1] + scaled(event->when - send->when);
+    }
+    return due;
+}
+
+/* must be called with the traceLock held */
+static void reportReplay(bool complete)
+{
+    struct rusage usage;
+
+    if (replay.reported)
+        return;
+    replay.reported = true;
+
+    getrusage(RUSAGE_SELF, &usage);
+    message(LOG_NORMAL,
+            "Replay %s after %llu ms: %u packets delivered (%u without "
+            "their request), %u sends (%u differed, %u beyond the trace), "
+            "cpu %ld.%03lds user %ld.%03lds system\n",
+            complete ? "finished" : "stopped",
+            (unsigned long long)(microsSinceX() - replay.start) / 1000,
+            replay.delivered, replay.early,
+            replay.sends, replay.differed, replay.extra,
+            (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec / 1000,
+            (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec / 1000);
+}
+
+static replayDeviceList *replayList = NULL;
+
+/* must be called with the traceLock held */
+static void checkFinished(replayDevice *dev)
+{
+    replayDevice *other;
+
+    dev->finished = true;
+    for(other = (replayDevice*)replayList->deviceList.head;
+        other != NULL; other = (replayDevice*)other->header.next)
+        if (! other->finished)
+            return;
+    reportReplay(true);
+}
+
+static int replayInterruptRecv(deviceInfo *info,
+                               void *buffer, int bufSize, int timeout)
+{
+    replayDevice *dev = deviceFromInfoPtr(info);
+    uint64_t deadline = microsSinceX() + (uint64_t)timeout * 1000;
+    int retval;
+
+    EnterCriticalSection(&traceLock);
+    while(true)
+    {
+        traceEvent *event;
+        uint64_t now = microsSinceX(), due;
+        bool early;
+
+        /* recorded timeouts happen on their own here */
+        while(dev->recvs.pos < dev->recvs.count &&
+              dev->recvs.events[dev->recvs.pos].retval < 0 &&
+              dev->recvs.events[dev->recvs.pos].error == ETIMEDOUT)
+            dev->recvs.pos++;
+
+        if (dev->info.stopped)
+        {
+            retval = -(errno = ENXIO);
+            break;
+        }
+        else if (dev->recvs.pos == dev->recvs.count)
+        {
+            if (! dev->finished)
+                checkFinished(dev);
+            if (now >= deadline)
+            {
+                retval = -(errno = ETIMEDOUT);
+                break;
+            }
+            waitConditionUntil(&replayCond, &traceLock, deadline);
+            continue;
+        }
+
+        event = dev->recvs.events + dev->recvs.pos;
+        due = dueTime(dev, event, &early);
+        if (due <= now)
+        {
+            dev->recvs.pos++;
+            if (event->retval < 0)
+                retval = -(errno = event->error);
+            else
+            {
+                retval = event->length;
+                if (retval > bufSize)
+                    retval = bufSize;
+                memcpy(buffer, event->data, retval);
+                replay.delivered++;
+                if (early)
+                    replay.early++;
+            }
+            break;
+        }
+        else if (now >= deadline)
+        {
+            retval = -(errno = ETIMEDOUT);
+            break;
+        }
+        waitConditionUntil(&replayCond, &traceLock,
+                           due < deadline ? due : deadline);
+    }
+    LeaveCriticalSection(&traceLock);
+
+    return retval;
+}
+
+static int replayInterruptSend(deviceInfo *info,
+                               void *buffer, int bufSize, int UNUSED(timeout))
+{
+    replayDevice *dev = deviceFromInfoPtr(info);
+    int retval = bufSize;
+
+    EnterCriticalSection(&traceLock);
+    if (dev->info.stopped)
+        retval = -(errno = ENXIO);
+    else if (dev->sends.pos == dev->sends.count)
+        replay.extra++;
+    else
+    {
+        traceEvent *event = dev->sends.events + dev->sends.pos;
+
+        if (event->length != bufSize ||
+            memcmp(event->data, buffer, bufSize) != 0)
+        {
+            message(LOG_DEBUG, "Send %u to %d differs from the trace\n",
+                    dev->sends.pos, dev->info.id);
+            replay.differed++;
+        }
+        if (event->retval < 0)
+            retval = -(errno = event->error);
+
+        /* releases the receives that were waiting on this */
+        dev->sentAt[dev->sends.pos++] = microsSinceX();
+        pthread_cond_broadcast(&replayCond);
+    }
+    replay.sends++;
+    LeaveCriticalSection(&traceLock);
+
+    return retval;
+}
+
+static bool replayFindDeviceEndpoints(deviceInfo *info, int *maxPacketSize)
+{
+    replayDevice *dev = deviceFromInfoPtr(info);
+    *maxPacketSize = dev->maxPacketSize;
+    return true;
+}
+
+static int replayClearHalt(deviceInfo *UNUSED(info), unsigned int UNUSED(ep))
+{
+    return 0;
+}
+
+static int replayResetDevice(deviceInfo *UNUSED(info))
+{
+    return 0;
+}
+
+static void replayGetDeviceLocation(deviceInfo *info, uint8_t loc[2])
+{
+    replayDevice *dev = deviceFromInfoPtr(info);
+    loc[0] = dev->loc[0];
+    loc[1] = dev->loc[1];
+}
+
+static void replayReleaseDevice(deviceInfo *info)
+{
+    replayDevice *dev = deviceFromInfoPtr(info);
+
+    EnterCriticalSection(&traceLock);
+    if (! dev->removed)
+    {
+        dev->removed = true;
+        removeItem((itemHeader*)dev);
+    }
+    LeaveCriticalSection(&traceLock);
+}
+
+static void freeEvents(eventArray *array)
+{
+    unsigned int x;
+
+    for(x = 0; x < array->count; x++)
+        free(array->events[x].data);
+    free(array->events);
+}
+
+static void freeReplayDevice(replayDevice *dev)
+{
+    freeEvents(&dev->sends);
+    freeEvents(&dev->recvs);
+    free(dev->sentAt);
+    free(dev);
+}
+
+static void replayFreeDevice(deviceInfo *info)
+{
+    freeReplayDevice(deviceFromInfoPtr(info));
+}
+
+static deviceList* replayPrepareDeviceList(usbId *ids, deviceFunc ndf)
+{
+    replayDeviceList *list;
+
+    list = (replayDeviceList*)malloc(sizeof(replayDeviceList));
+    if (list != NULL)
+    {
+        memset(list, 0, sizeof(replayDeviceList));
+        list->ids = ids;
+        list->newDev = ndf;
+        replayList = list;
+    }
+    return list;
+}
+
+static void replayClaimDevices(deviceList *devList,
+                               bool claim, bool UNUSED(force))
+{
+    ((replayDeviceList*)devList)->describe = ! claim;
+}
+
+static bool replayUpdateDeviceList(deviceList *devList)
+{
+    replayDeviceList *list = (replayDeviceList*)devList;
+    replayDevice *dev;
+
+    if (list->describe)
+    {
+        for(dev = (replayDevice*)replay.loaded.head;
+            dev != NULL; dev = (replayDevice*)dev->header.next)
+            message(LOG_NORMAL,
+                    "  Traced device %d on %d:%d: %d sends, %d receives\n",
+                    dev->info.id, dev->loc[0], dev->loc[1],
+                    dev->sends.count, dev->recvs.count);
+        return true;
+    }
+
+    /* every traced device appears on the first scan, and the clock
+       starts with it */
+    EnterCriticalSection(&traceLock);
+    if (! replay.started)
+    {
+        replay.started = true;
+        replay.start = microsSinceX();
+    }
+    LeaveCriticalSection(&traceLock);
+
+    while((dev = (replayDevice*)removeFirstItem(&replay.loaded)) != NULL)
+    {
+        usbId *id;
+
+        /* the caller hangs its settings off the matching id */
+        for(id = list->ids; id->idVendor != INVALID_VENDOR; id++)
+            if (id->idVendor == dev->info.type.idVendor &&
+                id->idProduct == dev->info.type.idProduct)
+                break;
+        if (id->idVendor == INVALID_VENDOR)
+            id = list->ids;
+        dev->info.type = *id;
+
+        EnterCriticalSection(&traceLock);
+        insertItem(&list->deviceList, NULL, (itemHeader*)dev);
+        LeaveCriticalSection(&traceLock);
+
+        if (list->newDev != NULL)
+            list->newDev(&dev->info);
+    }
+
+    return true;
+}
+
+static unsigned int replayStopDevices(deviceList *devList)
+{
+    replayDeviceList *list = (replayDeviceList*)devList;
+    unsigned int count;
+    replayDevice *dev;
+
+    EnterCriticalSection(&traceLock);
+    count = list->deviceList.count;
+    for(dev = (replayDevice*)list->deviceList.head;
+        dev != NULL; dev = (replayDevice*)dev->header.next)
+        dev->info.stopped = true;
+    pthread_cond_broadcast(&replayCond);
+    LeaveCriticalSection(&traceLock);
+
+    return count;
+}
+
+static unsigned int replayReleaseDevices(deviceList *devList)
+{
+    replayDeviceList *list = (replayDeviceList*)devList;
+    unsigned int count = list->deviceList.count;
+    replayDevice *head, *prev = NULL;
+
+    /* loop, but if head does not change then sleep a bit */
+    while((head = (replayDevice*)firstItem(&list->deviceList)) != NULL)
+    {
+        if (head != prev)
+            replayReleaseDevice(&head->info);
+        else
+            Sleep(100);
+        prev = head;
+    }
+
+    /* illegal to access the list after this call */
+    EnterCriticalSection(&traceLock);
+    replayList = NULL;
+    LeaveCriticalSection(&traceLock);
+    free(list);
+    return count;
+}
+
+static void replayPrintError(int level, char *msg, deviceInfo *UNUSED(info))
+{
+    if (msg != NULL)
+        message(level, "%s: %s\n", msg, translateError(errno));
+    else
+        message(level, "%s\n", translateError(errno));
+}
+
+static bool replayInitializeDriver()
+{
+    return true;
+}
+
+static void replayCleanupDriver()
+{
+    replayDevice *dev;
+
+    EnterCriticalSection(&traceLock);
+    if (replay.started)
+        reportReplay(false);
+    LeaveCriticalSection(&traceLock);
+
+    while((dev = (replayDevice*)removeFirstItem(&replay.loaded)) != NULL)
+        freeReplayDevice(dev);
+}
+
+static driverImpl replayImpl = {
+    replayInitializeDriver,
+    replayCleanupDriver,
+    replayFindDeviceEndpoints,
+    replayInterruptRecv,
+    replayInterruptSend,
+    replayClearHalt,
+    replayResetDevice,
+    replayGetDeviceLocation,
+    replayReleaseDevice,
+    replayFreeDevice,
+    replayPrepareDeviceList,
+    replayClaimDevices,
+    replayUpdateDeviceList,
+    replayStopDevices,
+    replayReleaseDevices,
+    replayPrintError,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+driverImpl* traceReplayer(const char *path, double speed)
+{
+    unsigned char *contents;
+    replayDevice *dev;
+    bool loaded;
+    FILE *input;
+    long size;
+
+    input = fopen(path, "rb");
+    if (input == NULL)
+    {
+        message(LOG_ERROR, "Failed to open trace %s: %s\n",
+                path, translateError(errno));
+        return NULL;
+    }
+
+    /* traces are read whole, keeping the replay off the disk */
+    fseek(input, 0, SEEK_END);
+    size = ftell(input);
+    fseek(input, 0, SEEK_SET);
+    contents = (unsigned char*)malloc(size + 1);
+    if (contents == NULL || fread(contents, 1, size, input) != (size_t)size)
+    {
+        message(LOG_ERROR, "Failed to read trace %s\n", path);
+        free(contents);
+        fclose(input);
+        return NULL;
+    }
+    fclose(input);
+    contents[size] = '\0';
+
+    initializeList(&replay.loaded);
+    replay.speed = speed;
+    if (size >= (long)sizeof(traceMagic) &&
+        memcmp(contents, traceMagic, sizeof(traceMagic)) == 0)
+        loaded = loadTrace(contents + sizeof(traceMagic), contents + size);
+    else
+        loaded = loadUsbmon((char*)contents);
+    free(contents);
+
+    /* room to note when each send actually happens */
+    for(dev = (replayDevice*)replay.loaded.head;
+        loaded && dev != NULL; dev = (replayDevice*)dev->header.next)
+        if (dev->sends.count > 0 &&
+            (dev->sentAt = (uint64_t*)malloc(sizeof(uint64_t) *
+                                             dev->sends.count)) == NULL)
+            loaded = false;
+
+    if (! loaded)
+    {
+        replayCleanupDriver();
+        return NULL;
+    }
+
+    message(LOG_INFO, "Replaying %d device(s) from %s\n",
+            replay.loaded.count, path);
+    return &replayImpl;
+}
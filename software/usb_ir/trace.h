@@ -0,0 +1,25 @@
+/****************************************************************************
+ ** trace.h *****************************************************************
+ ****************************************************************************
+ *
+ * Recording and replay of the USB traffic that passes through the
+ * driver layer.  Both are driverImpl wrappers used by driver.c.
+ *
+ * Copyright (C) 2017, IguanaWorks Incorporated (http://iguanaworks.net)
+ * Author: Joseph Dunn <jdunn@iguanaworks.net>
+ *
+ * Distributed under the GPL version 2.
+ * See LICENSE for license details.
+ */
+
+#pragma once
+
+#include "driverapi.h"
+
+/* wrap the real driver so every transfer is appended to path */
+driverImpl* traceRecorder(driverImpl *real, const char *path);
+
+/* play a recorded trace (or usbmon text capture) back as a driver,
+   speed scales the original timing and 0 delivers as fast as the
+   daemon keeps up */
+driverImpl* traceReplayer(const char *path, double speed);
@@ -44,6 +44,19 @@ uint64_t microsSinceX()
     return retval;
 }
 
+void sleepUntilMicros(uint64_t when)
+{
+    uint64_t now;
+
+    /* Sleep is only good to the scheduler tick, so yield for the
+       last of it */
+    while((now = microsSinceX()) < when)
+        if (when - now > 20000)
+            Sleep((DWORD)((when - now) / 1000 - 16));
+        else
+            SwitchToThread();
+}
+
 /* translate errno, or if the errnum == -1 translate GetLastError()  */
 char globalBuffer[256];
 char* translateError(int errnum)
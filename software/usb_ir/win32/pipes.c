@@ -16,6 +16,7 @@
 #include "pipes.h"
 
 #include <stdio.h> /* sprintf */
+#include <stdlib.h>
 #include <errno.h>
 
 bool createPipePair(PIPE_PTR *pair)
@@ -116,6 +117,44 @@ int writePipeTimed(PIPE_PTR fd, const void *buf, int count, int timeout)
     return timedPipeOperation(fd, NULL, buf, count, timeout);
 }
 
+/* reads on a byte mode pipe already complete with whatever is there */
+int readPipeSome(PIPE_PTR fd, void *buf, int count, int timeout)
+{
+    return timedPipeOperation(fd, buf, NULL, count, timeout);
+}
+
+/* there is no gathered write so join the header and payload first */
+int writePipePairTimed(PIPE_PTR fd, const void *head, int headSize,
+                       const void *body, int bodySize, int timeout)
+{
+    int retval = -1;
+    char *joined;
+
+    joined = (char*)malloc(headSize + bodySize);
+    if (joined != NULL)
+    {
+        memcpy(joined, head, headSize);
+        memcpy(joined + headSize, body, bodySize);
+        retval = timedPipeOperation(fd, NULL, joined,
+                                    headSize + bodySize, timeout);
+        free(joined);
+    }
+    return retval;
+}
+
+/* a zero timeout cancels whatever the pipe could not take at once */
+int writePipePairSome(PIPE_PTR fd, const void *head, int headSize,
+                      const void *body, int bodySize)
+{
+    int retval;
+
+    errno = 0;
+    retval = writePipePairTimed(fd, head, headSize, body, bodySize, 0);
+    if (retval == -1 && errno == ETIMEDOUT)
+        retval = 0;
+    return retval;
+}
+
 int readPipe(PIPE_PTR fd, void *buf, int count)
 {
     return readPipeTimed(fd, buf, count, INFINITE);
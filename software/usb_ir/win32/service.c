@@ -460,6 +460,12 @@ static void startOverlappedAction(PIPE_PTR fd, OVERLAPPED *over, bool connect)
         ReadFile(fd, NULL, 0, NULL, over);
 }
 
+/* there is no writable notification on these pipes, so queued output
+   is flushed as later packets go out to the client */
+void watchClientWrites(client *UNUSED(me), bool UNUSED(writes))
+{
+}
+
 /* listen to clients connecting to either name or alias, and the idev->reader */
 void listenToClients(const char *name, listHeader *clientList, iguanaDev *idev)
 {
@@ -482,7 +488,7 @@ void listenToClients(const char *name, listHeader *clientList, iguanaDev *idev)
     memset(over, 0, sizeof(OVERLAPPED) * 3);
     while(true)
     {
-        int count = 1;
+        int count = 1, wait;
 
         /* allocate the handles and overlap objects that I need to populate */
         handles = (HANDLE*)realloc(handles, sizeof(HANDLE) * (1 + 2 + clientList->count));
@@ -639,9 +645,18 @@ void listenToClients(const char *name, listHeader *clientList, iguanaDev *idev)
             handles[count++] = john->over.hEvent;
 		}
 
-        /* wait for something to happen */
+        /* wait for something to happen, or for an open frame to be due */
 //message(LOG_ERROR, "%p: Waiting on %d............\n", idev, count);
-        WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+        wait = -1;
+        if (idev != NULL)
+            wait = transmitTimeout(idev, framesTimeout(idev, wait));
+        WaitForMultipleObjects(count, handles, FALSE,
+                               wait < 0 ? INFINITE : (DWORD)wait);
+        if (idev != NULL)
+        {
+            finishFrames(idev);
+            transmitQueued(idev);
+        }
 
         /* handle the reader thread sending us things, and on failure quit */
         if (WaitForSingleObject(handles[0], 0) == WAIT_OBJECT_0)